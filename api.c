@@ -0,0 +1,329 @@
+/*
+ * Interface for using pam-afs-session's token handling without PAM.
+ *
+ * Implements the functions declared in pamafs.h.  Each operation forks a
+ * worker process, in its own process group so that it and any aklog it runs
+ * can be killed together, that does the same work as the PAM module using a
+ * struct pam_args with no PAM handle.  The worker exits when it's done, and
+ * the caller sees that as end of file on the read end of a pipe.
+ *
+ * When obtaining tokens, the worker normally creates its own PAG so that the
+ * caller's tokens aren't touched and many acquisitions can run at once.  It
+ * then reads the tokens back out of that PAG and writes them to the pipe so
+ * that the caller can put them wherever they're needed.
+ *
+ * The workers apply the same checks as the PAM module: users skipped because
+ * of ignore_root or minimum_uid are left alone, and tokens are also not
+ * obtained if afs_homedir_only or the TGT checks say not to.  As with the
+ * PAM module, skipping a user isn't a failure; the operation succeeds with
+ * no tokens.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/kafs.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+#include <pamafs.h>
+
+/* An operation in progress or finished. */
+struct pamafs_op {
+    struct pam_args *args;      /* Configuration and logging. */
+    pid_t pid;                  /* Worker process and process group. */
+    int fd;                     /* Read end of the pipe from the worker. */
+    bool finished;              /* Whether pamafs_op_finish has been called. */
+    int status;                 /* Result once finished. */
+    struct pamafs_tokens *tokens; /* Tokens from the worker, if any. */
+};
+
+
+/*
+ * Write all of a buffer to a file descriptor, retrying after interrupts.
+ * Returns true on success and false on failure.
+ */
+static bool
+op_write(int fd, const char *data, size_t length)
+{
+    size_t total = 0;
+    ssize_t status;
+
+    while (total < length) {
+        status = write(fd, data + total, length - total);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status < 0)
+            return false;
+        total += (size_t) status;
+    }
+    return true;
+}
+
+
+/*
+ * The body of a worker obtaining tokens.  Unless the user should be skipped,
+ * creates a new PAG unless nopag is set, obtains tokens, and writes them to
+ * fd if they're in a new PAG.  Exits with status 0 on success (including
+ * skipping the user) and 1 on failure.  Never returns.
+ */
+static void __attribute__((__noreturn__))
+op_acquire(struct pam_args *args, struct passwd *pwd, const char *cache,
+           int fd)
+{
+    struct pamafs_tokens *tokens;
+
+    if (pamafs_token_check(args, pwd, cache) != PAM_SUCCESS)
+        _exit(0);
+    if (!args->config->nopag && k_setpag() != 0) {
+        putil_err(args, "PAG creation failed: %s", strerror(errno));
+        _exit(1);
+    }
+    if (pamafs_token_acquire(args, pwd, cache, false) != PAM_SUCCESS)
+        _exit(1);
+    if (args->config->nopag)
+        _exit(0);
+    tokens = pamafs_tokens_read(args);
+    if (tokens == NULL)
+        _exit(1);
+    if (!op_write(fd, tokens->data, tokens->length)) {
+        putil_err(args, "cannot write tokens: %s", strerror(errno));
+        _exit(1);
+    }
+    _exit(0);
+}
+
+
+/*
+ * The body of a worker deleting tokens.  Does nothing for users who should be
+ * skipped, for whom the PAM module would never have obtained tokens.  Exits
+ * with status 0 on success and 1 on failure.  Never returns.
+ */
+static void __attribute__((__noreturn__))
+op_delete(struct pam_args *args, struct passwd *pwd, const char *cache)
+{
+    if (pamafs_should_ignore(args, pwd))
+        _exit(0);
+    putil_debug(args, "destroying tokens");
+    if (pamafs_unlog() != 0) {
+        putil_err(args, "unable to delete credentials: %s", strerror(errno));
+        _exit(1);
+    }
+    if (args->config->token_cache)
+        pamafs_store_remove(args, pwd, cache, NULL);
+    _exit(0);
+}
+
+
+/*
+ * Start an operation for the given user and ticket cache with the given
+ * module options.  If acquire is true, obtain tokens, and otherwise delete
+ * them.  Returns the new operation or NULL on failure.
+ */
+static struct pamafs_op *
+op_start(const char *user, const char *cache, int argc, const char **argv,
+         bool acquire)
+{
+    struct pamafs_op *op;
+    struct passwd *pwd;
+    int fds[2];
+
+    op = calloc(1, sizeof(struct pamafs_op));
+    if (op == NULL)
+        return NULL;
+    op->fd = -1;
+    op->args = pamafs_init(NULL, 0, argc, argv);
+    if (op->args == NULL)
+        goto fail;
+    if (!k_hasafs()) {
+        putil_err(op->args, "AFS apparently not available");
+        goto fail;
+    }
+    pwd = getpwnam(user);
+    if (pwd == NULL) {
+        putil_err(op->args, "cannot find UID for %s", user);
+        goto fail;
+    }
+
+    /* The worker doesn't use any of the features tied to a PAM session. */
+    op->args->config->async_tokens = false;
+    op->args->config->prefetch_tokens = false;
+    op->args->config->renew_tokens = false;
+
+    if (pipe(fds) < 0) {
+        putil_err(op->args, "cannot create pipe: %s", strerror(errno));
+        goto fail;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    op->pid = fork();
+    if (op->pid < 0) {
+        putil_crit(op->args, "cannot fork: %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        goto fail;
+    } else if (op->pid == 0) {
+        close(fds[0]);
+        setpgid(0, 0);
+        op->args->user = user;
+        if (cache != NULL && setenv("KRB5CCNAME", cache, 1) < 0)
+            _exit(1);
+        if (acquire)
+            op_acquire(op->args, pwd, cache, fds[1]);
+        else
+            op_delete(op->args, pwd, cache);
+    }
+
+    /* Also set the process group here to avoid racing with a kill. */
+    setpgid(op->pid, op->pid);
+    close(fds[1]);
+    op->fd = fds[0];
+    return op;
+
+fail:
+    pamafs_op_free(op);
+    return NULL;
+}
+
+
+/*
+ * Start obtaining tokens.
+ */
+struct pamafs_op *
+pamafs_acquire_start(const char *user, const char *cache, int argc,
+                     const char **argv)
+{
+    return op_start(user, cache, argc, argv, true);
+}
+
+
+/*
+ * Start deleting tokens.
+ */
+struct pamafs_op *
+pamafs_delete_start(const char *user, const char *cache, int argc,
+                    const char **argv)
+{
+    return op_start(user, cache, argc, argv, false);
+}
+
+
+/*
+ * Return the file descriptor to wait on.
+ */
+int
+pamafs_op_fd(const struct pamafs_op *op)
+{
+    return op->fd;
+}
+
+
+/*
+ * Collect everything the worker wrote, wait for it to exit, and record the
+ * result.
+ */
+int
+pamafs_op_finish(struct pamafs_op *op)
+{
+    struct pamafs_tokens *tokens;
+    char buffer[BUFSIZ];
+    char *data;
+    ssize_t status;
+    int result;
+
+    if (op->finished)
+        return op->status;
+    op->finished = true;
+    op->status = -1;
+    tokens = calloc(1, sizeof(struct pamafs_tokens));
+    if (tokens == NULL) {
+        putil_crit(op->args, "cannot allocate memory: %s", strerror(errno));
+        return -1;
+    }
+    op->tokens = tokens;
+    while ((status = read(op->fd, buffer, sizeof(buffer))) != 0) {
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status < 0) {
+            putil_err(op->args, "cannot read tokens: %s", strerror(errno));
+            break;
+        }
+        data = realloc(tokens->data, tokens->length + (size_t) status);
+        if (data == NULL) {
+            putil_crit(op->args, "cannot allocate memory: %s",
+                       strerror(errno));
+            break;
+        }
+        memcpy(data + tokens->length, buffer, (size_t) status);
+        tokens->data = data;
+        tokens->length += (size_t) status;
+    }
+    memset(buffer, 0, sizeof(buffer));
+    close(op->fd);
+    op->fd = -1;
+    if (status != 0)
+        kill(-op->pid, SIGKILL);
+    while (waitpid(op->pid, &result, 0) < 0)
+        if (errno != EINTR) {
+            putil_err(op->args, "cannot wait for worker: %s",
+                      strerror(errno));
+            return -1;
+        }
+    op->pid = 0;
+    if (status != 0 || !WIFEXITED(result) || WEXITSTATUS(result) != 0)
+        return -1;
+    if (!pamafs_tokens_check(tokens)) {
+        putil_err(op->args, "worker returned malformed tokens");
+        return -1;
+    }
+    op->status = 0;
+    return 0;
+}
+
+
+/*
+ * Put the tokens from a finished operation into the current PAG.
+ */
+int
+pamafs_op_install(struct pamafs_op *op)
+{
+    if (!op->finished || op->status != 0 || op->tokens == NULL)
+        return -1;
+    if (op->tokens->count == 0)
+        return 0;
+    return pamafs_tokens_write(op->args, op->tokens) ? 0 : -1;
+}
+
+
+/*
+ * Free an operation, stopping its worker if it's still running.
+ */
+void
+pamafs_op_free(struct pamafs_op *op)
+{
+    if (op == NULL)
+        return;
+    if (op->pid > 0) {
+        kill(-op->pid, SIGKILL);
+        while (waitpid(op->pid, NULL, 0) < 0 && errno == EINTR)
+            ;
+    }
+    if (op->fd >= 0)
+        close(op->fd);
+    pamafs_tokens_free(op->tokens);
+    if (op->args != NULL)
+        pamafs_free(op->args);
+    free(op);
+}
@@ -0,0 +1,632 @@
+/*
+ * Obtaining tokens in the background.
+ *
+ * If the async_tokens option is set, pam_sm_open_session creates the PAG as
+ * usual but then obtains tokens in a detached process that's already in that
+ * PAG and returns immediately, so that interactive users don't wait for
+ * aklog before seeing a shell.  The progress of that process is recorded in
+ * a status file in the state directory, containing "pending" until it
+ * finishes and then "success" or "failure".  Only root can read the state
+ * directory, so if the user has a runtime directory that only they can
+ * write to (XDG_RUNTIME_DIR or /run/user/<uid>), the same status is also
+ * written there, as the user.  The path to that file, or if there isn't one
+ * to the file in the state directory, is put in the PAM environment as
+ * AFS_TOKEN_STATUS.  Status files are never created in directories that
+ * other users can write to, such as /tmp, since anyone could create them
+ * first.  Both files are named for the user, the process, and a count of
+ * sessions in this process, since one process may handle several sessions.
+ *
+ * The process is detached by forking twice, so that the application never
+ * sees it as a child, and is put in its own process group so that it and any
+ * aklog it's running can be killed together if the session is closed before
+ * it finishes.
+ *
+ * If the prefetch_tokens option is set, the same mechanism is used to start
+ * obtaining tokens during pam_sm_authenticate, in a process with its own
+ * PAG, so that aklog runs while the rest of the PAM stack does.  That process
+ * saves the tokens in the token store (see store.c), from which they're put
+ * into the session's PAG by pam_sm_setcred or pam_sm_open_session.  The
+ * ticket cache used during authentication is usually not the one used for
+ * the session (pam_krb5 only sets PAM_KRB5CCNAME during authentication and
+ * creates the session's cache in pam_sm_setcred), so prefetched tokens are
+ * keyed by UID and the principal of the TGT rather than by ticket cache.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#ifdef HAVE_KRB5
+# include <portable/krb5.h>
+#endif
+#include <portable/kafs.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+
+/* The name of our PAM data item for a background acquisition. */
+#define ASYNC_DATA "pam_afs_session_async"
+
+/* The contents of the status file. */
+#define STATUS_PENDING "pending\n"
+#define STATUS_SUCCESS "success\n"
+#define STATUS_FAILURE "failure\n"
+
+/* Information about a background acquisition, stored as PAM data. */
+struct async_data {
+    pid_t pid;                  /* Process (and process group) doing it. */
+    uid_t uid;                  /* User the tokens are for. */
+    char *name;                 /* Name of the status file. */
+    char *status;               /* Path to the user's status file or NULL. */
+};
+
+/* The number of sessions started in this process, protected by async_lock. */
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long async_sessions = 0;
+
+
+/*
+ * Free the async_data struct when PAM is done with it.
+ */
+static void
+async_data_free(pam_handle_t *pamh UNUSED, void *data, int status UNUSED)
+{
+    struct async_data *async = data;
+
+    free(async->name);
+    free(async->status);
+    free(async);
+}
+
+
+/*
+ * Build the path to the status file the user can read, with the given name,
+ * in their runtime directory: XDG_RUNTIME_DIR from the PAM environment if
+ * it's set and otherwise /run/user/<uid>.  That directory must be owned by
+ * the user and not writable by anyone else, so that no other user can put a
+ * file where the status is expected.  Returns NULL if there's no such
+ * directory, in which case there is no such file, or on failure.
+ */
+static char *
+async_status_path(struct pam_args *args, uid_t uid, const char *name)
+{
+    const char *runtime;
+    char *dir = NULL;
+    char *path = NULL;
+    struct stat st;
+
+    runtime = pam_getenv(args->pamh, "XDG_RUNTIME_DIR");
+    if (runtime != NULL && runtime[0] != '\0')
+        dir = strdup(runtime);
+    else if (asprintf(&dir, "/run/user/%lu", (unsigned long) uid) < 0)
+        dir = NULL;
+    if (dir == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        return NULL;
+    }
+    if (dir[0] != '/' || lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode)
+        || st.st_uid != uid || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+        putil_debug(args, "no private runtime directory at %s", dir);
+        free(dir);
+        return NULL;
+    }
+    if (asprintf(&path, "%s/%s", dir, name) < 0) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        path = NULL;
+    }
+    free(dir);
+    return path;
+}
+
+
+/*
+ * Write a result to the status file the user can read, or remove that file
+ * if result is NULL.  It's in a directory the user controls, so this is done
+ * with our effective UID set to theirs so that it can't be used to make us
+ * write anywhere they couldn't.  The file is written under a temporary name
+ * from mkstemp and renamed into place so that it's never seen partly
+ * written.  The effective UID is shared by all threads, so this may only be
+ * called in a child process, which exits if it can't change its UID back.
+ * Returns true on success and false on failure, which is reported.
+ */
+static bool
+async_status_write(struct pam_args *args, uid_t uid, const char *path,
+                   const char *result)
+{
+    uid_t euid;
+    char *tmp = NULL;
+    int fd = -1;
+    bool okay = false;
+
+    euid = geteuid();
+    if (euid != uid && seteuid(uid) < 0) {
+        putil_err(args, "cannot change to UID %lu: %s", (unsigned long) uid,
+                  strerror(errno));
+        return false;
+    }
+    if (result == NULL) {
+        if (unlink(path) < 0 && errno != ENOENT)
+            putil_err(args, "cannot remove %s: %s", path, strerror(errno));
+        else
+            okay = true;
+        goto done;
+    }
+    if (asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        tmp = NULL;
+        goto done;
+    }
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        putil_err(args, "cannot create %s: %s", tmp, strerror(errno));
+        free(tmp);
+        tmp = NULL;
+        goto done;
+    }
+    if (write(fd, result, strlen(result)) != (ssize_t) strlen(result)) {
+        putil_err(args, "cannot write to %s: %s", tmp, strerror(errno));
+        goto done;
+    }
+    if (close(fd) < 0) {
+        fd = -1;
+        putil_err(args, "cannot write to %s: %s", tmp, strerror(errno));
+        goto done;
+    }
+    fd = -1;
+    if (rename(tmp, path) < 0) {
+        putil_err(args, "cannot rename %s to %s: %s", tmp, path,
+                  strerror(errno));
+        goto done;
+    }
+    okay = true;
+
+done:
+    if (fd >= 0)
+        close(fd);
+    if (tmp != NULL && !okay)
+        unlink(tmp);
+    free(tmp);
+    if (euid != uid && seteuid(euid) < 0) {
+        putil_crit(args, "cannot change back to UID %lu: %s",
+                   (unsigned long) euid, strerror(errno));
+        _exit(1);
+    }
+    return okay;
+}
+
+
+/*
+ * The body of the background process.  Detach from the application's file
+ * descriptors for standard input and output, obtain tokens, record the
+ * result in the named status file and in the user's status file if status
+ * isn't NULL, and exit.  If prefetch isn't NULL, this is prefetching tokens,
+ * so first create a new PAG and save the tokens in the token store under the
+ * prefetch key.  Never returns.
+ */
+static void __attribute__((__noreturn__))
+async_run(struct pam_args *args, struct passwd *pwd, const char *cache,
+          const char *name, const char *status_path, const char *prefetch)
+{
+    int fd, status;
+    const char *result;
+
+    if (setpgid(0, 0) < 0)
+        putil_err(args, "cannot create process group: %s", strerror(errno));
+    fd = open("/dev/null", O_RDWR);
+    if (fd >= 0) {
+        dup2(fd, 0);
+        dup2(fd, 1);
+        dup2(fd, 2);
+        if (fd > 2)
+            close(fd);
+    }
+
+    /*
+     * A prefetching process must not wait for itself, and its tokens are
+     * only saved under the prefetch key, since the ticket cache they'd
+     * otherwise be saved under usually doesn't outlast authentication.
+     */
+    args->config->prefetch_tokens = false;
+    if (prefetch == NULL)
+        status = pamafs_token_acquire(args, pwd, cache, false);
+    else if (k_setpag() != 0) {
+        putil_err(args, "PAG creation failed: %s", strerror(errno));
+        status = PAM_CRED_ERR;
+    } else {
+        args->config->token_cache = false;
+        status = pamafs_token_acquire(args, pwd, cache, false);
+        if (status == PAM_SUCCESS)
+            pamafs_store_save(args, pwd, cache, prefetch);
+    }
+    result = (status == PAM_SUCCESS) ? STATUS_SUCCESS : STATUS_FAILURE;
+    pamafs_state_replace(args, name, result, strlen(result));
+    if (status_path != NULL)
+        async_status_write(args, pwd->pw_uid, status_path, result);
+    _exit(0);
+}
+
+
+/*
+ * Start a detached process that obtains tokens and records the result in the
+ * named status file, and in the user's status file at status if it's not
+ * NULL.  If prefetch isn't NULL, the process prefetches tokens in its own
+ * PAG and saves them under that key.  Returns the PID of the process, which
+ * is also its process group, or -1 on failure.
+ */
+static pid_t
+async_spawn(struct pam_args *args, struct passwd *pwd, const char *cache,
+            const char *name, const char *status_path, const char *prefetch)
+{
+    bool restore_handler;
+    int fds[2];
+    pid_t child, pid;
+    ssize_t status;
+
+    if (!pamafs_state_replace(args, name, STATUS_PENDING,
+                              strlen(STATUS_PENDING)))
+        return -1;
+
+    /*
+     * The background process writes the user's status file and then reports
+     * its PID on a pipe, so that the file exists by the time we return.  The
+     * intermediate child just exits.  See pamafs_child_sigchld for why we
+     * override SIGCHLD.
+     */
+    if (pipe(fds) < 0) {
+        putil_err(args, "cannot create pipe: %s", strerror(errno));
+        pamafs_state_remove(args, name);
+        return -1;
+    }
+    restore_handler = pamafs_child_sigchld(args);
+    child = fork();
+    if (child < 0) {
+        putil_crit(args, "cannot fork: %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        status = 0;
+    } else if (child == 0) {
+        close(fds[0]);
+        pid = fork();
+        if (pid == 0) {
+            setpgid(0, 0);
+            if (status_path != NULL)
+                async_status_write(args, pwd->pw_uid, status_path,
+                                   STATUS_PENDING);
+            pid = getpid();
+            if (write(fds[1], &pid, sizeof(pid)) != sizeof(pid))
+                _exit(1);
+            close(fds[1]);
+            async_run(args, pwd, cache, name, status_path, prefetch);
+        }
+        if (pid < 0)
+            _exit(1);
+
+        /* Also set the process group here to avoid racing with a kill. */
+        setpgid(pid, pid);
+        _exit(0);
+    } else {
+        close(fds[1]);
+        do
+            status = read(fds[0], &pid, sizeof(pid));
+        while (status < 0 && errno == EINTR);
+        close(fds[0]);
+        while (waitpid(child, NULL, 0) < 0 && errno == EINTR)
+            ;
+    }
+    if (restore_handler)
+        pamafs_child_sigchld_restore(args);
+    if (status != sizeof(pid)) {
+        putil_err(args, "cannot start background process");
+        pamafs_state_remove(args, name);
+        return -1;
+    }
+    putil_debug(args, "obtaining tokens in background process %lu",
+                (unsigned long) pid);
+    return pid;
+}
+
+
+/*
+ * Start obtaining tokens in the background.  Starts the detached process and
+ * records it in PAM data so that pamafs_async_stop can find it.  If the
+ * background process can't be started, falls back on obtaining tokens
+ * immediately.  Returns PAM_SUCCESS or an error code for pam_setcred.
+ */
+int
+pamafs_async_start(struct pam_args *args, struct passwd *pwd,
+                   const char *cache)
+{
+    struct async_data *async;
+    char *name, *path, *env, *user;
+    char *status_path = NULL;
+    unsigned long session;
+    pid_t pid;
+    int pamret;
+
+    pthread_mutex_lock(&async_lock);
+    session = ++async_sessions;
+    pthread_mutex_unlock(&async_lock);
+    if (asprintf(&name, "async-%lu-%lu-%lu", (unsigned long) pwd->pw_uid,
+                 (unsigned long) getpid(), session) < 0) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        goto fallback;
+    }
+    if (asprintf(&user, "afs-status-%lu-%lu-%lu", (unsigned long) pwd->pw_uid,
+                 (unsigned long) getpid(), session) < 0) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        free(name);
+        goto fallback;
+    }
+    status_path = async_status_path(args, pwd->pw_uid, user);
+    free(user);
+    pid = async_spawn(args, pwd, cache, name, status_path, NULL);
+    if (pid < 0) {
+        free(name);
+        free(status_path);
+        goto fallback;
+    }
+
+    /*
+     * Tell the application where to find the status and remember the process
+     * so that it can be stopped if the session is closed before it finishes.
+     * Neither of these failing should stop the session, since the tokens are
+     * on their way.  Point to the file the user can read if there is one.
+     */
+    if (status_path != NULL)
+        path = strdup(status_path);
+    else
+        path = pamafs_state_path(args, name);
+    if (path != NULL) {
+        if (asprintf(&env, "AFS_TOKEN_STATUS=%s", path) < 0)
+            putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        else {
+            pamret = pam_putenv(args->pamh, env);
+            if (pamret != PAM_SUCCESS)
+                putil_err_pam(args, pamret, "cannot set AFS_TOKEN_STATUS");
+            free(env);
+        }
+        free(path);
+    }
+    async = calloc(1, sizeof(struct async_data));
+    if (async == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        free(name);
+        free(status_path);
+        return PAM_SUCCESS;
+    }
+    async->pid = pid;
+    async->uid = pwd->pw_uid;
+    async->name = name;
+    async->status = status_path;
+    pamret = pam_set_data(args->pamh, ASYNC_DATA, async, async_data_free);
+    if (pamret != PAM_SUCCESS) {
+        putil_err_pam(args, pamret, "cannot set background process data");
+        async_data_free(args->pamh, async, pamret);
+    }
+    return PAM_SUCCESS;
+
+fallback:
+    putil_err(args, "obtaining tokens in the foreground");
+    return pamafs_token_acquire(args, pwd, cache, false);
+}
+
+
+/*
+ * Return the principal of the TGT in the given ticket cache, or NULL if it
+ * can't be determined or we weren't built with Kerberos support.
+ */
+#ifdef HAVE_KRB5
+static char *
+prefetch_principal(struct pam_args *args, const char *cache)
+{
+    krb5_error_code ret;
+    char *principal;
+    time_t authtime, endtime;
+
+    if (cache == NULL || cache[0] == '\0' || args->ctx == NULL)
+        return NULL;
+    ret = pamafs_cache_tgt(args, cache, &principal, &authtime, &endtime);
+    if (ret != 0) {
+        putil_debug_krb5(args, ret, "cannot find TGT in %s", cache);
+        return NULL;
+    }
+    return principal;
+}
+#else /* !HAVE_KRB5 */
+static char *
+prefetch_principal(struct pam_args *args UNUSED, const char *cache UNUSED)
+{
+    return NULL;
+}
+#endif /* !HAVE_KRB5 */
+
+
+/*
+ * Return the key under which tokens prefetched for the given ticket cache are
+ * saved: "prefetch:" followed by the principal of the TGT in the cache.  The
+ * saved tokens are also keyed by UID, so without Kerberos support, or if the
+ * principal can't be determined, this is just "prefetch:".  Returns NULL on
+ * allocation failure.
+ */
+static char *
+prefetch_key(struct pam_args *args, const char *cache)
+{
+    char *key, *principal;
+    int status;
+
+    principal = prefetch_principal(args, cache);
+    status = asprintf(&key, "prefetch:%s", principal == NULL ? "" : principal);
+    if (status < 0) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        key = NULL;
+    }
+    free(principal);
+    return key;
+}
+
+
+/*
+ * Start obtaining tokens for the given user and ticket cache in a background
+ * process with its own PAG, saving them in the token store for a later call
+ * to pamafs_prefetch_wait.  Failures are reported but otherwise ignored,
+ * since tokens will then just be obtained normally.
+ */
+void
+pamafs_prefetch_start(struct pam_args *args, struct passwd *pwd,
+                      const char *cache)
+{
+    char *key, *name;
+
+    key = prefetch_key(args, cache);
+    if (key == NULL)
+        return;
+    name = pamafs_state_name(args, "prefetch", pwd->pw_uid, key);
+    if (name != NULL)
+        async_spawn(args, pwd, cache, name, NULL, key);
+    free(name);
+    free(key);
+}
+
+
+/*
+ * If tokens are being prefetched for the given user and the principal in the
+ * given ticket cache, wait for up to prefetch_timeout seconds for that to
+ * finish and then put the tokens from the token store into the current PAG.
+ * The saved tokens are removed, since they were only for this session.
+ * Returns true if tokens were put in the PAG and false otherwise.
+ */
+bool
+pamafs_prefetch_wait(struct pam_args *args, struct passwd *pwd,
+                     const char *cache)
+{
+    struct timespec delay;
+    char *key, *name;
+    char *status = NULL;
+    size_t length;
+    long timeout, waited, interval;
+    bool okay = false;
+
+    key = prefetch_key(args, cache);
+    if (key == NULL)
+        return false;
+    name = pamafs_state_name(args, "prefetch", pwd->pw_uid, key);
+    if (name == NULL) {
+        free(key);
+        return false;
+    }
+    timeout = args->config->prefetch_timeout * 1000;
+    waited = 0;
+    interval = 10;
+    while (pamafs_state_read(args, name, &status, &length)) {
+        if (strcmp(status, STATUS_PENDING) != 0 || waited >= timeout)
+            break;
+        free(status);
+        status = NULL;
+        if (interval > timeout - waited)
+            interval = timeout - waited;
+        delay.tv_sec = interval / 1000;
+        delay.tv_nsec = (interval % 1000) * 1000 * 1000;
+        nanosleep(&delay, NULL);
+        waited += interval;
+        if (interval < 500)
+            interval *= 2;
+    }
+    if (status == NULL)
+        goto done;
+    if (strcmp(status, STATUS_PENDING) == 0)
+        putil_notice(args, "timed out waiting for prefetched tokens");
+    else if (strcmp(status, STATUS_SUCCESS) == 0) {
+        putil_debug(args, "prefetching tokens succeeded");
+        okay = pamafs_store_restore(args, pwd, cache, key);
+        pamafs_store_remove(args, pwd, cache, key);
+    } else
+        putil_debug(args, "prefetching tokens failed");
+    pamafs_state_remove(args, name);
+    free(status);
+
+done:
+    free(name);
+    free(key);
+    return okay;
+}
+
+
+/*
+ * Remove the user's status file.  This has to be done as the user (see
+ * async_status_write), which is only safe in a child process.
+ */
+static void
+async_status_remove(struct pam_args *args, uid_t uid, const char *path)
+{
+    bool restore_handler;
+    pid_t child;
+
+    restore_handler = pamafs_child_sigchld(args);
+    child = fork();
+    if (child < 0)
+        putil_crit(args, "cannot fork: %s", strerror(errno));
+    else if (child == 0)
+        _exit(async_status_write(args, uid, path, NULL) ? 0 : 1);
+    else
+        while (waitpid(child, NULL, 0) < 0 && errno == EINTR)
+            ;
+    if (restore_handler)
+        pamafs_child_sigchld_restore(args);
+}
+
+
+/*
+ * If tokens are being obtained in the background for this session, stop
+ * that if it's still in progress and remove its status file.  Called before
+ * deleting tokens so that new tokens don't appear after we've deleted them.
+ */
+void
+pamafs_async_stop(struct pam_args *args)
+{
+    const void *data;
+    const struct async_data *async;
+    char *status;
+    size_t length;
+    int pamret;
+
+    if (pam_get_data(args->pamh, ASYNC_DATA, &data) != PAM_SUCCESS)
+        return;
+    if (data == NULL)
+        return;
+    async = data;
+
+    /*
+     * Only signal the process if it hasn't recorded its result, since
+     * otherwise it has exited and its PID may have been reused.
+     */
+    if (pamafs_state_read(args, async->name, &status, &length)) {
+        if (strcmp(status, STATUS_PENDING) == 0) {
+            putil_debug(args, "stopping background process %lu",
+                        (unsigned long) async->pid);
+            if (kill(-async->pid, SIGKILL) < 0 && errno != ESRCH)
+                putil_err(args, "cannot stop background process %lu: %s",
+                          (unsigned long) async->pid, strerror(errno));
+        }
+        free(status);
+    }
+    pamafs_state_remove(args, async->name);
+    if (async->status != NULL)
+        async_status_remove(args, async->uid, async->status);
+    pamret = pam_set_data(args->pamh, ASYNC_DATA, NULL, NULL);
+    if (pamret != PAM_SUCCESS)
+        putil_err_pam(args, pamret, "cannot remove background process data");
+}
@@ -0,0 +1,248 @@
+/*
+ * Circuit breaker for AFS cells whose token acquisition keeps failing.
+ *
+ * If the KDC or database servers for a cell are unreachable, every login
+ * waits for aklog or krb5_afslog to time out before continuing without
+ * tokens.  If the cell_breaker option is set, consecutive failures to obtain
+ * tokens for each cell are counted in a small table in the state directory
+ * shared by all processes on the host.  Once a cell has failed that many
+ * times in a row, no attempt is made to obtain tokens for it for
+ * cell_breaker_time seconds.  After that, a single login is allowed to try
+ * again: if it succeeds, the cell is back to normal, and if it fails, the
+ * cell is skipped for another cell_breaker_time seconds.
+ *
+ * Only failures that point to a problem with the cell or the local cache
+ * manager are recorded here; deciding which those are is left to the caller.
+ * Failures specific to one user, such as an expired ticket, must not be, or
+ * a few users with bad credentials could shut everyone out of a cell.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+
+/* The name of the table in the state directory. */
+#define BREAKER_FILE "breaker"
+
+/* How long to wait, in milliseconds, for other processes using the table. */
+#define BREAKER_LOCK_WAIT 2000
+
+/*
+ * The number of cells tracked in the table.  When it's full, the entry for
+ * the cell that last failed longest ago is reused.
+ */
+#define BREAKER_CELLS 64
+
+/*
+ * An entry in the table.  An empty cell name means the local cell, used when
+ * tokens are obtained without naming specific cells.  An entry with no
+ * failures is unused.
+ */
+struct breaker_entry {
+    char cell[256];             /* Nul-terminated name of the cell. */
+    uint32_t failures;          /* Number of consecutive failures. */
+    uint32_t pad;               /* Unused, for alignment. */
+    int64_t failed;             /* Time of the most recent failure. */
+    int64_t until;              /* Skip this cell until this time. */
+};
+
+
+/*
+ * Open and lock the table, and read its contents into table, which must have
+ * room for BREAKER_CELLS entries.  A missing or short table is treated as
+ * containing empty entries.  Returns the file descriptor, which must be
+ * passed to breaker_close, or -1 on failure.
+ */
+static int
+breaker_open(struct pam_args *args, struct breaker_entry *table)
+{
+    int fd;
+    ssize_t status;
+    size_t total = 0;
+    const size_t size = sizeof(struct breaker_entry) * BREAKER_CELLS;
+
+    memset(table, 0, size);
+    fd = pamafs_state_open(args, BREAKER_FILE, O_RDWR | O_CREAT);
+    if (fd < 0)
+        return -1;
+    if (!pamafs_state_lock(args, fd, true, BREAKER_LOCK_WAIT)) {
+        putil_err(args, "cannot lock cell failure table");
+        close(fd);
+        return -1;
+    }
+    while (total < size) {
+        status = read(fd, (char *) table + total, size - total);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status <= 0)
+            break;
+        total += (size_t) status;
+    }
+    return fd;
+}
+
+
+/*
+ * Write the table back, if it was changed, and unlock and close it.
+ */
+static void
+breaker_close(struct pam_args *args, int fd, struct breaker_entry *table,
+              bool changed)
+{
+    const size_t size = sizeof(struct breaker_entry) * BREAKER_CELLS;
+
+    if (changed)
+        if (pwrite(fd, table, size, 0) != (ssize_t) size)
+            putil_err(args, "cannot update cell failure table: %s",
+                      strerror(errno));
+    close(fd);
+}
+
+
+/*
+ * Find the entry for a cell in the table, returning NULL if there isn't one.
+ */
+static struct breaker_entry *
+breaker_find(struct breaker_entry *table, const char *cell)
+{
+    size_t i;
+
+    for (i = 0; i < BREAKER_CELLS; i++)
+        if (table[i].failures > 0 && strcmp(table[i].cell, cell) == 0)
+            return &table[i];
+    return NULL;
+}
+
+
+/*
+ * Return a printable name for a cell for log messages.
+ */
+static const char *
+breaker_name(const char *cell)
+{
+    return (cell[0] == '\0') ? "local cell" : cell;
+}
+
+
+/*
+ * Check whether we should try to obtain tokens for a cell.  cell may be the
+ * empty string to mean whatever cells aklog or krb5_afslog would normally
+ * obtain tokens for.  Returns false if the cell is being skipped because of
+ * recent failures.  When the skip period for a cell ends, returns true for
+ * only one caller until that caller reports its result with
+ * pamafs_breaker_record, so that only one login at a time waits to find out
+ * if the cell is still broken.  Always returns true if the table can't be
+ * used.
+ */
+bool
+pamafs_breaker_allow(struct pam_args *args, const char *cell)
+{
+    struct breaker_entry table[BREAKER_CELLS];
+    struct breaker_entry *entry;
+    time_t now;
+    long threshold;
+    bool allow = true;
+    bool changed = false;
+    int fd;
+
+    threshold = args->config->cell_breaker;
+    if (threshold <= 0)
+        return true;
+    fd = breaker_open(args, table);
+    if (fd < 0)
+        return true;
+    entry = breaker_find(table, cell);
+    if (entry != NULL && entry->failures >= (uint32_t) threshold) {
+        now = time(NULL);
+        if (now < entry->until) {
+            putil_debug(args, "skipping %s after %lu failures",
+                        breaker_name(cell), (unsigned long) entry->failures);
+            allow = false;
+        } else {
+            putil_debug(args, "checking whether %s has recovered",
+                        breaker_name(cell));
+            entry->until = now + args->config->cell_breaker_time;
+            changed = true;
+        }
+    }
+    breaker_close(args, fd, table, changed);
+    return allow;
+}
+
+
+/*
+ * Record whether obtaining tokens for a cell succeeded.  A success forgets
+ * any previous failures.  A failure that brings the number of consecutive
+ * failures to cell_breaker starts (or, after a failed check for recovery,
+ * restarts) the period during which the cell is skipped.
+ */
+void
+pamafs_breaker_record(struct pam_args *args, const char *cell, bool success)
+{
+    struct breaker_entry table[BREAKER_CELLS];
+    struct breaker_entry *entry;
+    time_t now;
+    long threshold;
+    size_t i;
+    int fd;
+
+    threshold = args->config->cell_breaker;
+    if (threshold <= 0)
+        return;
+    fd = breaker_open(args, table);
+    if (fd < 0)
+        return;
+    entry = breaker_find(table, cell);
+    if (success) {
+        if (entry == NULL) {
+            breaker_close(args, fd, table, false);
+            return;
+        }
+        if (entry->failures >= (uint32_t) threshold)
+            putil_notice(args, "%s has recovered", breaker_name(cell));
+        memset(entry, 0, sizeof(*entry));
+        breaker_close(args, fd, table, true);
+        return;
+    }
+
+    /* Find or create the entry for the cell and record the failure. */
+    now = time(NULL);
+    if (entry == NULL) {
+        if (strlen(cell) >= sizeof(entry->cell)) {
+            breaker_close(args, fd, table, false);
+            return;
+        }
+        entry = &table[0];
+        for (i = 0; i < BREAKER_CELLS; i++) {
+            if (table[i].failures == 0) {
+                entry = &table[i];
+                break;
+            }
+            if (table[i].failed < entry->failed)
+                entry = &table[i];
+        }
+        memset(entry, 0, sizeof(*entry));
+        strlcpy(entry->cell, cell, sizeof(entry->cell));
+    }
+    entry->failures++;
+    entry->failed = now;
+    if (entry->failures >= (uint32_t) threshold) {
+        entry->until = now + args->config->cell_breaker_time;
+        putil_err(args, "skipping %s for %lds after %lu failures",
+                  breaker_name(cell), args->config->cell_breaker_time,
+                  (unsigned long) entry->failures);
+    }
+    breaker_close(args, fd, table, true);
+}
@@ -0,0 +1,377 @@
+/*
+ * Waiting for child processes with a deadline.
+ *
+ * Tokens are obtained either by running aklog or, if krb5_afslog is used, in
+ * a helper child process that shares our PAG.  Either way, a slow or
+ * unreachable KDC or AFS server could otherwise block the login
+ * indefinitely.  These functions wait for such a child for at most
+ * token_timeout seconds and kill it if it takes longer, so that the login
+ * can continue without tokens.
+ *
+ * The child is given the write end of a pipe, so the read end becomes
+ * readable (end of file) when the child exits.  This lets us wait with poll
+ * and a timeout rather than polling waitpid.  aklog also writes its output
+ * to that pipe.  We read it as it arrives so that the child never blocks on
+ * a full pipe, keep the first PAMAFS_CHILD_OUTPUT bytes for the caller to
+ * log, and discard the rest.  If the child exits but something it started
+ * keeps the pipe open, we notice within CHILD_POLL milliseconds.  If the
+ * child closes the pipe but doesn't exit, we poll waitpid until the deadline.
+ * The deadline is kept on the monotonic clock so that changes to the system
+ * time can't stretch or cut it short.
+ *
+ * The disposition of SIGCHLD and the state of the process between fork and
+ * exec are shared with any other threads in the application, so these are
+ * also handled here, in ways that are safe with threads.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ * Copyright 2015 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+
+/* How often to check whether the child exited without closing the pipe. */
+#define CHILD_POLL 100
+
+/* Most reads of child output in a row before checking the deadline again. */
+#define CHILD_READS 16
+
+/*
+ * The number of SIGCHLD overrides in effect and the application's handler
+ * saved by the first of them, protected by child_lock.
+ */
+static pthread_mutex_t child_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long child_overrides = 0;
+static struct sigaction child_saved;
+
+
+/*
+ * Return the number of milliseconds from now until the given deadline, in
+ * nanoseconds on the clock used by pamafs_time_now, or 0 if it has passed.
+ */
+static long
+child_remaining(uint64_t deadline)
+{
+    uint64_t now;
+
+    now = pamafs_time_now();
+    if (now >= deadline)
+        return 0;
+    return (long) ((deadline - now) / 1000000);
+}
+
+
+/*
+ * Create the pipe used to notice when a child exits.  On success, returns
+ * true and stores the two ends in fds.  On failure, reports the error and
+ * sets both to -1, in which case pamafs_child_wait can still be used but
+ * can't enforce the deadline.
+ */
+bool
+pamafs_child_pipe(struct pam_args *args, int fds[2])
+{
+    if (pipe(fds) < 0) {
+        putil_err(args, "cannot create pipe: %s", strerror(errno));
+        fds[0] = -1;
+        fds[1] = -1;
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Report a failure in a child process before it could exec and exit with
+ * status 1.  If the application has other threads, only async-signal-safe
+ * functions may be called between fork and exec, which rules out our usual
+ * logging (and strerror), so write what failed and the error number to
+ * standard error, which is the pipe the parent logs.
+ */
+void
+pamafs_child_fail(const char *what, int error)
+{
+    char number[32];
+    char *p = number + sizeof(number);
+    unsigned int value = (error < 0) ? 0 : (unsigned int) error;
+    ssize_t status;
+
+    *--p = '\n';
+    do {
+        *--p = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    status = write(2, what, strlen(what));
+    if (status >= 0)
+        status = write(2, ": errno ", strlen(": errno "));
+    if (status >= 0)
+        status = write(2, p, (size_t) (number + sizeof(number) - p));
+    _exit(1);
+}
+
+
+/*
+ * The application that calls us may have set a SIGCHLD handler, but we need
+ * to ensure that it's not called for our children, so we temporarily
+ * override it.  This is a bit of a disaster if the application has other
+ * children that it wants to handle while we wait; there seems to be no good
+ * solution here.
+ *
+ * The disposition is shared by all threads, so overrides are counted: the
+ * first saves the application's handler and the last restores it.
+ * Otherwise, two threads running aklog at once could each save the other's
+ * override and leave SIGCHLD at the default for good.  With thread_safe,
+ * the disposition is left alone, since changing it would affect the
+ * application's other threads, so the application must leave SIGCHLD at
+ * SIG_DFL.  Otherwise, the child is reaped before we can wait for it and
+ * pamafs_child_wait reports that distinctly.
+ *
+ * Returns true if pamafs_child_sigchld_restore must be called afterwards.
+ */
+bool
+pamafs_child_sigchld(struct pam_args *args)
+{
+    struct sigaction sa;
+    bool okay = true;
+
+    if (args->config->thread_safe)
+        return false;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+    pthread_mutex_lock(&child_lock);
+    if (child_overrides == 0 && sigaction(SIGCHLD, &sa, &child_saved) < 0)
+        okay = false;
+    else
+        child_overrides++;
+    pthread_mutex_unlock(&child_lock);
+    if (!okay)
+        putil_err(args, "cannot set SIGCHLD handler, continuing anyway");
+    return okay;
+}
+
+
+/*
+ * Undo an override of SIGCHLD, restoring the application's handler if this
+ * was the last one.
+ */
+void
+pamafs_child_sigchld_restore(struct pam_args *args)
+{
+    bool okay = true;
+
+    pthread_mutex_lock(&child_lock);
+    child_overrides--;
+    if (child_overrides == 0 && sigaction(SIGCHLD, &child_saved, NULL) < 0)
+        okay = false;
+    pthread_mutex_unlock(&child_lock);
+    if (!okay)
+        putil_err(args, "cannot restore SIGCHLD handler");
+}
+
+
+/*
+ * Reap a child process, storing its wait status and resource usage, retrying
+ * on EINTR.  options are passed to wait4.  Returns the result of wait4.
+ * Without wait4, uses waitpid and leaves the resource usage zeroed.
+ */
+static pid_t
+child_reap(pid_t child, int *status, int options, struct rusage *usage)
+{
+    pid_t result;
+
+    memset(usage, 0, sizeof(*usage));
+    do {
+#ifdef HAVE_WAIT4
+        result = wait4(child, status, options, usage);
+#else
+        result = waitpid(child, status, options);
+#endif
+    } while (result < 0 && errno == EINTR);
+    return result;
+}
+
+
+/*
+ * Read whatever output from the child is available on the non-blocking fd,
+ * appending it to output if that isn't NULL and discarding anything past the
+ * size of its buffer.  Returns true if we reached end of file or got an
+ * error, and false if there's nothing more to read for now.
+ */
+static bool
+child_read(int fd, struct pamafs_child_output *output)
+{
+    char buffer[BUFSIZ];
+    size_t space, length;
+    ssize_t result;
+    int i;
+
+    for (i = 0; i < CHILD_READS; i++) {
+        result = read(fd, buffer, sizeof(buffer));
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0)
+            return (errno != EAGAIN);
+        if (result == 0)
+            return true;
+        if (output == NULL)
+            continue;
+        length = (size_t) result;
+        space = sizeof(output->buffer) - 1 - output->length;
+        if (length > space) {
+            length = space;
+            output->truncated = true;
+        }
+        memcpy(output->buffer + output->length, buffer, length);
+        output->length += length;
+        output->buffer[output->length] = '\0';
+    }
+    return false;
+}
+
+
+/*
+ * Kill a child that missed its deadline and reap it.  If fd isn't -1, collect
+ * any last output from it and close it.
+ */
+static void
+child_kill(struct pam_args *args, pid_t child, int fd, long timeout,
+           const char *what, int *status, struct pamafs_child_output *output)
+{
+    struct rusage usage;
+
+    putil_err(args, "%s timed out after %lds, continuing without tokens",
+              what, timeout);
+    kill(child, SIGKILL);
+    if (fd >= 0) {
+        child_read(fd, output);
+        close(fd);
+    }
+    child_reap(child, status, 0, &usage);
+    if (output != NULL)
+        output->usage = usage;
+}
+
+
+/*
+ * Wait for a child process.  fd is the read end of the pipe from
+ * pamafs_child_pipe, with the write end already closed in the parent, or -1
+ * to just wait.  If timeout is greater than 0 and the child hasn't exited
+ * within that many seconds, kill it, reap it, and report that what timed
+ * out.  Closes fd.  If output isn't NULL, store in it whatever the child
+ * wrote to the pipe and its resource usage.  Returns true and sets status to
+ * the wait status of the child if it exited on its own, and false otherwise.
+ */
+bool
+pamafs_child_wait(struct pam_args *args, pid_t child, int fd, long timeout,
+                  const char *what, int *status,
+                  struct pamafs_child_output *output)
+{
+    struct pollfd pfd;
+    struct rusage usage;
+    uint64_t deadline = 0;
+    long remaining, interval;
+    int flags, result;
+    pid_t pid;
+    bool done = false;
+
+    if (output != NULL) {
+        output->length = 0;
+        output->truncated = false;
+        output->buffer[0] = '\0';
+    }
+    if (timeout > 0)
+        deadline = pamafs_time_now() + (uint64_t) timeout * 1000000000ULL;
+    if (fd >= 0) {
+        flags = fcntl(fd, F_GETFL);
+        if (flags >= 0)
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (fd >= 0 && !done) {
+        remaining = CHILD_POLL;
+        if (timeout > 0) {
+            remaining = child_remaining(deadline);
+            if (remaining == 0) {
+                child_kill(args, child, fd, timeout, what, status, output);
+                return false;
+            }
+            if (remaining > CHILD_POLL)
+                remaining = CHILD_POLL;
+        }
+        pfd.revents = 0;
+        result = poll(&pfd, 1, (int) remaining);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0) {
+            putil_err(args, "cannot wait for %s: %s", what, strerror(errno));
+            break;
+        }
+        if (result > 0) {
+            done = child_read(fd, output);
+            continue;
+        }
+
+        /* Nothing to read.  See if the child exited but the pipe is open. */
+        pid = child_reap(child, status, WNOHANG, &usage);
+        if (pid == child) {
+            child_read(fd, output);
+            close(fd);
+            if (output != NULL)
+                output->usage = usage;
+            return true;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+
+    /*
+     * The pipe is closed or was never created, but the child may not have
+     * exited: aklog could close its output and then hang.  Without a timeout,
+     * just wait for it.  Otherwise, poll until the deadline, starting with
+     * short intervals since the child has usually just exited.
+     */
+    if (timeout <= 0)
+        pid = child_reap(child, status, 0, &usage);
+    else {
+        interval = 1;
+        while ((pid = child_reap(child, status, WNOHANG, &usage)) == 0) {
+            remaining = child_remaining(deadline);
+            if (remaining == 0) {
+                child_kill(args, child, -1, timeout, what, status, output);
+                return false;
+            }
+            if (remaining > interval)
+                remaining = interval;
+            poll(NULL, 0, (int) remaining);
+            if (interval < CHILD_POLL)
+                interval *= 2;
+        }
+    }
+    if (pid < 0 && errno == ECHILD) {
+        putil_err(args, "cannot wait for %s: already reaped, SIGCHLD must be"
+                  " left at SIG_DFL with thread_safe", what);
+        return false;
+    }
+    if (pid < 0) {
+        putil_err(args, "cannot wait for %s: %s", what, strerror(errno));
+        return false;
+    }
+    if (output != NULL)
+        output->usage = usage;
+    return true;
+}
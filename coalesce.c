@@ -0,0 +1,104 @@
+/*
+ * Coalescing of simultaneous token acquisitions for the same user.
+ *
+ * When a batch scheduler starts many sessions for the same user at once,
+ * every one of them would otherwise run aklog against the same KDC and
+ * database servers at the same time.  If the coalesce_tokens option is set,
+ * only one of them (the leader) obtains tokens, while the others wait for it
+ * to finish and then take the leader's tokens from the saved token store
+ * (see store.c) into their own PAGs.
+ *
+ * The coordination is done with a lock file per UID and ticket cache in the
+ * state directory.  The leader holds a write lock while obtaining and saving
+ * tokens; the other sessions wait, for a bounded time, for a read lock, which
+ * they can only get once the leader is done.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+
+
+/*
+ * Wait for tokens being obtained by another session for the same user and
+ * ticket cache, or become the session responsible for obtaining them.
+ * Returns true if tokens were obtained from another session and put in the
+ * current PAG.  Otherwise, returns false and sets lock to a file descriptor
+ * that must be passed to pamafs_coalesce_end once the caller has obtained
+ * and saved tokens.  lock may be -1 if coordination failed or we gave up
+ * waiting, in which case the caller should just obtain tokens itself.
+ */
+bool
+pamafs_coalesce_wait(struct pam_args *args, const struct passwd *pwd,
+                     const char *cache, int *lock)
+{
+    char *name;
+    int fd;
+    long timeout;
+
+    *lock = -1;
+    name = pamafs_state_name(args, "acquire", pwd->pw_uid, cache);
+    if (name == NULL)
+        return false;
+    fd = pamafs_state_open(args, name, O_RDWR | O_CREAT);
+    free(name);
+    if (fd < 0)
+        return false;
+
+    /*
+     * If nothing else holds the lock, we're the leader.  The leader of a
+     * previous round may have finished between our check of the saved
+     * tokens and getting the lock, though, so check again.
+     */
+    if (pamafs_state_lock(args, fd, true, 0)) {
+        if (pamafs_store_restore(args, pwd, cache, NULL)) {
+            close(fd);
+            return true;
+        }
+        putil_debug(args, "obtaining tokens for other waiting sessions");
+        *lock = fd;
+        return false;
+    }
+
+    /* Someone else is obtaining tokens.  Wait for them to finish. */
+    timeout = args->config->coalesce_timeout;
+    putil_debug(args, "waiting up to %lds for another session to obtain"
+                " tokens", timeout);
+    if (!pamafs_state_lock(args, fd, false, timeout * 1000)) {
+        putil_notice(args, "timed out waiting for another session to obtain"
+                     " tokens");
+        close(fd);
+        return false;
+    }
+    if (pamafs_store_restore(args, pwd, cache, NULL)) {
+        close(fd);
+        return true;
+    }
+    putil_debug(args, "other session did not obtain tokens");
+    close(fd);
+    return false;
+}
+
+
+/*
+ * Release the lock taken by the leader after it has saved its tokens, which
+ * lets the waiting sessions proceed.
+ */
+void
+pamafs_coalesce_end(struct pam_args *args UNUSED, int lock)
+{
+    if (lock >= 0)
+        close(lock);
+}
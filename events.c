@@ -0,0 +1,292 @@
+/*
+ * Binary event log of PAM calls.
+ *
+ * If the event_log option is set to a number of records, each PAM call
+ * writes one fixed-size record describing what it did (the user, flags,
+ * result, whether a PAG was created, how many cells tokens were requested
+ * for, the exit status of aklog, and the time spent in each phase) into a
+ * ring buffer of that many records in a file in the state directory.  This
+ * keeps a history of recent calls for analysis with pam-afs-session-events
+ * after an incident without the cost or loss of logging every call through
+ * syslog.
+ *
+ * The file is mapped into memory the first time it's needed and stays mapped
+ * for the life of the process.  Writers never lock; each claims a slot with
+ * an atomic increment of the next sequence number and marks the record
+ * incomplete while writing it, as described in events.h.  The size of the
+ * ring is set by whichever process creates the file, so changing event_log
+ * only takes effect once the file is removed.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <events.h>
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+
+/*
+ * Without the atomic builtins, fall back on ordinary loads and stores.
+ * Records may then be lost or mixed up when processes write them at the same
+ * time.
+ */
+#ifdef HAVE_ATOMIC_BUILTINS
+# define EVENTS_CLAIM(p)    __atomic_fetch_add((p), 1, __ATOMIC_RELAXED)
+# define EVENTS_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+# define EVENTS_FENCE()     __atomic_thread_fence(__ATOMIC_RELEASE)
+#else
+# define EVENTS_CLAIM(p)    ((*(p))++)
+# define EVENTS_STORE(p, v) (*(p) = (v))
+# define EVENTS_FENCE()     /* empty */
+#endif
+
+/*
+ * The event logs mapped so far, one per state directory.  As with the
+ * statistics, entries are only added, while holding events_lock, and are
+ * published with a release store, and they're never removed or unmapped, so
+ * writers only lock the first time they need a given directory.  If a file
+ * couldn't be mapped, its entry has a NULL map so that we don't try again.
+ */
+struct events_mapping {
+    struct events_mapping *next;
+    char *dir;
+    struct pamafs_events *map;
+};
+static pthread_mutex_t events_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct events_mapping *events_list = NULL;
+
+
+/*
+ * Set a field of a newly created event log if it's still zero, and return
+ * its value afterwards.
+ */
+static uint64_t
+events_claim(uint64_t *field, uint64_t value)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+    uint64_t expected = 0;
+
+    if (__atomic_compare_exchange_n(field, &expected, value, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        return value;
+    return expected;
+#else
+    if (*field == 0)
+        *field = value;
+    return *field;
+#endif
+}
+
+
+/*
+ * Map the event log in the state directory, creating it with event_log
+ * records if needed, and return the mapping.  Failures are reported with
+ * putil_err and return NULL.
+ */
+static struct pamafs_events *
+events_open(struct pam_args *args)
+{
+    struct pamafs_events *events;
+    size_t length, minimum;
+    uint64_t count;
+
+    minimum = sizeof(struct pamafs_events)
+        + (size_t) args->config->event_log * sizeof(struct pamafs_event);
+    events = pamafs_state_map(args, PAMAFS_EVENTS_FILE, minimum, &length);
+    if (events == NULL)
+        return NULL;
+    count = events_claim(&events->count, (uint64_t) args->config->event_log);
+    if (count == 0 || count > (length - sizeof(struct pamafs_events))
+                                  / sizeof(struct pamafs_event)
+        || events_claim(&events->magic, PAMAFS_EVENTS_MAGIC)
+               != PAMAFS_EVENTS_MAGIC) {
+        putil_err(args, "%s has an unknown format, not logging events",
+                  PAMAFS_EVENTS_FILE);
+        munmap((void *) events, length);
+        return NULL;
+    }
+    return events;
+}
+
+
+/*
+ * Search a list of mappings for the given state directory.
+ */
+static struct events_mapping *
+events_find(struct events_mapping *mapping, const char *dir)
+{
+    for (; mapping != NULL; mapping = mapping->next)
+        if (strcmp(mapping->dir, dir) == 0)
+            return mapping;
+    return NULL;
+}
+
+
+/*
+ * Return the event log to write to, mapping the file if this is the first
+ * time we've needed it for this state directory, or NULL if the event log
+ * isn't enabled or can't be written.  Once the file has been mapped, this
+ * doesn't lock.
+ */
+static struct pamafs_events *
+events_get(struct pam_args *args)
+{
+    const char *dir = args->config->state_dir;
+    struct events_mapping *mapping;
+    struct pamafs_events *events;
+
+    if (args->config->event_log <= 0 || dir == NULL)
+        return NULL;
+#ifdef HAVE_ATOMIC_BUILTINS
+    mapping = events_find(__atomic_load_n(&events_list, __ATOMIC_ACQUIRE),
+                          dir);
+    if (mapping != NULL)
+        return mapping->map;
+#endif
+
+    /* Not found, so map the file unless another thread just did. */
+    pthread_mutex_lock(&events_lock);
+    mapping = events_find(events_list, dir);
+    if (mapping == NULL) {
+        mapping = calloc(1, sizeof(struct events_mapping));
+        if (mapping != NULL)
+            mapping->dir = strdup(dir);
+        if (mapping == NULL || mapping->dir == NULL) {
+            putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+            free(mapping);
+            pthread_mutex_unlock(&events_lock);
+            return NULL;
+        }
+        mapping->map = events_open(args);
+        mapping->next = events_list;
+#ifdef HAVE_ATOMIC_BUILTINS
+        __atomic_store_n(&events_list, mapping, __ATOMIC_RELEASE);
+#else
+        events_list = mapping;
+#endif
+    }
+    events = mapping->map;
+    pthread_mutex_unlock(&events_lock);
+    return events;
+}
+
+
+/*
+ * Convert nanoseconds to microseconds for a record, saturating rather than
+ * wrapping.
+ */
+static uint32_t
+events_usec(uint64_t nsec)
+{
+    uint64_t usec = nsec / 1000;
+
+    return (usec > UINT32_MAX) ? UINT32_MAX : (uint32_t) usec;
+}
+
+
+/*
+ * Note the UID of the user the current call is for.
+ */
+void
+pamafs_events_user(struct pam_args *args, uid_t uid)
+{
+    if (args->config->timing != NULL)
+        args->config->timing->uid = uid;
+}
+
+
+/*
+ * Note that the current call created a PAG.
+ */
+void
+pamafs_events_pag(struct pam_args *args)
+{
+    if (args->config->timing != NULL)
+        args->config->timing->pag_created = true;
+}
+
+
+/*
+ * Note that the current call ran aklog for the given number of cells (0 for
+ * the default cell) and that it exited with status.
+ */
+void
+pamafs_events_aklog(struct pam_args *args, unsigned int cells, int status)
+{
+    struct pamafs_timing *timing = args->config->timing;
+
+    if (timing == NULL)
+        return;
+    timing->cells += (cells == 0) ? 1 : cells;
+    timing->aklog_status = status;
+}
+
+
+/*
+ * Write a record of the current call to the event log, given the entry
+ * point, the PAM flags it was called with, and the status it's returning.
+ */
+void
+pamafs_events_record(struct pam_args *args, enum pamafs_event_call call,
+                     int flags, int status)
+{
+    struct pamafs_events *events;
+    struct pamafs_timing *timing;
+    struct pamafs_event event, *record;
+    struct timespec now;
+    PAM_CONST void *user = NULL;
+    uint64_t seq;
+    size_t i;
+
+    if (args == NULL || args->config == NULL)
+        return;
+    timing = args->config->timing;
+    if (timing == NULL)
+        return;
+    events = events_get(args);
+    if (events == NULL)
+        return;
+
+    /* Build the record. */
+    memset(&event, 0, sizeof(event));
+    if (clock_gettime(CLOCK_REALTIME, &now) == 0)
+        event.time = (uint64_t) now.tv_sec * 1000000000ULL
+            + (uint64_t) now.tv_nsec;
+    event.pid = (uint32_t) getpid();
+    event.uid = (uint32_t) timing->uid;
+    event.flags = flags;
+    event.status = status;
+    event.aklog_status = timing->aklog_status;
+    event.call = (uint16_t) call;
+    event.pag_created = timing->pag_created;
+    event.cells = (timing->cells > UINT8_MAX) ? UINT8_MAX : timing->cells;
+    if (timing->start != 0)
+        event.total_us = events_usec(pamafs_time_now() - timing->start);
+    for (i = 0; i < PAMAFS_PHASE_MAX && i < PAMAFS_EVENTS_PHASES; i++)
+        event.phase_us[i] = events_usec(timing->phase[i]);
+    if (pam_get_item(args->pamh, PAM_USER, &user) == PAM_SUCCESS
+        && user != NULL)
+        strlcpy(event.user, user, sizeof(event.user));
+
+    /* Claim a slot and write the record, marking it incomplete meanwhile. */
+    seq = EVENTS_CLAIM(&events->next);
+    record = &events->record[seq % events->count];
+    EVENTS_STORE(&record->seq, 0);
+    EVENTS_FENCE();
+    memcpy((char *) record + sizeof(record->seq),
+           (char *) &event + sizeof(event.seq),
+           sizeof(event) - sizeof(event.seq));
+    EVENTS_STORE(&record->seq, seq + 1);
+}
@@ -0,0 +1,84 @@
+/*
+ * Layout of the event log.
+ *
+ * If the event_log option is set, the module writes a fixed-size binary
+ * record describing each PAM call into a ring buffer in a file in the state
+ * directory, for post-mortem analysis with pam-afs-session-events.  This
+ * header describes the layout of that file and is shared between the module
+ * and that program.
+ *
+ * The file starts with a header followed by count records.  Writers claim
+ * the next sequence number by atomically incrementing next and write their
+ * record into slot (sequence % count).  The seq field of a record is zeroed
+ * before the rest of the record is written and set to the sequence number
+ * plus one afterwards, so readers can discard records that are being
+ * written by checking that seq is nonzero and unchanged after copying the
+ * record.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef EVENTS_H
+#define EVENTS_H 1
+
+#include <config.h>
+#include <portable/system.h>
+
+/* Name of the event log in the state directory. */
+#define PAMAFS_EVENTS_FILE "events"
+
+/* Magic number and version ("pafsevt" followed by the version). */
+#define PAMAFS_EVENTS_MAGIC 0x7061667365767401ULL
+
+/* Largest number of records allowed (112MB of records). */
+#define PAMAFS_EVENTS_LIMIT (1024L * 1024L)
+
+/* Space for phase durations, at least the number of enum pamafs_phase. */
+#define PAMAFS_EVENTS_PHASES 8
+
+/* Space for the user name, which is truncated if longer. */
+#define PAMAFS_EVENTS_USER 32
+
+/* Value of aklog_status if aklog was not run or could not be waited for. */
+#define PAMAFS_EVENTS_NO_AKLOG  -1
+#define PAMAFS_EVENTS_NO_STATUS -2
+
+/* The PAM entry points. */
+enum pamafs_event_call {
+    PAMAFS_CALL_AUTHENTICATE,
+    PAMAFS_CALL_SETCRED,
+    PAMAFS_CALL_OPEN_SESSION,
+    PAMAFS_CALL_CLOSE_SESSION,
+    PAMAFS_CALL_MAX
+};
+
+/* One record in the ring buffer, describing one PAM call. */
+struct pamafs_event {
+    uint64_t seq;               /* Sequence number + 1, or 0 if incomplete. */
+    uint64_t time;              /* Nanoseconds since the epoch at return. */
+    uint32_t pid;               /* Process ID of the caller. */
+    uint32_t uid;               /* UID of the user, or -1 if not known. */
+    int32_t flags;              /* PAM flags passed to the call. */
+    int32_t status;             /* PAM status returned. */
+    int32_t aklog_status;       /* Exit status of aklog, 128 + signal. */
+    uint16_t call;              /* enum pamafs_event_call. */
+    uint8_t pag_created;        /* Whether a new PAG was created. */
+    uint8_t cells;              /* Cells tokens were requested for. */
+    uint32_t total_us;          /* Total time of the call. */
+    uint32_t phase_us[PAMAFS_EVENTS_PHASES]; /* Time in each phase. */
+    char user[PAMAFS_EVENTS_USER];           /* PAM user, nul-terminated. */
+};
+
+/* The header of the file, followed by count records. */
+struct pamafs_events {
+    uint64_t magic;             /* PAMAFS_EVENTS_MAGIC. */
+    uint64_t count;             /* Number of records in the ring. */
+    uint64_t next;              /* Next sequence number to write. */
+    uint64_t reserved;          /* Unused, for alignment. */
+    struct pamafs_event record[]; /* The ring of records. */
+};
+
+#endif /* !EVENTS_H */
@@ -0,0 +1,288 @@
+/*
+ * Determine whether a user's home directory is in AFS and its cell.
+ *
+ * If afs_homedir_only is set, tokens are only obtained for users whose home
+ * directory is in AFS.  If afs_homedir_paths is set, a home directory is
+ * in AFS if it's at or below one of those paths, and the file system is
+ * never touched.  Otherwise, the type of the file system holding the home
+ * directory is checked.  Since an AFS home directory may not be accessible
+ * before the user has tokens, each parent directory is tried in turn until
+ * one can be checked.
+ *
+ * The results of checking file systems are cached for the life of the
+ * process, since some applications open many sessions and a hung file
+ * server would otherwise be touched for each one.
+ *
+ * If aklog_homedir_cell is set along with aklog_homedir, the cache manager
+ * is asked which cell holds the home directory so that tokens can be
+ * obtained for just that cell without another process walking the path.
+ * The answer is remembered for the top of the cell's tree (/afs/<cell> or
+ * /afs/.<cell>) when the home directory is below it, so that it's reused
+ * for every user with a home directory in the same cell, and otherwise for
+ * the home directory itself.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <pthread.h>
+#ifdef HAVE_SYS_VFS_H
+# include <sys/vfs.h>
+#elif HAVE_STRUCT_STATFS_F_FSTYPENAME
+# include <sys/param.h>
+# include <sys/mount.h>
+#endif
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+#include <pam-util/vector.h>
+
+/* File system magic numbers used by OpenAFS and by the kernel AFS client. */
+#define AFS_MAGIC_OPENAFS 0x5346414FUL
+#define AFS_MAGIC_KAFS    0x6B414653UL
+
+/* The number of home directories whose file system type is remembered. */
+#define HOMEDIR_CACHE_SIZE 16
+
+/* A home directory whose file system type was already checked. */
+struct homedir_cache {
+    char *path;
+    bool afs;
+};
+
+/* A path prefix whose files are known to be in a cell. */
+struct cell_cache {
+    char *prefix;
+    char *cell;
+};
+
+/* Both caches, protected by homedir_lock. */
+static pthread_mutex_t homedir_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct homedir_cache homedir_cache[HOMEDIR_CACHE_SIZE];
+static size_t homedir_cache_next = 0;
+static struct cell_cache cell_cache[HOMEDIR_CACHE_SIZE];
+static size_t cell_cache_next = 0;
+
+
+/*
+ * Returns true if path is prefix or is below it.  A trailing slash on the
+ * prefix is ignored.
+ */
+static bool
+homedir_has_prefix(const char *path, const char *prefix)
+{
+    size_t length;
+
+    length = strlen(prefix);
+    while (length > 1 && prefix[length - 1] == '/')
+        length--;
+    if (strncmp(path, prefix, length) != 0)
+        return false;
+    return (path[length] == '\0' || path[length] == '/'
+            || (length == 1 && prefix[0] == '/'));
+}
+
+
+/*
+ * Check the type of the file system holding path.  Sets afs and returns
+ * true if it could be determined, and returns false otherwise, setting
+ * errno.  On systems without a way to check, this always fails.
+ */
+#if defined(HAVE_SYS_VFS_H) || HAVE_STRUCT_STATFS_F_FSTYPENAME
+static bool
+homedir_statfs(const char *path, bool *afs)
+{
+    struct statfs info;
+
+    if (statfs(path, &info) < 0)
+        return false;
+# ifdef HAVE_SYS_VFS_H
+    *afs = ((unsigned long) info.f_type == AFS_MAGIC_OPENAFS
+            || (unsigned long) info.f_type == AFS_MAGIC_KAFS);
+# else
+    *afs = (strcmp(info.f_fstypename, "afs") == 0);
+# endif
+    return true;
+}
+#else
+static bool
+homedir_statfs(const char *path UNUSED, bool *afs UNUSED)
+{
+    errno = ENOSYS;
+    return false;
+}
+#endif
+
+
+/*
+ * Check the type of the file system holding path, trying each parent
+ * directory in turn if the path can't be checked.  Returns true if it's AFS.
+ * If no directory can be checked, reports that and assumes it's in AFS,
+ * since skipping tokens for a user who needs them is worse than running
+ * aklog for one who doesn't.
+ */
+static bool
+homedir_check(struct pam_args *args, const char *path)
+{
+    char *copy, *end;
+    bool afs;
+
+    copy = strdup(path);
+    if (copy == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        return true;
+    }
+    while (!homedir_statfs(copy, &afs)) {
+        putil_debug(args, "cannot check file system of %s: %s", copy,
+                    strerror(errno));
+        end = strrchr(copy, '/');
+        if (end == NULL || (end == copy && copy[1] == '\0')) {
+            putil_err(args, "cannot check file system of %s, assuming AFS",
+                      path);
+            free(copy);
+            return true;
+        }
+        if (end == copy)
+            end++;
+        *end = '\0';
+    }
+    free(copy);
+    return afs;
+}
+
+
+/*
+ * Returns true if the given home directory is in AFS, using the prefix list
+ * if one was configured and otherwise checking the file system type, with
+ * the result cached.
+ */
+bool
+pamafs_homedir_in_afs(struct pam_args *args, const char *path)
+{
+    struct vector *prefixes = args->config->afs_homedir_paths;
+    struct homedir_cache *entry;
+    char *copy;
+    size_t i;
+    bool afs;
+
+    if (path == NULL || path[0] != '/')
+        return false;
+    if (prefixes != NULL && prefixes->count > 0) {
+        for (i = 0; i < prefixes->count; i++)
+            if (homedir_has_prefix(path, prefixes->strings[i]))
+                return true;
+        return false;
+    }
+
+    /* Check the cache, and otherwise check and replace the oldest entry. */
+    pthread_mutex_lock(&homedir_lock);
+    for (i = 0; i < HOMEDIR_CACHE_SIZE; i++)
+        if (homedir_cache[i].path != NULL)
+            if (strcmp(homedir_cache[i].path, path) == 0) {
+                afs = homedir_cache[i].afs;
+                pthread_mutex_unlock(&homedir_lock);
+                return afs;
+            }
+    pthread_mutex_unlock(&homedir_lock);
+    afs = homedir_check(args, path);
+    copy = strdup(path);
+    if (copy != NULL) {
+        pthread_mutex_lock(&homedir_lock);
+        entry = &homedir_cache[homedir_cache_next];
+        free(entry->path);
+        entry->path = copy;
+        entry->afs = afs;
+        homedir_cache_next = (homedir_cache_next + 1) % HOMEDIR_CACHE_SIZE;
+        pthread_mutex_unlock(&homedir_lock);
+    }
+    return afs;
+}
+
+
+/*
+ * Given a path and the cell holding it, return the prefix under which all
+ * paths are assumed to be in the same cell as a newly allocated string, or
+ * NULL on allocation failure.
+ */
+static char *
+cell_prefix(const char *path, const char *cell)
+{
+    const char *start, *end;
+    size_t length;
+
+    length = strlen(cell);
+    if (strncmp(path, "/afs/", strlen("/afs/")) == 0) {
+        start = path + strlen("/afs/");
+        if (*start == '.')
+            start++;
+        end = start + length;
+        if (strncmp(start, cell, length) == 0
+            && (*end == '\0' || *end == '/'))
+            return strndup(path, (size_t) (end - path));
+    }
+    return strdup(path);
+}
+
+
+/*
+ * Return the cell holding the given home directory as a newly allocated
+ * string, using the longest matching cached prefix if there is one and
+ * otherwise asking the cache manager.  Returns NULL if the cell couldn't be
+ * determined, in which case the caller should fall back on letting aklog
+ * walk the path.  Failures aren't cached since they may be temporary.
+ */
+char *
+pamafs_homedir_cell(struct pam_args *args, const char *path)
+{
+    struct cell_cache *entry;
+    struct cell_cache *best = NULL;
+    char *cell, *prefix, *copy;
+    size_t i;
+
+    if (path == NULL || path[0] != '/')
+        return NULL;
+    pthread_mutex_lock(&homedir_lock);
+    for (i = 0; i < HOMEDIR_CACHE_SIZE; i++) {
+        entry = &cell_cache[i];
+        if (entry->prefix == NULL || !homedir_has_prefix(path, entry->prefix))
+            continue;
+        if (best == NULL || strlen(entry->prefix) > strlen(best->prefix))
+            best = entry;
+    }
+    cell = (best == NULL) ? NULL : strdup(best->cell);
+    pthread_mutex_unlock(&homedir_lock);
+    if (best != NULL) {
+        if (cell == NULL)
+            putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        else
+            putil_debug(args, "using cached cell %s for %s", cell, path);
+        return cell;
+    }
+    cell = pamafs_file_cell(args, path);
+    if (cell == NULL)
+        return NULL;
+    putil_debug(args, "home directory %s is in cell %s", path, cell);
+    prefix = cell_prefix(path, cell);
+    copy = strdup(cell);
+    if (prefix == NULL || copy == NULL) {
+        free(prefix);
+        free(copy);
+        return cell;
+    }
+    pthread_mutex_lock(&homedir_lock);
+    entry = &cell_cache[cell_cache_next];
+    free(entry->prefix);
+    free(entry->cell);
+    entry->prefix = prefix;
+    entry->cell = copy;
+    cell_cache_next = (cell_cache_next + 1) % HOMEDIR_CACHE_SIZE;
+    pthread_mutex_unlock(&homedir_lock);
+    return cell;
+}
@@ -12,7 +12,7 @@
 #define INTERNAL_H 1
 
 #include <config.h>
-#ifdef HAVE_KERBEROS
+#ifdef HAVE_KRB5
 # include <portable/krb5.h>
 #endif
 #include <portable/pam.h>
@@ -20,6 +20,12 @@
 #include <portable/stdbool.h>
 
 #include <stdarg.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include <events.h>
+#include <stats.h>
 
 /* Forward declarations to avoid unnecessary includes. */
 struct pam_args;
@@ -35,16 +41,95 @@ struct vector;
  */
 struct pam_config {
     struct vector *afs_cells;   /* List of AFS cells to get tokens for. */
+    bool afs_homedir_only;      /* Skip users whose home isn't in AFS. */
+    struct vector *afs_homedir_paths; /* Paths of AFS home directories. */
+    struct vector *aklog_env;   /* Extra variables for aklog_minimal_env. */
     bool aklog_homedir;         /* Pass -p <homedir> to aklog. */
+    bool aklog_homedir_cell;    /* Look up the home directory's cell. */
+    long aklog_jitter;          /* Random delay in ms before taking a slot. */
+    bool aklog_minimal_env;     /* Pass aklog only a few variables. */
+    long aklog_slot_wait;       /* Seconds to wait for a free slot. */
+    long aklog_slots;           /* Host-wide limit on token acquisitions. */
     bool always_aklog;          /* Always run aklog even w/o KRB5CCNAME. */
+    bool async_tokens;          /* Obtain tokens in the background. */
+    long cell_breaker;          /* Failures before skipping a cell. */
+    long cell_breaker_time;     /* Seconds to skip a failing cell. */
+    struct vector *cell_realms; /* Kerberos realms of cells as cell=REALM. */
+    bool check_tgt;             /* Skip aklog without a usable TGT. */
+    long coalesce_timeout;      /* Seconds to wait for another session. */
+    bool coalesce_tokens;       /* Share token acquisition between sessions. */
     bool debug;                 /* Log debugging information. */
+    long event_log;             /* Records in the event log, or 0 for none. */
     bool ignore_root;           /* Skip authentication for root. */
     bool kdestroy;              /* Destroy ticket cache after aklog. */
+    long minimum_lifetime;      /* Seconds of TGT lifetime needed for aklog. */
     long minimum_uid;           /* Ignore users below this UID. */
     bool nopag;                 /* Don't create a new PAG. */
     bool notokens;              /* Only create a PAG, don't obtain tokens. */
+    long prefetch_timeout;      /* Seconds to wait for prefetched tokens. */
+    bool prefetch_tokens;       /* Start obtaining tokens in authenticate. */
     struct vector *program;     /* Program to run for tokens. */
+    long renew_margin;          /* Seconds before expiration to renew. */
+    bool renew_pag;             /* Keep renewing while the PAG is in use. */
+    bool renew_tokens;          /* Renew tokens for the life of the session. */
     bool retain_after_close;    /* Don't destroy the cache on session end. */
+    long slow_threshold;        /* Log timing of calls over this many ms. */
+    char *state_dir;            /* Directory for state kept between calls. */
+    bool stats;                 /* Count what we do in the state directory. */
+    bool thread_safe;           /* Safe to call from several threads. */
+    bool token_cache;           /* Save tokens for reuse by later sessions. */
+    long token_timeout;         /* Seconds to wait for tokens or 0. */
+    bool trace_calls;           /* Record each call in a trace for replay. */
+    long unlog_grace;           /* Seconds to wait before a counted unlog. */
+    bool unlog_refcount;        /* Unlog only when the last session closes. */
+
+    /* Not an option.  Timing of the current PAM call, if any. */
+    struct pamafs_timing *timing;
+};
+
+/* The phases of a PAM call that are timed. */
+enum pamafs_phase {
+    PAMAFS_PHASE_INIT,          /* pamafs_init. */
+    PAMAFS_PHASE_HASAFS,        /* k_hasafs. */
+    PAMAFS_PHASE_SETPAG,        /* k_setpag. */
+    PAMAFS_PHASE_TOKENS,        /* Obtaining or deleting tokens. */
+    PAMAFS_PHASE_AKLOG,         /* Running aklog or krb5_afslog. */
+    PAMAFS_PHASE_MAX
+};
+
+/*
+ * Nanoseconds spent in each phase of a PAM call, plus what the call did for
+ * the event log.
+ */
+struct pamafs_timing {
+    uint64_t start;                     /* When the call started. */
+    uint64_t phase[PAMAFS_PHASE_MAX];   /* Total time in each phase. */
+    uid_t uid;                          /* UID of the user, if looked up. */
+    bool pag_created;                   /* Whether a PAG was created. */
+    unsigned int cells;                 /* Cells tokens were requested for. */
+    int aklog_status;                   /* Exit status of the last aklog. */
+};
+
+/*
+ * A set of tokens read out of the cache manager, stored as the concatenation
+ * of the VIOCGETTOK output for each token.
+ */
+struct pamafs_tokens {
+    char *data;                 /* Concatenated token data. */
+    size_t length;              /* Total length of data. */
+    size_t count;               /* Number of tokens. */
+    time_t expires;             /* Earliest expiration time of any token. */
+};
+
+/* Bytes of output kept from a child, the rest being discarded. */
+#define PAMAFS_CHILD_OUTPUT 4096
+
+/* The output and resource usage of a child collected by pamafs_child_wait. */
+struct pamafs_child_output {
+    char buffer[PAMAFS_CHILD_OUTPUT];   /* Output, nul-terminated. */
+    size_t length;                      /* Bytes of output kept. */
+    bool truncated;                     /* Whether output was discarded. */
+    struct rusage usage;                /* Resource usage from wait4. */
 };
 
 BEGIN_DECLS
@@ -61,7 +146,157 @@ void pamafs_free(struct pam_args *);
 
 /* Token manipulation functions. */
 int pamafs_token_get(struct pam_args *, bool reinitialize);
+int pamafs_token_acquire(struct pam_args *, struct passwd *,
+                         const char *cache, bool reinitialize);
 int pamafs_token_delete(struct pam_args *);
+void pamafs_token_prefetch(struct pam_args *);
+
+/*
+ * Check whether a user should be skipped because of ignore_root or
+ * minimum_uid, and whether tokens should be obtained for a user and ticket
+ * cache, which also applies afs_homedir_only and the TGT checks.  The latter
+ * returns PAM_SUCCESS or PAM_IGNORE.
+ */
+bool pamafs_should_ignore(struct pam_args *, const struct passwd *);
+int pamafs_token_check(struct pam_args *, const struct passwd *,
+                       const char *cache);
+
+/*
+ * Start obtaining tokens in the background, or stop doing so if that's still
+ * in progress.
+ */
+int pamafs_async_start(struct pam_args *, struct passwd *, const char *cache);
+void pamafs_async_stop(struct pam_args *);
+
+/*
+ * Start obtaining tokens in the background from pam_sm_authenticate, and
+ * wait for that to finish when opening the session.
+ */
+void pamafs_prefetch_start(struct pam_args *, struct passwd *,
+                           const char *cache);
+bool pamafs_prefetch_wait(struct pam_args *, struct passwd *,
+                          const char *cache);
+
+/* Start or stop the process renewing tokens for the session. */
+void pamafs_renew_start(struct pam_args *, struct passwd *, const char *cache);
+void pamafs_renew_stop(struct pam_args *);
+
+/*
+ * Find the TGT in the named ticket cache and return its client principal (if
+ * principal isn't NULL), authentication time, and expiration time.
+ */
+#ifdef HAVE_KRB5
+krb5_error_code pamafs_cache_tgt(struct pam_args *, const char *cache,
+                                 char **principal, time_t *authtime,
+                                 time_t *endtime);
+#endif
+
+/* Read tokens from or store tokens into the current PAG. */
+struct pamafs_tokens *pamafs_tokens_read(struct pam_args *);
+bool pamafs_tokens_check(struct pamafs_tokens *);
+bool pamafs_tokens_write(struct pam_args *, struct pamafs_tokens *);
+void pamafs_tokens_free(struct pamafs_tokens *);
+
+/* Ask the cache manager for the cell holding a path. */
+char *pamafs_file_cell(struct pam_args *, const char *path);
+
+/* Delete the tokens in the current PAG, as k_unlog. */
+int pamafs_unlog(void);
+
+/* Manipulate files in the state directory. */
+char *pamafs_state_path(struct pam_args *, const char *name);
+char *pamafs_state_name(struct pam_args *, const char *prefix, uid_t,
+                        const char *cache);
+int pamafs_state_open(struct pam_args *, const char *name, int flags);
+int pamafs_state_dir(struct pam_args *);
+int pamafs_state_openat(struct pam_args *, int dir, const char *name,
+                        int flags);
+bool pamafs_state_read(struct pam_args *, const char *name, char **data,
+                       size_t *length);
+void *pamafs_state_map(struct pam_args *, const char *name, size_t minimum,
+                       size_t *length);
+bool pamafs_state_replace(struct pam_args *, const char *name,
+                          const void *data, size_t length);
+void pamafs_state_remove(struct pam_args *, const char *name);
+bool pamafs_state_lock(struct pam_args *, int fd, bool exclusive,
+                       long timeout);
+
+/*
+ * Save, reuse, and remove saved tokens for a user and ticket cache, keyed by
+ * the name of the ticket cache or by key if it's not NULL.
+ */
+void pamafs_store_save(struct pam_args *, const struct passwd *,
+                       const char *cache, const char *key);
+bool pamafs_store_restore(struct pam_args *, const struct passwd *,
+                          const char *cache, const char *key);
+void pamafs_store_remove(struct pam_args *, const struct passwd *,
+                         const char *cache, const char *key);
+
+/*
+ * Wait for another session obtaining tokens for the same user and ticket
+ * cache, or become the session that obtains them, and release the lock when
+ * done.
+ */
+bool pamafs_coalesce_wait(struct pam_args *, const struct passwd *,
+                          const char *cache, int *lock);
+void pamafs_coalesce_end(struct pam_args *, int lock);
+
+/* Obtain and release one of the host-wide slots for obtaining tokens. */
+bool pamafs_slot_acquire(struct pam_args *, int *slot);
+void pamafs_slot_release(struct pam_args *, int slot);
+
+/* Check and record failures to obtain tokens for a cell. */
+bool pamafs_breaker_allow(struct pam_args *, const char *cell);
+void pamafs_breaker_record(struct pam_args *, const char *cell,
+                           bool success);
+
+/* Check whether a home directory is in AFS and find its cell. */
+bool pamafs_homedir_in_afs(struct pam_args *, const char *path);
+char *pamafs_homedir_cell(struct pam_args *, const char *path);
+
+/* Count sessions sharing tokens without PAGs. */
+void pamafs_refcount_open(struct pam_args *, const struct passwd *);
+bool pamafs_refcount_close(struct pam_args *);
+
+/* Time the phases of a PAM call and log the result. */
+uint64_t pamafs_time_now(void);
+void pamafs_timing_start(struct pamafs_timing *);
+void pamafs_timing_init(struct pam_args *, struct pamafs_timing *);
+void pamafs_timing_add(struct pam_args *, enum pamafs_phase, uint64_t start);
+void pamafs_timing_report(struct pam_args *, const char *func);
+
+/* Update the shared statistics. */
+void pamafs_stats_count(struct pam_args *, enum pamafs_stat);
+void pamafs_stats_aklog(struct pam_args *, uint64_t start);
+
+/* Note what the current PAM call did and record it in the event log. */
+void pamafs_events_user(struct pam_args *, uid_t);
+void pamafs_events_pag(struct pam_args *);
+void pamafs_events_aklog(struct pam_args *, unsigned int cells, int status);
+void pamafs_events_record(struct pam_args *, enum pamafs_event_call,
+                          int flags, int status);
+
+/* Record the start of the current PAM call in the trace. */
+void pamafs_trace_record(struct pam_args *, enum pamafs_event_call,
+                         int flags);
+
+/*
+ * Wait for a child process for at most timeout seconds, optionally
+ * collecting its output and resource usage.
+ */
+bool pamafs_child_pipe(struct pam_args *, int fds[2]);
+void pamafs_child_fail(const char *what, int error)
+    __attribute__((__noreturn__));
+bool pamafs_child_wait(struct pam_args *, pid_t child, int fd, long timeout,
+                       const char *what, int *status,
+                       struct pamafs_child_output *);
+
+/*
+ * Override SIGCHLD while we have children, returning whether the override
+ * must be undone with pamafs_child_sigchld_restore.
+ */
+bool pamafs_child_sigchld(struct pam_args *);
+void pamafs_child_sigchld_restore(struct pam_args *);
 
 /* Undo default visibility change. */
 #pragma GCC visibility pop
@@ -45,6 +45,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #ifdef HAVE_SYS_IOCCOM_H
 # include <sys/ioccom.h>
@@ -92,23 +93,36 @@ static int k_syscall(long, long, long, long, long, int *);
  * we change this static variable is to say that the call failed, so there
  * shouldn't be a collision of updates from multiple calls.
  *
+ * The handler is process-wide, so the probe is serialized with a mutex.
+ * Otherwise, two threads probing at once could each restore the other's
+ * handler, leaving ours in place for good or restoring the default while
+ * the other's system call could still raise SIGSYS and kill the process.
+ * The other implementations use an ioctl rather than a system call and
+ * can't raise SIGSYS, so they skip all of this.
+ *
  * It's probably safe to just ignore SIGSYS instead, but this feels more
  * thorough.
  */
+#if defined(SIGSYS) && defined(HAVE_KAFS_SYSCALL)
+# define KAFS_SIGSYS 1
+#endif
 static volatile sig_atomic_t syscall_okay = 1;
+#ifdef KAFS_SIGSYS
+static pthread_mutex_t syscall_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 
 /*
  * Signal handler to catch failed system calls and change the okay flag.
  */
-#ifdef SIGSYS
+#ifdef KAFS_SIGSYS
 static void
 sigsys_handler(int s UNUSED)
 {
     syscall_okay = 0;
     signal(SIGSYS, sigsys_handler);
 }
-#endif /* SIGSYS */
+#endif /* KAFS_SIGSYS */
 
 
 /*
@@ -138,11 +152,14 @@ k_hasafs(void)
 {
     struct ViceIoctl iob;
     int rval, saved_errno, okay;
+#ifdef KAFS_SIGSYS
     void (*saved_func)(int);
+#endif
 
     saved_errno = errno;
 
-#ifdef SIGSYS
+#ifdef KAFS_SIGSYS
+    pthread_mutex_lock(&syscall_lock);
     saved_func = signal(SIGSYS, sigsys_handler);
 #endif
 
@@ -152,8 +169,9 @@ k_hasafs(void)
     iob.out_size = 0;
     rval = k_pioctl(NULL, _IOW('V', 3, struct ViceIoctl), &iob, 0);
 
-#ifdef SIGSYS
+#ifdef KAFS_SIGSYS
     signal(SIGSYS, saved_func);
+    pthread_mutex_unlock(&syscall_lock);
 #endif
 
     okay = (syscall_okay && rval == -1 && errno == EINVAL);
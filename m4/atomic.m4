@@ -0,0 +1,43 @@
+dnl Test for the compiler's __atomic builtins.
+dnl
+dnl Check whether the compiler supports the __atomic builtins introduced in
+dnl GCC 4.7 (and also supported by Clang) on 64-bit integers.  These are used
+dnl to update counters shared between processes without locking.
+dnl
+dnl Provides RRA_C_ATOMIC_BUILTINS, which defines HAVE_ATOMIC_BUILTINS if the
+dnl builtins are available.
+dnl
+dnl Written by agent <agent@local>
+dnl Copyright 2026 agent <agent@local>
+dnl
+dnl This file is free software; the authors give unlimited permission to copy
+dnl and/or distribute it, with or without modifications, as long as this
+dnl notice is preserved.
+
+dnl Source used by RRA_C_ATOMIC_BUILTINS.
+AC_DEFUN([_RRA_C_ATOMIC_BUILTINS_SOURCE], [[
+#include <stdint.h>
+
+uint64_t counter;
+
+int
+main(void)
+{
+    uint64_t expected = 0;
+
+    __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+    __atomic_compare_exchange_n(&counter, &expected, 2, 0, __ATOMIC_SEQ_CST,
+                                __ATOMIC_SEQ_CST);
+    return (__atomic_load_n(&counter, __ATOMIC_RELAXED) == 1) ? 0 : 1;
+}
+]])
+
+dnl The user-callable test.
+AC_DEFUN([RRA_C_ATOMIC_BUILTINS],
+[AC_CACHE_CHECK([for __atomic builtins], [rra_cv_c_atomic_builtins],
+    [AC_LINK_IFELSE([AC_LANG_SOURCE([_RRA_C_ATOMIC_BUILTINS_SOURCE])],
+        [rra_cv_c_atomic_builtins=yes],
+        [rra_cv_c_atomic_builtins=no])])
+ AS_IF([test x"$rra_cv_c_atomic_builtins" = xyes],
+    [AC_DEFINE([HAVE_ATOMIC_BUILTINS], 1,
+        [Define if the compiler supports the __atomic builtins.])])])
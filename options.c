@@ -21,6 +21,7 @@
 #include <pam-util/logging.h>
 #include <pam-util/options.h>
 #include <pam-util/vector.h>
+#include <probes.h>
 
 #ifdef HAVE_KRB5_AFSLOG
 # undef PATH_AKLOG
@@ -28,16 +29,36 @@
 #if !defined(PATH_AKLOG)
 # define PATH_AKLOG NULL
 #endif
+#ifndef PATH_STATE_DIR
+# define PATH_STATE_DIR "/run/pam-afs-session"
+#endif
 
 /* Our option definition. */
 #define K(name) (#name), offsetof(struct pam_config, name)
 static const struct option options[] = {
     { K(afs_cells),          true, LIST    (NULL)       },
+    { K(afs_homedir_only),   true, BOOL    (false)      },
+    { K(afs_homedir_paths),  true, LIST    (NULL)       },
+    { K(aklog_env),          true, LIST    (NULL)       },
     { K(aklog_homedir),      true, BOOL    (false)      },
+    { K(aklog_homedir_cell), true, BOOL    (false)      },
+    { K(aklog_jitter),       true, NUMBER  (0)          },
+    { K(aklog_minimal_env),  true, BOOL    (false)      },
+    { K(aklog_slot_wait),    true, NUMBER  (30)         },
+    { K(aklog_slots),        true, NUMBER  (0)          },
     { K(always_aklog),       true, BOOL    (false)      },
+    { K(async_tokens),       true, BOOL    (false)      },
+    { K(cell_breaker),       true, NUMBER  (0)          },
+    { K(cell_breaker_time),  true, NUMBER  (300)        },
+    { K(cell_realms),        true, LIST    (NULL)       },
+    { K(check_tgt),          true, BOOL    (false)      },
+    { K(coalesce_timeout),   true, NUMBER  (30)         },
+    { K(coalesce_tokens),    true, BOOL    (false)      },
     { K(debug),              true, BOOL    (false)      },
+    { K(event_log),          true, NUMBER  (0)          },
     { K(ignore_root),        true, BOOL    (false)      },
     { K(kdestroy),           true, BOOL    (false)      },
+    { K(minimum_lifetime),   true, NUMBER  (0)          },
     { K(minimum_uid),        true, NUMBER  (0)          },
 #ifdef NO_PAG_SUPPORT
     { K(nopag),              true, BOOL    (true)       },
@@ -45,8 +66,22 @@ static const struct option options[] = {
     { K(nopag),              true, BOOL    (false)      },
 #endif
     { K(notokens),           true, BOOL    (false)      },
+    { K(prefetch_timeout),   true, NUMBER  (30)         },
+    { K(prefetch_tokens),    true, BOOL    (false)      },
     { K(program),            true, STRLIST (PATH_AKLOG) },
+    { K(renew_margin),       true, NUMBER  (600)        },
+    { K(renew_pag),          true, BOOL    (false)      },
+    { K(renew_tokens),       true, BOOL    (false)      },
     { K(retain_after_close), true, BOOL    (false)      },
+    { K(slow_threshold),     true, NUMBER  (0)          },
+    { K(state_dir),          true, STRING  (PATH_STATE_DIR) },
+    { K(stats),              true, BOOL    (false)      },
+    { K(thread_safe),        true, BOOL    (false)      },
+    { K(token_cache),        true, BOOL    (false)      },
+    { K(token_timeout),      true, NUMBER  (0)          },
+    { K(trace_calls),        true, BOOL    (false)      },
+    { K(unlog_grace),        true, NUMBER  (0)          },
+    { K(unlog_refcount),     true, BOOL    (false)      },
 };
 static const size_t optlen = sizeof(options) / sizeof(options[0]);
 
@@ -59,6 +94,8 @@ struct pam_args *
 pamafs_init(pam_handle_t *pamh, int flags, int argc, const char **argv)
 {
     struct pam_args *args;
+    const char *entry, *equals;
+    size_t i;
 
     args = putil_args_new(pamh, flags);
     if (args == NULL)
@@ -74,8 +111,10 @@ pamafs_init(pam_handle_t *pamh, int flags, int argc, const char **argv)
         putil_args_free(args);
         return NULL;
     }
+    PAMAFS_PROBE(args_krb5_entry);
     if (!putil_args_krb5(args, "pam-afs-session", options, optlen))
         goto fail;
+    PAMAFS_PROBE(args_krb5_return);
     if (!putil_args_parse(args, argc, argv, options, optlen))
         goto fail;
     if (args->config->debug)
@@ -85,11 +124,76 @@ pamafs_init(pam_handle_t *pamh, int flags, int argc, const char **argv)
     if (args->config->minimum_uid < 0)
         args->config->minimum_uid = 0;
 
-    /* Warn if kdestroy was set and we can't honor it. */
-#ifndef HAVE_KERBEROS
+    /* Negative times make no sense, so treat them as zero. */
+    if (args->config->aklog_jitter < 0)
+        args->config->aklog_jitter = 0;
+    if (args->config->aklog_slot_wait < 0)
+        args->config->aklog_slot_wait = 0;
+    if (args->config->cell_breaker_time < 0)
+        args->config->cell_breaker_time = 0;
+    if (args->config->coalesce_timeout < 0)
+        args->config->coalesce_timeout = 0;
+    if (args->config->prefetch_timeout < 0)
+        args->config->prefetch_timeout = 0;
+    if (args->config->renew_margin < 0)
+        args->config->renew_margin = 0;
+    if (args->config->slow_threshold < 0)
+        args->config->slow_threshold = 0;
+    if (args->config->unlog_grace < 0)
+        args->config->unlog_grace = 0;
+
+    /* Keep the event log to a sane size. */
+    if (args->config->event_log < 0)
+        args->config->event_log = 0;
+    if (args->config->event_log > PAMAFS_EVENTS_LIMIT)
+        args->config->event_log = PAMAFS_EVENTS_LIMIT;
+
+    /* Complain about cell_realms entries that aren't cell=REALM. */
+    if (args->config->cell_realms != NULL)
+        for (i = 0; i < args->config->cell_realms->count; i++) {
+            entry = args->config->cell_realms->strings[i];
+            equals = strchr(entry, '=');
+            if (equals == NULL || equals == entry || equals[1] == '\0')
+                putil_err(args, "ignoring invalid cell_realms entry %s",
+                          entry);
+        }
+
+    /* Sessions only share tokens, and need counting, without PAGs. */
+    if (!args->config->nopag)
+        args->config->unlog_refcount = false;
+
+    /*
+     * Background processes run module code after fork, which isn't safe if
+     * the application has other threads, so with thread_safe everything is
+     * done in the calling thread and unlog_grace is ignored.
+     */
+    if (args->config->thread_safe) {
+        args->config->async_tokens = false;
+        args->config->prefetch_tokens = false;
+        args->config->renew_tokens = false;
+        args->config->unlog_grace = 0;
+    }
+
+    /*
+     * Coalescing token acquisitions and prefetching tokens work via the
+     * saved token store, and neither can work if the cache is destroyed.
+     * Renewing tokens needs the cache for the life of the session.
+     */
+    if (args->config->kdestroy) {
+        args->config->prefetch_tokens = false;
+        args->config->renew_tokens = false;
+    }
+    if (args->config->coalesce_tokens || args->config->prefetch_tokens)
+        args->config->token_cache = true;
+
+    /* Warn if kdestroy or check_tgt was set and we can't honor it. */
+#ifndef HAVE_KRB5
     if (args->config->kdestroy)
         putil_err(args, "kdestroy specified but not built with Kerberos"
                   " support");
+    if (args->config->check_tgt)
+        putil_err(args, "check_tgt specified but not built with Kerberos"
+                  " support");
 #endif
 
     return args;
@@ -111,8 +215,16 @@ pamafs_free(struct pam_args *args)
     if (args->config != NULL) {
         if (args->config->afs_cells != NULL)
             vector_free(args->config->afs_cells);
+        if (args->config->afs_homedir_paths != NULL)
+            vector_free(args->config->afs_homedir_paths);
+        if (args->config->aklog_env != NULL)
+            vector_free(args->config->aklog_env);
+        if (args->config->cell_realms != NULL)
+            vector_free(args->config->cell_realms);
         if (args->config->program != NULL)
             free(args->config->program);
+        if (args->config->state_dir != NULL)
+            free(args->config->state_dir);
         free(args->config);
         args->config = NULL;
     }
@@ -0,0 +1,79 @@
+/*
+ * Interface for using pam-afs-session's token handling without PAM.
+ *
+ * Programs such as job launchers and event-driven daemons can use these
+ * functions to obtain and delete AFS tokens the way the PAM module does, but
+ * without a PAM stack and without blocking.  Each operation runs in a child
+ * process.  The caller starts it, waits for the file descriptor returned by
+ * pamafs_op_fd to become readable with poll, select, or an event loop, and
+ * then calls pamafs_op_finish to collect the result.  Many operations may be
+ * in progress at once.
+ *
+ * Options are given in the same form as PAM module arguments.  The caller
+ * must not reap the child processes itself.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef PAMAFS_H
+#define PAMAFS_H 1
+
+/* Opaque struct representing an operation in progress. */
+struct pamafs_op;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Start obtaining tokens for user from the Kerberos ticket cache cache (or
+ * the default if NULL).  Unless the nopag option is given, the tokens are
+ * obtained in a new PAG and then held by the operation for pamafs_op_install
+ * rather than added to the caller's PAG.  The same checks as the PAM module
+ * are applied (ignore_root, minimum_uid, afs_homedir_only, and the TGT
+ * checks), and a user they skip gets a successful operation with no tokens.
+ * Returns NULL on failure.
+ */
+struct pamafs_op *pamafs_acquire_start(const char *user, const char *cache,
+                                       int argc, const char **argv);
+
+/*
+ * Start deleting the tokens in the current PAG along with any saved copy of
+ * the tokens for user and cache.  Does nothing, successfully, for a user
+ * skipped because of ignore_root or minimum_uid.  Returns NULL on failure.
+ */
+struct pamafs_op *pamafs_delete_start(const char *user, const char *cache,
+                                      int argc, const char **argv);
+
+/*
+ * Return the file descriptor that becomes readable once the operation is
+ * ready for pamafs_op_finish.
+ */
+int pamafs_op_fd(const struct pamafs_op *);
+
+/*
+ * Wait for the operation to finish and return 0 if it succeeded and -1 if it
+ * failed.  Only waits for the child process to exit once the file descriptor
+ * is readable.
+ */
+int pamafs_op_finish(struct pamafs_op *);
+
+/*
+ * Put the tokens obtained by a finished pamafs_acquire_start operation into
+ * the current PAG, such as in a child process that's about to run a job.
+ * May be called any number of times.  Returns 0 on success and -1 on
+ * failure.
+ */
+int pamafs_op_install(struct pamafs_op *);
+
+/* Free an operation, killing its child process if it's still running. */
+void pamafs_op_free(struct pamafs_op *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !PAMAFS_H */
@@ -0,0 +1,303 @@
+/*
+ * Queries and updates of the AFS cache manager through k_pioctl.
+ *
+ * The rest of the module only needs k_setpag and k_unlog, but some optional
+ * features need to read the tokens in the current PAG back out of the cache
+ * manager and put them into another PAG, or ask it which cell a file is in.
+ * The token format used here is the traditional one shared by VIOCGETTOK
+ * and VIOCSETTOK: the output of the former can be passed unmodified as the
+ * input of the latter.
+ *
+ *     int32            length of the secret token
+ *     char[]           secret token (the encrypted ticket)
+ *     int32            length of the clear token
+ *     struct           clear token (key, ViceId, start and end times)
+ *     int32            primary flag
+ *     char[]           nul-terminated cell name
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/kafs.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <time.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+#include <probes.h>
+
+/* The pioctl numbers, if not already provided by kafs.h. */
+#ifndef _VICEIOCTL
+# define _VICEIOCTL(id) _IOW('V', (id), struct ViceIoctl)
+#endif
+#ifndef VIOCSETTOK
+# define VIOCSETTOK _VICEIOCTL(3)
+#endif
+#ifndef VIOCGETTOK
+# define VIOCGETTOK _VICEIOCTL(8)
+#endif
+#ifndef VIOC_FILE_CELL_NAME
+# define VIOC_FILE_CELL_NAME _VICEIOCTL(30)
+#endif
+
+/* Size of the buffer for a single token and the maximum tokens to read. */
+#define TOKEN_BUFSIZ 8192
+#define TOKEN_MAX    64
+
+/* Size of the buffer for a cell name. */
+#define CELL_BUFSIZ  256
+
+/*
+ * The clear token as laid out by the cache manager.  All members are 32-bit
+ * integers in host byte order except the session key.
+ */
+struct clear_token {
+    int32_t auth_handle;
+    char key[8];
+    int32_t vice_id;
+    int32_t begin;
+    int32_t end;
+};
+
+
+/*
+ * Parse a single token as returned by VIOCGETTOK, checking that all the
+ * lengths are consistent with the size of the buffer.  Returns the total
+ * length of the token (including the cell name and its nul) and stores the
+ * end time in the provided pointer, or returns 0 if the token is malformed.
+ */
+static size_t
+token_parse(const char *buffer, size_t length, time_t *end)
+{
+    const char *p = buffer;
+    const char *cell;
+    int32_t size;
+    struct clear_token ct;
+
+    if (length < sizeof(int32_t))
+        return 0;
+    memcpy(&size, p, sizeof(int32_t));
+    p += sizeof(int32_t);
+    if (size < 0 || (size_t) size > length - (size_t) (p - buffer))
+        return 0;
+    p += size;
+    if ((size_t) (p - buffer) + sizeof(int32_t) > length)
+        return 0;
+    memcpy(&size, p, sizeof(int32_t));
+    p += sizeof(int32_t);
+    if (size != sizeof(struct clear_token))
+        return 0;
+    if ((size_t) (p - buffer) + sizeof(ct) + sizeof(int32_t) > length)
+        return 0;
+    memcpy(&ct, p, sizeof(ct));
+    p += sizeof(ct) + sizeof(int32_t);
+    cell = p;
+    while ((size_t) (p - buffer) < length && *p != '\0')
+        p++;
+    if ((size_t) (p - buffer) >= length || p == cell)
+        return 0;
+    if (end != NULL)
+        *end = ct.end;
+    return (size_t) (p - buffer) + 1;
+}
+
+
+/*
+ * Read all of the tokens in the current PAG.  Returns a newly allocated
+ * struct pamafs_tokens on success (possibly holding no tokens) and NULL on
+ * failure, which is reported with putil_err.  The caller is responsible for
+ * freeing the result with pamafs_tokens_free.
+ */
+struct pamafs_tokens *
+pamafs_tokens_read(struct pam_args *args)
+{
+    struct pamafs_tokens *tokens;
+    struct ViceIoctl iob;
+    char buffer[TOKEN_BUFSIZ];
+    int32_t i;
+    size_t length;
+    time_t end;
+    char *data;
+
+    tokens = calloc(1, sizeof(struct pamafs_tokens));
+    if (tokens == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        return NULL;
+    }
+    for (i = 0; i < TOKEN_MAX; i++) {
+        memset(buffer, 0, sizeof(buffer));
+        iob.in = (char *) &i;
+        iob.in_size = sizeof(i);
+        iob.out = buffer;
+        iob.out_size = sizeof(buffer);
+        if (k_pioctl(NULL, VIOCGETTOK, &iob, 0) != 0) {
+            if (errno == EDOM)
+                break;
+            continue;
+        }
+        length = token_parse(buffer, sizeof(buffer), &end);
+        if (length == 0) {
+            putil_err(args, "ignoring malformed token %ld", (long) i);
+            continue;
+        }
+        data = realloc(tokens->data, tokens->length + length);
+        if (data == NULL) {
+            putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+            pamafs_tokens_free(tokens);
+            return NULL;
+        }
+        memcpy(data + tokens->length, buffer, length);
+        tokens->data = data;
+        tokens->length += length;
+        if (tokens->count == 0 || end < tokens->expires)
+            tokens->expires = end;
+        tokens->count++;
+    }
+    return tokens;
+}
+
+
+/*
+ * Verify a buffer of concatenated tokens as produced by pamafs_tokens_read,
+ * such as one read back from disk, and fill in the count and expiration.
+ * Returns true if the data is well-formed and false otherwise.
+ */
+bool
+pamafs_tokens_check(struct pamafs_tokens *tokens)
+{
+    size_t offset, length;
+    time_t end;
+
+    tokens->count = 0;
+    tokens->expires = 0;
+    for (offset = 0; offset < tokens->length; offset += length) {
+        length = token_parse(tokens->data + offset, tokens->length - offset,
+                             &end);
+        if (length == 0)
+            return false;
+        if (tokens->count == 0 || end < tokens->expires)
+            tokens->expires = end;
+        tokens->count++;
+    }
+    return true;
+}
+
+
+/*
+ * Store a set of tokens previously read with pamafs_tokens_read in the
+ * current PAG.  Returns true if all tokens were stored and false otherwise,
+ * reporting the error with putil_err.
+ */
+bool
+pamafs_tokens_write(struct pam_args *args, struct pamafs_tokens *tokens)
+{
+    struct ViceIoctl iob;
+    size_t offset, length, flag;
+    int32_t size, primary;
+    char *token;
+
+    for (offset = 0; offset < tokens->length; offset += length) {
+        token = tokens->data + offset;
+        length = token_parse(token, tokens->length - offset, NULL);
+        if (length == 0) {
+            putil_err(args, "cannot store malformed token");
+            return false;
+        }
+
+        /*
+         * Clear everything but the primary bit of the flag, since the cache
+         * manager interprets some of the other bits as a request to create a
+         * new PAG.
+         */
+        memcpy(&size, token, sizeof(int32_t));
+        flag = sizeof(int32_t) + (size_t) size + sizeof(int32_t)
+            + sizeof(struct clear_token);
+        memcpy(&primary, token + flag, sizeof(int32_t));
+        primary &= 1;
+        memcpy(token + flag, &primary, sizeof(int32_t));
+
+        iob.in = token;
+        iob.in_size = (short) length;
+        iob.out = NULL;
+        iob.out_size = 0;
+        if (k_pioctl(NULL, VIOCSETTOK, &iob, 0) != 0) {
+            putil_err(args, "cannot store token: %s", strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Free a struct pamafs_tokens.
+ */
+void
+pamafs_tokens_free(struct pamafs_tokens *tokens)
+{
+    if (tokens == NULL)
+        return;
+    if (tokens->data != NULL) {
+        memset(tokens->data, 0, tokens->length);
+        free(tokens->data);
+    }
+    free(tokens);
+}
+
+
+/*
+ * Ask the cache manager which cell holds the given path.  Returns the cell
+ * name as a newly allocated string or NULL on failure, which is reported at
+ * the debug level since the caller has other ways of finding the cell.
+ */
+char *
+pamafs_file_cell(struct pam_args *args, const char *path)
+{
+    struct ViceIoctl iob;
+    char buffer[CELL_BUFSIZ];
+    char *cell;
+
+    memset(buffer, 0, sizeof(buffer));
+    iob.in = NULL;
+    iob.in_size = 0;
+    iob.out = buffer;
+    iob.out_size = sizeof(buffer);
+    if (k_pioctl((char *) path, VIOC_FILE_CELL_NAME, &iob, 1) != 0) {
+        putil_debug(args, "cannot get cell of %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    buffer[sizeof(buffer) - 1] = '\0';
+    if (buffer[0] == '\0') {
+        putil_debug(args, "cache manager returned no cell for %s", path);
+        return NULL;
+    }
+    cell = strdup(buffer);
+    if (cell == NULL)
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+    return cell;
+}
+
+
+/*
+ * Delete the tokens in the current PAG.  This is k_unlog with tracing probes
+ * around it, preserving errno for the caller.
+ */
+int
+pamafs_unlog(void)
+{
+    int status, oerrno;
+
+    PAMAFS_PROBE(unlog_entry);
+    status = k_unlog();
+    oerrno = errno;
+    PAMAFS_PROBE1(unlog_return, status);
+    errno = oerrno;
+    return status;
+}
@@ -0,0 +1,34 @@
+/*
+ * Static tracing probes.
+ *
+ * If sys/sdt.h is available (from SystemTap on Linux, or natively on systems
+ * with DTrace), the module is built with USDT probes under the provider
+ * pam_afs_session at the entry and return of each PAM function and around
+ * the expensive operations it performs, so that perf, bpftrace, SystemTap,
+ * or DTrace can measure it on a running system.  A probe that no tracer is
+ * attached to is a single no-op instruction.  Otherwise, the probe macros
+ * expand to nothing.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef PROBES_H
+#define PROBES_H 1
+
+#include <config.h>
+
+#ifdef HAVE_SYS_SDT_H
+# include <sys/sdt.h>
+# define PAMAFS_PROBE(name)        DTRACE_PROBE(pam_afs_session, name)
+# define PAMAFS_PROBE1(name, a)    DTRACE_PROBE1(pam_afs_session, name, a)
+# define PAMAFS_PROBE2(name, a, b) DTRACE_PROBE2(pam_afs_session, name, a, b)
+#else
+# define PAMAFS_PROBE(name)        /* empty */
+# define PAMAFS_PROBE1(name, a)    /* empty */
+# define PAMAFS_PROBE2(name, a, b) /* empty */
+#endif
+
+#endif /* !PROBES_H */
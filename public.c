@@ -22,6 +22,100 @@
 #include <internal.h>
 #include <pam-util/args.h>
 #include <pam-util/logging.h>
+#include <probes.h>
+
+/* The name of our PAM data item recording that this login was counted. */
+#define LOGIN_DATA "pam_afs_session_login"
+
+
+/*
+ * Call k_hasafs, recording the time it takes.
+ */
+static int
+timed_hasafs(struct pam_args *args)
+{
+    uint64_t start;
+    int status;
+
+    start = pamafs_time_now();
+    status = k_hasafs();
+    pamafs_timing_add(args, PAMAFS_PHASE_HASAFS, start);
+    return status;
+}
+
+
+/*
+ * Count a login in the statistics, just before the PAG is created for it.
+ * pam_setcred and pam_open_session may both set up the same login, so only
+ * count it the first time for each PAM handle, and remember that we did so
+ * that count_close counts the matching close.
+ */
+static void
+count_login(struct pam_args *args)
+{
+    const void *data;
+    int status;
+
+    if (!args->config->stats)
+        return;
+    status = pam_get_data(args->pamh, LOGIN_DATA, &data);
+    if (status == PAM_SUCCESS && data != NULL)
+        return;
+    status = pam_set_data(args->pamh, LOGIN_DATA, (char *) "yes", NULL);
+    if (status != PAM_SUCCESS) {
+        putil_err_pam(args, status, "cannot set login data");
+        return;
+    }
+    pamafs_stats_count(args, PAMAFS_STAT_LOGINS);
+}
+
+
+/*
+ * Count a close in the statistics if the login was counted and hasn't been
+ * closed already, since pam_setcred with PAM_DELETE_CRED and
+ * pam_close_session may both tear down the same login.
+ */
+static void
+count_close(struct pam_args *args)
+{
+    const void *data;
+    int status;
+
+    if (!args->config->stats)
+        return;
+    status = pam_get_data(args->pamh, LOGIN_DATA, &data);
+    if (status != PAM_SUCCESS || data == NULL)
+        return;
+    status = pam_set_data(args->pamh, LOGIN_DATA, NULL, NULL);
+    if (status != PAM_SUCCESS) {
+        putil_err_pam(args, status, "cannot remove login data");
+        return;
+    }
+    pamafs_stats_count(args, PAMAFS_STAT_CLOSES);
+}
+
+
+/*
+ * Call k_setpag, recording the time it takes and whether it succeeded.
+ * Preserves errno.
+ */
+static int
+timed_setpag(struct pam_args *args)
+{
+    uint64_t start;
+    int status, oerrno;
+
+    start = pamafs_time_now();
+    PAMAFS_PROBE(setpag_entry);
+    status = k_setpag();
+    oerrno = errno;
+    PAMAFS_PROBE1(setpag_return, status);
+    pamafs_timing_add(args, PAMAFS_PHASE_SETPAG, start);
+    if (status == 0)
+        pamafs_events_pag(args);
+    errno = oerrno;
+    return status;
+}
 
 
 /*
@@ -35,19 +129,26 @@ pam_sm_open_session(pam_handle_t *pamh, int flags, int argc,
                     const char *argv[])
 {
     struct pam_args *args;
+    struct pamafs_timing timing;
+    uint64_t start;
     int pamret = PAM_SUCCESS;
     const void *dummy;
 
+    PAMAFS_PROBE1(open_session_entry, flags);
+    pamafs_timing_start(&timing);
     args = pamafs_init(pamh, flags, argc, argv);
     if (args == NULL) {
         pamret = PAM_SESSION_ERR;
         goto done;
     }
+    pamafs_timing_init(args, &timing);
     ENTRY(args, flags);
+    pamafs_trace_record(args, PAMAFS_CALL_OPEN_SESSION, flags);
 
     /* Do nothing unless AFS is available. */
-    if (!k_hasafs()) {
+    if (!timed_hasafs(args)) {
         putil_err(args, "skipping, AFS apparently not available");
+        pamafs_stats_count(args, PAMAFS_STAT_SKIP_NO_AFS);
         pamret = PAM_IGNORE;
         goto done;
     }
@@ -57,43 +158,77 @@ pam_sm_open_session(pam_handle_t *pamh, int flags, int argc,
      * PAG.  Do this even if we're otherwise ignoring the user.
      */
     if (pam_get_data(pamh, "pam_afs_session", &dummy) == PAM_SUCCESS) {
-        if (!k_haspag() && !args->config->nopag)
+        if (!k_haspag() && !args->config->nopag) {
             putil_notice(args, "PAG apparently lost, recreating");
-        else {
+            pamafs_stats_count(args, PAMAFS_STAT_PAG_LOST);
+        } else {
             putil_debug(args, "skipping, apparently already ran");
             pamret = PAM_SUCCESS;
             goto done;
         }
     }
-    if (!args->config->nopag && k_setpag() != 0) {
+    count_login(args);
+    if (!args->config->nopag && timed_setpag(args) != 0) {
         putil_err(args, "PAG creation failed: %s", strerror(errno));
+        pamafs_stats_count(args, PAMAFS_STAT_PAG_FAILED);
         pamret = PAM_SESSION_ERR;
         goto done;
     }
 
     /* Get tokens. */
-    if (!args->config->notokens)
+    if (!args->config->notokens) {
+        start = pamafs_time_now();
         pamret = pamafs_token_get(args, false);
+        pamafs_timing_add(args, PAMAFS_PHASE_TOKENS, start);
+    }
 
     /* Error codes are returned for pam_setcred.  Map to pam_open_sesssion. */
     if (pamret != PAM_SUCCESS && pamret != PAM_IGNORE)
         pamret = PAM_SESSION_ERR;
 
 done:
+    pamafs_timing_report(args, __func__);
+    pamafs_events_record(args, PAMAFS_CALL_OPEN_SESSION, flags, pamret);
     EXIT(args, pamret);
     pamafs_free(args);
+    PAMAFS_PROBE1(open_session_return, pamret);
     return pamret;
 }
 
 
 /*
- * Don't do anything for authenticate.  We're only an auth module so that we
- * can supply a pam_setcred implementation.
+ * We're only an auth module so that we can supply a pam_setcred
+ * implementation, so normally don't do anything for authenticate.  If
+ * prefetch_tokens is set, though, start obtaining tokens in the background
+ * so that they're ready by the time the session is opened.
  */
 int
-pam_sm_authenticate(pam_handle_t *pamh UNUSED, int flags UNUSED,
-                    int argc UNUSED, const char *argv[] UNUSED)
+pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
+                    const char *argv[])
 {
+    struct pam_args *args;
+    struct pamafs_timing timing;
+    uint64_t start;
+
+    PAMAFS_PROBE1(authenticate_entry, flags);
+    pamafs_timing_start(&timing);
+    args = pamafs_init(pamh, flags, argc, argv);
+    if (args != NULL)
+        pamafs_timing_init(args, &timing);
+    pamafs_trace_record(args, PAMAFS_CALL_AUTHENTICATE, flags);
+    if (args != NULL && args->config->prefetch_tokens && timed_hasafs(args)) {
+        ENTRY(args, flags);
+        start = pamafs_time_now();
+        pamafs_token_prefetch(args);
+        pamafs_timing_add(args, PAMAFS_PHASE_TOKENS, start);
+        pamafs_timing_report(args, __func__);
+        pamafs_events_record(args, PAMAFS_CALL_AUTHENTICATE, flags,
+                             PAM_SUCCESS);
+        EXIT(args, PAM_SUCCESS);
+    }
+    pamafs_free(args);
+    PAMAFS_PROBE1(authenticate_return, PAM_SUCCESS);
+
     /*
      * We want to return PAM_IGNORE here, but Linux PAM 0.99.7.1 (at least)
      * has a bug that causes PAM_IGNORE to result in authentication failure
@@ -114,17 +249,23 @@ pam_sm_setcred(pam_handle_t *pamh, int flags, int argc,
                const char *argv[])
 {
     struct pam_args *args;
+    struct pamafs_timing timing;
+    uint64_t start;
     int status;
     int pamret = PAM_SUCCESS;
     const void *dummy;
     bool reinitialize;
 
+    PAMAFS_PROBE1(setcred_entry, flags);
+    pamafs_timing_start(&timing);
     args = pamafs_init(pamh, flags, argc, argv);
     if (args == NULL) {
         pamret = PAM_CRED_ERR;
         goto done;
     }
+    pamafs_timing_init(args, &timing);
     ENTRY(args, flags);
+    pamafs_trace_record(args, PAMAFS_CALL_SETCRED, flags);
 
     /*
      * Do nothing unless AFS is available.  We need to return success here
@@ -135,8 +276,9 @@ pam_sm_setcred(pam_handle_t *pamh, int flags, int argc,
      * with the [] syntax.  Since we do nothing in this case, and since the
      * stack is already frozen from the auth group, success makes sense.
      */
-    if (!k_hasafs()) {
+    if (!timed_hasafs(args)) {
         putil_err(args, "skipping, AFS apparently not available");
+        pamafs_stats_count(args, PAMAFS_STAT_SKIP_NO_AFS);
         pamret = PAM_SUCCESS;
         goto done;
     }
@@ -147,11 +289,14 @@ pam_sm_setcred(pam_handle_t *pamh, int flags, int argc,
      * pam_setcred, since normally this call is made by pam_close_session.
      */
     if (flags & PAM_DELETE_CRED) {
+        count_close(args);
         if (args->config->retain_after_close || args->config->notokens) {
             pamret = PAM_SUCCESS;
             putil_debug(args, "skipping as configured");
         } else {
+            start = pamafs_time_now();
             pamret = pamafs_token_delete(args);
+            pamafs_timing_add(args, PAMAFS_PHASE_TOKENS, start);
             if (pamret == PAM_SESSION_ERR)
                 pamret = PAM_CRED_ERR;
         }
@@ -168,25 +313,34 @@ pam_sm_setcred(pam_handle_t *pamh, int flags, int argc,
     if (!reinitialize) {
         status = pam_get_data(pamh, "pam_afs_session", &dummy);
         if (status == PAM_SUCCESS) {
-            if (!k_haspag() && !args->config->nopag)
+            if (!k_haspag() && !args->config->nopag) {
                 putil_notice(args, "PAG apparently lost, recreating");
-            else {
+                pamafs_stats_count(args, PAMAFS_STAT_PAG_LOST);
+            } else {
                 putil_debug(args, "skipping, apparently already ran");
                 goto done;
             }
         }
-        if (!args->config->nopag && k_setpag() != 0) {
+        count_login(args);
+        if (!args->config->nopag && timed_setpag(args) != 0) {
             putil_err(args, "PAG creation failed: %s", strerror(errno));
+            pamafs_stats_count(args, PAMAFS_STAT_PAG_FAILED);
             pamret = PAM_CRED_ERR;
             goto done;
         }
     }
-    if (!args->config->notokens)
+    if (!args->config->notokens) {
+        start = pamafs_time_now();
         pamret = pamafs_token_get(args, reinitialize);
+        pamafs_timing_add(args, PAMAFS_PHASE_TOKENS, start);
+    }
 
 done:
+    pamafs_timing_report(args, __func__);
+    pamafs_events_record(args, PAMAFS_CALL_SETCRED, flags, pamret);
     EXIT(args, pamret);
     pamafs_free(args);
+    PAMAFS_PROBE1(setcred_return, pamret);
     return pamret;
 }
 
@@ -200,14 +354,21 @@ pam_sm_close_session(pam_handle_t *pamh, int flags, int argc,
                      const char *argv[])
 {
     struct pam_args *args;
+    struct pamafs_timing timing;
+    uint64_t start;
     int pamret = PAM_SUCCESS;
 
+    PAMAFS_PROBE1(close_session_entry, flags);
+    pamafs_timing_start(&timing);
     args = pamafs_init(pamh, flags, argc, argv);
     if (args == NULL) {
         pamret = PAM_SESSION_ERR;
         goto done;
     }
+    pamafs_timing_init(args, &timing);
     ENTRY(args, flags);
+    pamafs_trace_record(args, PAMAFS_CALL_CLOSE_SESSION, flags);
+    count_close(args);
 
     /* Do nothing if so configured. */
     if (args->config->retain_after_close || args->config->notokens) {
@@ -217,17 +378,23 @@ pam_sm_close_session(pam_handle_t *pamh, int flags, int argc,
     }
 
     /* Do nothing unless AFS is available. */
-    if (!k_hasafs()) {
+    if (!timed_hasafs(args)) {
         pamret = PAM_IGNORE;
         putil_err(args, "skipping, AFS apparently not available");
+        pamafs_stats_count(args, PAMAFS_STAT_SKIP_NO_AFS);
         goto done;
     }
 
     /* Delete tokens. */
+    start = pamafs_time_now();
     pamret = pamafs_token_delete(args);
+    pamafs_timing_add(args, PAMAFS_PHASE_TOKENS, start);
 
 done:
+    pamafs_timing_report(args, __func__);
+    pamafs_events_record(args, PAMAFS_CALL_CLOSE_SESSION, flags, pamret);
     EXIT(args, pamret);
     pamafs_free(args);
+    PAMAFS_PROBE1(close_session_return, pamret);
     return pamret;
 }
@@ -0,0 +1,368 @@
+/*
+ * Reference counting of sessions sharing tokens.
+ *
+ * Without PAGs (the nopag option), all of a user's sessions share the same
+ * tokens, so deleting them when one session closes takes them away from all
+ * of the others.  If the unlog_refcount option is set, the number of open
+ * sessions for each UID is kept in a file in the state directory, protected
+ * by a lock, and tokens are only deleted when the last session closes.
+ *
+ * If unlog_grace is also set, deleting the tokens is delayed by that many
+ * seconds in a detached process so that a user who reconnects right away
+ * doesn't have to obtain tokens again.  Each new session increments a
+ * generation number in the same file, and the delayed process only deletes
+ * the tokens if there are still no sessions and the generation hasn't
+ * changed.
+ *
+ * The file also records the process ID of the process holding each session,
+ * and sessions whose process no longer exists are dropped before deciding
+ * whether to delete tokens.  Otherwise, a session that never reaches
+ * close_session (a crashed sshd or a killed login process) would keep its
+ * user's tokens from ever being deleted.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/kafs.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+
+/* The name of our PAM data item recording that we counted this session. */
+#define REFCOUNT_DATA "pam_afs_session_refcount"
+
+/* How long to wait for the lock on the count, in milliseconds. */
+#define REFCOUNT_LOCK_WAIT (10 * 1000)
+
+/*
+ * The contents of the count file.  This header is followed by the process ID
+ * of the process holding each session, as count uint32_t values.
+ */
+struct refcount {
+    uint32_t count;             /* Number of open sessions. */
+    uint32_t generation;        /* Incremented for each new session. */
+};
+
+/* What we remember about a counted session, stored as PAM data. */
+struct refcount_data {
+    uid_t uid;                  /* User the session was counted for. */
+    pid_t pid;                  /* Process recorded as holding it. */
+};
+
+
+/*
+ * Free the refcount_data struct when PAM is done with it.
+ */
+static void
+refcount_data_free(pam_handle_t *pamh UNUSED, void *data, int status UNUSED)
+{
+    free(data);
+}
+
+
+/*
+ * Open and lock the count file for a UID and read its contents, storing the
+ * header in ref and a newly allocated array of the holders in pids, which
+ * the caller frees and which has room for one more.  A missing or short file
+ * is treated as having only as many holders as it records.  Returns the
+ * locked file descriptor, which the caller closes to release the lock, or -1
+ * on failure.
+ */
+static int
+refcount_lock(struct pam_args *args, uid_t uid, struct refcount *ref,
+              uint32_t **pids)
+{
+    char *name;
+    int fd;
+    ssize_t status;
+    size_t size;
+
+    if (asprintf(&name, "sessions-%lu", (unsigned long) uid) < 0) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        return -1;
+    }
+    fd = pamafs_state_open(args, name, O_RDWR | O_CREAT);
+    free(name);
+    if (fd < 0)
+        return -1;
+    if (!pamafs_state_lock(args, fd, true, REFCOUNT_LOCK_WAIT)) {
+        putil_err(args, "cannot lock session count for UID %lu",
+                  (unsigned long) uid);
+        close(fd);
+        return -1;
+    }
+    memset(ref, 0, sizeof(*ref));
+    do
+        status = pread(fd, ref, sizeof(*ref), 0);
+    while (status < 0 && errno == EINTR);
+    if (status != sizeof(*ref))
+        memset(ref, 0, sizeof(*ref));
+    size = ((size_t) ref->count + 1) * sizeof(uint32_t);
+    *pids = malloc(size);
+    if (*pids == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (ref->count > 0) {
+        do
+            status = pread(fd, *pids, size - sizeof(uint32_t), sizeof(*ref));
+        while (status < 0 && errno == EINTR);
+        if (status < 0)
+            status = 0;
+        ref->count = (uint32_t) ((size_t) status / sizeof(uint32_t));
+    }
+    return fd;
+}
+
+
+/*
+ * Remove the holders of sessions whose processes no longer exist, since they
+ * exited or crashed without closing the session.  A process ID may have been
+ * reused since, in which case the session is kept, erring on the side of
+ * keeping tokens.
+ */
+static void
+refcount_prune(struct pam_args *args, struct refcount *ref, uint32_t *pids)
+{
+    uint32_t i = 0;
+
+    while (i < ref->count) {
+        if (kill((pid_t) pids[i], 0) < 0 && errno == ESRCH) {
+            putil_debug(args, "ignoring session of exited process %lu",
+                        (unsigned long) pids[i]);
+            pids[i] = pids[--ref->count];
+        } else
+            i++;
+    }
+}
+
+
+/*
+ * Write the contents of the count file back.  Returns true on success and
+ * false on failure, which is reported.
+ */
+static bool
+refcount_write(struct pam_args *args, int fd, const struct refcount *ref,
+               const uint32_t *pids)
+{
+    ssize_t status;
+    size_t size;
+
+    do
+        status = pwrite(fd, ref, sizeof(*ref), 0);
+    while (status < 0 && errno == EINTR);
+    if (status != sizeof(*ref))
+        goto fail;
+    size = (size_t) ref->count * sizeof(uint32_t);
+    if (size > 0) {
+        do
+            status = pwrite(fd, pids, size, sizeof(*ref));
+        while (status < 0 && errno == EINTR);
+        if (status < 0 || (size_t) status != size)
+            goto fail;
+    }
+    if (ftruncate(fd, (off_t) (sizeof(*ref) + size)) < 0)
+        goto fail;
+    return true;
+
+fail:
+    putil_err(args, "cannot update session count: %s", strerror(errno));
+    return false;
+}
+
+
+/*
+ * The body of the process that deletes tokens after unlog_grace seconds if
+ * no new session has started in the meantime.  Never returns.
+ */
+static void __attribute__((__noreturn__))
+refcount_grace(struct pam_args *args, uid_t uid, uint32_t generation)
+{
+    struct refcount ref;
+    struct timespec delay;
+    uint32_t *pids;
+    int fd;
+
+    delay.tv_sec = args->config->unlog_grace;
+    delay.tv_nsec = 0;
+    while (nanosleep(&delay, &delay) < 0 && errno == EINTR)
+        ;
+    fd = refcount_lock(args, uid, &ref, &pids);
+    if (fd < 0)
+        _exit(1);
+    refcount_prune(args, &ref, pids);
+    if (ref.count == 0 && ref.generation == generation) {
+        putil_debug(args, "destroying tokens after grace period");
+        if (pamafs_unlog() != 0)
+            putil_err(args, "unable to delete credentials: %s",
+                      strerror(errno));
+    }
+    close(fd);
+    _exit(0);
+}
+
+
+/*
+ * Start the process that deletes tokens after the grace period.  Fork twice
+ * so that the application never sees it as a child.  See
+ * pamafs_child_sigchld for why we override SIGCHLD.
+ */
+static void
+refcount_grace_start(struct pam_args *args, uid_t uid, uint32_t generation)
+{
+    bool restore_handler;
+    pid_t child, pid;
+    int fd;
+
+    restore_handler = pamafs_child_sigchld(args);
+    child = fork();
+    if (child < 0)
+        putil_crit(args, "cannot fork: %s", strerror(errno));
+    else if (child == 0) {
+        pid = fork();
+        if (pid == 0) {
+            setpgid(0, 0);
+            fd = open("/dev/null", O_RDWR);
+            if (fd >= 0) {
+                dup2(fd, 0);
+                dup2(fd, 1);
+                dup2(fd, 2);
+                if (fd > 2)
+                    close(fd);
+            }
+            refcount_grace(args, uid, generation);
+        }
+        _exit(pid < 0 ? 1 : 0);
+    } else
+        while (waitpid(child, NULL, 0) < 0 && errno == EINTR)
+            ;
+    if (restore_handler)
+        pamafs_child_sigchld_restore(args);
+}
+
+
+/*
+ * Count a new session for the given user, held by the current process, and
+ * remember that we did so that pamafs_refcount_close can subtract it again.
+ * Failures are reported but otherwise ignored; an uncounted session just
+ * deletes tokens when it closes, as it would without unlog_refcount.
+ */
+void
+pamafs_refcount_open(struct pam_args *args, const struct passwd *pwd)
+{
+    struct refcount ref;
+    struct refcount_data *data;
+    uint32_t *pids;
+    int fd, pamret;
+
+    if (!args->config->unlog_refcount)
+        return;
+    data = malloc(sizeof(struct refcount_data));
+    if (data == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        return;
+    }
+    data->uid = pwd->pw_uid;
+    data->pid = getpid();
+    fd = refcount_lock(args, data->uid, &ref, &pids);
+    if (fd < 0) {
+        free(data);
+        return;
+    }
+    refcount_prune(args, &ref, pids);
+    pids[ref.count++] = (uint32_t) data->pid;
+    ref.generation++;
+    if (!refcount_write(args, fd, &ref, pids)) {
+        close(fd);
+        free(pids);
+        free(data);
+        return;
+    }
+    close(fd);
+    free(pids);
+    putil_debug(args, "%lu sessions for UID %lu", (unsigned long) ref.count,
+                (unsigned long) data->uid);
+    pamret = pam_set_data(args->pamh, REFCOUNT_DATA, data,
+                          refcount_data_free);
+    if (pamret != PAM_SUCCESS) {
+        putil_err_pam(args, pamret, "cannot set session count data");
+        free(data);
+    }
+}
+
+
+/*
+ * Stop counting the current session.  Returns true if the caller should
+ * delete tokens now, which is the case if this session wasn't counted or
+ * was the last one for the user and unlog_grace isn't set.  Otherwise,
+ * either leaves the tokens for the remaining sessions or starts the process
+ * that deletes them after the grace period, and returns false.
+ */
+bool
+pamafs_refcount_close(struct pam_args *args)
+{
+    const void *data;
+    struct refcount_data session;
+    struct refcount ref;
+    uint32_t *pids;
+    uint32_t i;
+    int fd, pamret;
+
+    if (pam_get_data(args->pamh, REFCOUNT_DATA, &data) != PAM_SUCCESS)
+        return true;
+    if (data == NULL)
+        return true;
+    session = *(const struct refcount_data *) data;
+    pamret = pam_set_data(args->pamh, REFCOUNT_DATA, NULL, NULL);
+    if (pamret != PAM_SUCCESS)
+        putil_err_pam(args, pamret, "cannot remove session count data");
+
+    /*
+     * Remove one session held by the process that opened this one, which
+     * may already be gone if the session is being closed by another process.
+     * If the count can't be updated, err on the side of keeping tokens.
+     */
+    fd = refcount_lock(args, session.uid, &ref, &pids);
+    if (fd < 0)
+        return false;
+    for (i = 0; i < ref.count; i++)
+        if (pids[i] == (uint32_t) session.pid) {
+            pids[i] = pids[--ref.count];
+            break;
+        }
+    refcount_prune(args, &ref, pids);
+    if (!refcount_write(args, fd, &ref, pids)) {
+        close(fd);
+        free(pids);
+        return false;
+    }
+    close(fd);
+    free(pids);
+    if (ref.count > 0) {
+        putil_debug(args, "not destroying tokens, %lu other sessions for"
+                    " UID %lu", (unsigned long) ref.count,
+                    (unsigned long) session.uid);
+        return false;
+    }
+    if (args->config->unlog_grace > 0) {
+        putil_debug(args, "destroying tokens in %lds unless a new session"
+                    " starts", args->config->unlog_grace);
+        refcount_grace_start(args, session.uid, ref.generation);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,594 @@
+/*
+ * Renewal of tokens for the life of a session.
+ *
+ * Tokens expire at the same time as the Kerberos tickets they were obtained
+ * from, after which long-running sessions and batch jobs lose access to AFS
+ * even if their tickets could still be renewed.  If the renew_tokens option
+ * is set, pam_sm_open_session starts a helper process in the session's PAG
+ * that sleeps until renew_margin seconds before the tokens expire, renews the
+ * Kerberos TGT if it can, obtains new tokens the same way the session did,
+ * and goes back to sleep.
+ *
+ * The helper watches a pipe whose write end is held by the application that
+ * opened the session and closed when the session is closed or the
+ * application exits.  It waits on that pipe with a timeout set by the token
+ * expiration time, so it wakes up either when it's time to renew tokens or
+ * when the session is over, and never has to poll.  A second pipe, held open
+ * by the helper, lets the application tell whether the helper is still
+ * running before it tries to stop it.
+ *
+ * Jobs started with nohup or by a batch system can outlive the application,
+ * so if the renew_pag option is set, the helper instead keeps running after
+ * the pipe is closed for as long as any other process is still in its PAG.
+ * This only works where the PAG is a supplementary group, as on Linux, and
+ * is checked by reading the groups of every process from /proc each time
+ * the helper wakes up.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#ifdef HAVE_KRB5
+# include <portable/krb5.h>
+#endif
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pwd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+
+/* The name of our PAM data item for the renewal helper. */
+#define RENEW_DATA "pam_afs_session_renew"
+
+/*
+ * How long to wait, in seconds, before trying again if renewing tokens didn't
+ * extend their lifetime or there are no tokens to renew.
+ */
+#define RENEW_RETRY 60
+
+/*
+ * How often, in seconds, to check whether any other process is still in the
+ * PAG once the session is over, with renew_pag.
+ */
+#define RENEW_PAG_CHECK 300
+
+/* Information about the renewal helper, stored as PAM data. */
+struct renew_data {
+    pid_t pid;                  /* Process (and process group) of helper. */
+    int control;                /* Closed to tell the helper to exit. */
+    int alive;                  /* Reaches end of file if the helper exits. */
+};
+
+
+/*
+ * Free the renew_data struct when PAM is done with it.  Closing the control
+ * pipe tells the helper to exit if it's still running.
+ */
+static void
+renew_data_free(pam_handle_t *pamh UNUSED, void *data, int status UNUSED)
+{
+    struct renew_data *renew = data;
+
+    close(renew->control);
+    close(renew->alive);
+    free(renew);
+}
+
+
+/*
+ * Replace the contents of the ticket cache with the given credentials for
+ * client, without ever leaving the cache empty or partly written.  For a file
+ * cache, the credentials are written to a new file in the same directory,
+ * given the mode of the old one, and renamed over it.  Otherwise, they're
+ * written to a new cache of the same type, which is moved into place with
+ * krb5_cc_move.  Returns a Kerberos error code (or errno value).
+ */
+#ifdef HAVE_KRB5
+static krb5_error_code
+renew_replace(struct pam_args *args, krb5_ccache cache,
+              krb5_principal client, krb5_creds *creds)
+{
+    krb5_error_code ret;
+    krb5_ccache tmp = NULL;
+    const char *type, *path;
+    char *file = NULL;
+    char *name = NULL;
+    struct stat st;
+    int fd;
+
+    /* Other cache types can be moved into place by the library. */
+    type = krb5_cc_get_type(args->ctx, cache);
+    if (type == NULL || strcmp(type, "FILE") != 0) {
+        ret = krb5_cc_new_unique(args->ctx, type, NULL, &tmp);
+        if (ret != 0)
+            return ret;
+        ret = krb5_cc_initialize(args->ctx, tmp, client);
+        if (ret == 0)
+            ret = krb5_cc_store_cred(args->ctx, tmp, creds);
+        if (ret == 0)
+            ret = krb5_cc_move(args->ctx, tmp, cache);
+        if (ret != 0)
+            krb5_cc_destroy(args->ctx, tmp);
+        return ret;
+    }
+
+    /* Write a new file cache next to the old one and rename it. */
+    path = krb5_cc_get_name(args->ctx, cache);
+    if (stat(path, &st) < 0)
+        return errno;
+    if (asprintf(&file, "%s.XXXXXX", path) < 0)
+        return errno;
+    fd = mkstemp(file);
+    if (fd < 0) {
+        ret = errno;
+        free(file);
+        return ret;
+    }
+    close(fd);
+    if (asprintf(&name, "FILE:%s", file) < 0) {
+        ret = errno;
+        name = NULL;
+        goto done;
+    }
+    ret = krb5_cc_resolve(args->ctx, name, &tmp);
+    if (ret != 0)
+        goto done;
+    ret = krb5_cc_initialize(args->ctx, tmp, client);
+    if (ret == 0)
+        ret = krb5_cc_store_cred(args->ctx, tmp, creds);
+    krb5_cc_close(args->ctx, tmp);
+    if (ret != 0)
+        goto done;
+    if (chmod(file, st.st_mode & 07777) < 0 || rename(file, path) < 0)
+        ret = errno;
+
+done:
+    if (ret != 0)
+        unlink(file);
+    free(name);
+    free(file);
+    return ret;
+}
+
+
+/*
+ * Renew the TGT in the ticket cache as the user, who owns it.  This is the
+ * body of the child process started by renew_tgt.  Returns true on success
+ * and false on failure, which is reported at the debug level.
+ */
+static bool
+renew_tgt_user(struct pam_args *args, const char *cachename)
+{
+    krb5_error_code ret;
+    krb5_ccache cache = NULL;
+    krb5_principal client = NULL;
+    krb5_creds creds;
+    bool have_creds = false;
+
+    ret = krb5_cc_resolve(args->ctx, cachename, &cache);
+    if (ret != 0)
+        goto fail;
+    ret = krb5_cc_get_principal(args->ctx, cache, &client);
+    if (ret != 0)
+        goto fail;
+    memset(&creds, 0, sizeof(creds));
+    ret = krb5_get_renewed_creds(args->ctx, &creds, client, cache, NULL);
+    if (ret != 0)
+        goto fail;
+    have_creds = true;
+    ret = renew_replace(args, cache, client, &creds);
+    if (ret != 0)
+        goto fail;
+    putil_debug(args, "renewed Kerberos tickets");
+    goto done;
+
+fail:
+    putil_debug_krb5(args, ret, "cannot renew Kerberos tickets");
+done:
+    if (have_creds)
+        krb5_free_cred_contents(args->ctx, &creds);
+    if (client != NULL)
+        krb5_free_principal(args->ctx, client);
+    if (cache != NULL)
+        krb5_cc_close(args->ctx, cache);
+    return (ret == 0);
+}
+
+
+/*
+ * Renew the TGT in the ticket cache, if it's renewable, so that new tokens
+ * can be obtained from it.  The helper may be running as root, so this is
+ * done in a child process running as the user, so that the ticket cache is
+ * never written with root's privileges or left owned by root.  Failures are
+ * only reported at the debug level, since the TGT may just not be renewable
+ * and aklog may still work.
+ */
+static void
+renew_tgt(struct pam_args *args, struct passwd *pwd, const char *cachename)
+{
+    bool restore_handler;
+    pid_t child;
+
+    if (cachename == NULL || args->ctx == NULL)
+        return;
+    restore_handler = pamafs_child_sigchld(args);
+    child = fork();
+    if (child < 0)
+        putil_crit(args, "cannot fork: %s", strerror(errno));
+    else if (child == 0) {
+        if (getegid() != pwd->pw_gid && setgid(pwd->pw_gid) < 0) {
+            putil_err(args, "cannot setgid: %s", strerror(errno));
+            _exit(1);
+        }
+        if (setuid(pwd->pw_uid) < 0) {
+            putil_err(args, "cannot setuid: %s", strerror(errno));
+            _exit(1);
+        }
+        _exit(renew_tgt_user(args, cachename) ? 0 : 1);
+    } else
+        while (waitpid(child, NULL, 0) < 0 && errno == EINTR)
+            ;
+    if (restore_handler)
+        pamafs_child_sigchld_restore(args);
+}
+#else /* !HAVE_KRB5 */
+static void
+renew_tgt(struct pam_args *args UNUSED, struct passwd *pwd UNUSED,
+          const char *cachename UNUSED)
+{
+    return;
+}
+#endif /* !HAVE_KRB5 */
+
+
+/*
+ * Return how long to sleep, in seconds, before renewing the tokens in the
+ * current PAG, but at least minimum seconds.  If there are no tokens, wait
+ * RENEW_RETRY seconds to see if some show up.
+ */
+static long
+renew_interval(struct pam_args *args, long minimum)
+{
+    struct pamafs_tokens *tokens;
+    time_t expires = 0;
+
+    tokens = pamafs_tokens_read(args);
+    if (tokens != NULL) {
+        if (tokens->count > 0)
+            expires = tokens->expires;
+        pamafs_tokens_free(tokens);
+    }
+    if (expires == 0)
+        return RENEW_RETRY;
+    expires -= time(NULL) + args->config->renew_margin;
+    if (expires < minimum)
+        return minimum;
+    if (expires > INT_MAX / 1000)
+        return INT_MAX / 1000;
+    return (long) expires;
+}
+
+
+/*
+ * Return the group representing the PAG the current process is in, or 0 if
+ * it isn't in one or its PAG isn't a group.  This is the single-group PAG
+ * used on Linux, whose high byte is 'A' (see k_haspag).
+ */
+static gid_t
+renew_pag_group(void)
+{
+    gid_t *groups;
+    gid_t pag = 0;
+    int ngroups, i;
+
+    ngroups = getgroups(0, NULL);
+    if (ngroups <= 0)
+        return 0;
+    groups = calloc((size_t) ngroups, sizeof(gid_t));
+    if (groups == NULL)
+        return 0;
+    ngroups = getgroups(ngroups, groups);
+    for (i = 0; i < ngroups; i++)
+        if (((groups[i] >> 24) & 0xff) == 'A') {
+            pag = groups[i];
+            break;
+        }
+    free(groups);
+    return pag;
+}
+
+
+/*
+ * Return true if the process with the given /proc/<pid>/status file has the
+ * given group.
+ */
+static bool
+renew_proc_has_group(const char *path, gid_t group)
+{
+    FILE *file;
+    char word[64];
+    unsigned long gid;
+    bool found = false;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        return false;
+    while (!found && fscanf(file, "%63s", word) == 1) {
+        if (strcmp(word, "Groups:") != 0)
+            continue;
+        while (fscanf(file, "%lu", &gid) == 1)
+            if ((gid_t) gid == group) {
+                found = true;
+                break;
+            }
+        break;
+    }
+    fclose(file);
+    return found;
+}
+
+
+/*
+ * Return true if any process other than this one is in the PAG with the
+ * given group, based on the groups shown in /proc.  Returns false if /proc
+ * can't be read, since then we can't tell.
+ */
+static bool
+renew_pag_used(struct pam_args *args, gid_t pag)
+{
+    DIR *proc;
+    struct dirent *entry;
+    char path[PATH_MAX];
+    unsigned long self;
+    bool used = false;
+
+    proc = opendir("/proc");
+    if (proc == NULL) {
+        putil_err(args, "cannot open /proc: %s", strerror(errno));
+        return false;
+    }
+    self = (unsigned long) getpid();
+    while (!used && (entry = readdir(proc)) != NULL) {
+        if (entry->d_name[0] < '1' || entry->d_name[0] > '9')
+            continue;
+        if (strtoul(entry->d_name, NULL, 10) == self)
+            continue;
+        snprintf(path, sizeof(path), "/proc/%s/status", entry->d_name);
+        used = renew_proc_has_group(path, pag);
+    }
+    closedir(proc);
+    return used;
+}
+
+
+/*
+ * The body of the helper process.  Sleep until it's time to renew tokens,
+ * renew them, and repeat until the control pipe is closed or, with
+ * renew_pag, until no other process is in the PAG.  Never returns.
+ */
+static void __attribute__((__noreturn__))
+renew_run(struct pam_args *args, struct passwd *pwd, const char *cache,
+          int control)
+{
+    struct pollfd pfd;
+    char buffer[1];
+    long interval;
+    long minimum = 0;
+    int fd, status;
+    gid_t pag = 0;
+
+    if (setpgid(0, 0) < 0)
+        putil_err(args, "cannot create process group: %s", strerror(errno));
+    fd = open("/dev/null", O_RDWR);
+    if (fd >= 0) {
+        dup2(fd, 0);
+        dup2(fd, 1);
+        dup2(fd, 2);
+        if (fd > 2)
+            close(fd);
+    }
+
+    /* Sessions started from the helper shouldn't wait for other sessions. */
+    args->config->async_tokens = false;
+    args->config->prefetch_tokens = false;
+
+    pfd.fd = control;
+    pfd.events = POLLIN;
+    while (1) {
+        interval = renew_interval(args, minimum);
+        if (pag != 0 && interval > RENEW_PAG_CHECK)
+            interval = RENEW_PAG_CHECK;
+        putil_debug(args, "renewing tokens in %lds", interval);
+        pfd.revents = 0;
+        status = poll(&pfd, 1, (int) (interval * 1000));
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status < 0) {
+            putil_err(args, "cannot wait for session: %s", strerror(errno));
+            break;
+        }
+        if (status > 0) {
+            status = read(control, buffer, sizeof(buffer));
+            if (status > 0 || (status < 0 && errno == EINTR))
+                continue;
+            if (!args->config->renew_pag)
+                break;
+            pag = renew_pag_group();
+            if (pag == 0) {
+                putil_debug(args, "PAG is not a group, cannot tell when it"
+                            " is no longer in use");
+                break;
+            }
+            if (!renew_pag_used(args, pag))
+                break;
+            putil_debug(args, "session closed, renewing tokens while PAG"
+                        " %lu is in use", (unsigned long) pag);
+            close(control);
+            pfd.fd = -1;
+            continue;
+        }
+        if (pag != 0 && !renew_pag_used(args, pag))
+            break;
+
+        /*
+         * After the first renewal, don't try again for RENEW_RETRY seconds
+         * even if the tokens still expire soon, which happens if the TGT
+         * can't be renewed, so that we don't spin.
+         */
+        minimum = RENEW_RETRY;
+        renew_tgt(args, pwd, cache);
+        if (pamafs_token_acquire(args, pwd, cache, true) == PAM_SUCCESS)
+            putil_debug(args, "renewed tokens");
+        else
+            putil_err(args, "cannot renew tokens");
+    }
+    putil_debug(args, "session ended, no longer renewing tokens");
+    _exit(0);
+}
+
+
+/*
+ * Start the renewal helper for the current session, running in the current
+ * PAG, and remember it in PAM data.  Failures are reported but otherwise
+ * ignored, since the session already has tokens.
+ */
+void
+pamafs_renew_start(struct pam_args *args, struct passwd *pwd,
+                   const char *cache)
+{
+    struct renew_data *renew;
+    bool restore_handler;
+    int control[2], alive[2];
+    pid_t child, pid;
+    ssize_t status = 0;
+    int pamret;
+
+    /* Set up the pipes, which should never be inherited by programs. */
+    if (pipe(control) < 0) {
+        putil_err(args, "cannot create pipe: %s", strerror(errno));
+        return;
+    }
+    if (pipe(alive) < 0) {
+        putil_err(args, "cannot create pipe: %s", strerror(errno));
+        close(control[0]);
+        close(control[1]);
+        return;
+    }
+    fcntl(control[0], F_SETFD, FD_CLOEXEC);
+    fcntl(control[1], F_SETFD, FD_CLOEXEC);
+    fcntl(alive[0], F_SETFD, FD_CLOEXEC);
+    fcntl(alive[1], F_SETFD, FD_CLOEXEC);
+
+    /*
+     * Fork twice so that the helper isn't our child.  The intermediate child
+     * reports the PID of the helper on the alive pipe and exits.  See
+     * pamafs_child_sigchld for why we override SIGCHLD.
+     */
+    restore_handler = pamafs_child_sigchld(args);
+    child = fork();
+    if (child < 0)
+        putil_crit(args, "cannot fork: %s", strerror(errno));
+    else if (child == 0) {
+        close(control[1]);
+        close(alive[0]);
+        pid = fork();
+        if (pid == 0)
+            renew_run(args, pwd, cache, control[0]);
+        if (pid < 0)
+            _exit(1);
+        setpgid(pid, pid);
+        if (write(alive[1], &pid, sizeof(pid)) != sizeof(pid))
+            _exit(1);
+        _exit(0);
+    } else {
+        close(alive[1]);
+        alive[1] = -1;
+        do
+            status = read(alive[0], &pid, sizeof(pid));
+        while (status < 0 && errno == EINTR);
+        while (waitpid(child, NULL, 0) < 0 && errno == EINTR)
+            ;
+    }
+    if (restore_handler)
+        pamafs_child_sigchld_restore(args);
+    close(control[0]);
+    if (alive[1] >= 0)
+        close(alive[1]);
+    if (status != sizeof(pid)) {
+        putil_err(args, "cannot start token renewal process");
+        close(control[1]);
+        close(alive[0]);
+        return;
+    }
+    putil_debug(args, "renewing tokens in process %lu", (unsigned long) pid);
+
+    /* Remember the helper so that we can stop it. */
+    renew = calloc(1, sizeof(struct renew_data));
+    if (renew == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        close(control[1]);
+        close(alive[0]);
+        return;
+    }
+    renew->pid = pid;
+    renew->control = control[1];
+    renew->alive = alive[0];
+    pamret = pam_set_data(args->pamh, RENEW_DATA, renew, renew_data_free);
+    if (pamret != PAM_SUCCESS) {
+        putil_err_pam(args, pamret, "cannot set renewal process data");
+        renew_data_free(args->pamh, renew, pamret);
+    }
+}
+
+
+/*
+ * Stop the renewal helper for the current session, if any.  Called before
+ * deleting tokens so that the helper can't obtain new ones afterwards.
+ */
+void
+pamafs_renew_stop(struct pam_args *args)
+{
+    const void *data;
+    const struct renew_data *renew;
+    struct pollfd pfd;
+    int pamret;
+
+    if (pam_get_data(args->pamh, RENEW_DATA, &data) != PAM_SUCCESS)
+        return;
+    if (data == NULL)
+        return;
+    renew = data;
+
+    /*
+     * If the alive pipe has reached end of file, the helper has already
+     * exited and its PID may have been reused, so don't signal it.
+     */
+    pfd.fd = renew->alive;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) == 0) {
+        putil_debug(args, "stopping token renewal process %lu",
+                    (unsigned long) renew->pid);
+        if (kill(-renew->pid, SIGKILL) < 0 && errno != ESRCH)
+            putil_err(args, "cannot stop token renewal process %lu: %s",
+                      (unsigned long) renew->pid, strerror(errno));
+    }
+    pamret = pam_set_data(args->pamh, RENEW_DATA, NULL, NULL);
+    if (pamret != PAM_SUCCESS)
+        putil_err_pam(args, pamret, "cannot remove renewal process data");
+}
@@ -0,0 +1,190 @@
+/*
+ * Host-wide limit on simultaneous token acquisitions.
+ *
+ * After a reboot or when a cluster starts many jobs at once, a host may try
+ * to run aklog for hundreds of sessions at the same moment, which overloads
+ * the host and the KDC and makes every login slower.  If the aklog_slots
+ * option is set, obtaining tokens requires holding one of that many slots,
+ * each of which is a lock file in the state directory.  Sessions that can't
+ * get a slot within aklog_slot_wait seconds continue without tokens, and
+ * pam_open_session and pam_setcred still return success for them.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+
+
+/*
+ * Sleep for the given number of milliseconds.
+ */
+static void
+slot_sleep(long msec)
+{
+    struct timespec delay;
+
+    delay.tv_sec = msec / 1000;
+    delay.tv_nsec = (msec % 1000) * 1000 * 1000;
+    nanosleep(&delay, NULL);
+}
+
+
+/*
+ * Open all of the slot files, checking the state directory only once.
+ * Returns a newly allocated array of aklog_slots descriptors, or NULL if the
+ * slot files can't be used, which has already been reported.
+ */
+static int *
+slot_open(struct pam_args *args)
+{
+    char *name;
+    int *fds;
+    long i, count;
+    int dir;
+
+    count = args->config->aklog_slots;
+    fds = calloc((size_t) count, sizeof(int));
+    if (fds == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        return NULL;
+    }
+    dir = pamafs_state_dir(args);
+    if (dir < 0) {
+        free(fds);
+        return NULL;
+    }
+    for (i = 0; i < count; i++) {
+        if (asprintf(&name, "slot-%ld", i) < 0) {
+            putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+            break;
+        }
+        fds[i] = pamafs_state_openat(args, dir, name, O_RDWR | O_CREAT);
+        free(name);
+        if (fds[i] < 0)
+            break;
+    }
+    close(dir);
+    if (i < count) {
+        while (i-- > 0)
+            close(fds[i]);
+        free(fds);
+        return NULL;
+    }
+    return fds;
+}
+
+
+/*
+ * Try once to lock each of the open slot files.  Returns the index of the
+ * locked slot or -1 if all slots are busy.
+ */
+static long
+slot_try(struct pam_args *args, const int *fds)
+{
+    long i;
+
+    for (i = 0; i < args->config->aklog_slots; i++)
+        if (pamafs_state_lock(args, fds[i], true, 0)) {
+            putil_debug(args, "obtained token slot %ld", i);
+            return i;
+        }
+    return -1;
+}
+
+
+/*
+ * Wait for a free slot for obtaining tokens, after first waiting a random
+ * interval of up to aklog_jitter milliseconds if that option is set.  The
+ * slot files are opened once and kept open while polling, so each poll only
+ * costs one fcntl per slot.
+ *
+ * Returns false if all slots stayed busy for aklog_slot_wait seconds, in
+ * which case the caller should not obtain tokens.  The session still
+ * continues: pamafs_token_get returns PAM_SUCCESS as it does for any failure
+ * to obtain tokens, but the session isn't marked as having tokens.
+ * Otherwise, returns true and sets slot to a file descriptor holding the
+ * slot that should be passed to pamafs_slot_release when done.  slot is set
+ * to -1 if aklog_slots isn't set or if the slot files couldn't be used,
+ * since problems with the state directory shouldn't prevent obtaining
+ * tokens.
+ */
+bool
+pamafs_slot_acquire(struct pam_args *args, int *slot)
+{
+    long jitter, timeout, waited, interval, i, found;
+    unsigned long seed;
+    struct timeval now;
+    int *fds;
+
+    *slot = -1;
+    if (args->config->aklog_slots <= 0)
+        return true;
+    jitter = args->config->aklog_jitter;
+    if (jitter > 0) {
+        /*
+         * This only needs to differ between processes, and calling srand
+         * would disturb the random number state of the application.
+         */
+        gettimeofday(&now, NULL);
+        seed = (unsigned long) getpid() * 2654435761UL;
+        seed ^= (unsigned long) now.tv_usec;
+        slot_sleep((long) (seed % (unsigned long) (jitter + 1)));
+    }
+    fds = slot_open(args);
+    if (fds == NULL)
+        return true;
+
+    /* Poll for a slot with exponential backoff up to half a second. */
+    timeout = args->config->aklog_slot_wait * 1000;
+    waited = 0;
+    interval = 10;
+    while ((found = slot_try(args, fds)) < 0) {
+        if (waited >= timeout)
+            break;
+        if (interval > timeout - waited)
+            interval = timeout - waited;
+        slot_sleep(interval);
+        waited += interval;
+        if (interval < 500)
+            interval *= 2;
+    }
+
+    /* Keep only the slot we locked, if any. */
+    for (i = 0; i < args->config->aklog_slots; i++)
+        if (i != found)
+            close(fds[i]);
+    if (found >= 0)
+        *slot = fds[found];
+    free(fds);
+    if (found < 0) {
+        putil_err(args, "all %ld token slots busy for %lds, continuing"
+                  " without tokens", args->config->aklog_slots,
+                  args->config->aklog_slot_wait);
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Release a slot obtained with pamafs_slot_acquire.
+ */
+void
+pamafs_slot_release(struct pam_args *args UNUSED, int slot)
+{
+    if (slot >= 0)
+        close(slot);
+}
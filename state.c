@@ -0,0 +1,457 @@
+/*
+ * Management of the module's state directory.
+ *
+ * Several optional features keep small amounts of data that have to survive
+ * from one PAM call to the next, possibly in a different process.  All of
+ * that data lives in a single directory, normally on a tmpfs file system
+ * under /run, that must be owned by the user running the module (normally
+ * root) and must not be accessible to anyone else.  These functions find or
+ * create that directory and open, replace, and remove files in it.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+
+/* Some systems don't have O_NOFOLLOW or O_CLOEXEC. */
+#ifndef O_NOFOLLOW
+# define O_NOFOLLOW 0
+#endif
+#ifndef O_CLOEXEC
+# define O_CLOEXEC 0
+#endif
+
+/* Use open file description locks if available.  See pamafs_state_lock. */
+#ifdef F_OFD_SETLK
+# define STATE_SETLK F_OFD_SETLK
+#else
+# define STATE_SETLK F_SETLK
+#endif
+
+
+/*
+ * Check that a file or directory is safe to trust: owned by the user we're
+ * running as and not writable by anyone else.  Takes the result of stat or
+ * fstat and the path (for error reporting).
+ */
+static bool
+state_check(struct pam_args *args, const struct stat *st, const char *path)
+{
+    if (st->st_uid != geteuid()) {
+        putil_err(args, "%s not owned by UID %lu, ignoring", path,
+                  (unsigned long) geteuid());
+        return false;
+    }
+    if ((st->st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+        putil_err(args, "%s is group or world-writable, ignoring", path);
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Make sure that the state directory exists and is safe to use, creating it
+ * if necessary.  Returns true if it can be used and false otherwise; any
+ * problems are reported with putil_err.
+ */
+static bool
+state_dir_check(struct pam_args *args)
+{
+    const char *dir = args->config->state_dir;
+    struct stat st;
+
+    if (dir == NULL || dir[0] != '/') {
+        putil_err(args, "state_dir must be an absolute path");
+        return false;
+    }
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        putil_err(args, "cannot create %s: %s", dir, strerror(errno));
+        return false;
+    }
+    if (lstat(dir, &st) < 0) {
+        putil_err(args, "cannot stat %s: %s", dir, strerror(errno));
+        return false;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        putil_err(args, "%s is not a directory", dir);
+        return false;
+    }
+    return state_check(args, &st, dir);
+}
+
+
+/*
+ * Build the path to a file in the state directory.  Returns newly allocated
+ * memory or NULL on failure, which is reported with putil_crit.
+ */
+char *
+pamafs_state_path(struct pam_args *args, const char *name)
+{
+    char *path;
+
+    if (asprintf(&path, "%s/%s", args->config->state_dir, name) < 0) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        return NULL;
+    }
+    return path;
+}
+
+
+/*
+ * Build the name of a state file that holds data for a particular user and
+ * Kerberos ticket cache.  The ticket cache name may be arbitrarily long and
+ * contain arbitrary characters, so it's represented by a hash; callers that
+ * care about collisions should store the full name in the file and check it.
+ * Returns newly allocated memory or NULL on failure.
+ */
+char *
+pamafs_state_name(struct pam_args *args, const char *prefix, uid_t uid,
+                  const char *cache)
+{
+    uint32_t hash = 2166136261U;
+    const unsigned char *p;
+    char *name;
+
+    if (cache == NULL)
+        cache = "";
+    for (p = (const unsigned char *) cache; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 16777619U;
+    }
+    if (asprintf(&name, "%s-%lu-%08lx", prefix, (unsigned long) uid,
+                 (unsigned long) hash) < 0) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        return NULL;
+    }
+    return name;
+}
+
+
+/*
+ * Open a file in the state directory given a descriptor for the directory
+ * returned by pamafs_state_dir, or -1 to open it by path.  The directory is
+ * not checked; otherwise the same as pamafs_state_open.
+ */
+int
+pamafs_state_openat(struct pam_args *args, int dir, const char *name,
+                    int flags)
+{
+    char *path;
+    int fd;
+    struct stat st;
+
+    path = pamafs_state_path(args, name);
+    if (path == NULL)
+        return -1;
+    if (dir < 0)
+        fd = open(path, flags | O_NOFOLLOW | O_CLOEXEC, 0600);
+    else
+        fd = openat(dir, name, flags | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        if (errno != ENOENT || (flags & O_CREAT))
+            putil_err(args, "cannot open %s: %s", path, strerror(errno));
+        free(path);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)
+        || !state_check(args, &st, path)) {
+        close(fd);
+        free(path);
+        return -1;
+    }
+    free(path);
+    return fd;
+}
+
+
+/*
+ * Open a file in the state directory, creating the directory first if
+ * needed.  flags are passed to open (O_NOFOLLOW and O_CLOEXEC are always
+ * added, so that aklog and our background processes don't inherit the file
+ * or its locks) and new files are always created mode 0600.  Returns the
+ * file descriptor or -1 on failure.  Failure to open a file that doesn't
+ * exist without O_CREAT is not reported, since callers generally treat that
+ * as a normal condition.
+ */
+int
+pamafs_state_open(struct pam_args *args, const char *name, int flags)
+{
+    if (!state_dir_check(args))
+        return -1;
+    return pamafs_state_openat(args, -1, name, flags);
+}
+
+
+/*
+ * Check and open the state directory, creating it if needed, for callers
+ * that open several files in it and only want to check it once.  Returns a
+ * descriptor to pass to pamafs_state_openat, which the caller should close,
+ * or -1 on failure.
+ */
+int
+pamafs_state_dir(struct pam_args *args)
+{
+    int fd;
+
+    if (!state_dir_check(args))
+        return -1;
+    fd = open(args->config->state_dir,
+              O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        putil_err(args, "cannot open %s: %s", args->config->state_dir,
+                  strerror(errno));
+    return fd;
+}
+
+/*
+ * Map a file in the state directory into memory for sharing between
+ * processes, creating it if necessary and extending it with zeroes to at
+ * least minimum bytes.  The whole file is mapped read/write and its length
+ * is returned in length.  Returns the mapping or NULL on failure, which is
+ * reported with putil_err.  Unmap with munmap.
+ */
+void *
+pamafs_state_map(struct pam_args *args, const char *name, size_t minimum,
+                 size_t *length)
+{
+    void *map;
+    struct stat st;
+    int fd;
+
+    fd = pamafs_state_open(args, name, O_RDWR | O_CREAT);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0) {
+        putil_err(args, "cannot stat %s: %s", name, strerror(errno));
+        goto fail;
+    }
+    if ((size_t) st.st_size < minimum) {
+        if (ftruncate(fd, (off_t) minimum) < 0) {
+            putil_err(args, "cannot extend %s: %s", name, strerror(errno));
+            goto fail;
+        }
+        st.st_size = (off_t) minimum;
+    }
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fd, 0);
+    if (map == MAP_FAILED) {
+        putil_err(args, "cannot map %s: %s", name, strerror(errno));
+        goto fail;
+    }
+    close(fd);
+    *length = (size_t) st.st_size;
+    return map;
+
+fail:
+    close(fd);
+    return NULL;
+}
+
+
+/*
+ * Read the full contents of a file in the state directory.  Returns true and
+ * sets data and length on success.  The data is newly allocated memory and
+ * is nul-terminated for the convenience of the caller; the nul is not
+ * included in the length.  Returns false if the file doesn't exist or can't
+ * be read.
+ */
+bool
+pamafs_state_read(struct pam_args *args, const char *name, char **data,
+                  size_t *length)
+{
+    int fd;
+    struct stat st;
+    char *buffer;
+    size_t total = 0;
+    ssize_t status;
+
+    fd = pamafs_state_open(args, name, O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) < 0) {
+        putil_err(args, "cannot stat %s: %s", name, strerror(errno));
+        close(fd);
+        return false;
+    }
+    buffer = malloc((size_t) st.st_size + 1);
+    if (buffer == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        close(fd);
+        return false;
+    }
+    while (total < (size_t) st.st_size) {
+        status = read(fd, buffer + total, (size_t) st.st_size - total);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status <= 0)
+            break;
+        total += (size_t) status;
+    }
+    close(fd);
+    if (total != (size_t) st.st_size) {
+        putil_err(args, "cannot read %s", name);
+        free(buffer);
+        return false;
+    }
+    buffer[total] = '\0';
+    *data = buffer;
+    *length = total;
+    return true;
+}
+
+
+/*
+ * Atomically replace a file in the state directory with new contents by
+ * writing a temporary file and renaming it over the original.  The temporary
+ * file has a unique name from mkstemp, so that threads or processes
+ * replacing the same file at once each write their own.  Returns true on
+ * success and false on failure, which is reported with putil_err.
+ */
+bool
+pamafs_state_replace(struct pam_args *args, const char *name,
+                     const void *data, size_t length)
+{
+    char *path = NULL;
+    char *temp = NULL;
+    int fd = -1;
+    const char *p = data;
+    ssize_t status;
+    size_t total = 0;
+
+    if (!state_dir_check(args))
+        return false;
+    path = pamafs_state_path(args, name);
+    if (path == NULL)
+        return false;
+    if (asprintf(&temp, "%s.XXXXXX", path) < 0) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        temp = NULL;
+        goto fail;
+    }
+    fd = mkstemp(temp);
+    if (fd < 0) {
+        putil_err(args, "cannot create %s: %s", temp, strerror(errno));
+        free(temp);
+        temp = NULL;
+        goto fail;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    while (total < length) {
+        status = write(fd, p + total, length - total);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status < 0) {
+            putil_err(args, "cannot write to %s: %s", temp, strerror(errno));
+            goto fail;
+        }
+        total += (size_t) status;
+    }
+    if (close(fd) < 0) {
+        fd = -1;
+        putil_err(args, "cannot write to %s: %s", temp, strerror(errno));
+        goto fail;
+    }
+    fd = -1;
+    if (rename(temp, path) < 0) {
+        putil_err(args, "cannot rename %s to %s: %s", temp, path,
+                  strerror(errno));
+        goto fail;
+    }
+    free(temp);
+    free(path);
+    return true;
+
+fail:
+    if (fd >= 0)
+        close(fd);
+    if (temp != NULL) {
+        unlink(temp);
+        free(temp);
+    }
+    free(path);
+    return false;
+}
+
+
+/*
+ * Lock a file opened with pamafs_state_open, waiting for up to timeout
+ * milliseconds for any conflicting lock to be released.  Takes an exclusive
+ * (write) lock if exclusive is true and a shared (read) lock otherwise.  A
+ * timeout of 0 means to try once without waiting.  fcntl locks are used
+ * rather than flock for portability, and polled rather than waited for with
+ * F_SETLKW so that the wait is bounded.  Traditional fcntl locks belong to
+ * the process, so threads wouldn't exclude each other and closing any
+ * descriptor for the file would drop them all; where available, open file
+ * description locks, which belong to the descriptor, are used instead.
+ * Returns true if the lock was obtained and false otherwise; errors other
+ * than a conflicting lock are reported with putil_err.
+ */
+bool
+pamafs_state_lock(struct pam_args *args, int fd, bool exclusive,
+                  long timeout)
+{
+    struct flock lock;
+    struct timespec delay;
+    long waited = 0;
+    long interval = 10;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = exclusive ? F_WRLCK : F_RDLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = 0;
+    lock.l_len = 0;
+    while (fcntl(fd, STATE_SETLK, &lock) < 0) {
+        if (errno == EINTR)
+            continue;
+        if (errno != EACCES && errno != EAGAIN) {
+            putil_err(args, "cannot lock state file: %s", strerror(errno));
+            return false;
+        }
+        if (waited >= timeout)
+            return false;
+
+        /* Back off exponentially up to half a second between attempts. */
+        if (interval > timeout - waited)
+            interval = timeout - waited;
+        delay.tv_sec = interval / 1000;
+        delay.tv_nsec = (interval % 1000) * 1000 * 1000;
+        nanosleep(&delay, NULL);
+        waited += interval;
+        if (interval < 500)
+            interval *= 2;
+    }
+    return true;
+}
+
+
+/*
+ * Remove a file from the state directory.  It's not an error if the file
+ * doesn't exist.
+ */
+void
+pamafs_state_remove(struct pam_args *args, const char *name)
+{
+    char *path;
+
+    path = pamafs_state_path(args, name);
+    if (path == NULL)
+        return;
+    if (unlink(path) < 0 && errno != ENOENT)
+        putil_err(args, "cannot remove %s: %s", path, strerror(errno));
+    free(path);
+}
@@ -0,0 +1,210 @@
+/*
+ * Shared counters and latency histograms.
+ *
+ * If the stats option is set, the module counts logins, the outcome of each
+ * attempt to obtain tokens, the reasons for skipping users, lost PAGs, and
+ * the time taken by aklog in a file in the state directory, for reporting by
+ * pam-afs-session-stat.  The file is mapped into memory the first time it's
+ * needed and stays mapped for the life of the process, and the counters in it
+ * are updated with relaxed atomic increments, so counting costs no system
+ * calls and never waits for another process or thread.  If the file can't be
+ * mapped, the error is reported once and nothing is counted.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+#include <stats.h>
+
+/*
+ * Without the atomic builtins, fall back on ordinary increments.  Counts may
+ * then be lost when processes update them at the same time, but they're
+ * still good enough for trends.
+ */
+#ifdef HAVE_ATOMIC_BUILTINS
+# define STATS_ADD(p, n) __atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+#else
+# define STATS_ADD(p, n) (*(p) += (n))
+#endif
+
+/*
+ * The statistics files mapped so far, one per state directory.  Entries are
+ * only ever added to the front of the list, while holding stats_lock, and
+ * are then published with a release store, so the list can be searched
+ * without locking.  Entries are never removed and the files are never
+ * unmapped, so a mapping can be used without locking once it's been found.
+ * If a file couldn't be mapped, its entry has a NULL map so that we don't
+ * try again for the same directory.  Without the atomic builtins, searching
+ * the list takes stats_lock.
+ */
+struct stats_mapping {
+    struct stats_mapping *next;
+    char *dir;
+    struct pamafs_stats *map;
+};
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_mapping *stats_list = NULL;
+
+
+/*
+ * Claim a newly created statistics file by setting its magic number, or
+ * check the magic number of an existing one.  Returns false if the file has
+ * a different format.
+ */
+static bool
+stats_claim(struct pamafs_stats *stats)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+    uint64_t expected = 0;
+
+    if (__atomic_compare_exchange_n(&stats->magic, &expected,
+                                    PAMAFS_STATS_MAGIC, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        return true;
+    return (expected == PAMAFS_STATS_MAGIC);
+#else
+    if (stats->magic == 0)
+        stats->magic = PAMAFS_STATS_MAGIC;
+    return (stats->magic == PAMAFS_STATS_MAGIC);
+#endif
+}
+
+
+/*
+ * Map the statistics file in the state directory, creating it if needed, and
+ * return the mapping.  Failures are reported with putil_err and return NULL.
+ */
+static struct pamafs_stats *
+stats_open(struct pam_args *args)
+{
+    struct pamafs_stats *stats;
+    size_t length;
+
+    stats = pamafs_state_map(args, PAMAFS_STATS_FILE,
+                             sizeof(struct pamafs_stats), &length);
+    if (stats == NULL)
+        return NULL;
+    if (!stats_claim(stats)) {
+        putil_err(args, "%s has an unknown format, not updating statistics",
+                  PAMAFS_STATS_FILE);
+        munmap((void *) stats, length);
+        return NULL;
+    }
+    return stats;
+}
+
+
+/*
+ * Search a list of mappings for the given state directory.
+ */
+static struct stats_mapping *
+stats_find(struct stats_mapping *mapping, const char *dir)
+{
+    for (; mapping != NULL; mapping = mapping->next)
+        if (strcmp(mapping->dir, dir) == 0)
+            return mapping;
+    return NULL;
+}
+
+
+/*
+ * Return the statistics to update, mapping the file if this is the first
+ * time we've needed it for this state directory, or NULL if statistics
+ * aren't enabled or can't be kept.  Once the file has been mapped, this
+ * doesn't lock.
+ */
+static struct pamafs_stats *
+stats_get(struct pam_args *args)
+{
+    const char *dir = args->config->state_dir;
+    struct stats_mapping *mapping;
+    struct pamafs_stats *stats = NULL;
+
+    if (!args->config->stats || dir == NULL)
+        return NULL;
+#ifdef HAVE_ATOMIC_BUILTINS
+    mapping = stats_find(__atomic_load_n(&stats_list, __ATOMIC_ACQUIRE), dir);
+    if (mapping != NULL)
+        return mapping->map;
+#endif
+
+    /* Not found, so map the file unless another thread just did. */
+    pthread_mutex_lock(&stats_lock);
+    mapping = stats_find(stats_list, dir);
+    if (mapping == NULL) {
+        mapping = calloc(1, sizeof(struct stats_mapping));
+        if (mapping != NULL)
+            mapping->dir = strdup(dir);
+        if (mapping == NULL || mapping->dir == NULL) {
+            putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+            free(mapping);
+            pthread_mutex_unlock(&stats_lock);
+            return NULL;
+        }
+        mapping->map = stats_open(args);
+        mapping->next = stats_list;
+#ifdef HAVE_ATOMIC_BUILTINS
+        __atomic_store_n(&stats_list, mapping, __ATOMIC_RELEASE);
+#else
+        stats_list = mapping;
+#endif
+    }
+    stats = mapping->map;
+    pthread_mutex_unlock(&stats_lock);
+    return stats;
+}
+
+
+/*
+ * Increment one of the counters.
+ */
+void
+pamafs_stats_count(struct pam_args *args, enum pamafs_stat stat)
+{
+    struct pamafs_stats *stats;
+
+    stats = stats_get(args);
+    if (stats == NULL)
+        return;
+    STATS_ADD(&stats->counter[stat], 1);
+}
+
+
+/*
+ * Record a run of aklog or krb5_afslog that started at start, as returned by
+ * pamafs_time_now, in the latency histogram.
+ */
+void
+pamafs_stats_aklog(struct pam_args *args, uint64_t start)
+{
+    struct pamafs_stats *stats;
+    uint64_t now, usec;
+    size_t bucket = 0;
+
+    if (start == 0)
+        return;
+    stats = stats_get(args);
+    if (stats == NULL)
+        return;
+    now = pamafs_time_now();
+    usec = (now > start) ? (now - start) / 1000 : 0;
+    STATS_ADD(&stats->aklog_count, 1);
+    STATS_ADD(&stats->aklog_total_us, usec);
+    while (usec > 0 && bucket < PAMAFS_STATS_BUCKETS - 1) {
+        usec >>= 1;
+        bucket++;
+    }
+    STATS_ADD(&stats->aklog_bucket[bucket], 1);
+}
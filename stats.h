@@ -0,0 +1,71 @@
+/*
+ * Layout of the shared statistics file.
+ *
+ * If the stats option is set, the module counts what it does in a small file
+ * in the state directory that every process using the module maps into
+ * memory and updates with atomic operations.  This header describes the
+ * layout of that file and is shared between the module and the
+ * pam-afs-session-stat program that reports its contents.
+ *
+ * New counters may be added at the end of enum pamafs_stat without changing
+ * the version, since space is reserved for them, but any other change to the
+ * layout requires a new magic number.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef STATS_H
+#define STATS_H 1
+
+#include <config.h>
+#include <portable/system.h>
+
+/* Name of the statistics file in the state directory. */
+#define PAMAFS_STATS_FILE "stats"
+
+/* Magic number and version ("pafstat" followed by the version). */
+#define PAMAFS_STATS_MAGIC 0x7061667374617401ULL
+
+/* Space reserved for counters and the number of histogram buckets. */
+#define PAMAFS_STATS_COUNTERS 64
+#define PAMAFS_STATS_BUCKETS  32
+
+/* The counters.  The names reported for them are in pam-afs-session-stat. */
+enum pamafs_stat {
+    PAMAFS_STAT_LOGINS,         /* Logins a PAG was set up for. */
+    PAMAFS_STAT_CLOSES,         /* Those logins closed again. */
+    PAMAFS_STAT_TOKENS_AKLOG,   /* Tokens obtained with aklog. */
+    PAMAFS_STAT_TOKENS_CACHED,  /* Tokens reused from token_cache. */
+    PAMAFS_STAT_TOKENS_SHARED,  /* Tokens obtained by another session. */
+    PAMAFS_STAT_TOKENS_ASYNC,   /* Tokens obtained in the background. */
+    PAMAFS_STAT_TOKENS_FAILED,  /* aklog failed for at least one cell. */
+    PAMAFS_STAT_TOKENS_NO_SLOT, /* No slot free within aklog_slot_wait. */
+    PAMAFS_STAT_SKIP_NO_AFS,    /* Skipped since AFS isn't available. */
+    PAMAFS_STAT_SKIP_NO_CACHE,  /* Skipped for lack of a ticket cache. */
+    PAMAFS_STAT_SKIP_IGNORED,   /* Skipped for ignore_root or minimum_uid. */
+    PAMAFS_STAT_SKIP_HOMEDIR,   /* Skipped for afs_homedir_only. */
+    PAMAFS_STAT_SKIP_NO_TGT,    /* Skipped for check_tgt. */
+    PAMAFS_STAT_PAG_LOST,       /* PAG apparently lost and recreated. */
+    PAMAFS_STAT_PAG_FAILED,     /* PAG creation failed. */
+    PAMAFS_STAT_MAX
+};
+
+/*
+ * The contents of the statistics file.  All fields are updated atomically
+ * and are only ever incremented.  The aklog latency histogram is bucketed by
+ * powers of two: bucket 0 counts runs that took less than a microsecond and
+ * bucket n counts runs that took at least 2^(n-1) and less than 2^n
+ * microseconds, except that the last bucket also counts anything longer.
+ */
+struct pamafs_stats {
+    uint64_t magic;                             /* PAMAFS_STATS_MAGIC. */
+    uint64_t counter[PAMAFS_STATS_COUNTERS];    /* Indexed by pamafs_stat. */
+    uint64_t aklog_count;                       /* Number of aklog runs. */
+    uint64_t aklog_total_us;                    /* Total time in aklog. */
+    uint64_t aklog_bucket[PAMAFS_STATS_BUCKETS]; /* Latency histogram. */
+};
+
+#endif /* !STATS_H */
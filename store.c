@@ -0,0 +1,260 @@
+/*
+ * Saved tokens for reuse by later sessions.
+ *
+ * If the token_cache option is set, the tokens obtained for a session are
+ * copied out of the cache manager and saved in the state directory, keyed by
+ * UID and the name of the Kerberos ticket cache used to obtain them.  A later
+ * session for the same user with the same ticket cache can then put those
+ * tokens straight into its new PAG instead of running aklog again.  Tokens
+ * obtained by prefetch_tokens are instead saved under a key naming the
+ * user's principal (see async.c), since the ticket cache is usually renamed
+ * between authentication and the session.
+ *
+ * Saved tokens are only used while they are still valid.  If built with
+ * Kerberos support, they are also tied to the ticket-granting ticket in the
+ * cache: they're only reused if the TGT is still the same one (by
+ * authentication time) and hasn't expired.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#ifdef HAVE_KRB5
+# include <portable/krb5.h>
+#endif
+#include <portable/system.h>
+
+#include <errno.h>
+#include <pwd.h>
+#include <time.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+
+/*
+ * Saved tokens must be valid for at least this many seconds to be reused, so
+ * that we don't hand a new session tokens that are about to expire.
+ */
+#define STORE_MARGIN (5 * 60)
+
+/* The header at the start of a saved token file. */
+struct store_header {
+    char magic[4];              /* "PAFS" */
+    uint32_t version;           /* Currently 1. */
+    uint32_t uid;               /* UID the tokens were obtained for. */
+    uint32_t cache_length;      /* Length of the key (ticket cache name). */
+    uint32_t data_length;       /* Length of the token data. */
+    uint32_t pad;               /* Unused, for alignment. */
+    int64_t authtime;           /* Authentication time of the TGT or 0. */
+    int64_t expires;            /* When the saved tokens become unusable. */
+};
+#define STORE_VERSION 1
+
+
+/*
+ * Determine the authentication time and expiration time of the TGT in the
+ * ticket cache, if possible.  Without Kerberos support, always report zero
+ * for both, meaning that only token expiration applies.  Returns false if
+ * the ticket cache doesn't contain a usable TGT.
+ */
+#ifdef HAVE_KRB5
+static bool
+store_tgt(struct pam_args *args, const char *cache, time_t *authtime,
+          time_t *endtime)
+{
+    krb5_error_code ret;
+
+    *authtime = 0;
+    *endtime = 0;
+    if (cache == NULL || cache[0] == '\0' || args->ctx == NULL)
+        return true;
+    ret = pamafs_cache_tgt(args, cache, NULL, authtime, endtime);
+    if (ret != 0) {
+        putil_debug_krb5(args, ret, "cannot find TGT in ticket cache");
+        return false;
+    }
+    return true;
+}
+#else /* !HAVE_KRB5 */
+static bool
+store_tgt(struct pam_args *args UNUSED, const char *cache UNUSED,
+          time_t *authtime, time_t *endtime)
+{
+    *authtime = 0;
+    *endtime = 0;
+    return true;
+}
+#endif /* !HAVE_KRB5 */
+
+
+/*
+ * Save the tokens in the current PAG for the given user and ticket cache,
+ * under the given key or, if it's NULL, under the name of the ticket cache.
+ * Failures are reported but otherwise ignored, since the tokens themselves
+ * were obtained successfully.
+ */
+void
+pamafs_store_save(struct pam_args *args, const struct passwd *pwd,
+                  const char *cache, const char *key)
+{
+    struct pamafs_tokens *tokens = NULL;
+    struct store_header header;
+    char *name = NULL;
+    char *data = NULL;
+    size_t cache_length, length;
+    time_t authtime, endtime;
+
+    if (cache == NULL)
+        cache = "";
+    if (key == NULL)
+        key = cache;
+    if (!store_tgt(args, cache, &authtime, &endtime))
+        return;
+    tokens = pamafs_tokens_read(args);
+    if (tokens == NULL)
+        return;
+    if (tokens->count == 0) {
+        putil_debug(args, "no tokens to save");
+        goto done;
+    }
+    name = pamafs_state_name(args, "tokens", pwd->pw_uid, key);
+    if (name == NULL)
+        goto done;
+
+    /* Build the file contents. */
+    cache_length = strlen(key);
+    length = sizeof(header) + cache_length + tokens->length;
+    data = malloc(length);
+    if (data == NULL) {
+        putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        goto done;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "PAFS", sizeof(header.magic));
+    header.version = STORE_VERSION;
+    header.uid = (uint32_t) pwd->pw_uid;
+    header.cache_length = (uint32_t) cache_length;
+    header.data_length = (uint32_t) tokens->length;
+    header.authtime = authtime;
+    header.expires = tokens->expires;
+    if (endtime != 0 && endtime < tokens->expires)
+        header.expires = endtime;
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + sizeof(header), key, cache_length);
+    memcpy(data + sizeof(header) + cache_length, tokens->data,
+           tokens->length);
+
+    /* Write it out. */
+    if (pamafs_state_replace(args, name, data, length))
+        putil_debug(args, "saved %lu tokens for reuse",
+                    (unsigned long) tokens->count);
+    memset(data, 0, length);
+
+done:
+    free(data);
+    free(name);
+    pamafs_tokens_free(tokens);
+}
+
+
+/*
+ * Look for saved tokens for the given user and ticket cache, under the given
+ * key or the name of the ticket cache if it's NULL, and, if they're still
+ * valid, put them in the current PAG.  Returns true if tokens were restored
+ * and false otherwise (in which case the caller should obtain tokens
+ * normally).  Unusable saved tokens are removed.
+ */
+bool
+pamafs_store_restore(struct pam_args *args, const struct passwd *pwd,
+                     const char *cache, const char *key)
+{
+    struct pamafs_tokens tokens;
+    struct store_header header;
+    char *name, *data;
+    size_t length;
+    time_t now, authtime, endtime;
+    bool okay = false;
+
+    if (cache == NULL)
+        cache = "";
+    if (key == NULL)
+        key = cache;
+    name = pamafs_state_name(args, "tokens", pwd->pw_uid, key);
+    if (name == NULL)
+        return false;
+    if (!pamafs_state_read(args, name, &data, &length)) {
+        free(name);
+        return false;
+    }
+
+    /* Check the header. */
+    if (length < sizeof(header))
+        goto invalid;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, "PAFS", sizeof(header.magic)) != 0
+        || header.version != STORE_VERSION
+        || header.uid != (uint32_t) pwd->pw_uid
+        || header.cache_length != strlen(key)
+        || length != sizeof(header) + header.cache_length + header.data_length
+        || memcmp(data + sizeof(header), key, header.cache_length) != 0)
+        goto invalid;
+
+    /* Check whether the tokens are still usable. */
+    now = time(NULL);
+    if (header.expires - now < STORE_MARGIN) {
+        putil_debug(args, "saved tokens expired or about to expire");
+        goto invalid;
+    }
+    if (!store_tgt(args, cache, &authtime, &endtime))
+        goto invalid;
+    if (header.authtime != authtime) {
+        putil_debug(args, "saved tokens were obtained with a different TGT");
+        goto invalid;
+    }
+
+    /* Put the tokens in the current PAG. */
+    tokens.data = data + sizeof(header) + header.cache_length;
+    tokens.length = header.data_length;
+    if (!pamafs_tokens_check(&tokens) || tokens.count == 0)
+        goto invalid;
+    if (pamafs_tokens_write(args, &tokens)) {
+        putil_debug(args, "reused %lu saved tokens",
+                    (unsigned long) tokens.count);
+        okay = true;
+    }
+    goto done;
+
+invalid:
+    pamafs_state_remove(args, name);
+done:
+    memset(data, 0, length);
+    free(data);
+    free(name);
+    return okay;
+}
+
+
+/*
+ * Remove any saved tokens for the given user and ticket cache, or for the
+ * given key if it's not NULL.  Called when tokens are deleted at the end of a
+ * session, when the ticket cache they came from is destroyed, and when
+ * prefetched tokens have been used.
+ */
+void
+pamafs_store_remove(struct pam_args *args, const struct passwd *pwd,
+                    const char *cache, const char *key)
+{
+    char *name;
+
+    if (key == NULL)
+        key = (cache == NULL) ? "" : cache;
+    name = pamafs_state_name(args, "tokens", pwd->pw_uid, key);
+    if (name == NULL)
+        return;
+    pamafs_state_remove(args, name);
+    free(name);
+}
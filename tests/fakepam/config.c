@@ -465,6 +465,54 @@ parse_options(FILE *script, struct work *work,
 }
 
 
+/*
+ * Parse the environment section of a PAM script.  This consists of zero or
+ * more lines in the format:
+ *
+ *     NAME = value
+ *
+ * where the value may contain whitespace and undergoes %-escape expansion.
+ * Returns the variables as a linked list in the order they were given.
+ */
+static struct variable *
+parse_environment(FILE *script, const struct script_config *config)
+{
+    char *line, *name, *token;
+    size_t length = 0;
+    struct variable *head = NULL;
+    struct variable *current = NULL;
+    struct variable *next;
+
+    for (line = readline(script); line != NULL; line = readline(script)) {
+        length = strlen(line);
+        name = strtok(line, " ");
+        if (name[0] == '[')
+            break;
+        token = strtok(NULL, " ");
+        if (token == NULL || strcmp(token, "=") != 0)
+            bail("malformed environment line near %s", name);
+        token = strtok(NULL, "");
+        if (token == NULL)
+            bail("malformed environment line near %s", name);
+        next = bmalloc(sizeof(struct variable));
+        next->name = bstrdup(name);
+        next->value = expand_string(token, config);
+        next->next = NULL;
+        if (head == NULL)
+            head = next;
+        else
+            current->next = next;
+        current = next;
+        free(line);
+    }
+    if (line != NULL) {
+        free(line);
+        rewind_section(script, length);
+    }
+    return head;
+}
+
+
 /*
  * Parse the call portion of a PAM call in the run section of a PAM script.
  * This handles parsing the PAM flags that optionally may be given as part of
@@ -663,6 +711,8 @@ parse_script(FILE *script, const struct script_config *config)
             bail("line outside of section: %s", line);
         if (strcmp(token, "[options]") == 0)
             parse_options(script, work, config);
+        else if (strcmp(token, "[environment]") == 0)
+            work->environment = parse_environment(script, config);
         else if (strcmp(token, "[run]") == 0)
             work->actions = parse_run(script);
         else if (strcmp(token, "[output]") == 0)
@@ -82,6 +82,13 @@ struct prompts {
     size_t current;
 };
 
+/* A process environment variable to set while running a script. */
+struct variable {
+    char *name;
+    char *value;
+    struct variable *next;
+};
+
 /*
  * Holds the complete set of things that we should do.  Currently, this
  * contains only a linked list of actions.
@@ -91,6 +98,7 @@ struct work {
     struct action *actions;
     struct prompts *prompts;
     struct output *output;
+    struct variable *environment;
 };
 
 BEGIN_DECLS
@@ -265,6 +265,7 @@ run_script(const char *file, const struct script_config *config)
     struct work *work;
     struct options *opts;
     struct action *action, *oaction;
+    struct variable *variable, *ovariable;
     struct pam_conv conv = { NULL, NULL };
     pam_handle_t *pamh;
     int status;
@@ -290,6 +291,12 @@ run_script(const char *file, const struct script_config *config)
         conv.appdata_ptr = work->prompts;
     }
 
+    /* Set any environment variables the script asks for. */
+    for (variable = work->environment; variable != NULL;
+         variable = variable->next)
+        if (setenv(variable->name, variable->value, 1) < 0)
+            sysbail("cannot set environment variable %s", variable->name);
+
     /* Initialize PAM. */
     status = pam_start("test", config->user, &conv, &pamh);
     if (status != PAM_SUCCESS)
@@ -327,6 +334,15 @@ run_script(const char *file, const struct script_config *config)
         action = action->next;
         free(oaction);
     }
+    variable = work->environment;
+    while (variable != NULL) {
+        unsetenv(variable->name);
+        free(variable->name);
+        free(variable->value);
+        ovariable = variable;
+        variable = variable->next;
+        free(ovariable);
+    }
     for (i = 0; i < ARRAY_SIZE(work->options); i++)
         if (work->options[i].argv != NULL) {
             for (j = 0; work->options[i].argv[j] != NULL; j++)
@@ -0,0 +1,253 @@
+/*
+ * Benchmark for the cost of kafs calls against the fake AFS ioctl device.
+ *
+ * Must be run with the fake AFS ioctl device preloaded, as in:
+ *
+ *     LD_PRELOAD=tests/kafs/.libs/fakeafs.so tests/kafs/bench
+ *
+ * Times k_hasafs, k_setpag, k_haspag, k_pioctl (retrieving a token with
+ * VIOCGETTOK), and k_unlog in a loop, so that the overhead of the kafs
+ * backend itself is measured without a cache manager.  Results are written
+ * as JSON with one result per line, giving operations per second, the 50th,
+ * 99th, and 99.9th percentile latency in microseconds, and the number of
+ * opens of the device and system calls per call.  Exits with status 2 on any
+ * error.  This is not run as part of the test suite.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/kafs.h>
+#include <portable/system.h>
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdarg.h>
+#ifdef HAVE_SYS_IOCCOM_H
+# include <sys/ioccom.h>
+#endif
+#include <sys/ioctl.h>
+#include <time.h>
+
+#include <tests/kafs/fakeafs.h>
+
+/* The calls that are timed. */
+enum bench_call {
+    CALL_HASAFS,
+    CALL_SETPAG,
+    CALL_HASPAG,
+    CALL_PIOCTL,
+    CALL_UNLOG,
+    CALL_MAX
+};
+static const char *const call_names[CALL_MAX] = {
+    "k_hasafs", "k_setpag", "k_haspag", "k_pioctl", "k_unlog"
+};
+
+/* Usage message. */
+static const char usage_message[] = "\
+Usage: bench [-n <count>] [-o <output>]\n";
+
+
+/*
+ * Report a fatal error and exit with status 2.
+ */
+static void __attribute__((__noreturn__, __format__(printf, 1, 2)))
+die(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+
+/*
+ * Return the current time on the monotonic clock in nanoseconds.
+ */
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        die("cannot read clock: %s", strerror(errno));
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+
+/*
+ * Comparison function for sorting latencies.
+ */
+static int
+compare_ns(const void *a, const void *b)
+{
+    const uint64_t *x = a;
+    const uint64_t *y = b;
+
+    return (*x > *y) - (*x < *y);
+}
+
+
+/*
+ * Return the given percentile (between 0 and 1) of a sorted array of
+ * latencies in microseconds, using the nearest rank.
+ */
+static double
+percentile(const uint64_t *sorted, size_t count, double p)
+{
+    size_t rank;
+
+    rank = (size_t) (p * (double) count + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > count)
+        rank = count;
+    return (double) sorted[rank - 1] / 1000.0;
+}
+
+
+/*
+ * Store a token in the current PAG for VIOCGETTOK to return.
+ */
+static void
+store_token(void)
+{
+    struct ViceIoctl iob;
+    const char token[] = "bench token";
+
+    memset(&iob, 0, sizeof(iob));
+    iob.in = (char *) token;
+    iob.in_size = sizeof(token);
+    if (k_pioctl(NULL, VIOCSETTOK, &iob, 0) != 0)
+        die("VIOCSETTOK failed: %s", strerror(errno));
+}
+
+
+/*
+ * Make one call, dying if it fails.  The VIOCGETTOK call retrieves the token
+ * stored by store_token.
+ */
+static void
+run_call(enum bench_call call)
+{
+    struct ViceIoctl iob;
+    int32_t index = 0;
+    char buffer[BUFSIZ];
+    int status = 0;
+
+    switch (call) {
+    case CALL_HASAFS:
+        status = k_hasafs() ? 0 : -1;
+        break;
+    case CALL_SETPAG:
+        status = k_setpag();
+        break;
+    case CALL_HASPAG:
+        status = k_haspag() ? 0 : -1;
+        break;
+    case CALL_PIOCTL:
+        memset(&iob, 0, sizeof(iob));
+        iob.in = (char *) &index;
+        iob.in_size = sizeof(index);
+        iob.out = buffer;
+        iob.out_size = sizeof(buffer);
+        status = k_pioctl(NULL, VIOCGETTOK, &iob, 0);
+        break;
+    case CALL_UNLOG:
+        status = k_unlog();
+        break;
+    case CALL_MAX:
+    default:
+        die("unknown call %d", (int) call);
+    }
+    if (status != 0)
+        die("%s failed: %s", call_names[call], strerror(errno));
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct fakeafs_counts *counts;
+    uint64_t *latencies;
+    uint64_t start, total;
+    const char *output_file = NULL;
+    FILE *output = stdout;
+    size_t count = 100000;
+    size_t i;
+    int call, option;
+
+    while ((option = getopt(argc, argv, "hn:o:")) != EOF) {
+        switch (option) {
+        case 'h':
+            printf("%s", usage_message);
+            exit(0);
+        case 'n':
+            count = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            output_file = optarg;
+            break;
+        default:
+            fprintf(stderr, "%s", usage_message);
+            exit(2);
+        }
+    }
+    if (count == 0)
+        die("iteration count must be positive");
+
+    /* Refuse to touch the tokens of a real cache manager. */
+    counts = dlsym(RTLD_DEFAULT, FAKEAFS_COUNTS);
+    if (counts == NULL)
+        die("fake AFS device not loaded with LD_PRELOAD");
+    if (!k_hasafs())
+        die("kafs does not use the AFS ioctl device");
+
+    /* Time each call, reporting the results as they're available. */
+    if (output_file != NULL) {
+        output = fopen(output_file, "w");
+        if (output == NULL)
+            die("cannot create %s: %s", output_file, strerror(errno));
+    }
+    latencies = calloc(count, sizeof(uint64_t));
+    if (latencies == NULL)
+        die("cannot allocate memory: %s", strerror(errno));
+    fprintf(output, "{\n  \"iterations\": %lu,\n  \"results\": [\n",
+            (unsigned long) count);
+    for (call = 0; call < CALL_MAX; call++) {
+        if (call == CALL_PIOCTL)
+            store_token();
+        memset(counts, 0, sizeof(*counts));
+        total = 0;
+        for (i = 0; i < count; i++) {
+            start = now_ns();
+            run_call(call);
+            latencies[i] = now_ns() - start;
+            total += latencies[i];
+        }
+        qsort(latencies, count, sizeof(uint64_t), compare_ns);
+        fprintf(output, "    { \"call\": \"%s\", \"ops_per_sec\": %.1f,"
+                " \"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f,"
+                " \"opens\": %.2f, \"ioctls\": %.2f }%s\n",
+                call_names[call],
+                (total > 0) ? (double) count * 1e9 / (double) total : 0.0,
+                percentile(latencies, count, 0.50),
+                percentile(latencies, count, 0.99),
+                percentile(latencies, count, 0.999),
+                (double) counts->opens / (double) count,
+                (double) counts->ioctls / (double) count,
+                (call < CALL_MAX - 1) ? "," : "");
+    }
+    fprintf(output, "  ]\n}\n");
+    free(latencies);
+    if (output != stdout && fclose(output) != 0)
+        die("cannot write %s: %s", output_file, strerror(errno));
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Test the kafs backend against the fake AFS ioctl device.
+ *
+ * This is the backend program run by the fake-t driver script with fakeafs
+ * preloaded.  It checks the results of k_hasafs, k_haspag, k_setpag,
+ * k_pioctl, and k_unlog against the fake cache manager and, for the kafs
+ * replacement on Linux, that each call opens the device, makes one system
+ * call, and closes it again.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/kafs.h>
+#include <portable/system.h>
+
+#include <dlfcn.h>
+#include <errno.h>
+#ifdef HAVE_SYS_IOCCOM_H
+# include <sys/ioccom.h>
+#endif
+#include <sys/ioctl.h>
+
+#include <tests/kafs/fakeafs.h>
+#include <tests/tap/basic.h>
+
+/* The counts kept by the fake. */
+static struct fakeafs_counts *counts;
+
+
+/*
+ * Check that the last call opened the device once, made one system call,
+ * and closed the device, and then reset the counts.  Only the kafs
+ * replacement is known to do this; other implementations may probe more.
+ */
+static void
+is_calls(const char *call)
+{
+#if defined(HAVE_KAFS_REPLACEMENT) && defined(HAVE_KAFS_LINUX)
+    is_int(1, counts->opens, "...%s opens the device once", call);
+    is_int(1, counts->ioctls, "...makes one system call");
+    is_int(1, counts->closes, "...and closes the device");
+#else
+    skip_block(3, "not using the kafs replacement on Linux");
+#endif
+    memset(counts, 0, sizeof(*counts));
+}
+
+
+/*
+ * Store a token with VIOCSETTOK.
+ */
+static int
+settok(const char *token)
+{
+    struct ViceIoctl iob;
+
+    memset(&iob, 0, sizeof(iob));
+    iob.in = (char *) token;
+    iob.in_size = (short) (strlen(token) + 1);
+    return k_pioctl(NULL, VIOCSETTOK, &iob, 0);
+}
+
+
+/*
+ * Retrieve the token with the given index with VIOCGETTOK into buffer, which
+ * must be BUFSIZ long.
+ */
+static int
+gettok(int32_t index, char *buffer)
+{
+    struct ViceIoctl iob;
+
+    memset(&iob, 0, sizeof(iob));
+    iob.in = (char *) &index;
+    iob.in_size = sizeof(index);
+    iob.out = buffer;
+    iob.out_size = BUFSIZ;
+    return k_pioctl(NULL, VIOCGETTOK, &iob, 0);
+}
+
+
+int
+main(void)
+{
+    char buffer[BUFSIZ];
+
+    counts = dlsym(RTLD_DEFAULT, FAKEAFS_COUNTS);
+    if (counts == NULL)
+        skip_all("fake AFS device not loaded");
+    if (!k_hasafs())
+        skip_all("kafs does not use the AFS ioctl device");
+#ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+#endif
+    plan(33);
+
+    /* Probing for AFS and PAGs. */
+    memset(counts, 0, sizeof(*counts));
+    ok(k_hasafs(), "k_hasafs");
+    is_calls("k_hasafs");
+    is_int(0, k_haspag(), "k_haspag before k_setpag");
+    is_calls("k_haspag");
+    is_int(0, k_setpag(), "k_setpag");
+    is_calls("k_setpag");
+    is_int(1, k_haspag(), "k_haspag after k_setpag");
+    memset(counts, 0, sizeof(*counts));
+
+    /* Storing and retrieving tokens. */
+    is_int(0, settok("token one"), "VIOCSETTOK");
+    is_calls("VIOCSETTOK");
+    is_int(0, settok("token two"), "VIOCSETTOK of a second token");
+    is_int(0, gettok(0, buffer), "VIOCGETTOK");
+    is_string("token one", buffer, "...returns the first token");
+    is_int(0, gettok(1, buffer), "VIOCGETTOK of the second token");
+    is_string("token two", buffer, "...returns the second token");
+    errno = 0;
+    is_int(-1, gettok(2, buffer), "VIOCGETTOK past the last token");
+    is_int(EDOM, errno, "...fails with EDOM");
+    memset(counts, 0, sizeof(*counts));
+
+    /* A new PAG has no tokens, and k_unlog discards them. */
+    is_int(0, k_setpag(), "k_setpag");
+    is_int(-1, gettok(0, buffer), "...and the new PAG has no tokens");
+    is_int(0, settok("token three"), "VIOCSETTOK in the new PAG");
+    memset(counts, 0, sizeof(*counts));
+    is_int(0, k_unlog(), "k_unlog");
+    is_calls("k_unlog");
+    errno = 0;
+    is_int(-1, gettok(0, buffer), "...and the tokens are gone");
+    is_int(EDOM, errno, "...so VIOCGETTOK fails with EDOM");
+    return 0;
+}
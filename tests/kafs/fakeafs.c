@@ -0,0 +1,313 @@
+/*
+ * Fake AFS ioctl device for testing.
+ *
+ * Loaded with LD_PRELOAD, this interposes open, close, and ioctl.  Opening
+ * /proc/fs/openafs/afs_ioctl returns a descriptor for /dev/null that is
+ * remembered as the AFS device, and AFS system calls made with ioctl on that
+ * descriptor are handled by a minimal stand-in for the cache manager: PAGs
+ * can be created and queried, and tokens are kept per PAG as opaque blobs
+ * that can be stored, read back, and discarded.  Everything else is passed
+ * to the real functions.
+ *
+ * This lets the real kafs backends be tested and benchmarked without AFS.
+ * The counts of calls handled are exported as fakeafs_counts for dlsym.
+ * This is not thread-safe.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/kafs.h>
+#include <portable/system.h>
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#ifdef HAVE_SYS_IOCCOM_H
+# include <sys/ioccom.h>
+#endif
+#include <sys/ioctl.h>
+
+#include <tests/kafs/fakeafs.h>
+
+/* The AFS device that we fake and the file that stands in for it. */
+#define FAKE_DEVICE "/proc/fs/openafs/afs_ioctl"
+#define FAKE_STANDIN "/dev/null"
+
+/* The ioctl request used for AFS system calls and the system calls. */
+#define FAKE_REQUEST _IOW('C', 1, void *)
+#define FAKE_PIOCTL  20
+#define FAKE_SETPAG  21
+
+/* The highest descriptor we track and limits on the stored tokens. */
+#define FAKE_FDS        1024
+#define FAKE_TOKENS     16
+#define FAKE_TOKEN_SIZE 2048
+
+/* The PAG of a process not in a PAG. */
+#define FAKE_NO_PAG ((uint32_t) -1)
+
+/*
+ * The arguments to an AFS system call, from the afs/afs_args.h OpenAFS
+ * header and matching kafs/sys-linux.c.
+ */
+struct afsprocdata {
+    long param4;
+    long param3;
+    long param2;
+    long param1;
+    long syscall;
+};
+
+/* A token stored by VIOCSETTOK. */
+struct fake_token {
+    bool used;
+    uint32_t pag;
+    size_t length;
+    char data[FAKE_TOKEN_SIZE];
+};
+
+/* The counts of calls, exported for tests. */
+struct fakeafs_counts fakeafs_counts;
+
+/* The descriptors that refer to the fake device. */
+static bool fake_fds[FAKE_FDS];
+
+/* The current PAG, the number used for the last new one, and the tokens. */
+static uint32_t fake_pag = FAKE_NO_PAG;
+static uint32_t fake_last_pag = 0;
+static struct fake_token fake_tokens[FAKE_TOKENS];
+
+/* The real functions. */
+static int (*real_open)(const char *, int, ...) = NULL;
+static int (*real_open64)(const char *, int, ...) = NULL;
+static int (*real_close)(int) = NULL;
+static int (*real_ioctl)(int, unsigned long, ...) = NULL;
+
+
+/*
+ * Find the next definition of a function, aborting if there isn't one since
+ * there's nothing else useful to do.
+ */
+static void *
+fake_next(const char *name)
+{
+    void *function;
+
+    function = dlsym(RTLD_NEXT, name);
+    if (function == NULL) {
+        fprintf(stderr, "fakeafs: cannot find %s: %s\n", name, dlerror());
+        abort();
+    }
+    return function;
+}
+
+
+/*
+ * Common code for open and open64.  Opens the stand-in for the fake device
+ * and remembers its descriptor, or calls the real function.
+ */
+static int
+fake_open(int (*next)(const char *, int, ...), const char *path, int flags,
+          mode_t mode)
+{
+    int fd;
+
+    if (strcmp(path, FAKE_DEVICE) != 0) {
+        fd = next(path, flags, mode);
+        if (fd >= 0 && fd < FAKE_FDS)
+            fake_fds[fd] = false;
+        return fd;
+    }
+    fakeafs_counts.opens++;
+    fd = next(FAKE_STANDIN, O_RDWR);
+    if (fd >= FAKE_FDS) {
+        real_close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+    if (fd >= 0)
+        fake_fds[fd] = true;
+    return fd;
+}
+
+
+/*
+ * The interposed open functions.  The mode is only present with O_CREAT.
+ */
+int
+open(const char *path, int flags, ...)
+{
+    va_list args;
+    mode_t mode = 0;
+
+    if (real_open == NULL) {
+        real_open = fake_next("open");
+        real_close = fake_next("close");
+    }
+    if (flags & O_CREAT) {
+        va_start(args, flags);
+        mode = (mode_t) va_arg(args, int);
+        va_end(args);
+    }
+    return fake_open(real_open, path, flags, mode);
+}
+
+int
+open64(const char *path, int flags, ...)
+{
+    va_list args;
+    mode_t mode = 0;
+
+    if (real_open64 == NULL) {
+        real_open64 = fake_next("open64");
+        real_close = fake_next("close");
+    }
+    if (flags & O_CREAT) {
+        va_start(args, flags);
+        mode = (mode_t) va_arg(args, int);
+        va_end(args);
+    }
+    return fake_open(real_open64, path, flags, mode);
+}
+
+
+/*
+ * The interposed close, which forgets about a fake device descriptor.
+ */
+int
+close(int fd)
+{
+    if (real_close == NULL)
+        real_close = fake_next("close");
+    if (fd >= 0 && fd < FAKE_FDS && fake_fds[fd]) {
+        fakeafs_counts.closes++;
+        fake_fds[fd] = false;
+    }
+    return real_close(fd);
+}
+
+
+/*
+ * Store a token in the current PAG.  An empty token is rejected with EINVAL,
+ * which k_hasafs relies on.
+ */
+static int
+fake_settok(const struct ViceIoctl *iob)
+{
+    size_t i;
+
+    if (iob->in_size <= 0)
+        return EINVAL;
+    if ((size_t) iob->in_size > FAKE_TOKEN_SIZE)
+        return E2BIG;
+    for (i = 0; i < FAKE_TOKENS; i++)
+        if (!fake_tokens[i].used) {
+            fake_tokens[i].used = true;
+            fake_tokens[i].pag = fake_pag;
+            fake_tokens[i].length = (size_t) iob->in_size;
+            memcpy(fake_tokens[i].data, iob->in, fake_tokens[i].length);
+            return 0;
+        }
+    return ENOSPC;
+}
+
+
+/*
+ * Return the token of the current PAG at the index given in the input, or
+ * fail with EDOM if there aren't that many tokens.
+ */
+static int
+fake_gettok(const struct ViceIoctl *iob)
+{
+    int32_t index;
+    size_t i;
+
+    if (iob->in_size < (short) sizeof(index))
+        return EINVAL;
+    memcpy(&index, iob->in, sizeof(index));
+    for (i = 0; i < FAKE_TOKENS; i++) {
+        if (!fake_tokens[i].used || fake_tokens[i].pag != fake_pag)
+            continue;
+        if (index-- > 0)
+            continue;
+        if (iob->out_size < 0
+            || (size_t) iob->out_size < fake_tokens[i].length)
+            return E2BIG;
+        memcpy(iob->out, fake_tokens[i].data, fake_tokens[i].length);
+        return 0;
+    }
+    return EDOM;
+}
+
+
+/*
+ * Handle a pioctl, returning 0 on success or an errno value on failure.
+ */
+static int
+fake_pioctl(int cmd, const struct ViceIoctl *iob)
+{
+    size_t i;
+
+    if (iob == NULL)
+        return EFAULT;
+    if (cmd == (int) VIOCSETTOK)
+        return fake_settok(iob);
+    else if (cmd == (int) VIOCGETTOK)
+        return fake_gettok(iob);
+    else if (cmd == (int) VIOCUNLOG) {
+        for (i = 0; i < FAKE_TOKENS; i++)
+            if (fake_tokens[i].pag == fake_pag)
+                fake_tokens[i].used = false;
+        return 0;
+    } else if (cmd == (int) VIOC_GETPAG) {
+        if (iob->out_size < (short) sizeof(fake_pag))
+            return EINVAL;
+        memcpy(iob->out, &fake_pag, sizeof(fake_pag));
+        return 0;
+    }
+    return EINVAL;
+}
+
+
+/*
+ * The interposed ioctl.  AFS system calls on the fake device are handled by
+ * the fake and everything else is passed to the real function.
+ */
+int
+ioctl(int fd, unsigned long request, ...)
+{
+    va_list args;
+    void *arg;
+    struct afsprocdata *data;
+    int status = EINVAL;
+
+    va_start(args, request);
+    arg = va_arg(args, void *);
+    va_end(args);
+    if (fd < 0 || fd >= FAKE_FDS || !fake_fds[fd]) {
+        if (real_ioctl == NULL)
+            real_ioctl = fake_next("ioctl");
+        return real_ioctl(fd, request, arg);
+    }
+    if (request == (unsigned long) FAKE_REQUEST) {
+        fakeafs_counts.ioctls++;
+        data = arg;
+        if (data->syscall == FAKE_PIOCTL)
+            status = fake_pioctl((int) data->param2,
+                                 (struct ViceIoctl *) data->param3);
+        else if (data->syscall == FAKE_SETPAG) {
+            fake_pag = ('A' << 24) | ++fake_last_pag;
+            status = 0;
+        }
+    }
+    if (status != 0) {
+        errno = status;
+        return -1;
+    }
+    return 0;
+}
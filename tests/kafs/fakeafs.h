@@ -0,0 +1,50 @@
+/*
+ * Interface to the fake AFS ioctl device used for testing.
+ *
+ * fakeafs is a shared object meant to be loaded with LD_PRELOAD.  It
+ * interposes open, close, and ioctl so that /proc/fs/openafs/afs_ioctl is
+ * handled by a minimal local stand-in for the cache manager, which lets the
+ * real kafs backends be tested and benchmarked on systems without AFS.
+ * Programs find the counts of calls it handled with dlsym, which fails if
+ * the fake wasn't preloaded.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef TESTS_KAFS_FAKEAFS_H
+#define TESTS_KAFS_FAKEAFS_H 1
+
+/* The pioctls supported by the fake, if not already provided by kafs.h. */
+#ifndef _VICEIOCTL
+# define _VICEIOCTL(id) _IOW('V', (id), struct ViceIoctl)
+#endif
+#ifndef _CVICEIOCTL
+# define _CVICEIOCTL(id) _IOW('C', (id), struct ViceIoctl)
+#endif
+#ifndef VIOCSETTOK
+# define VIOCSETTOK _VICEIOCTL(3)
+#endif
+#ifndef VIOCGETTOK
+# define VIOCGETTOK _VICEIOCTL(8)
+#endif
+#ifndef VIOCUNLOG
+# define VIOCUNLOG _VICEIOCTL(9)
+#endif
+#ifndef VIOC_GETPAG
+# define VIOC_GETPAG _CVICEIOCTL(13)
+#endif
+
+/* The name of the counts exported by the fake, for dlsym. */
+#define FAKEAFS_COUNTS "fakeafs_counts"
+
+/* Counts of the calls handled by the fake, which tests may reset. */
+struct fakeafs_counts {
+    unsigned long opens;        /* Opens of the ioctl device. */
+    unsigned long ioctls;       /* AFS system calls through the device. */
+    unsigned long closes;       /* Closes of the ioctl device. */
+};
+
+#endif /* !TESTS_KAFS_FAKEAFS_H */
@@ -0,0 +1,143 @@
+/*
+ * Test the interface for using the token handling without PAM.
+ *
+ * Starts several operations at once, waits for them with poll, and checks
+ * that tokens obtained in the worker's PAG can be put into ours, that users
+ * the PAM module would skip are skipped, and that failures are reported.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <poll.h>
+#include <pwd.h>
+#include <time.h>
+
+#include <pamafs.h>
+#include <tests/module/util.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+/* Provided by the fake kafs library. */
+extern bool fakekafs_token;
+extern time_t fakekafs_token_expires;
+extern int fakekafs_settok;
+
+/* How many acquisitions to run at once. */
+#define COUNT 3
+
+
+/*
+ * Wait for up to ten seconds for an operation's file descriptor to become
+ * readable.  Returns true if it did.
+ */
+static bool
+wait_for(struct pamafs_op *op)
+{
+    struct pollfd pfd;
+
+    pfd.fd = pamafs_op_fd(op);
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 10 * 1000) == 1;
+}
+
+
+int
+main(void)
+{
+    struct passwd *user;
+    struct pamafs_op *ops[COUNT];
+    struct pamafs_op *op;
+    char *aklog, *program, *cache, *minimum;
+    const char *argv[] = { NULL, NULL, NULL };
+    int i, okay;
+
+    plan(13);
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        bail("cannot find username of current user");
+    aklog = test_file_path("data/fake-aklog");
+    if (aklog == NULL)
+        bail("cannot find fake-aklog");
+    basprintf(&program, "program=%s", aklog);
+    argv[0] = program;
+    cache = module_cache("krb5cc_test", time(NULL) + 3600);
+
+    /*
+     * The fake aklog can't change the token state of the worker, so start
+     * with a token that the workers will inherit and pass back.
+     */
+    fakekafs_token = true;
+    fakekafs_token_expires = time(NULL) + 3600;
+    unlink("aklog-args");
+    for (i = 0; i < COUNT; i++)
+        ops[i] = pamafs_acquire_start(user->pw_name, cache, 1, argv);
+    okay = 0;
+    for (i = 0; i < COUNT; i++)
+        if (ops[i] != NULL && wait_for(ops[i]))
+            if (pamafs_op_finish(ops[i]) == 0)
+                okay++;
+    is_int(COUNT, okay, "all acquisitions succeeded");
+    ok(access("aklog-args", F_OK) == 0, "...and aklog was run");
+    is_int(0, pamafs_op_finish(ops[0]), "...and finishing again is harmless");
+
+    /* Tokens from the worker can be installed in our PAG. */
+    fakekafs_token = false;
+    fakekafs_settok = 0;
+    is_int(0, pamafs_op_install(ops[0]), "install tokens");
+    ok(fakekafs_token, "...and we have tokens");
+    is_int(1, fakekafs_settok, "...stored with one VIOCSETTOK");
+    for (i = 0; i < COUNT; i++)
+        pamafs_op_free(ops[i]);
+
+    /* Deleting tokens. */
+    op = pamafs_delete_start(user->pw_name, cache, 1, argv);
+    ok(op != NULL && wait_for(op), "delete finishes");
+    is_int(0, pamafs_op_finish(op), "...and succeeds");
+    pamafs_op_free(op);
+
+    /*
+     * Users the PAM module would skip are skipped here too, which succeeds
+     * without running aklog and leaves no tokens to install.
+     */
+    unlink("aklog-args");
+    basprintf(&minimum, "minimum_uid=%lu", (unsigned long) user->pw_uid + 1);
+    argv[1] = minimum;
+    fakekafs_settok = 0;
+    op = pamafs_acquire_start(user->pw_name, cache, 2, argv);
+    if (op == NULL)
+        bail("cannot start acquiring tokens");
+    is_int(0, pamafs_op_finish(op), "skipped user");
+    ok(access("aklog-args", F_OK) < 0, "...without running aklog");
+    ok(pamafs_op_install(op) == 0 && fakekafs_settok == 0,
+       "...and with no tokens to install");
+    pamafs_op_free(op);
+    argv[1] = NULL;
+    free(minimum);
+
+    /* A failing aklog is reported and leaves nothing to install. */
+    free(program);
+    basprintf(&program, "program=%s", "/bin/false");
+    argv[0] = program;
+    op = pamafs_acquire_start(user->pw_name, cache, 1, argv);
+    if (op == NULL)
+        bail("cannot start acquiring tokens");
+    is_int(-1, pamafs_op_finish(op), "failing aklog");
+    is_int(-1, pamafs_op_install(op), "...and nothing to install");
+    pamafs_op_free(op);
+
+    /* Clean up. */
+    unlink("aklog-args");
+    module_cache_free(cache);
+    free(program);
+    test_file_path_free(aklog);
+    return 0;
+}
@@ -0,0 +1,208 @@
+/*
+ * Test obtaining tokens in the background.
+ *
+ * Uses a fake aklog that sleeps for a configurable length of time and checks
+ * that opening a session with async_tokens set returns immediately, that the
+ * status file reports when tokens have been obtained, that it's only put in
+ * the user's runtime directory if no one else can write there, and that
+ * closing the session while tokens are still being obtained stops the
+ * background process.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <pwd.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <tests/fakepam/pam.h>
+#include <tests/module/util.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Read the contents of a status file into a static buffer.  Returns the
+ * empty string if it can't be read.
+ */
+static const char *
+read_status(const char *path)
+{
+    static char buffer[BUFSIZ];
+    FILE *file;
+    size_t length = 0;
+
+    file = fopen(path, "r");
+    if (file != NULL) {
+        length = fread(buffer, 1, sizeof(buffer) - 1, file);
+        fclose(file);
+    }
+    buffer[length] = '\0';
+    return buffer;
+}
+
+
+/*
+ * Wait up to ten seconds for a status file to no longer say pending and
+ * return its contents.
+ */
+static const char *
+wait_status(const char *path)
+{
+    int i;
+
+    for (i = 0; i < 100; i++) {
+        if (strcmp(read_status(path), "pending\n") != 0)
+            break;
+        usleep(100 * 1000);
+    }
+    return read_status(path);
+}
+
+
+/*
+ * Open a session with the given runtime directory and with aklog sleeping
+ * for the given number of seconds, check that it returned right away, and
+ * return the PAM handle.  Stores a copy of the path to the status file in
+ * status.
+ */
+static pam_handle_t *
+open_session(struct passwd *user, const char *runtime, const char **argv,
+             const char *sleep, char **status)
+{
+    pam_handle_t *pamh;
+    const char *path;
+    char *env;
+    time_t start;
+    int pamret;
+
+    pamh = module_start(user, "krb5cc_test");
+    basprintf(&env, "AKLOG_SLEEP=%s", sleep);
+    if (pam_putenv(pamh, env) != PAM_SUCCESS)
+        sysbail("cannot set PAM environment variable");
+    free(env);
+    basprintf(&env, "XDG_RUNTIME_DIR=%s", runtime);
+    if (pam_putenv(pamh, env) != PAM_SUCCESS)
+        sysbail("cannot set PAM environment variable");
+    free(env);
+    start = time(NULL);
+    pamret = pam_sm_open_session(pamh, 0, 3, argv);
+    is_int(PAM_SUCCESS, pamret, "open session with %ss aklog", sleep);
+    ok(time(NULL) - start < 2, "...without waiting for aklog");
+    path = pam_getenv(pamh, "AFS_TOKEN_STATUS");
+    ok(path != NULL, "...and status file is set");
+    *status = bstrdup(path == NULL ? "" : path);
+    is_string("pending\n", read_status(*status), "...and pending");
+    return pamh;
+}
+
+
+int
+main(void)
+{
+    struct passwd *user;
+    pam_handle_t *pamh, *other;
+    char *aklog, *tmpdir, *program, *state, *status, *status2, *runtime;
+    char *prefix;
+    const char *argv[] = { NULL, NULL, "async_tokens", NULL };
+
+#ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+#endif
+    plan(30);
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        bail("cannot find username of current user");
+    pam_set_pwd(user);
+
+    /* Set up the module arguments. */
+    aklog = test_file_path("data/fake-aklog-slow");
+    tmpdir = test_tmpdir();
+    basprintf(&program, "program=%s", aklog);
+    basprintf(&state, "state_dir=%s/state", tmpdir);
+    argv[0] = program;
+    argv[1] = state;
+
+    /*
+     * The status file is in the user's runtime directory, where they can
+     * read it, and reports success once aklog finishes.
+     */
+    basprintf(&runtime, "%s/runtime", tmpdir);
+    if (mkdir(runtime, 0700) < 0)
+        sysbail("cannot create %s", runtime);
+    basprintf(&prefix, "%s/afs-status-", runtime);
+    pamh = open_session(user, runtime, argv, "1", &status);
+    ok(strncmp(status, prefix, strlen(prefix)) == 0,
+       "...in the runtime directory");
+    is_string("success\n", wait_status(status), "tokens obtained");
+    is_int(PAM_SUCCESS, pam_sm_close_session(pamh, 0, 3, argv),
+           "close session");
+    ok(access(status, F_OK) < 0, "...and status file was removed");
+    pam_end(pamh, 0);
+    free(status);
+
+    /*
+     * Closing the session while aklog is still running stops it, so the
+     * status file doesn't reappear when aklog would have finished.
+     */
+    pamh = open_session(user, runtime, argv, "2", &status);
+    is_int(PAM_SUCCESS, pam_sm_close_session(pamh, 0, 3, argv),
+           "close session while pending");
+    pam_end(pamh, 0);
+    sleep(3);
+    ok(access(status, F_OK) < 0, "...and background process was stopped");
+    free(status);
+
+    /* Two sessions in the same process get separate status files. */
+    pamh = open_session(user, runtime, argv, "1", &status);
+    other = open_session(user, runtime, argv, "1", &status2);
+    ok(strcmp(status, status2) != 0, "sessions have separate status files");
+    is_string("success\n", wait_status(status), "...first succeeded");
+    is_string("success\n", wait_status(status2), "...second succeeded");
+    pam_sm_close_session(pamh, 0, 3, argv);
+    pam_sm_close_session(other, 0, 3, argv);
+    pam_end(pamh, 0);
+    pam_end(other, 0);
+    free(status);
+    free(status2);
+
+    /*
+     * If others can write to the runtime directory, only the status file in
+     * the state directory is kept.
+     */
+    free(prefix);
+    basprintf(&prefix, "%s/state/async-", tmpdir);
+    if (chmod(runtime, 01777) < 0)
+        sysbail("cannot chmod %s", runtime);
+    pamh = open_session(user, runtime, argv, "0", &status);
+    ok(strncmp(status, prefix, strlen(prefix)) == 0,
+       "...in the state directory if the runtime directory is shared");
+    wait_status(status);
+    pam_sm_close_session(pamh, 0, 3, argv);
+    pam_end(pamh, 0);
+    free(status);
+
+    /* Clean up. */
+    unlink("aklog-runs");
+    rmdir("aklog-running");
+    rmdir(runtime);
+    free(runtime);
+    free(prefix);
+    free(program);
+    free(state);
+    basprintf(&state, "%s/state", tmpdir);
+    module_state_remove(state);
+    free(state);
+    test_tmpdir_free(tmpdir);
+    test_file_path_free(aklog);
+    return 0;
+}
@@ -0,0 +1,407 @@
+/*
+ * Benchmark for the cost of PAM calls into pam-afs-session.
+ *
+ * Runs sessions through pam_sm_setcred, pam_sm_open_session, and
+ * pam_sm_close_session in a loop using the fake PAM and kafs libraries, so
+ * that only the cost of the module itself and of running aklog is measured.
+ * Tokens are obtained by running an external program (by default /bin/true,
+ * set with -a) and, if built with krb5_afslog support, separately through
+ * the fake krb5_afslog functions.
+ *
+ * Results are written as JSON with one result per line, giving operations
+ * per second and the 50th, 99th, and 99.9th percentile latency in
+ * microseconds for each PAM call and for the whole session.  If a baseline
+ * written by an earlier run is given with -b, each result is compared with
+ * it, and the program exits with status 1 if operations per second dropped
+ * or the median or 99th percentile latency rose by more than the tolerance
+ * (20% by default, set with -t).  Exits with status 2 on any other error.
+ *
+ * Any arguments after the options are passed to the module as PAM options.
+ * This is not run as part of the test suite.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <pwd.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include <tests/fakepam/pam.h>
+
+/* The calls that are timed, with the whole session last. */
+enum bench_call {
+    CALL_SETCRED,
+    CALL_OPEN,
+    CALL_CLOSE,
+    CALL_SESSION,
+    CALL_MAX
+};
+static const char *const call_names[CALL_MAX] = {
+    "setcred", "open_session", "close_session", "session"
+};
+
+/* The summary of the latencies of one call. */
+struct bench_result {
+    char path[16];
+    char call[32];
+    double ops_per_sec;
+    double p50_us;
+    double p99_us;
+    double p999_us;
+};
+
+/* Usage message. */
+static const char usage_message[] = "\
+Usage: bench [-n <count>] [-a <aklog>] [-o <output>] [-b <baseline>]\n\
+             [-t <percent>] [<module-option> ...]\n";
+
+
+/*
+ * Report a fatal error and exit with status 2.
+ */
+static void __attribute__((__noreturn__, __format__(printf, 1, 2)))
+die(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+
+/*
+ * Return the current time on the monotonic clock in nanoseconds.
+ */
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        die("cannot read clock: %s", strerror(errno));
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+
+/*
+ * Comparison function for sorting latencies.
+ */
+static int
+compare_ns(const void *a, const void *b)
+{
+    const uint64_t *x = a;
+    const uint64_t *y = b;
+
+    return (*x > *y) - (*x < *y);
+}
+
+
+/*
+ * Return the given percentile (between 0 and 1) of a sorted array of
+ * latencies in microseconds, using the nearest rank.
+ */
+static double
+percentile(const uint64_t *sorted, size_t count, double p)
+{
+    size_t rank;
+
+    rank = (size_t) (p * (double) count + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > count)
+        rank = count;
+    return (double) sorted[rank - 1] / 1000.0;
+}
+
+
+/*
+ * Summarize the latencies of one call, sorting them in place.
+ */
+static void
+summarize(struct bench_result *result, const char *path, enum bench_call call,
+          uint64_t *latencies, size_t count)
+{
+    uint64_t total = 0;
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        total += latencies[i];
+    qsort(latencies, count, sizeof(uint64_t), compare_ns);
+    memset(result, 0, sizeof(*result));
+    strlcpy(result->path, path, sizeof(result->path));
+    strlcpy(result->call, call_names[call], sizeof(result->call));
+    if (total > 0)
+        result->ops_per_sec = (double) count * 1e9 / (double) total;
+    result->p50_us = percentile(latencies, count, 0.50);
+    result->p99_us = percentile(latencies, count, 0.99);
+    result->p999_us = percentile(latencies, count, 0.999);
+}
+
+
+/*
+ * Run count sessions for the given user with the given module options and
+ * summarize the latency of each call into results, which must have room for
+ * CALL_MAX results.  path is the name of the way tokens are obtained.
+ */
+static void
+run_bench(struct passwd *user, const char *path, size_t count, int argc,
+          const char **argv, struct bench_result *results)
+{
+    pam_handle_t *pamh;
+    struct pam_conv conv = { NULL, NULL };
+    uint64_t *latencies[CALL_MAX];
+    uint64_t start, t_setcred, t_open, t_close;
+    size_t i;
+    int call, status;
+
+    for (call = 0; call < CALL_MAX; call++) {
+        latencies[call] = calloc(count, sizeof(uint64_t));
+        if (latencies[call] == NULL)
+            die("cannot allocate memory: %s", strerror(errno));
+    }
+    for (i = 0; i < count; i++) {
+        if (pam_start("bench", user->pw_name, &conv, &pamh) != PAM_SUCCESS)
+            die("cannot create PAM handle");
+        if (pam_putenv(pamh, "KRB5CCNAME=krb5cc_bench") != PAM_SUCCESS)
+            die("cannot set PAM environment variable");
+        start = now_ns();
+        status = pam_sm_setcred(pamh, PAM_ESTABLISH_CRED, argc, argv);
+        t_setcred = now_ns();
+        if (status != PAM_SUCCESS)
+            die("pam_sm_setcred failed with status %d", status);
+        status = pam_sm_open_session(pamh, 0, argc, argv);
+        t_open = now_ns();
+        if (status != PAM_SUCCESS)
+            die("pam_sm_open_session failed with status %d", status);
+        status = pam_sm_close_session(pamh, 0, argc, argv);
+        t_close = now_ns();
+        if (status != PAM_SUCCESS)
+            die("pam_sm_close_session failed with status %d", status);
+        pam_end(pamh, 0);
+        pam_output_free(pam_output());
+        latencies[CALL_SETCRED][i] = t_setcred - start;
+        latencies[CALL_OPEN][i] = t_open - t_setcred;
+        latencies[CALL_CLOSE][i] = t_close - t_open;
+        latencies[CALL_SESSION][i] = t_close - start;
+    }
+    for (call = 0; call < CALL_MAX; call++) {
+        summarize(&results[call], path, call, latencies[call], count);
+        free(latencies[call]);
+    }
+}
+
+
+/*
+ * Write the results as JSON, one result per line so that they can be read
+ * back as a baseline by read_baseline.
+ */
+static void
+write_results(FILE *output, size_t count, const struct bench_result *results,
+              size_t nresults)
+{
+    size_t i;
+
+    fprintf(output, "{\n  \"iterations\": %lu,\n  \"results\": [\n",
+            (unsigned long) count);
+    for (i = 0; i < nresults; i++)
+        fprintf(output, "    { \"path\": \"%s\", \"call\": \"%s\","
+                " \"ops_per_sec\": %.1f, \"p50_us\": %.1f,"
+                " \"p99_us\": %.1f, \"p999_us\": %.1f }%s\n",
+                results[i].path, results[i].call, results[i].ops_per_sec,
+                results[i].p50_us, results[i].p99_us, results[i].p999_us,
+                (i + 1 < nresults) ? "," : "");
+    fprintf(output, "  ]\n}\n");
+}
+
+
+/*
+ * Read results from a baseline file written by write_results.  Returns the
+ * results in a newly allocated array and stores their number in count.
+ * Lines that aren't results are ignored.
+ */
+static struct bench_result *
+read_baseline(const char *file, size_t *count)
+{
+    FILE *input;
+    char line[BUFSIZ];
+    struct bench_result result;
+    struct bench_result *results = NULL;
+    int n;
+
+    input = fopen(file, "r");
+    if (input == NULL)
+        die("cannot open baseline %s: %s", file, strerror(errno));
+    *count = 0;
+    while (fgets(line, sizeof(line), input) != NULL) {
+        memset(&result, 0, sizeof(result));
+        n = sscanf(line, " { \"path\": \"%15[^\"]\", \"call\": \"%31[^\"]\","
+                   " \"ops_per_sec\": %lf, \"p50_us\": %lf, \"p99_us\": %lf,"
+                   " \"p999_us\": %lf", result.path, result.call,
+                   &result.ops_per_sec, &result.p50_us, &result.p99_us,
+                   &result.p999_us);
+        if (n != 6)
+            continue;
+        results = reallocarray(results, *count + 1, sizeof(result));
+        if (results == NULL)
+            die("cannot allocate memory: %s", strerror(errno));
+        results[*count] = result;
+        (*count)++;
+    }
+    fclose(input);
+    return results;
+}
+
+
+/*
+ * Compare results with a baseline, reporting each regression to standard
+ * error.  tolerance is the allowed relative change.  Returns the number of
+ * regressions found.
+ */
+static int
+compare_baseline(const struct bench_result *results, size_t nresults,
+                 const struct bench_result *baseline, size_t nbaseline,
+                 double tolerance)
+{
+    const struct bench_result *new, *old;
+    size_t i, j;
+    int regressions = 0;
+
+    for (i = 0; i < nresults; i++) {
+        new = &results[i];
+        old = NULL;
+        for (j = 0; j < nbaseline; j++)
+            if (strcmp(new->path, baseline[j].path) == 0
+                && strcmp(new->call, baseline[j].call) == 0)
+                old = &baseline[j];
+        if (old == NULL)
+            continue;
+        if (new->ops_per_sec < old->ops_per_sec * (1 - tolerance)) {
+            fprintf(stderr, "%s %s: %.1f ops/sec, baseline %.1f\n",
+                    new->path, new->call, new->ops_per_sec,
+                    old->ops_per_sec);
+            regressions++;
+        }
+        if (new->p50_us > old->p50_us * (1 + tolerance)) {
+            fprintf(stderr, "%s %s: p50 %.1fus, baseline %.1fus\n",
+                    new->path, new->call, new->p50_us, old->p50_us);
+            regressions++;
+        }
+        if (new->p99_us > old->p99_us * (1 + tolerance)) {
+            fprintf(stderr, "%s %s: p99 %.1fus, baseline %.1fus\n",
+                    new->path, new->call, new->p99_us, old->p99_us);
+            regressions++;
+        }
+    }
+    return regressions;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct passwd *user;
+    struct bench_result results[2 * CALL_MAX];
+    struct bench_result *baseline;
+    const char **options;
+    const char *aklog = "/bin/true";
+    const char *output_file = NULL;
+    const char *baseline_file = NULL;
+    char *program;
+    FILE *output = stdout;
+    size_t count = 1000;
+    size_t nresults, nbaseline;
+    double tolerance = 0.20;
+    int option, i, noptions;
+
+    while ((option = getopt(argc, argv, "a:b:hn:o:t:")) != EOF) {
+        switch (option) {
+        case 'a':
+            aklog = optarg;
+            break;
+        case 'b':
+            baseline_file = optarg;
+            break;
+        case 'h':
+            printf("%s", usage_message);
+            exit(0);
+        case 'n':
+            count = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            output_file = optarg;
+            break;
+        case 't':
+            tolerance = strtod(optarg, NULL) / 100;
+            break;
+        default:
+            fprintf(stderr, "%s", usage_message);
+            exit(2);
+        }
+    }
+    if (count == 0)
+        die("iteration count must be positive");
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        die("cannot find username of current user");
+    pam_set_pwd(user);
+
+    /* Build the module options, leaving room for program. */
+    noptions = argc - optind;
+    options = calloc((size_t) noptions + 2, sizeof(const char *));
+    if (options == NULL)
+        die("cannot allocate memory: %s", strerror(errno));
+    for (i = 0; i < noptions; i++)
+        options[i + 1] = argv[optind + i];
+
+    /* Obtain tokens by running a program. */
+    if (asprintf(&program, "program=%s", aklog) < 0)
+        die("cannot allocate memory: %s", strerror(errno));
+    options[0] = program;
+    run_bench(user, "aklog", count, noptions + 1, options, results);
+    nresults = CALL_MAX;
+    free(program);
+
+    /* Obtain tokens with krb5_afslog if we can. */
+#if defined(HAVE_KRB5) && defined(HAVE_KRB5_AFSLOG)
+    run_bench(user, "afslog", count, noptions, options + 1,
+              results + nresults);
+    nresults += CALL_MAX;
+#endif
+
+    /* Report the results and compare them with the baseline. */
+    if (output_file != NULL) {
+        output = fopen(output_file, "w");
+        if (output == NULL)
+            die("cannot create %s: %s", output_file, strerror(errno));
+    }
+    write_results(output, count, results, nresults);
+    if (output != stdout && fclose(output) != 0)
+        die("cannot write %s: %s", output_file, strerror(errno));
+    free(options);
+    if (baseline_file != NULL) {
+        baseline = read_baseline(baseline_file, &nbaseline);
+        if (nbaseline == 0)
+            die("no results found in baseline %s", baseline_file);
+        i = compare_baseline(results, nresults, baseline, nbaseline,
+                             tolerance);
+        free(baseline);
+        if (i > 0) {
+            fprintf(stderr, "%d regressions against %s\n", i, baseline_file);
+            exit(1);
+        }
+    }
+    return 0;
+}
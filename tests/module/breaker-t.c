@@ -0,0 +1,148 @@
+/*
+ * Test the circuit breaker for cells that keep failing.
+ *
+ * Uses a fake aklog that fails for a cell on demand and records each time it
+ * was run, and checks that a failing cell is skipped after repeated failures
+ * that point to a problem with the cell but not after failures specific to
+ * the user, that a single session checks whether it recovered after the skip
+ * period, and that it's used normally again once it has.  Also checks that
+ * the aklog_homedir arguments are only passed to one of the aklog runs.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <pwd.h>
+
+#include <tests/fakepam/pam.h>
+#include <tests/module/util.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+/* The marker file that makes the fake aklog fail for the bad cell. */
+#define FAIL_FILE "aklog-fail-bad.example.com"
+
+/* The aklog runs expected when both cells or only the good cell are tried. */
+#define RUN_BOTH "-c good.example.com\n-c bad.example.com\n"
+#define RUN_GOOD "-c good.example.com\n"
+
+
+/*
+ * Open and close a session for the given user and check that the fake aklog
+ * was run with the expected arguments.
+ */
+static void
+check_session(struct passwd *user, const char **argv, const char *expected,
+              const char *message)
+{
+    pam_handle_t *pamh;
+    char buffer[BUFSIZ];
+    FILE *runs;
+    size_t length = 0;
+    int argc;
+
+    for (argc = 0; argv[argc] != NULL; argc++)
+        ;
+    unlink("aklog-runs");
+    pamh = module_start(user, "krb5cc_test");
+    if (pam_sm_open_session(pamh, 0, argc, argv) != PAM_SUCCESS)
+        diag("open session failed");
+    pam_end(pamh, 0);
+    runs = fopen("aklog-runs", "r");
+    if (runs != NULL) {
+        length = fread(buffer, 1, sizeof(buffer) - 1, runs);
+        fclose(runs);
+    }
+    buffer[length] = '\0';
+    is_string(expected, buffer, "%s", message);
+}
+
+
+int
+main(void)
+{
+    struct passwd *user;
+    FILE *marker;
+    char *aklog, *tmpdir, *program, *state, *expected;
+    const char *argv[] = {
+        NULL, NULL, "afs_cells=good.example.com,bad.example.com",
+        "cell_breaker=2", "cell_breaker_time=1", NULL, NULL
+    };
+
+#ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+#endif
+    plan(11);
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        bail("cannot find username of current user");
+    pam_set_pwd(user);
+
+    /* Set up the module arguments. */
+    aklog = test_file_path("data/fake-aklog-fail");
+    tmpdir = test_tmpdir();
+    basprintf(&program, "program=%s", aklog);
+    basprintf(&state, "state_dir=%s/state", tmpdir);
+    argv[0] = program;
+    argv[1] = state;
+
+    /*
+     * Failures specific to the user, here the aklog status for a Kerberos
+     * error, don't count toward skipping the cell.
+     */
+    marker = fopen(FAIL_FILE, "w");
+    if (marker == NULL)
+        sysbail("cannot create %s", FAIL_FILE);
+    fprintf(marker, "4\n");
+    fclose(marker);
+    check_session(user, argv, RUN_BOTH, "first user failure");
+    check_session(user, argv, RUN_BOTH, "second user failure");
+    check_session(user, argv, RUN_BOTH, "...and cell is not skipped");
+
+    /* Make one of the cells fail with an AFS error. */
+    marker = fopen(FAIL_FILE, "w");
+    if (marker == NULL)
+        sysbail("cannot create %s", FAIL_FILE);
+    fclose(marker);
+
+    /* Both cells are tried until the bad one has failed twice. */
+    check_session(user, argv, RUN_BOTH, "first failure");
+    check_session(user, argv, RUN_BOTH, "second failure");
+    check_session(user, argv, RUN_GOOD, "failing cell is skipped");
+
+    /* After the skip period, one session tries again, and fails. */
+    sleep(2);
+    check_session(user, argv, RUN_BOTH, "failing cell is checked");
+    check_session(user, argv, RUN_GOOD, "...and skipped again");
+
+    /* Once the cell works again, the next check notices. */
+    unlink(FAIL_FILE);
+    sleep(2);
+    check_session(user, argv, RUN_BOTH, "recovered cell is checked");
+    check_session(user, argv, RUN_BOTH, "...and used again");
+
+    /* The home directory is only passed to the first aklog run. */
+    argv[5] = "aklog_homedir";
+    basprintf(&expected, "-p %s %s", user->pw_dir, RUN_BOTH);
+    check_session(user, argv, expected, "aklog_homedir passed once");
+    free(expected);
+
+    /* Clean up. */
+    unlink("aklog-runs");
+    free(program);
+    free(state);
+    basprintf(&state, "%s/state", tmpdir);
+    module_state_remove(state);
+    free(state);
+    test_tmpdir_free(tmpdir);
+    test_file_path_free(aklog);
+    return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * Test coalescing of simultaneous token acquisitions.
+ *
+ * Starts several processes that open sessions for the same user and ticket
+ * cache at the same moment, using a fake aklog that takes a while to run, and
+ * checks that only one of them runs aklog while the rest wait for it and reuse
+ * its tokens.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <pwd.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <tests/fakepam/pam.h>
+#include <tests/module/util.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+/* Provided by the fakekafs layer. */
+extern bool fakekafs_token;
+extern int fakekafs_settok;
+
+/* The number of simultaneous sessions to start. */
+#define SESSIONS 8
+
+/* Exit statuses of the child processes. */
+#define CHILD_WAITED  0
+#define CHILD_AKLOG   1
+#define CHILD_FAILED  2
+
+
+/*
+ * Count the number of lines in a file, returning 0 if it doesn't exist.
+ */
+static int
+count_lines(const char *path)
+{
+    FILE *file;
+    int c;
+    int count = 0;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        return 0;
+    while ((c = getc(file)) != EOF)
+        if (c == '\n')
+            count++;
+    fclose(file);
+    return count;
+}
+
+
+/*
+ * The body of each child process.  Wait for the parent to close the barrier
+ * pipe, open a session with the given ticket cache, and report via the exit
+ * status whether we ran aklog or got tokens from another session.
+ */
+static void __attribute__((__noreturn__))
+run_session(struct passwd *user, const char *cache, int barrier,
+            const char **argv)
+{
+    pam_handle_t *pamh;
+    char buffer;
+
+    if (read(barrier, &buffer, 1) < 0)
+        _exit(CHILD_FAILED);
+    close(barrier);
+    pamh = module_start(user, cache);
+
+    /*
+     * The fake aklog can't change our token state, so pretend that whoever
+     * runs it already has a token.  Sessions that get the token from another
+     * session do so with VIOCSETTOK.
+     */
+    fakekafs_token = true;
+    if (pam_sm_open_session(pamh, 0, 4, argv) != PAM_SUCCESS)
+        _exit(CHILD_FAILED);
+    pam_end(pamh, 0);
+    _exit(fakekafs_settok == 1 ? CHILD_WAITED : CHILD_AKLOG);
+}
+
+
+int
+main(void)
+{
+    struct passwd *user;
+    int i, fds[2], status;
+    int waited = 0, leaders = 0, failed = 0;
+    pid_t child;
+    char *aklog, *tmpdir, *program, *state, *cache;
+    const char *argv[] = { NULL, NULL, "coalesce_tokens", "debug", NULL };
+
+#ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+#endif
+    plan(4);
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        bail("cannot find username of current user");
+    pam_set_pwd(user);
+
+    /* Set up the module arguments. */
+    aklog = test_file_path("data/fake-aklog-slow");
+    tmpdir = test_tmpdir();
+    basprintf(&program, "program=%s", aklog);
+    basprintf(&state, "state_dir=%s/state", tmpdir);
+    argv[0] = program;
+    argv[1] = state;
+    cache = module_cache("krb5cc_test", time(NULL) + 3600);
+    unlink("aklog-runs");
+
+    /*
+     * Start the sessions.  They all block reading from a pipe until we close
+     * the write end so that they all start as close together as possible.
+     */
+    if (pipe(fds) < 0)
+        sysbail("cannot create pipe");
+    for (i = 0; i < SESSIONS; i++) {
+        fflush(stdout);
+        child = fork();
+        if (child < 0)
+            sysbail("cannot fork");
+        else if (child == 0) {
+            close(fds[1]);
+            run_session(user, cache, fds[0], argv);
+        }
+    }
+    close(fds[0]);
+    close(fds[1]);
+
+    /* Collect the results. */
+    for (i = 0; i < SESSIONS; i++) {
+        if (wait(&status) < 0)
+            sysbail("cannot wait for child");
+        if (!WIFEXITED(status))
+            failed++;
+        else if (WEXITSTATUS(status) == CHILD_WAITED)
+            waited++;
+        else if (WEXITSTATUS(status) == CHILD_AKLOG)
+            leaders++;
+        else
+            failed++;
+    }
+    is_int(0, failed, "all sessions opened successfully");
+    is_int(1, leaders, "one session obtained tokens");
+    is_int(SESSIONS - 1, waited, "...and the rest reused them");
+    is_int(1, count_lines("aklog-runs"), "aklog was run once");
+
+    /* Clean up. */
+    unlink("aklog-runs");
+    module_cache_free(cache);
+    free(program);
+    free(state);
+    basprintf(&state, "%s/state", tmpdir);
+    module_state_remove(state);
+    free(state);
+    test_tmpdir_free(tmpdir);
+    test_file_path_free(aklog);
+    return 0;
+}
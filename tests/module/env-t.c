@@ -0,0 +1,124 @@
+/*
+ * Test the environment passed to aklog.
+ *
+ * Uses a fake aklog that saves its environment and checks that the whole
+ * PAM environment is passed by default but that only the standard variables
+ * and those listed in aklog_env are passed with aklog_minimal_env.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <pwd.h>
+
+#include <tests/fakepam/pam.h>
+#include <tests/module/util.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Return true if the environment saved by the fake aklog contains the given
+ * line.
+ */
+static bool
+env_has(const char *line)
+{
+    FILE *file;
+    char buffer[BUFSIZ];
+    bool found = false;
+
+    file = fopen("aklog-env", "r");
+    if (file == NULL)
+        return false;
+    while (!found && fgets(buffer, sizeof(buffer), file) != NULL) {
+        buffer[strcspn(buffer, "\n")] = '\0';
+        if (strcmp(buffer, line) == 0)
+            found = true;
+    }
+    fclose(file);
+    return found;
+}
+
+
+/*
+ * Open a session with the given arguments and a PAM environment containing
+ * KRB5CCNAME, FOO, and EXTRA, and close it again.
+ */
+static void
+run_session(struct passwd *user, int argc, const char **argv)
+{
+    pam_handle_t *pamh;
+    int status;
+
+    pamh = module_start(user, "krb5cc_test");
+    if (pam_putenv(pamh, "FOO=foo") != PAM_SUCCESS)
+        sysbail("cannot set PAM environment variable");
+    if (pam_putenv(pamh, "EXTRA=extra") != PAM_SUCCESS)
+        sysbail("cannot set PAM environment variable");
+    unlink("aklog-env");
+    status = pam_sm_open_session(pamh, 0, argc, argv);
+    is_int(PAM_SUCCESS, status, "open session");
+    pam_sm_close_session(pamh, 0, argc, argv);
+    pam_end(pamh, 0);
+}
+
+
+int
+main(void)
+{
+    struct passwd *user;
+    char *aklog, *program;
+    const char *argv[] = {
+        NULL, "aklog_minimal_env", "aklog_env=EXTRA", NULL
+    };
+
+#ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+#endif
+    plan(11);
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        bail("cannot find username of current user");
+    pam_set_pwd(user);
+
+    /* Set up the module arguments. */
+    aklog = test_file_path("data/fake-aklog-env");
+    if (aklog == NULL)
+        bail("cannot find fake-aklog-env");
+    basprintf(&program, "program=%s", aklog);
+    argv[0] = program;
+    if (setenv("TZ", "UTC", 1) < 0)
+        sysbail("cannot set TZ");
+
+    /* By default, aklog gets the whole PAM environment. */
+    run_session(user, 1, argv);
+    ok(env_has("KRB5CCNAME=krb5cc_test"), "...with KRB5CCNAME");
+    ok(env_has("FOO=foo"), "...and FOO");
+    ok(env_has("EXTRA=extra"), "...and EXTRA");
+
+    /* With aklog_minimal_env, only the standard variables. */
+    run_session(user, 2, argv);
+    ok(env_has("KRB5CCNAME=krb5cc_test"), "minimal with KRB5CCNAME");
+    ok(env_has("TZ=UTC"), "...and TZ from the regular environment");
+    ok(!env_has("FOO=foo"), "...but not FOO");
+    ok(!env_has("EXTRA=extra"), "...or EXTRA");
+
+    /* Plus those listed in aklog_env. */
+    run_session(user, 3, argv);
+    ok(env_has("EXTRA=extra"), "aklog_env adds EXTRA");
+
+    /* Clean up. */
+    unlink("aklog-env");
+    free(program);
+    test_file_path_free(aklog);
+    return 0;
+}
@@ -0,0 +1,191 @@
+/*
+ * Test the binary event log kept with the event_log option.
+ *
+ * Runs several PAM calls with the event log enabled and checks the records
+ * through pam-afs-session-events, including its filters, and that the ring
+ * wraps around when it's full.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <pwd.h>
+
+#include <events.h>
+#include <tests/fakepam/pam.h>
+#include <tests/module/util.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+/* The path to pam-afs-session-events and the event log. */
+static char *tool;
+static char *log_path;
+
+
+/*
+ * Open and close a session for the given user with the given arguments.
+ */
+static void
+run_session(struct passwd *user, int argc, const char **argv)
+{
+    pam_handle_t *pamh;
+
+    pamh = module_start(user, "krb5cc_test");
+    is_int(PAM_SUCCESS, pam_sm_open_session(pamh, 0, argc, argv),
+           "open session");
+    pam_sm_close_session(pamh, 0, argc, argv);
+    pam_end(pamh, 0);
+}
+
+
+/*
+ * Run pam-afs-session-events with the given options on the event log and
+ * return its output in newly allocated memory, setting lines to the number
+ * of lines of output.
+ */
+static char *
+run_tool(const char *options, size_t *lines)
+{
+    char *command, *p;
+    char buffer[BUFSIZ * 4];
+    size_t length;
+    FILE *output;
+
+    basprintf(&command, "%s %s %s", tool, options, log_path);
+    output = popen(command, "r");
+    if (output == NULL)
+        sysbail("cannot run %s", command);
+    length = fread(buffer, 1, sizeof(buffer) - 1, output);
+    buffer[length] = '\0';
+    if (pclose(output) != 0)
+        diag("%s failed", command);
+    free(command);
+    *lines = 0;
+    for (p = buffer; *p != '\0'; p++)
+        if (*p == '\n')
+            (*lines)++;
+    return bstrdup(buffer);
+}
+
+
+int
+main(void)
+{
+    struct passwd *user;
+    struct pamafs_events header;
+    char *aklog, *tmpdir, *program, *state, *option, *output, *expected;
+    size_t lines;
+    FILE *file;
+    const char *argv[] = { NULL, NULL, "event_log=16", NULL };
+
+#ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+#endif
+    plan(20);
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        bail("cannot find username of current user");
+    pam_set_pwd(user);
+
+    /* Set up the module arguments and paths. */
+    aklog = test_file_path("data/fake-aklog");
+    if (aklog == NULL)
+        bail("cannot find fake-aklog");
+    tool = test_file_path("../tools/pam-afs-session-events");
+    if (tool == NULL)
+        bail("cannot find pam-afs-session-events");
+    basprintf(&program, "program=%s", aklog);
+    tmpdir = test_tmpdir();
+    basprintf(&state, "%s/state", tmpdir);
+    module_state_remove(state);
+    basprintf(&option, "state_dir=%s", state);
+    basprintf(&log_path, "%s/%s", state, PAMAFS_EVENTS_FILE);
+    argv[0] = program;
+    argv[1] = option;
+
+    /* One session that obtains tokens and one where aklog fails. */
+    run_session(user, 3, argv);
+    argv[0] = "program=/bin/false";
+    run_session(user, 3, argv);
+
+    /* Check the full log. */
+    output = run_tool("", &lines);
+    is_int(4, lines, "four events logged");
+    basprintf(&expected, " open_session user=%s uid=%lu flags=0x0 status=0"
+              " pag=1 cells=1 aklog=0 total_ms=", user->pw_name,
+              (unsigned long) user->pw_uid);
+    ok(strstr(output, expected) != NULL, "...including the first open");
+    free(expected);
+    ok(strstr(output, " close_session ") != NULL, "...and a close");
+    ok(strstr(output, " aklog=1 ") != NULL, "...and a failed aklog");
+    ok(strstr(output, " aklog_ms=") != NULL, "...and the aklog time");
+    free(output);
+
+    /* Check the filters. */
+    output = run_tool("-e", &lines);
+    is_int(1, lines, "one failure");
+    ok(strstr(output, " aklog=1 ") != NULL, "...which is the failed aklog");
+    free(output);
+    output = run_tool("-c close_session", &lines);
+    is_int(2, lines, "two closes");
+    ok(strstr(output, " open_session ") == NULL, "...and no opens");
+    free(output);
+    output = run_tool("-n 2", &lines);
+    is_int(2, lines, "last two events");
+    ok(strstr(output, " aklog=0 ") == NULL, "...which are the later ones");
+    free(output);
+    output = run_tool("-u nonexistent-user", &lines);
+    is_int(0, lines, "no events for another user");
+    free(output);
+
+    /*
+     * The ring wraps around once it's full, keeping the newest records.  Use
+     * a new state directory, since the module keeps the old log mapped.
+     */
+    module_state_remove(state);
+    free(state);
+    free(option);
+    free(log_path);
+    basprintf(&state, "%s/state-ring", tmpdir);
+    module_state_remove(state);
+    basprintf(&option, "state_dir=%s", state);
+    basprintf(&log_path, "%s/%s", state, PAMAFS_EVENTS_FILE);
+    argv[1] = option;
+    argv[2] = "event_log=3";
+    run_session(user, 3, argv);
+    run_session(user, 3, argv);
+    file = fopen(log_path, "r");
+    if (file == NULL)
+        sysbail("cannot open %s", log_path);
+    if (fread(&header, sizeof(header), 1, file) != 1)
+        sysbail("cannot read %s", log_path);
+    fclose(file);
+    is_int(3, header.count, "ring holds three records");
+    is_int(4, header.next, "...after four were written");
+    output = run_tool("", &lines);
+    is_int(3, lines, "...and three are reported");
+    *strchr(output, '\n') = '\0';
+    ok(strstr(output, " close_session ") != NULL,
+       "...starting with the oldest one kept");
+    free(output);
+
+    /* Clean up. */
+    unlink("aklog-args");
+    module_state_remove(state);
+    free(log_path);
+    free(option);
+    free(state);
+    free(program);
+    test_tmpdir_free(tmpdir);
+    test_file_path_free(tool);
+    test_file_path_free(aklog);
+    return 0;
+}
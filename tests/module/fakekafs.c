@@ -1,11 +1,16 @@
 /*
  * Fake kafs library used for testing.
  *
- * This source file provides an implementation of the kafs API that doesn't do
- * anything other than change internal state that can be queried.  It's used
- * for testing that the module makes the correct AFS calls.
+ * This source file provides an implementation of the kafs API that simulates
+ * an AFS cache manager in memory.  It keeps tokens per PAG and per cell with
+ * expiration times, supports getting and setting them with k_pioctl, and can
+ * delay or fail any of its operations as described in fakekafs.h.  It's used
+ * for testing that the module makes the correct AFS calls and how it copes
+ * with a slow or failing cache manager.  Operations are serialized with a
+ * mutex, so the module may be called from several threads at once.
  *
  * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2015 Russ Allbery <eagle@eyrie.org>
  * Copyright 2010, 2011
  *     The Board of Trustees of the Leland Stanford Junior University
  *
@@ -14,31 +19,404 @@
 
 #include <config.h>
 #include <portable/kafs.h>
-#ifdef HAVE_KERBEROS
+#ifdef HAVE_KRB5
 # include <portable/krb5.h>
 #endif
 #include <portable/system.h>
 
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <tests/module/fakekafs.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+/* The pioctl numbers we support. */
+#ifndef _VICEIOCTL
+# define _VICEIOCTL(id) _IOW('V', (id), struct ViceIoctl)
+#endif
+#ifndef VIOCSETTOK
+# define VIOCSETTOK _VICEIOCTL(3)
+#endif
+#ifndef VIOCGETTOK
+# define VIOCGETTOK _VICEIOCTL(8)
+#endif
+#ifndef VIOC_FILE_CELL_NAME
+# define VIOC_FILE_CELL_NAME _VICEIOCTL(30)
+#endif
+
 /* Used for unused parameters to silence gcc warnings. */
 #define UNUSED __attribute__((__unused__))
 
+/* Used for enumerating arrays. */
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
+
+/* The most tokens we keep across all PAGs and the longest cell name. */
+#define FAKE_TOKENS_MAX 64
+#define FAKE_CELL_MAX   64
+
+/* Default lifetime of tokens. */
+#define FAKE_LIFETIME (10 * 60 * 60)
+
 /* Whether to claim that we have AFS. */
 int fakekafs_hasafs = 1;
 
 /* The current PAG number or 0 if we're not in a PAG. */
 int fakekafs_pag = 0;
 
-/* Whether we've obtained tokens since the last time we changed PAGs. */
+/* Whether there is a token for FAKEKAFS_CELL, which isn't tied to a PAG. */
 bool fakekafs_token = false;
 
+/* The expiration time reported for that token, or 0 for the stored one. */
+time_t fakekafs_token_expires = 0;
+
+/* The number of times tokens have been stored with VIOCSETTOK. */
+int fakekafs_settok = 0;
+
+/* The number of times the cell of a file has been looked up. */
+int fakekafs_cellname = 0;
+
+/* The operations that can be delayed or failed. */
+enum fake_op {
+    FAKE_HASAFS,
+    FAKE_SETPAG,
+    FAKE_UNLOG,
+    FAKE_GETTOK,
+    FAKE_SETTOK,
+    FAKE_CELLNAME,
+    FAKE_AFSLOG,
+    FAKE_OP_MAX
+};
+static const char *const fake_op_names[FAKE_OP_MAX] = {
+    "hasafs", "setpag", "unlog", "gettok", "settok", "cellname", "afslog"
+};
+
+/* Error names accepted in <op>.errno. */
+static const struct {
+    const char *name;
+    int error;
+} fake_errors[] = {
+    { "EACCES",    EACCES    },
+    { "EDOM",      EDOM      },
+    { "EINVAL",    EINVAL    },
+    { "EIO",       EIO       },
+    { "ENOENT",    ENOENT    },
+    { "ENOSYS",    ENOSYS    },
+    { "EPERM",     EPERM     },
+    { "ETIMEDOUT", ETIMEDOUT },
+};
+
+/* Held by each operation between fake_start and fake_finish. */
+static pthread_mutex_t fake_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The fault configuration and call count of each operation. */
+static struct {
+    long delay;                 /* Milliseconds to sleep in each call. */
+    long fail;                  /* Calls left to fail, or -1 for all. */
+    int error;                  /* errno to fail with. */
+    unsigned long calls;        /* Calls since the last configuration. */
+} fake_ops[FAKE_OP_MAX];
+
+/* The lifetime of tokens from krb5_afslog. */
+static long fake_lifetime = FAKE_LIFETIME;
+
+/* The last value of FAKEKAFS we configured from. */
+static char *fake_env = NULL;
+
+/* A token held by the cache manager for a cell other than FAKEKAFS_CELL. */
+struct fake_token {
+    int pag;                    /* PAG the token is in. */
+    char cell[FAKE_CELL_MAX];   /* Cell the token is for. */
+    time_t expires;             /* Expiration time, 0 for FAKE_LIFETIME. */
+};
+static struct fake_token fake_tokens[FAKE_TOKENS_MAX];
+static size_t fake_count = 0;
+
+/* The layout of the clear token in VIOCGETTOK and VIOCSETTOK data. */
+struct clear_token {
+    int32_t auth_handle;
+    char key[8];
+    int32_t vice_id;
+    int32_t begin;
+    int32_t end;
+};
+
+
+/*
+ * Find the token for a cell in a PAG, returning NULL if there isn't one.
+ */
+static struct fake_token *
+token_find(int pag, const char *cell)
+{
+    size_t i;
+
+    for (i = 0; i < fake_count; i++)
+        if (fake_tokens[i].pag == pag
+            && strcmp(fake_tokens[i].cell, cell) == 0)
+            return &fake_tokens[i];
+    return NULL;
+}
+
+
+/*
+ * Store a token for a cell in a PAG, replacing any existing one.  A token
+ * for FAKEKAFS_CELL just sets fakekafs_token.
+ */
+static void
+token_add(int pag, const char *cell, time_t expires)
+{
+    struct fake_token *token;
+
+    if (strcmp(cell, FAKEKAFS_CELL) == 0) {
+        fakekafs_token = true;
+        return;
+    }
+    token = token_find(pag, cell);
+    if (token == NULL) {
+        if (fake_count >= FAKE_TOKENS_MAX)
+            bail("fakekafs: too many tokens");
+        token = &fake_tokens[fake_count++];
+        token->pag = pag;
+        strlcpy(token->cell, cell, sizeof(token->cell));
+    }
+    token->expires = expires;
+}
+
+
+/*
+ * Remove the tokens in a PAG, either for all cells if cell is NULL or for
+ * only the given cell.
+ */
+static void
+token_remove(int pag, const char *cell)
+{
+    size_t i = 0;
+
+    while (i < fake_count) {
+        if (fake_tokens[i].pag == pag
+            && (cell == NULL || strcmp(fake_tokens[i].cell, cell) == 0))
+            fake_tokens[i] = fake_tokens[--fake_count];
+        else
+            i++;
+    }
+}
+
+
+/*
+ * Parse one setting of a fault specification, calling bail if it's invalid.
+ */
+static void
+fake_setting(const char *setting)
+{
+    const char *value, *dot;
+    char *end;
+    size_t i, length;
+    long number;
+    enum fake_op op;
+
+    value = strchr(setting, '=');
+    if (value == NULL)
+        bail("fakekafs: invalid setting %s", setting);
+    value++;
+    number = strtol(value, &end, 10);
+    if (strncmp(setting, "hasafs=", strlen("hasafs=")) == 0) {
+        if (*end != '\0')
+            bail("fakekafs: invalid setting %s", setting);
+        fakekafs_hasafs = (number != 0);
+        return;
+    }
+    if (strncmp(setting, "lifetime=", strlen("lifetime=")) == 0) {
+        if (*end != '\0' || number <= 0)
+            bail("fakekafs: invalid setting %s", setting);
+        fake_lifetime = number;
+        return;
+    }
+
+    /* Everything else is <op>.<setting>=<value>. */
+    dot = strchr(setting, '.');
+    if (dot == NULL || dot > value)
+        bail("fakekafs: invalid setting %s", setting);
+    length = (size_t) (dot - setting);
+    for (op = 0; op < FAKE_OP_MAX; op++)
+        if (strlen(fake_op_names[op]) == length
+            && strncmp(setting, fake_op_names[op], length) == 0)
+            break;
+    if (op == FAKE_OP_MAX)
+        bail("fakekafs: unknown operation in %s", setting);
+    dot++;
+    if (strncmp(dot, "delay=", strlen("delay=")) == 0) {
+        if (*end != '\0' || number < 0)
+            bail("fakekafs: invalid setting %s", setting);
+        fake_ops[op].delay = number;
+    } else if (strncmp(dot, "fail=", strlen("fail=")) == 0) {
+        if (strcmp(value, "always") == 0)
+            fake_ops[op].fail = -1;
+        else if (*end != '\0' || number < 0)
+            bail("fakekafs: invalid setting %s", setting);
+        else
+            fake_ops[op].fail = number;
+    } else if (strncmp(dot, "errno=", strlen("errno=")) == 0) {
+        if (*end == '\0' && number > 0) {
+            fake_ops[op].error = (int) number;
+            return;
+        }
+        for (i = 0; i < ARRAY_SIZE(fake_errors); i++)
+            if (strcmp(value, fake_errors[i].name) == 0) {
+                fake_ops[op].error = fake_errors[i].error;
+                return;
+            }
+        bail("fakekafs: unknown error in %s", setting);
+    } else
+        bail("fakekafs: invalid setting %s", setting);
+}
+
 
 /*
- * Always return true and say we have AFS.
+ * Replace the fault configuration with the given specification and reset the
+ * call counts.
+ */
+void
+fakekafs_configure(const char *spec)
+{
+    char *copy, *setting, *save;
+    int op;
+
+    for (op = 0; op < FAKE_OP_MAX; op++) {
+        fake_ops[op].delay = 0;
+        fake_ops[op].fail = 0;
+        fake_ops[op].error = EIO;
+        fake_ops[op].calls = 0;
+    }
+    fake_lifetime = FAKE_LIFETIME;
+    if (spec == NULL)
+        return;
+    copy = bstrdup(spec);
+    for (setting = strtok_r(copy, ", \t", &save); setting != NULL;
+         setting = strtok_r(NULL, ", \t", &save))
+        fake_setting(setting);
+    free(copy);
+}
+
+
+/*
+ * Return the number of calls to an operation since the last configuration.
+ */
+unsigned long
+fakekafs_calls(const char *name)
+{
+    int op;
+
+    for (op = 0; op < FAKE_OP_MAX; op++)
+        if (strcmp(name, fake_op_names[op]) == 0)
+            return fake_ops[op].calls;
+    bail("fakekafs: unknown operation %s", name);
+}
+
+
+/*
+ * Add a token for a cell to the current PAG.
+ */
+void
+fakekafs_add_token(const char *cell, time_t expires)
+{
+    token_add(fakekafs_pag, cell, expires);
+}
+
+
+/*
+ * Return the number of tokens in a PAG, counting the one for FAKEKAFS_CELL
+ * only for the current PAG.
+ */
+size_t
+fakekafs_tokens(int pag)
+{
+    size_t i;
+    size_t count = (fakekafs_token && pag == fakekafs_pag) ? 1 : 0;
+
+    for (i = 0; i < fake_count; i++)
+        if (fake_tokens[i].pag == pag)
+            count++;
+    return count;
+}
+
+
+/*
+ * Return whether a PAG has a token for a cell.
+ */
+bool
+fakekafs_has_token(int pag, const char *cell)
+{
+    if (strcmp(cell, FAKEKAFS_CELL) == 0)
+        return fakekafs_token && pag == fakekafs_pag;
+    return token_find(pag, cell) != NULL;
+}
+
+
+/*
+ * Start an operation.  Picks up any change to FAKEKAFS, counts the call,
+ * sleeps if a delay is configured, and returns the errno to fail with or 0 to
+ * proceed.  Returns with fake_lock held, which fake_finish releases, but
+ * doesn't hold it while sleeping.
+ */
+static int
+fake_start(enum fake_op op)
+{
+    const char *env;
+    struct timespec delay;
+
+    pthread_mutex_lock(&fake_lock);
+    env = getenv("FAKEKAFS");
+    if ((env == NULL) != (fake_env == NULL)
+        || (env != NULL && strcmp(env, fake_env) != 0)) {
+        free(fake_env);
+        fake_env = (env == NULL) ? NULL : bstrdup(env);
+        fakekafs_configure(env);
+    }
+    fake_ops[op].calls++;
+    if (fake_ops[op].delay > 0) {
+        delay.tv_sec = fake_ops[op].delay / 1000;
+        delay.tv_nsec = (fake_ops[op].delay % 1000) * 1000000L;
+        pthread_mutex_unlock(&fake_lock);
+        while (nanosleep(&delay, &delay) < 0 && errno == EINTR)
+            ;
+        pthread_mutex_lock(&fake_lock);
+    }
+    if (fake_ops[op].fail == 0)
+        return 0;
+    if (fake_ops[op].fail > 0)
+        fake_ops[op].fail--;
+    return fake_ops[op].error;
+}
+
+
+/*
+ * Finish an operation, releasing fake_lock.  If error is nonzero, set errno
+ * to it and return -1, and otherwise return 0.
+ */
+static int
+fake_finish(int error)
+{
+    pthread_mutex_unlock(&fake_lock);
+    if (error == 0)
+        return 0;
+    errno = error;
+    return -1;
+}
+
+
+/*
+ * Say whether we have AFS.  A failure says that we don't.
  */
 int
 k_hasafs(void)
 {
-    return fakekafs_hasafs;
+    int hasafs;
+
+    hasafs = (fake_start(FAKE_HASAFS) == 0) ? fakekafs_hasafs : 0;
+    fake_finish(0);
+    return hasafs;
 }
 
 
@@ -53,63 +431,217 @@ k_haspag(void)
 
 
 /*
- * Provide k_pioctl since it's part of the interface, but always return -1 and
- * set errno to ENOSYS.
+ * Return the token at the given index in the current PAG in the format used
+ * by VIOCGETTOK, or fail with EDOM if there aren't that many tokens.  The
+ * token for FAKEKAFS_CELL, if any, comes first.
+ */
+static int
+fake_gettok(struct ViceIoctl *data)
+{
+    int32_t index, size;
+    struct clear_token ct;
+    const char *cell = NULL;
+    char *p = data->out;
+    const char ticket[] = "fake ticket";
+    time_t expires = 0;
+    size_t i, length;
+
+    memcpy(&index, data->in, sizeof(index));
+    if (fakekafs_token && index-- == 0) {
+        cell = FAKEKAFS_CELL;
+        expires = fakekafs_token_expires;
+    }
+    for (i = 0; cell == NULL && i < fake_count; i++)
+        if (fake_tokens[i].pag == fakekafs_pag && index-- == 0) {
+            cell = fake_tokens[i].cell;
+            expires = fake_tokens[i].expires;
+        }
+    if (cell == NULL)
+        return EDOM;
+    memset(&ct, 0, sizeof(ct));
+    ct.vice_id = (int32_t) getuid();
+    ct.begin = (int32_t) time(NULL);
+    ct.end = (int32_t) expires;
+    if (ct.end == 0)
+        ct.end = ct.begin + FAKE_LIFETIME;
+    length = strlen(cell) + 1;
+    if ((size_t) data->out_size < 3 * sizeof(size) + sizeof(ticket)
+                                      + sizeof(ct) + length)
+        return EINVAL;
+    size = sizeof(ticket);
+    memcpy(p, &size, sizeof(size));
+    p += sizeof(size);
+    memcpy(p, ticket, sizeof(ticket));
+    p += sizeof(ticket);
+    size = sizeof(ct);
+    memcpy(p, &size, sizeof(size));
+    p += sizeof(size);
+    memcpy(p, &ct, sizeof(ct));
+    p += sizeof(ct);
+    size = 1;
+    memcpy(p, &size, sizeof(size));
+    p += sizeof(size);
+    memcpy(p, cell, length);
+    return 0;
+}
+
+
+/*
+ * Store a token in the format used by VIOCSETTOK in the current PAG, taking
+ * the cell and expiration time from the token data.  A token for
+ * FAKEKAFS_CELL just sets fakekafs_token.
+ */
+static int
+fake_settok(struct ViceIoctl *data)
+{
+    const char *buffer = data->in;
+    size_t length = (size_t) data->in_size;
+    size_t offset = 0;
+    struct clear_token ct;
+    const char *cell;
+    int32_t size;
+
+    if (length < sizeof(size))
+        return EINVAL;
+    memcpy(&size, buffer, sizeof(size));
+    offset += sizeof(size);
+    if (size < 0 || (size_t) size + sizeof(size) > length - offset)
+        return EINVAL;
+    offset += (size_t) size;
+    memcpy(&size, buffer + offset, sizeof(size));
+    offset += sizeof(size);
+    if (size != sizeof(ct) || sizeof(ct) + sizeof(size) > length - offset)
+        return EINVAL;
+    memcpy(&ct, buffer + offset, sizeof(ct));
+    offset += sizeof(ct) + sizeof(size);
+    cell = buffer + offset;
+    if (offset >= length || memchr(cell, '\0', length - offset) == NULL
+        || strlen(cell) >= FAKE_CELL_MAX)
+        return EINVAL;
+    fakekafs_settok++;
+    token_add(fakekafs_pag, cell, (time_t) ct.end);
+    return 0;
+}
+
+
+/*
+ * Return the cell of a path in the format used by VIOC_FILE_CELL_NAME.  Paths
+ * are in AFS if they're below /afs, and their cell is the next component
+ * with any leading period removed.
+ */
+static int
+fake_cellname(const char *path, struct ViceIoctl *data)
+{
+    const char *cell;
+    size_t length;
+
+    fakekafs_cellname++;
+    if (path == NULL || strncmp(path, "/afs/", strlen("/afs/")) != 0)
+        return EINVAL;
+    cell = path + strlen("/afs/");
+    if (*cell == '.')
+        cell++;
+    length = strcspn(cell, "/");
+    if (length == 0 || length >= (size_t) data->out_size)
+        return EINVAL;
+    memcpy(data->out, cell, length);
+    ((char *) data->out)[length] = '\0';
+    return 0;
+}
+
+
+/*
+ * Support getting and setting tokens and looking up the cell of a file.  All
+ * other calls return -1 and set errno to ENOSYS.
  */
 int
-k_pioctl(char *path UNUSED, int call UNUSED, struct ViceIoctl *data UNUSED,
-         int follow UNUSED)
+k_pioctl(char *path, int call, struct ViceIoctl *data, int follow UNUSED)
 {
-    errno = ENOSYS;
-    return -1;
+    int error;
+
+    if (call == (int) VIOCGETTOK) {
+        error = fake_start(FAKE_GETTOK);
+        if (error == 0)
+            error = fake_gettok(data);
+    } else if (call == (int) VIOC_FILE_CELL_NAME) {
+        error = fake_start(FAKE_CELLNAME);
+        if (error == 0)
+            error = fake_cellname(path, data);
+    } else if (call == (int) VIOCSETTOK) {
+        error = fake_start(FAKE_SETTOK);
+        if (error == 0)
+            error = fake_settok(data);
+    } else {
+        errno = ENOSYS;
+        return -1;
+    }
+    return fake_finish(error);
 }
 
 
 /*
- * Enter a new PAG.  We can do this by just incrementing the PAG number.
- * Always returns 0, indicating no error.
+ * Enter a new PAG, which starts out with no tokens other than the one for
+ * FAKEKAFS_CELL.  We can do this by just incrementing the PAG number.
  */
 int
 k_setpag(void)
 {
-    fakekafs_pag++;
-    return 0;
+    int error;
+
+    error = fake_start(FAKE_SETPAG);
+    if (error == 0) {
+        fakekafs_pag++;
+        token_remove(fakekafs_pag, NULL);
+    }
+    return fake_finish(error);
 }
 
 
 /*
- * Remove the tokens from a PAG.
+ * Remove the tokens from the current PAG.
  */
 int
 k_unlog(void)
 {
-    fakekafs_token = false;
-    return 0;
+    int error;
+
+    error = fake_start(FAKE_UNLOG);
+    if (error == 0) {
+        fakekafs_token = false;
+        token_remove(fakekafs_pag, NULL);
+    }
+    return fake_finish(error);
 }
 
 
 /*
- * Obtain tokens in a PAG.  We support several versions of this function: all
- * the ones that can be called by the krb5_afslog support.  Since these
- * functions are prototyped to take Kerberos data types, they're only
- * available if built with Kerberos support.
+ * Obtain tokens in a PAG for the given cell, or FAKEKAFS_CELL if it's NULL.
+ * We support several versions of this function: all the ones that can be
+ * called by the krb5_afslog support.  Since these functions are prototyped
+ * to take Kerberos data types, they're only available if built with Kerberos
+ * support.
  */
-#if defined(HAVE_KERBEROS) && defined(HAVE_KRB5_AFSLOG)
+#if defined(HAVE_KRB5) && defined(HAVE_KRB5_AFSLOG)
 krb5_error_code
 krb5_afslog_uid(krb5_context context UNUSED, krb5_ccache id UNUSED,
-                const char *cell UNUSED, krb5_const_realm realm UNUSED,
+                const char *cell, krb5_const_realm realm UNUSED,
                 uid_t uid UNUSED)
 {
-    fakekafs_token = true;
-    return 0;
+    int error;
+
+    error = fake_start(FAKE_AFSLOG);
+    if (error == 0)
+        token_add(fakekafs_pag, (cell == NULL) ? FAKEKAFS_CELL : cell,
+                  time(NULL) + fake_lifetime);
+    fake_finish(0);
+    return error;
 }
 
 krb5_error_code
-krb5_afslog_uid_home(krb5_context context UNUSED, krb5_ccache id UNUSED,
-                     const char *cell UNUSED, krb5_const_realm realm UNUSED,
-                     uid_t uid UNUSED, const char *homedir UNUSED)
+krb5_afslog_uid_home(krb5_context context, krb5_ccache id, const char *cell,
+                     krb5_const_realm realm, uid_t uid,
+                     const char *homedir UNUSED)
 {
-    fakekafs_token = true;
-    return 0;
+    return krb5_afslog_uid(context, id, cell, realm, uid);
 }
-#endif /* HAVE_KERBEROS && HAVE_KRB5_AFSLOG */
+#endif /* HAVE_KRB5 && HAVE_KRB5_AFSLOG */
@@ -0,0 +1,87 @@
+/*
+ * Interface to the fake kafs library used for testing.
+ *
+ * The fake simulates an AFS cache manager: it keeps tokens per PAG and per
+ * cell with expiration times, and can be told to delay or fail any of its
+ * operations.  Faults are configured with a specification string, either
+ * passed to fakekafs_configure or taken from the FAKEKAFS environment
+ * variable (which fakepam scripts can set in their [environment] section).
+ * The specification is a list of settings separated by whitespace or commas:
+ *
+ *     <op>.delay=<ms>          Sleep this long in each call.
+ *     <op>.fail=<n>|always     Fail the next n calls, or all of them.
+ *     <op>.errno=<error>       Fail with this errno (default EIO), either
+ *                              a number or a name such as EPERM.
+ *     hasafs=0|1               Whether to claim that AFS is available.
+ *     lifetime=<seconds>       Lifetime of tokens from krb5_afslog.
+ *
+ * where <op> is one of hasafs, setpag, unlog, gettok, settok, cellname, or
+ * afslog.  A failed hasafs reports that AFS isn't available.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef TESTS_MODULE_FAKEKAFS_H
+#define TESTS_MODULE_FAKEKAFS_H 1
+
+#include <config.h>
+#include <portable/macros.h>
+#include <portable/stdbool.h>
+
+#include <time.h>
+
+/* The cell of the token controlled by fakekafs_token. */
+#define FAKEKAFS_CELL "example.com"
+
+/* Whether to claim that we have AFS. */
+extern int fakekafs_hasafs;
+
+/* The current PAG number or 0 if we're not in a PAG. */
+extern int fakekafs_pag;
+
+/*
+ * Whether there is a token for FAKEKAFS_CELL.  Unlike other tokens, it isn't
+ * tied to a PAG but kept across k_setpag, as if aklog had been run in each
+ * new PAG, since the fake aklog can't obtain tokens.  Tests set this directly
+ * to pretend that aklog worked.
+ */
+extern bool fakekafs_token;
+
+/* The expiration time of that token, or 0 for ten hours from now. */
+extern time_t fakekafs_token_expires;
+
+/* The number of times tokens have been stored with VIOCSETTOK. */
+extern int fakekafs_settok;
+
+/* The number of times the cell of a file has been looked up. */
+extern int fakekafs_cellname;
+
+BEGIN_DECLS
+
+/*
+ * Replace the fault configuration with the given specification (NULL for no
+ * faults) and reset the call counts.  Calls bail on a malformed
+ * specification.
+ */
+void fakekafs_configure(const char *spec);
+
+/* Return the number of calls to an operation since the last configuration. */
+unsigned long fakekafs_calls(const char *op);
+
+/* Add a token for a cell to the current PAG, as aklog would. */
+void fakekafs_add_token(const char *cell, time_t expires);
+
+/*
+ * Return the number of tokens in the given PAG, and whether that PAG has a
+ * token for the given cell.  The token for FAKEKAFS_CELL is only counted for
+ * the current PAG.
+ */
+size_t fakekafs_tokens(int pag);
+bool fakekafs_has_token(int pag, const char *cell);
+
+END_DECLS
+
+#endif /* !TESTS_MODULE_FAKEKAFS_H */
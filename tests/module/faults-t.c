@@ -0,0 +1,160 @@
+/*
+ * Test the module against a slow or failing cache manager.
+ *
+ * Runs the scripts in data/scripts/faults, which configure the fake kafs
+ * layer to delay or fail particular operations, and then checks the token
+ * handling of the fake itself: tokens kept per PAG and per cell, and
+ * injected failures and delays.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/kafs.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <pwd.h>
+#include <sys/time.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <tests/fakepam/pam.h>
+#include <tests/fakepam/script.h>
+#include <tests/module/fakekafs.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+/* VIOCGETTOK, if not already provided by kafs.h. */
+#ifndef _VICEIOCTL
+# define _VICEIOCTL(id) _IOW('V', (id), struct ViceIoctl)
+#endif
+#ifndef VIOCGETTOK
+# define VIOCGETTOK _VICEIOCTL(8)
+#endif
+
+
+/*
+ * Return the number of milliseconds since the given time.
+ */
+static long
+elapsed(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000
+        + (now.tv_usec - start->tv_usec) / 1000;
+}
+
+
+int
+main(void)
+{
+    struct script_config config;
+    struct passwd *user;
+    struct pamafs_tokens *tokens;
+    struct pam_args args;
+    struct timeval start;
+    struct ViceIoctl iob;
+    char buffer[BUFSIZ];
+    char *aklog;
+    int32_t index;
+
+#ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+#endif
+    plan_lazy();
+
+    /* The module only runs aklog with a ticket cache. */
+    if (putenv((char *) "KRB5CCNAME=krb5cc_test") < 0)
+        sysbail("cannot set KRB5CCNAME in the environment");
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        bail("cannot find username of current user");
+    pam_set_pwd(user);
+
+    /* Run the scripts. */
+    memset(&config, 0, sizeof(config));
+    aklog = test_file_path("data/fake-aklog");
+    if (aklog == NULL)
+        bail("cannot find fake-aklog");
+    config.user = user->pw_name;
+    config.extra[0] = aklog;
+    config.extra[2] = bstrdup(strerror(EPERM));
+    config.extra[3] = bstrdup(strerror(EIO));
+    run_script_dir("data/scripts/faults", &config);
+    unlink("aklog-args");
+
+    /* A new PAG starts without tokens and tokens are kept per PAG. */
+    fakekafs_configure(NULL);
+    fakekafs_pag = 0;
+    fakekafs_token = false;
+    fakekafs_settok = 0;
+    is_int(0, k_setpag(), "k_setpag");
+    is_int(1, fakekafs_pag, "...creates a PAG");
+    is_int(0, fakekafs_tokens(1), "...without tokens");
+    fakekafs_add_token("a.example.com", 0);
+    fakekafs_add_token("b.example.com", 0);
+    is_int(2, fakekafs_tokens(1), "tokens added for two cells");
+
+    /* Tokens can be read and copied into another PAG. */
+    memset(&args, 0, sizeof(args));
+    tokens = pamafs_tokens_read(&args);
+    ok(tokens != NULL, "reading tokens");
+    is_int(2, tokens == NULL ? 0 : tokens->count, "...finds both tokens");
+    is_int(0, k_setpag(), "k_setpag");
+    is_int(0, fakekafs_tokens(2), "...leaves the tokens behind");
+    ok(pamafs_tokens_write(&args, tokens), "writing tokens");
+    is_int(2, fakekafs_settok, "...with two VIOCSETTOK calls");
+    ok(fakekafs_has_token(2, "a.example.com"), "...copies the first token");
+    ok(fakekafs_has_token(2, "b.example.com"), "...and the second");
+    pamafs_tokens_free(tokens);
+
+    /* k_unlog only affects the current PAG. */
+    is_int(0, k_unlog(), "k_unlog");
+    is_int(0, fakekafs_tokens(2), "...removes the tokens of the PAG");
+    is_int(2, fakekafs_tokens(1), "...and no others");
+    memset(&iob, 0, sizeof(iob));
+    index = 0;
+    iob.in = (char *) &index;
+    iob.in_size = sizeof(index);
+    iob.out = buffer;
+    iob.out_size = sizeof(buffer);
+    errno = 0;
+    is_int(-1, k_pioctl(NULL, VIOCGETTOK, &iob, 0), "VIOCGETTOK then fails");
+    is_int(EDOM, errno, "...with EDOM");
+
+    /* The token controlled by fakekafs_token follows us to new PAGs. */
+    fakekafs_token = true;
+    is_int(0, k_setpag(), "k_setpag");
+    is_int(1, fakekafs_tokens(3), "...keeps the fakekafs_token token");
+    is_int(0, k_pioctl(NULL, VIOCGETTOK, &iob, 0), "...which can be read");
+    fakekafs_token = false;
+
+    /* Failures are injected for the requested number of calls. */
+    fakekafs_configure("unlog.fail=1,unlog.errno=EPERM");
+    errno = 0;
+    is_int(-1, k_unlog(), "injected k_unlog failure");
+    is_int(EPERM, errno, "...with the requested errno");
+    is_int(0, k_unlog(), "...only for one call");
+    is_int(2, fakekafs_calls("unlog"), "...and both calls were counted");
+
+    /* Delays are injected into each call. */
+    fakekafs_configure("setpag.delay=100");
+    gettimeofday(&start, NULL);
+    is_int(0, k_setpag(), "delayed k_setpag");
+    ok(elapsed(&start) >= 100, "...takes at least the delay");
+    fakekafs_configure(NULL);
+
+    /* Clean up. */
+    free((char *) config.extra[2]);
+    free((char *) config.extra[3]);
+    test_file_path_free(aklog);
+    return 0;
+}
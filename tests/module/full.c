@@ -29,7 +29,7 @@
 
 #include <config.h>
 #include <portable/kafs.h>
-#ifdef HAVE_KERBEROS
+#ifdef HAVE_KRB5
 # include <portable/krb5.h>
 #endif
 #include <portable/pam.h>
@@ -53,7 +53,7 @@ copy_krb5_env(pam_handle_t *pamh)
     const char *cache = NULL;
     char *env;
 
-#ifdef HAVE_KERBEROS
+#ifdef HAVE_KRB5
     krb5_error_code status;
     krb5_context ctx = NULL;
     krb5_ccache ccache = NULL;
@@ -80,7 +80,7 @@ copy_krb5_env(pam_handle_t *pamh)
         exit(4);
     }
 
-#ifdef HAVE_KERBEROS
+#ifdef HAVE_KRB5
     if (ctx != NULL) {
         if (ccache != NULL)
             krb5_cc_close(ctx, ccache);
@@ -0,0 +1,138 @@
+/*
+ * Test skipping tokens for users whose home directory isn't in AFS.
+ *
+ * Opens sessions for users with various home directories and checks that
+ * aklog is only run for those whose home directory afs_homedir_only
+ * considers to be in AFS, either from afs_homedir_paths or from the file
+ * system type.  Also checks that aklog_homedir_cell asks for tokens for the
+ * cell of the home directory, remembering it for other users in that cell.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <pwd.h>
+
+#include <tests/fakepam/pam.h>
+#include <tests/module/util.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+/* Provided by the fakekafs layer. */
+extern int fakekafs_cellname;
+
+/* The arguments to the last aklog run. */
+static char aklog_args[BUFSIZ];
+
+
+/*
+ * Open and close a session for the given user with the given home directory
+ * and report whether aklog was run.  If it was, its arguments are saved in
+ * aklog_args.
+ */
+static bool
+run_session(struct passwd *user, const char *home, int argc,
+            const char **argv)
+{
+    pam_handle_t *pamh;
+    FILE *file;
+    bool ran;
+
+    user->pw_dir = (char *) home;
+    pamh = module_start(user, "krb5cc_test");
+    unlink("aklog-args");
+    is_int(PAM_SUCCESS, pam_sm_open_session(pamh, 0, argc, argv),
+           "open session with home %s", home);
+    ran = (access("aklog-args", F_OK) == 0);
+    aklog_args[0] = '\0';
+    if (ran) {
+        file = fopen("aklog-args", "r");
+        if (file == NULL)
+            sysbail("cannot open aklog-args");
+        if (fgets(aklog_args, sizeof(aklog_args), file) == NULL)
+            sysbail("cannot read from aklog-args");
+        aklog_args[strcspn(aklog_args, "\n")] = '\0';
+        fclose(file);
+    }
+    pam_sm_close_session(pamh, 0, argc, argv);
+    pam_end(pamh, 0);
+    unlink("aklog-args");
+    return ran;
+}
+
+
+int
+main(void)
+{
+    struct passwd *pwd;
+    struct passwd user;
+    char *aklog, *tmpdir, *program;
+    const char *argv[] = {
+        NULL, "afs_homedir_only", "afs_homedir_paths=/afs/,/srv/afs", NULL
+    };
+
+#ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+#endif
+    plan(23);
+
+    /* Determine the user so that setuid will work. */
+    pwd = getpwuid(getuid());
+    if (pwd == NULL)
+        bail("cannot find username of current user");
+    user = *pwd;
+    pam_set_pwd(&user);
+
+    /* Set up the module arguments. */
+    aklog = test_file_path("data/fake-aklog");
+    if (aklog == NULL)
+        bail("cannot find fake-aklog");
+    basprintf(&program, "program=%s", aklog);
+    argv[0] = program;
+    tmpdir = test_tmpdir();
+
+    /* Home directories checked against the configured paths. */
+    ok(run_session(&user, "/afs/example.com/user/t/test", 3, argv),
+       "...and aklog was run");
+    ok(run_session(&user, "/srv/afs", 3, argv), "...and aklog was run");
+    ok(!run_session(&user, "/home/test", 3, argv),
+       "...and aklog was not run");
+    ok(!run_session(&user, "/afsx/test", 3, argv),
+       "...and aklog was not run");
+
+    /* Without paths, the file system is checked, and tmpdir isn't AFS. */
+    ok(!run_session(&user, tmpdir, 2, argv), "...and aklog was not run");
+
+    /* Without afs_homedir_only, the home directory doesn't matter. */
+    ok(run_session(&user, tmpdir, 1, argv), "...and aklog was run");
+
+    /* With aklog_homedir_cell, aklog is asked for the home cell. */
+    argv[1] = "aklog_homedir";
+    argv[2] = "aklog_homedir_cell";
+    run_session(&user, "/afs/example.com/user/t/test", 3, argv);
+    is_string("-c example.com", aklog_args, "...for the home cell");
+    is_int(1, fakekafs_cellname, "...which was looked up");
+    run_session(&user, "/afs/example.com/user/o/other", 3, argv);
+    is_string("-c example.com", aklog_args, "...for the same cell");
+    is_int(1, fakekafs_cellname, "...which was remembered");
+    run_session(&user, "/afs/example.org/u/test", 3, argv);
+    is_string("-c example.org", aklog_args, "...for another cell");
+    is_int(2, fakekafs_cellname, "...which was looked up");
+
+    /* If the cell can't be found, aklog walks the path. */
+    run_session(&user, "/home/test", 3, argv);
+    is_string("-p /home/test", aklog_args, "...and is passed the path");
+
+    /* Clean up. */
+    pam_set_pwd(pwd);
+    free(program);
+    test_tmpdir_free(tmpdir);
+    test_file_path_free(aklog);
+    return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * Test collecting and logging the output of aklog.
+ *
+ * Uses a fake aklog that writes to standard output and standard error and
+ * exits with a configurable status, and checks that its output is logged
+ * along with its exit status and resource usage, at the debug level if it
+ * succeeds and at the error level if it fails.  Also checks that an aklog
+ * producing a lot of output neither blocks nor floods the log.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <pwd.h>
+#include <syslog.h>
+#include <time.h>
+
+#include <tests/fakepam/pam.h>
+#include <tests/module/util.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Open and close a session with the given PAM environment variable set
+ * (which may be NULL) and return the output logged while doing so.
+ */
+static struct output *
+run_session(struct passwd *user, const char **argv, const char *env)
+{
+    pam_handle_t *pamh;
+
+    pamh = module_start(user, "krb5cc_test");
+    if (env != NULL && pam_putenv(pamh, env) != PAM_SUCCESS)
+        sysbail("cannot set PAM environment variable");
+    pam_output_free(pam_output());
+    pam_sm_open_session(pamh, 0, 3, argv);
+    pam_end(pamh, 0);
+    return pam_output();
+}
+
+
+/*
+ * Return the number of lines of output at the given priority that start with
+ * the given prefix.
+ */
+static size_t
+count_lines(const struct output *output, int priority, const char *prefix)
+{
+    size_t i, count = 0;
+
+    if (output == NULL)
+        return 0;
+    for (i = 0; i < output->count; i++)
+        if (output->lines[i].priority == priority
+            && strncmp(output->lines[i].line, prefix, strlen(prefix)) == 0)
+            count++;
+    return count;
+}
+
+
+int
+main(void)
+{
+    struct passwd *user;
+    struct output *output;
+    char *aklog, *program, *prefix;
+    time_t start;
+    const char *argv[] = { NULL, "debug", "token_timeout=10", NULL };
+
+#ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+#endif
+    plan(11);
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        bail("cannot find username of current user");
+    pam_set_pwd(user);
+
+    /* Set up the module arguments. */
+    aklog = test_file_path("data/fake-aklog-output");
+    if (aklog == NULL)
+        bail("cannot find fake-aklog-output");
+    basprintf(&program, "program=%s", aklog);
+    argv[0] = program;
+
+    /* A successful aklog has its output logged at the debug level. */
+    output = run_session(user, argv, NULL);
+    basprintf(&prefix, "aklog program %s exited with status 0 after ", aklog);
+    is_int(1, count_lines(output, LOG_DEBUG, prefix), "success is logged");
+    free(prefix);
+    is_int(1, count_lines(output, LOG_DEBUG, "aklog: args: "),
+           "...with standard output");
+    is_int(1, count_lines(output, LOG_DEBUG, "aklog: message on stderr"),
+           "...and standard error");
+    is_int(0, count_lines(output, LOG_ERR, "aklog"), "...and no errors");
+    pam_output_free(output);
+
+    /* A failed aklog has its status and output logged as errors. */
+    output = run_session(user, argv, "AKLOG_STATUS=3");
+    basprintf(&prefix, "aklog program %s returned 3 after ", aklog);
+    is_int(1, count_lines(output, LOG_ERR, prefix), "failure is logged");
+    free(prefix);
+    is_int(1, count_lines(output, LOG_ERR, "aklog: args: "),
+           "...with standard output");
+    is_int(1, count_lines(output, LOG_ERR, "aklog: message on stderr"),
+           "...and standard error");
+    pam_output_free(output);
+
+    /* A chatty aklog is neither blocked nor logged in full. */
+    start = time(NULL);
+    output = run_session(user, argv, "AKLOG_CHATTY=256");
+    ok(time(NULL) - start < 10, "chatty aklog finishes before the timeout");
+    basprintf(&prefix, "aklog program %s exited with status 0 after ", aklog);
+    is_int(1, count_lines(output, LOG_DEBUG, prefix), "...successfully");
+    free(prefix);
+    is_int(1, count_lines(output, LOG_DEBUG, "aklog: (further output"),
+           "...with its output truncated");
+    ok(count_lines(output, LOG_DEBUG, "aklog: ") <= 4,
+       "...to a few lines");
+    pam_output_free(output);
+
+    /* Clean up. */
+    free(program);
+    test_file_path_free(aklog);
+    return 0;
+}
@@ -0,0 +1,172 @@
+/*
+ * Test starting token acquisition early from pam_sm_authenticate.
+ *
+ * Uses a fake aklog that takes a while to run and the fakekafs layer, which
+ * can hand out and accept a single fake token, to check that authenticate
+ * starts obtaining tokens in the background without waiting for aklog and
+ * that opening the session then takes those tokens instead of running aklog
+ * again.  This is checked both with KRB5CCNAME set throughout and in the
+ * order pam_krb5 uses, with only PAM_KRB5CCNAME set during authentication
+ * and the ticket cache moved to a new name for the session.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <pwd.h>
+#include <time.h>
+
+#include <tests/fakepam/pam.h>
+#include <tests/module/util.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+/* Provided by the fakekafs layer. */
+extern bool fakekafs_token;
+extern int fakekafs_settok;
+
+
+/*
+ * Count the number of lines in a file, returning 0 if it doesn't exist.
+ */
+static int
+count_lines(const char *path)
+{
+    FILE *file;
+    int c;
+    int count = 0;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        return 0;
+    while ((c = getc(file)) != EOF)
+        if (c == '\n')
+            count++;
+    fclose(file);
+    return count;
+}
+
+
+/*
+ * Authenticate, which should start aklog in the background and return.  The
+ * fake aklog can't change our token state, so pretend that the background
+ * process already has a token once it's run.  Runs two tests and returns
+ * the start time.
+ */
+static time_t
+authenticate(pam_handle_t *pamh, const char **argv, const char *what)
+{
+    time_t start;
+    int status;
+
+    if (pam_putenv(pamh, "AKLOG_SLEEP=2") != PAM_SUCCESS)
+        sysbail("cannot set PAM environment variable");
+    fakekafs_token = true;
+    start = time(NULL);
+    status = pam_sm_authenticate(pamh, 0, 3, argv);
+    is_int(PAM_SUCCESS, status, "authenticate %s", what);
+    ok(time(NULL) - start < 2, "...without waiting for aklog");
+    fakekafs_token = false;
+    return start;
+}
+
+
+/*
+ * Open the session, which should wait for and use the prefetched token.
+ * Runs five tests.
+ */
+static void
+open_session(pam_handle_t *pamh, const char **argv, time_t start)
+{
+    int status;
+
+    fakekafs_settok = 0;
+    status = pam_sm_open_session(pamh, 0, 3, argv);
+    is_int(PAM_SUCCESS, status, "open session");
+    ok(time(NULL) - start >= 2, "...after waiting for aklog");
+    ok(fakekafs_token, "...and the token was put in the PAG");
+    is_int(1, fakekafs_settok, "...with one VIOCSETTOK call");
+    is_int(1, count_lines("aklog-runs"), "...and aklog was only run once");
+    unlink("aklog-runs");
+}
+
+
+int
+main(void)
+{
+    struct passwd *user;
+    pam_handle_t *pamh;
+    char *aklog, *tmpdir, *program, *state, *cache, *session, *env;
+    const char *argv[] = { NULL, NULL, "prefetch_tokens", NULL };
+    time_t start;
+
+#ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+#endif
+    plan(14);
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        bail("cannot find username of current user");
+    pam_set_pwd(user);
+
+    /* Set up the module arguments. */
+    aklog = test_file_path("data/fake-aklog-slow");
+    tmpdir = test_tmpdir();
+    basprintf(&program, "program=%s", aklog);
+    basprintf(&state, "state_dir=%s/state", tmpdir);
+    argv[0] = program;
+    argv[1] = state;
+    cache = module_cache("krb5cc_test", time(NULL) + 3600);
+    unlink("aklog-runs");
+
+    /* The same ticket cache is used throughout. */
+    pamh = module_start(user, cache);
+    start = authenticate(pamh, argv, "with KRB5CCNAME");
+    open_session(pamh, argv, start);
+    pam_end(pamh, 0);
+
+    /*
+     * pam_krb5 only sets PAM_KRB5CCNAME during authentication, and then puts
+     * the same credentials in a new ticket cache in pam_setcred and sets
+     * KRB5CCNAME to it.  Simulate that by renaming the cache.
+     */
+    pamh = module_start(user, NULL);
+    basprintf(&env, "PAM_KRB5CCNAME=%s", cache);
+    if (pam_putenv(pamh, env) != PAM_SUCCESS)
+        sysbail("cannot set PAM environment variable");
+    free(env);
+    start = authenticate(pamh, argv, "with PAM_KRB5CCNAME");
+    if (strncmp(cache, "FILE:", strlen("FILE:")) == 0) {
+        basprintf(&session, "FILE:krb5cc_session");
+        if (rename(cache + strlen("FILE:"), "krb5cc_session") < 0)
+            sysbail("cannot rename ticket cache");
+    } else
+        session = bstrdup("krb5cc_session");
+    basprintf(&env, "KRB5CCNAME=%s", session);
+    if (pam_putenv(pamh, env) != PAM_SUCCESS)
+        sysbail("cannot set PAM environment variable");
+    free(env);
+    open_session(pamh, argv, start);
+    pam_end(pamh, 0);
+
+    /* Clean up. */
+    unlink("aklog-runs");
+    module_cache_free(cache);
+    module_cache_free(session);
+    free(program);
+    free(state);
+    basprintf(&state, "%s/state", tmpdir);
+    module_state_remove(state);
+    free(state);
+    test_tmpdir_free(tmpdir);
+    test_file_path_free(aklog);
+    return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * Test passing the realms of cells from cell_realms to aklog.
+ *
+ * Opens sessions with afs_cells and cell_realms set and checks that aklog is
+ * told the realm of each cell that has one and that invalid entries are
+ * ignored.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <pwd.h>
+
+#include <tests/fakepam/pam.h>
+#include <tests/module/util.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Open and close a session and check that aklog was run with the expected
+ * arguments.
+ */
+static void
+is_session_args(struct passwd *user, int argc, const char **argv,
+                const char *expected, const char *message)
+{
+    pam_handle_t *pamh;
+    char buffer[BUFSIZ];
+    FILE *file;
+
+    pamh = module_start(user, "krb5cc_test");
+    unlink("aklog-args");
+    is_int(PAM_SUCCESS, pam_sm_open_session(pamh, 0, argc, argv),
+           "open session for %s", message);
+    buffer[0] = '\0';
+    file = fopen("aklog-args", "r");
+    if (file != NULL) {
+        if (fgets(buffer, sizeof(buffer), file) == NULL)
+            buffer[0] = '\0';
+        buffer[strcspn(buffer, "\n")] = '\0';
+        fclose(file);
+    }
+    is_string(expected, buffer, "...and aklog arguments");
+    pam_sm_close_session(pamh, 0, argc, argv);
+    pam_end(pamh, 0);
+    unlink("aklog-args");
+}
+
+
+int
+main(void)
+{
+    struct passwd *user;
+    char *aklog, *program;
+    const char *argv[] = {
+        NULL, "afs_cells=example.com,example.edu,example.org",
+        "cell_realms=example.com=EXAMPLE.COM,example.org=AD.EXAMPLE.ORG",
+        NULL
+    };
+
+#ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+#endif
+    plan(10);
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        bail("cannot find username of current user");
+    pam_set_pwd(user);
+
+    /* Set up the module arguments. */
+    aklog = test_file_path("data/fake-aklog");
+    if (aklog == NULL)
+        bail("cannot find fake-aklog");
+    basprintf(&program, "program=%s", aklog);
+    argv[0] = program;
+
+    /* All cells in one aklog run. */
+    is_session_args(user, 3, argv,
+                    "-c example.com -k EXAMPLE.COM -c example.edu"
+                    " -c example.org -k AD.EXAMPLE.ORG", "all cells");
+
+    /* Invalid entries are ignored. */
+    argv[1] = "afs_cells=example.com";
+    argv[2] = "cell_realms=bogus,=EXAMPLE.NET,example.com=EXAMPLE.COM";
+    is_session_args(user, 3, argv, "-c example.com -k EXAMPLE.COM",
+                    "one cell");
+
+    /* That includes entries with an empty realm. */
+    argv[2] = "cell_realms=example.com=,example.com=EXAMPLE.COM";
+    is_session_args(user, 3, argv, "-c example.com -k EXAMPLE.COM",
+                    "one cell after an empty realm");
+    argv[2] = "cell_realms=example.com=";
+    is_session_args(user, 3, argv, "-c example.com", "an empty realm");
+
+    /* Without afs_cells, there's no cell to look up. */
+    argv[1] = "debug";
+    is_session_args(user, 3, argv, "", "the default cell");
+
+    /* Clean up. */
+    free(program);
+    test_file_path_free(aklog);
+    return 0;
+}
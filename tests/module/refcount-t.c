@@ -0,0 +1,158 @@
+/*
+ * Test reference counting of sessions sharing tokens without PAGs.
+ *
+ * Opens two sessions for the same user with nopag and unlog_refcount set and
+ * checks that closing the first leaves the tokens alone and closing the
+ * second deletes them, unless unlog_grace defers that.  Also checks that a
+ * session whose process exited without closing it doesn't keep the tokens.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <pwd.h>
+#include <sys/wait.h>
+
+#include <tests/fakepam/pam.h>
+#include <tests/module/util.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+/* Provided by the fakekafs layer. */
+extern bool fakekafs_token;
+
+
+/*
+ * Open a session with a new PAM handle for the given user and return the
+ * handle.
+ */
+static pam_handle_t *
+open_session(struct passwd *user, int argc, const char **argv)
+{
+    pam_handle_t *pamh;
+    int status;
+
+    pamh = module_start(user, "krb5cc_test");
+    status = pam_sm_open_session(pamh, 0, argc, argv);
+    is_int(PAM_SUCCESS, status, "open session");
+    return pamh;
+}
+
+
+/*
+ * Close a session and free the PAM handle.
+ */
+static void
+close_session(pam_handle_t *pamh, int argc, const char **argv)
+{
+    int status;
+
+    status = pam_sm_close_session(pamh, 0, argc, argv);
+    is_int(PAM_SUCCESS, status, "close session");
+    pam_end(pamh, 0);
+}
+
+
+int
+main(void)
+{
+    struct passwd *user;
+    pam_handle_t *first, *second;
+    char *aklog, *tmpdir, *program, *state;
+    pid_t child;
+    int status;
+    const char *argv[] = {
+        NULL, NULL, "nopag", "unlog_refcount", "unlog_grace=1", NULL
+    };
+
+#ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+#endif
+    plan(20);
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        bail("cannot find username of current user");
+    pam_set_pwd(user);
+
+    /* Set up the module arguments. */
+    aklog = test_file_path("data/fake-aklog");
+    if (aklog == NULL)
+        bail("cannot find fake-aklog");
+    tmpdir = test_tmpdir();
+    basprintf(&program, "program=%s", aklog);
+    basprintf(&state, "state_dir=%s/state", tmpdir);
+    argv[0] = program;
+    argv[1] = state;
+
+    /*
+     * The fake aklog can't change our token state, so pretend it did.  Only
+     * the last of two sessions to close deletes the tokens.
+     */
+    fakekafs_token = true;
+    first = open_session(user, 4, argv);
+    second = open_session(user, 4, argv);
+    close_session(first, 4, argv);
+    ok(fakekafs_token, "...and tokens were kept for the other session");
+    close_session(second, 4, argv);
+    ok(!fakekafs_token, "...and tokens were deleted by the last session");
+
+    /* The count goes back to zero, so a new session is alone again. */
+    fakekafs_token = true;
+    first = open_session(user, 4, argv);
+    close_session(first, 4, argv);
+    ok(!fakekafs_token, "...and a single session deletes its tokens");
+
+    /*
+     * A session opened by a process that then exits without closing it, as
+     * if the application crashed, doesn't keep the tokens forever.
+     */
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        first = module_start(user, "krb5cc_test");
+        status = pam_sm_open_session(first, 0, 4, argv);
+        _exit(status == PAM_SUCCESS ? 0 : 1);
+    }
+    if (waitpid(child, &status, 0) != child)
+        sysbail("cannot wait for child");
+    is_int(0, status, "session opened in a process that exited");
+    fakekafs_token = true;
+    first = open_session(user, 4, argv);
+    close_session(first, 4, argv);
+    ok(!fakekafs_token, "...and it doesn't keep the tokens");
+
+    /* With unlog_grace, the last session leaves deleting them for later. */
+    fakekafs_token = true;
+    first = open_session(user, 5, argv);
+    close_session(first, 5, argv);
+    ok(fakekafs_token, "...and unlog_grace defers deleting tokens");
+    sleep(2);
+
+    /* Without nopag, sessions aren't counted. */
+    argv[2] = "debug";
+    first = open_session(user, 4, argv);
+    second = open_session(user, 4, argv);
+    close_session(first, 4, argv);
+    ok(!fakekafs_token, "...and each session deletes tokens with PAGs");
+    pam_end(second, 0);
+
+    /* Clean up. */
+    free(state);
+    basprintf(&state, "%s/state", tmpdir);
+    module_state_remove(state);
+    free(state);
+    free(program);
+    unlink("aklog-args");
+    test_tmpdir_free(tmpdir);
+    test_file_path_free(aklog);
+    return 0;
+}
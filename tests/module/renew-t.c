@@ -0,0 +1,121 @@
+/*
+ * Test renewing tokens for the life of a session.
+ *
+ * Opens a session with renew_tokens set and tokens that expire just after
+ * the renewal margin, and checks that the renewal process runs aklog again
+ * shortly afterwards.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <pwd.h>
+#include <time.h>
+
+#include <tests/fakepam/pam.h>
+#include <tests/module/util.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+/* Provided by the fake kafs library. */
+extern bool fakekafs_token;
+extern time_t fakekafs_token_expires;
+
+
+/*
+ * Wait for up to the given number of seconds for aklog to be run, which the
+ * fake aklog shows by creating aklog-args.  Returns true if it was run.
+ */
+static bool
+wait_for_aklog(int seconds)
+{
+    int i;
+
+    for (i = 0; i < seconds * 10; i++) {
+        if (access("aklog-args", F_OK) == 0)
+            return true;
+        usleep(100 * 1000);
+    }
+    return false;
+}
+
+
+int
+main(void)
+{
+    struct passwd *user;
+    pam_handle_t *pamh;
+    char *aklog, *program;
+    const char *argv[] = { NULL, "renew_tokens", "renew_margin=600", NULL };
+    const char *pag_argv[] = {
+        NULL, "renew_tokens", "renew_margin=600", "renew_pag",
+        "retain_after_close", NULL
+    };
+    int status;
+
+#ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+#endif
+    plan(7);
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        bail("cannot find username of current user");
+    pam_set_pwd(user);
+
+    /* Set up the module arguments. */
+    aklog = test_file_path("data/fake-aklog");
+    if (aklog == NULL)
+        bail("cannot find fake-aklog");
+    basprintf(&program, "program=%s", aklog);
+    argv[0] = program;
+    pag_argv[0] = program;
+
+    /*
+     * The tokens expire two seconds after they're due for renewal, so the
+     * renewal process should run aklog again about two seconds after the
+     * session is opened.
+     */
+    fakekafs_token = true;
+    fakekafs_token_expires = time(NULL) + 600 + 2;
+    pamh = module_start(user, "krb5cc_test");
+    unlink("aklog-args");
+    status = pam_sm_open_session(pamh, 0, 3, argv);
+    is_int(PAM_SUCCESS, status, "open session");
+    ok(access("aklog-args", F_OK) == 0, "...and aklog was run");
+    unlink("aklog-args");
+    ok(wait_for_aklog(6), "tokens were renewed");
+
+    status = pam_sm_close_session(pamh, 0, 3, argv);
+    is_int(PAM_SUCCESS, status, "close session");
+    pam_end(pamh, 0);
+
+    /*
+     * With renew_pag, the renewal process outlives the application only if
+     * other processes are in a PAG it can see.  The fake PAG isn't a group,
+     * so it still exits once the application is done with the session.
+     */
+    fakekafs_token = true;
+    fakekafs_token_expires = time(NULL) + 600 + 2;
+    pamh = module_start(user, "krb5cc_test");
+    status = pam_sm_open_session(pamh, 0, 5, pag_argv);
+    is_int(PAM_SUCCESS, status, "open session with renew_pag");
+    status = pam_sm_close_session(pamh, 0, 5, pag_argv);
+    is_int(PAM_IGNORE, status, "...and close it, retaining tokens");
+    pam_end(pamh, 0);
+    unlink("aklog-args");
+    ok(!wait_for_aklog(4), "...and tokens not renewed without a PAG group");
+
+    /* Clean up. */
+    unlink("aklog-args");
+    free(program);
+    test_file_path_free(aklog);
+    return 0;
+}
@@ -0,0 +1,581 @@
+/*
+ * Replay a trace of PAM calls against pam-afs-session.
+ *
+ * Reads a trace written by the module with the trace_calls option and makes
+ * the same calls, with the same flags and PAM service, using the fake PAM
+ * and kafs libraries.  The calls made by each process in the trace are made
+ * in order by one child process, so sessions from different processes
+ * overlap as they did when the trace was recorded.  Each child starts a new
+ * PAM handle when the service changes or when a new session starts after
+ * the previous one was closed.
+ * Each call is made at its recorded time relative to the first call,
+ * divided by the speed set with -s (1 by default, or 0 to make each call as
+ * soon as the previous call of the same process has finished).  All calls
+ * are made for the current user.  Tokens are obtained by running an
+ * external program (by default /bin/true, set with -a).
+ *
+ * Results are written as JSON with one result per line, giving the number
+ * of calls, failures, and the 50th, 99th, and 99.9th percentile latency in
+ * microseconds of each entry point, and how far behind schedule calls were
+ * made.  With -p, the trace is printed instead, one call per line.  Exits
+ * with status 2 on any error.
+ *
+ * Any arguments after the trace are passed to the module as PAM options.
+ * This is not run as part of the test suite except by trace-t.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <tests/fakepam/pam.h>
+#include <trace.h>
+
+/* Some systems only have the older name for anonymous mappings. */
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* The names of the entry points and classes of user. */
+static const char *const call_names[PAMAFS_CALL_MAX] = {
+    "authenticate", "setcred", "open_session", "close_session"
+};
+static const char *const class_names[PAMAFS_CLASS_MAX] = {
+    "unknown", "root", "system", "user"
+};
+
+/* The result of one replayed call, shared with the parent. */
+struct replay_result {
+    uint64_t latency;           /* Nanoseconds the call took. */
+    uint64_t lag;               /* Nanoseconds it started behind schedule. */
+    int status;                 /* PAM status returned. */
+    bool done;                  /* Whether the call was made. */
+};
+
+/* A record's process ID and index, for grouping the calls by process. */
+struct replay_index {
+    uint32_t pid;
+    size_t index;
+};
+
+/* Usage message. */
+static const char usage_message[] = "\
+Usage: replay [-p] [-a <aklog>] [-s <speed>] <trace> [<module-option> ...]\n";
+
+
+/*
+ * Report a fatal error and exit with status 2.
+ */
+static void __attribute__((__noreturn__, __format__(printf, 1, 2)))
+die(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+
+/*
+ * Return the current time on the monotonic clock in nanoseconds.
+ */
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        die("cannot read clock: %s", strerror(errno));
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+
+/*
+ * Sleep until the given time on the monotonic clock.
+ */
+static void
+sleep_until(uint64_t when)
+{
+    struct timespec delay;
+    uint64_t now;
+
+    for (now = now_ns(); now < when; now = now_ns()) {
+        delay.tv_sec = (time_t) ((when - now) / 1000000000ULL);
+        delay.tv_nsec = (long) ((when - now) % 1000000000ULL);
+        nanosleep(&delay, NULL);
+    }
+}
+
+
+/*
+ * Sort trace records by time, keeping records with the same time in the
+ * order they were written.  The trace is almost in order already, so an
+ * insertion sort is fast.
+ */
+static void
+sort_records(struct pamafs_trace *records, size_t count)
+{
+    struct pamafs_trace record;
+    size_t i, j;
+
+    for (i = 1; i < count; i++) {
+        record = records[i];
+        for (j = i; j > 0 && records[j - 1].time > record.time; j--)
+            records[j] = records[j - 1];
+        records[j] = record;
+    }
+}
+
+
+/*
+ * Comparison function for sorting records by process and then index.
+ */
+static int
+compare_index(const void *a, const void *b)
+{
+    const struct replay_index *x = a;
+    const struct replay_index *y = b;
+
+    if (x->pid != y->pid)
+        return (x->pid > y->pid) - (x->pid < y->pid);
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+
+/*
+ * Comparison function for sorting latencies.
+ */
+static int
+compare_ns(const void *a, const void *b)
+{
+    const uint64_t *x = a;
+    const uint64_t *y = b;
+
+    return (*x > *y) - (*x < *y);
+}
+
+
+/*
+ * Return the given percentile (between 0 and 1) of a sorted array of
+ * latencies in microseconds, using the nearest rank.
+ */
+static double
+percentile(const uint64_t *sorted, size_t count, double p)
+{
+    size_t rank;
+
+    if (count == 0)
+        return 0.0;
+    rank = (size_t) (p * (double) count + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > count)
+        rank = count;
+    return (double) sorted[rank - 1] / 1000.0;
+}
+
+
+/*
+ * Read a trace and return its records in newly allocated memory, sorted by
+ * time, storing their number in count.  Dies if the trace is malformed.
+ */
+static struct pamafs_trace *
+read_trace(const char *file, size_t *count)
+{
+    struct pamafs_trace *records;
+    struct stat st;
+    size_t i;
+    ssize_t status;
+    int fd;
+
+    fd = open(file, O_RDONLY);
+    if (fd < 0)
+        die("cannot open %s: %s", file, strerror(errno));
+    if (fstat(fd, &st) < 0)
+        die("cannot stat %s: %s", file, strerror(errno));
+    if (st.st_size <= 0 || st.st_size % sizeof(struct pamafs_trace) != 0)
+        die("%s is empty or not a trace", file);
+    *count = (size_t) st.st_size / sizeof(struct pamafs_trace);
+    records = calloc(*count, sizeof(struct pamafs_trace));
+    if (records == NULL)
+        die("cannot allocate memory: %s", strerror(errno));
+    status = read(fd, records, (size_t) st.st_size);
+    if (status != st.st_size)
+        die("cannot read %s", file);
+    close(fd);
+    for (i = 0; i < *count; i++)
+        if (records[i].version != PAMAFS_TRACE_VERSION
+            || records[i].call >= PAMAFS_CALL_MAX)
+            die("%s has an unknown format", file);
+    sort_records(records, *count);
+    return records;
+}
+
+
+/*
+ * Print the trace, one call per line, with times relative to the first.
+ */
+static void
+print_trace(const struct pamafs_trace *records, size_t count)
+{
+    const struct pamafs_trace *record;
+    unsigned int class;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        record = &records[i];
+        class = record->user_class;
+        if (class >= PAMAFS_CLASS_MAX)
+            class = PAMAFS_CLASS_UNKNOWN;
+        printf("%.6f pid=%lu %s service=%.*s user=%s flags=0x%x\n",
+               (double) (record->time - records[0].time) / 1e6,
+               (unsigned long) record->pid, call_names[record->call],
+               PAMAFS_TRACE_SERVICE, record->service, class_names[class],
+               (unsigned int) record->flags);
+    }
+}
+
+
+/*
+ * Return a newly allocated array giving, for each record, the index of the
+ * next record from the same process or count if there is none, and set
+ * first for each record to whether it's the first from its process.
+ */
+static size_t *
+link_processes(const struct pamafs_trace *records, size_t count, bool *first)
+{
+    struct replay_index *order;
+    size_t *next;
+    size_t i;
+
+    order = calloc(count, sizeof(struct replay_index));
+    next = calloc(count, sizeof(size_t));
+    if (order == NULL || next == NULL)
+        die("cannot allocate memory: %s", strerror(errno));
+    for (i = 0; i < count; i++) {
+        order[i].pid = records[i].pid;
+        order[i].index = i;
+    }
+    qsort(order, count, sizeof(struct replay_index), compare_index);
+    for (i = 0; i < count; i++) {
+        first[order[i].index] = (i == 0 || order[i - 1].pid != order[i].pid);
+        if (i + 1 < count && order[i + 1].pid == order[i].pid)
+            next[order[i].index] = order[i + 1].index;
+        else
+            next[order[i].index] = count;
+    }
+    free(order);
+    return next;
+}
+
+
+/*
+ * Make one call on a PAM handle, returning its status.
+ */
+static int
+replay_call(pam_handle_t *pamh, const struct pamafs_trace *record, int argc,
+            const char **argv)
+{
+    switch ((enum pamafs_event_call) record->call) {
+    case PAMAFS_CALL_AUTHENTICATE:
+        return pam_sm_authenticate(pamh, record->flags, argc, argv);
+    case PAMAFS_CALL_SETCRED:
+        return pam_sm_setcred(pamh, record->flags, argc, argv);
+    case PAMAFS_CALL_OPEN_SESSION:
+        return pam_sm_open_session(pamh, record->flags, argc, argv);
+    case PAMAFS_CALL_CLOSE_SESSION:
+        return pam_sm_close_session(pamh, record->flags, argc, argv);
+    case PAMAFS_CALL_MAX:
+    default:
+        return PAM_SYSTEM_ERR;
+    }
+}
+
+
+/*
+ * Return when a record should be replayed, given when the replay started and
+ * its speed.
+ */
+static uint64_t
+replay_due(const struct pamafs_trace *records, size_t i, uint64_t start,
+           double speed)
+{
+    if (speed <= 0)
+        return start;
+    return start + (uint64_t) ((double) (records[i].time - records[0].time)
+                               * 1000.0 / speed);
+}
+
+
+/*
+ * Return whether a new PAM handle is needed for a record, given the service
+ * of the current handle (the empty string if there is none) and whether its
+ * session has been closed.  A process may go on to start another session
+ * after closing one, but may also delete credentials after closing the
+ * session, which is done with the same handle.
+ */
+static bool
+replay_new_handle(const struct pamafs_trace *record, const char *service,
+                  bool closed)
+{
+    if (service[0] == '\0'
+        || strncmp(record->service, service, PAMAFS_TRACE_SERVICE) != 0)
+        return true;
+    if (!closed)
+        return false;
+    switch ((enum pamafs_event_call) record->call) {
+    case PAMAFS_CALL_AUTHENTICATE:
+    case PAMAFS_CALL_OPEN_SESSION:
+        return true;
+    case PAMAFS_CALL_SETCRED:
+        return !(record->flags & PAM_DELETE_CRED);
+    case PAMAFS_CALL_CLOSE_SESSION:
+    case PAMAFS_CALL_MAX:
+    default:
+        return false;
+    }
+}
+
+
+/*
+ * Replay the calls of one process in the trace, starting with the call at
+ * index first and following next, storing the results in the shared results
+ * array.  start is when the replay started and speed the speed of the
+ * replay.  Runs in a child process and exits when done.
+ */
+static void __attribute__((__noreturn__))
+replay_process(const struct pamafs_trace *records, size_t count,
+               const size_t *next, size_t first,
+               struct replay_result *results, uint64_t start, double speed,
+               struct passwd *user, int argc, const char **argv)
+{
+    pam_handle_t *pamh = NULL;
+    struct pam_conv conv = { NULL, NULL };
+    char service[PAMAFS_TRACE_SERVICE + 1] = "";
+    uint64_t due, begin;
+    size_t i;
+    bool closed = false;
+
+    for (i = first; i < count; i = next[i]) {
+        if (replay_new_handle(&records[i], service, closed)) {
+            if (pamh != NULL)
+                pam_end(pamh, 0);
+            memcpy(service, records[i].service, PAMAFS_TRACE_SERVICE);
+            service[PAMAFS_TRACE_SERVICE] = '\0';
+            if (pam_start(service, user->pw_name, &conv, &pamh)
+                != PAM_SUCCESS)
+                die("cannot create PAM handle");
+            if (pam_putenv(pamh, "KRB5CCNAME=krb5cc_replay") != PAM_SUCCESS)
+                die("cannot set PAM environment variable");
+            closed = false;
+        }
+        if (records[i].call == PAMAFS_CALL_CLOSE_SESSION)
+            closed = true;
+        due = replay_due(records, i, start, speed);
+        sleep_until(due);
+        begin = now_ns();
+        results[i].status = replay_call(pamh, &records[i], argc, argv);
+        results[i].latency = now_ns() - begin;
+        results[i].lag = begin - due;
+        results[i].done = true;
+        pam_output_free(pam_output());
+    }
+    pam_end(pamh, 0);
+    exit(0);
+}
+
+
+/*
+ * Replay the trace, starting one child process for each process in the
+ * trace just before its first call, and wait for all of them to finish.
+ */
+static void
+replay_trace(const struct pamafs_trace *records, size_t count,
+             struct replay_result *results, double speed,
+             struct passwd *user, int argc, const char **argv)
+{
+    uint64_t start;
+    size_t *next;
+    size_t i, processes = 0;
+    pid_t child;
+    bool *first;
+    int status;
+
+    first = calloc(count, sizeof(bool));
+    if (first == NULL)
+        die("cannot allocate memory: %s", strerror(errno));
+    next = link_processes(records, count, first);
+    start = now_ns();
+    for (i = 0; i < count; i++) {
+        if (!first[i])
+            continue;
+        sleep_until(replay_due(records, i, start, speed));
+        fflush(stdout);
+        child = fork();
+        if (child < 0)
+            die("cannot fork: %s", strerror(errno));
+        else if (child == 0)
+            replay_process(records, count, next, i, results, start, speed,
+                           user, argc, argv);
+        processes++;
+        while (waitpid(-1, &status, WNOHANG) > 0)
+            processes--;
+    }
+    for (; processes > 0; processes--)
+        if (waitpid(-1, &status, 0) < 0)
+            die("cannot wait for child: %s", strerror(errno));
+    free(first);
+    free(next);
+}
+
+
+/*
+ * Write the results as JSON, one result per line.
+ */
+static void
+write_results(const struct pamafs_trace *records, size_t count,
+              const struct replay_result *results, double speed)
+{
+    uint64_t *latencies, *lags;
+    size_t i, n, nlags = 0;
+    unsigned long failures;
+    unsigned int call;
+
+    latencies = calloc(count, sizeof(uint64_t));
+    lags = calloc(count, sizeof(uint64_t));
+    if (latencies == NULL || lags == NULL)
+        die("cannot allocate memory: %s", strerror(errno));
+    for (i = 0; i < count; i++)
+        if (results[i].done)
+            lags[nlags++] = results[i].lag;
+    qsort(lags, nlags, sizeof(uint64_t), compare_ns);
+    printf("{\n  \"calls\": %lu,\n  \"replayed\": %lu,\n"
+           "  \"recorded_s\": %.3f,\n  \"speed\": %.2f,\n"
+           "  \"lag_p50_us\": %.1f,\n  \"lag_p99_us\": %.1f,\n"
+           "  \"results\": [\n", (unsigned long) count,
+           (unsigned long) nlags,
+           (double) (records[count - 1].time - records[0].time) / 1e6,
+           speed, percentile(lags, nlags, 0.50),
+           percentile(lags, nlags, 0.99));
+    for (call = 0; call < PAMAFS_CALL_MAX; call++) {
+        failures = 0;
+        for (n = 0, i = 0; i < count; i++) {
+            if (records[i].call != call || !results[i].done)
+                continue;
+            latencies[n++] = results[i].latency;
+            if (results[i].status != PAM_SUCCESS
+                && results[i].status != PAM_IGNORE)
+                failures++;
+        }
+        qsort(latencies, n, sizeof(uint64_t), compare_ns);
+        printf("    { \"call\": \"%s\", \"count\": %lu, \"failures\": %lu,"
+               " \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f }%s\n",
+               call_names[call], (unsigned long) n, failures,
+               percentile(latencies, n, 0.50),
+               percentile(latencies, n, 0.99),
+               percentile(latencies, n, 0.999),
+               (call < PAMAFS_CALL_MAX - 1) ? "," : "");
+    }
+    printf("  ]\n}\n");
+    free(latencies);
+    free(lags);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct passwd *user;
+    struct pamafs_trace *records;
+    struct replay_result *results;
+    const char **options;
+    const char *aklog = "/bin/true";
+    char *program;
+    size_t count;
+    double speed = 1.0;
+    bool print = false;
+    int option, i, noptions;
+
+    while ((option = getopt(argc, argv, "a:hps:")) != EOF) {
+        switch (option) {
+        case 'a':
+            aklog = optarg;
+            break;
+        case 'h':
+            printf("%s", usage_message);
+            exit(0);
+        case 'p':
+            print = true;
+            break;
+        case 's':
+            speed = strtod(optarg, NULL);
+            break;
+        default:
+            fprintf(stderr, "%s", usage_message);
+            exit(2);
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "%s", usage_message);
+        exit(2);
+    }
+    if (speed < 0)
+        die("speed must not be negative");
+    records = read_trace(argv[optind], &count);
+    if (print) {
+        print_trace(records, count);
+        free(records);
+        return 0;
+    }
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        die("cannot find username of current user");
+    pam_set_pwd(user);
+
+    /* Build the module options, with program first. */
+    noptions = argc - optind - 1;
+    options = calloc((size_t) noptions + 2, sizeof(const char *));
+    if (options == NULL)
+        die("cannot allocate memory: %s", strerror(errno));
+    if (asprintf(&program, "program=%s", aklog) < 0)
+        die("cannot allocate memory: %s", strerror(errno));
+    options[0] = program;
+    for (i = 0; i < noptions; i++)
+        options[i + 1] = argv[optind + 1 + i];
+
+    /* Replay the trace with the results in memory shared with children. */
+    results = mmap(NULL, count * sizeof(struct replay_result),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED)
+        die("cannot map memory: %s", strerror(errno));
+    memset(results, 0, count * sizeof(struct replay_result));
+    replay_trace(records, count, results, speed, user, noptions + 1,
+                 options);
+    write_results(records, count, results, speed);
+
+    /* Clean up. */
+    munmap((void *) results, count * sizeof(struct replay_result));
+    free(program);
+    free(options);
+    free(records);
+    return 0;
+}
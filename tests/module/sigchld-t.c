@@ -78,6 +78,17 @@ main(void)
     is_int(0, child_signaled, "...and SIGCHLD handler not run");
     unlink("aklog-args");
 
+    /*
+     * With thread_safe, SIGCHLD is left alone, so if the application ignores
+     * it, aklog is reaped before the module can wait for it.  Check that this
+     * is reported as such.
+     */
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGCHLD, &sa, NULL) < 0)
+        sysbail("cannot ignore SIGCHLD");
+    run_script("data/scripts/sigchld/ignored", &config);
+    unlink("aklog-args");
+
     /* Clean up. */
     test_file_path_free(aklog);
     return 0;
@@ -0,0 +1,148 @@
+/*
+ * Test the host-wide limit on simultaneous token acquisitions.
+ *
+ * Starts several processes that open sessions at the same moment with a
+ * single token slot, using a fake aklog that takes a while to run and notices
+ * if another copy is running, and checks that sessions either wait their turn
+ * or give up on tokens depending on how long they're allowed to wait.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <pwd.h>
+#include <sys/wait.h>
+
+#include <tests/fakepam/pam.h>
+#include <tests/module/util.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+/* The number of simultaneous sessions to start. */
+#define SESSIONS 3
+
+
+/*
+ * Count the number of lines in a file, returning 0 if it doesn't exist.
+ */
+static int
+count_lines(const char *path)
+{
+    FILE *file;
+    int c;
+    int count = 0;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        return 0;
+    while ((c = getc(file)) != EOF)
+        if (c == '\n')
+            count++;
+    fclose(file);
+    return count;
+}
+
+
+/*
+ * Start SESSIONS processes that each open a session with the given module
+ * arguments as soon as the last one has been started, and wait for them all.
+ * Returns the number of sessions that failed.
+ */
+static int
+run_sessions(struct passwd *user, const char **argv, int argc)
+{
+    pam_handle_t *pamh;
+    int i, fds[2], status;
+    int failed = 0;
+    char buffer;
+    pid_t child;
+
+    unlink("aklog-runs");
+    unlink("aklog-overlap");
+    if (pipe(fds) < 0)
+        sysbail("cannot create pipe");
+    for (i = 0; i < SESSIONS; i++) {
+        fflush(stdout);
+        child = fork();
+        if (child < 0)
+            sysbail("cannot fork");
+        else if (child > 0)
+            continue;
+        close(fds[1]);
+        if (read(fds[0], &buffer, 1) < 0)
+            _exit(1);
+        pamh = module_start(user, "krb5cc_test");
+        if (pam_sm_open_session(pamh, 0, argc, argv) != PAM_SUCCESS)
+            _exit(1);
+        pam_end(pamh, 0);
+        _exit(0);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    for (i = 0; i < SESSIONS; i++) {
+        if (wait(&status) < 0)
+            sysbail("cannot wait for child");
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed++;
+    }
+    return failed;
+}
+
+
+int
+main(void)
+{
+    struct passwd *user;
+    char *aklog, *tmpdir, *program, *state;
+    const char *argv[] = { NULL, NULL, "aklog_slots=1", NULL, NULL };
+
+#ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+#endif
+    plan(6);
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        bail("cannot find username of current user");
+    pam_set_pwd(user);
+
+    /* Set up the module arguments. */
+    aklog = test_file_path("data/fake-aklog-slow");
+    tmpdir = test_tmpdir();
+    basprintf(&program, "program=%s", aklog);
+    basprintf(&state, "state_dir=%s/state", tmpdir);
+    argv[0] = program;
+    argv[1] = state;
+
+    /* Without waiting, only one session gets a slot. */
+    argv[3] = "aklog_slot_wait=0";
+    is_int(0, run_sessions(user, argv, 4), "sessions without waiting");
+    is_int(1, count_lines("aklog-runs"), "...and aklog was run once");
+    ok(access("aklog-overlap", F_OK) < 0, "...with no overlap");
+
+    /* With enough time, all sessions get tokens one at a time. */
+    argv[3] = "aklog_slot_wait=30";
+    is_int(0, run_sessions(user, argv, 4), "sessions with waiting");
+    is_int(SESSIONS, count_lines("aklog-runs"), "...and aklog was run each"
+           " time");
+    ok(access("aklog-overlap", F_OK) < 0, "...with no overlap");
+
+    /* Clean up. */
+    unlink("aklog-runs");
+    unlink("aklog-overlap");
+    free(program);
+    free(state);
+    basprintf(&state, "%s/state", tmpdir);
+    module_state_remove(state);
+    free(state);
+    test_tmpdir_free(tmpdir);
+    test_file_path_free(aklog);
+    return 0;
+}
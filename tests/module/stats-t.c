@@ -0,0 +1,191 @@
+/*
+ * Test the shared statistics kept with the stats option.
+ *
+ * Runs sessions that obtain tokens, fail to obtain tokens, lose their PAG,
+ * and are skipped for various reasons, and then checks the counters and
+ * aklog latency histogram in the statistics file, both directly and through
+ * pam-afs-session-stat.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <pwd.h>
+
+#include <stats.h>
+#include <tests/fakepam/pam.h>
+#include <tests/module/util.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+/* Provided by the fakekafs layer. */
+extern int fakekafs_pag;
+
+
+/*
+ * Open a session with a new PAM handle for the given user, with the given
+ * ticket cache if it's not NULL, and return the handle.
+ */
+static pam_handle_t *
+open_session(struct passwd *user, const char *cache, int argc,
+             const char **argv)
+{
+    pam_handle_t *pamh;
+
+    pamh = module_start(user, cache);
+    is_int(PAM_SUCCESS, pam_sm_open_session(pamh, 0, argc, argv),
+           "open session");
+    return pamh;
+}
+
+
+/*
+ * Read the statistics file from the state directory.
+ */
+static void
+read_stats(const char *state, struct pamafs_stats *stats)
+{
+    char *path;
+    FILE *file;
+
+    basprintf(&path, "%s/%s", state, PAMAFS_STATS_FILE);
+    file = fopen(path, "r");
+    if (file == NULL)
+        sysbail("cannot open %s", path);
+    if (fread(stats, sizeof(*stats), 1, file) != 1)
+        sysbail("cannot read %s", path);
+    fclose(file);
+    free(path);
+}
+
+
+int
+main(void)
+{
+    struct passwd *user;
+    pam_handle_t *pamh;
+    struct pamafs_stats stats;
+    char *aklog, *tmpdir, *program, *state, *minimum, *tool;
+    char *option, *command;
+    char buffer[BUFSIZ];
+    size_t length, i;
+    uint64_t total;
+    FILE *output;
+    const char *argv[] = { NULL, NULL, "stats", NULL, NULL };
+
+#ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+#endif
+    plan(25);
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        bail("cannot find username of current user");
+    pam_set_pwd(user);
+    unsetenv("KRB5CCNAME");
+
+    /* Set up the module arguments. */
+    aklog = test_file_path("data/fake-aklog");
+    if (aklog == NULL)
+        bail("cannot find fake-aklog");
+    basprintf(&program, "program=%s", aklog);
+    tmpdir = test_tmpdir();
+    basprintf(&state, "%s/state", tmpdir);
+    module_state_remove(state);
+    argv[0] = program;
+    basprintf(&option, "state_dir=%s", state);
+    argv[1] = option;
+
+    /* Obtain tokens, lose the PAG, get them again, and close the session. */
+    pamh = open_session(user, "krb5cc_test", 3, argv);
+    fakekafs_pag = 0;
+    is_int(PAM_SUCCESS, pam_sm_open_session(pamh, 0, 3, argv),
+           "open session again");
+    is_int(PAM_SUCCESS, pam_sm_close_session(pamh, 0, 3, argv),
+           "close session");
+    pam_end(pamh, 0);
+
+    /* Skip a session without a ticket cache and one for an ignored user. */
+    pamh = open_session(user, NULL, 3, argv);
+    pam_end(pamh, 0);
+    basprintf(&minimum, "minimum_uid=%lu", (unsigned long) getuid() + 1);
+    argv[3] = minimum;
+    pamh = open_session(user, "krb5cc_test", 4, argv);
+    pam_end(pamh, 0);
+
+    /* Fail to obtain tokens. */
+    argv[0] = "program=/bin/false";
+    pamh = open_session(user, "krb5cc_test", 3, argv);
+    pam_end(pamh, 0);
+
+    /* Check the counters. */
+    read_stats(state, &stats);
+    ok(stats.magic == PAMAFS_STATS_MAGIC, "statistics file has magic");
+    is_int(4, stats.counter[PAMAFS_STAT_LOGINS], "...and logins");
+    is_int(1, stats.counter[PAMAFS_STAT_CLOSES], "...and closes");
+    is_int(2, stats.counter[PAMAFS_STAT_TOKENS_AKLOG], "...and tokens");
+    is_int(1, stats.counter[PAMAFS_STAT_TOKENS_FAILED], "...and failures");
+    is_int(1, stats.counter[PAMAFS_STAT_SKIP_NO_CACHE], "...and no cache");
+    is_int(1, stats.counter[PAMAFS_STAT_SKIP_IGNORED], "...and ignored");
+    is_int(1, stats.counter[PAMAFS_STAT_PAG_LOST], "...and lost PAGs");
+    is_int(3, stats.aklog_count, "...and aklog runs");
+    for (total = 0, i = 0; i < PAMAFS_STATS_BUCKETS; i++)
+        total += stats.aklog_bucket[i];
+    is_int(3, total, "...which are all in the histogram");
+
+    /* Check the output of pam-afs-session-stat. */
+    tool = test_file_path("../tools/pam-afs-session-stat");
+    if (tool == NULL)
+        bail("cannot find pam-afs-session-stat");
+    basprintf(&command, "%s %s/%s", tool, state, PAMAFS_STATS_FILE);
+    output = popen(command, "r");
+    if (output == NULL)
+        sysbail("cannot run %s", command);
+    length = fread(buffer, 1, sizeof(buffer) - 1, output);
+    buffer[length] = '\0';
+    is_int(0, pclose(output), "pam-afs-session-stat succeeds");
+    ok(strstr(buffer, "\ncloses 1\n") != NULL, "...and reports closes");
+    ok(strstr(buffer, "\naklog_latency_count 3\n") != NULL,
+       "...and aklog runs");
+
+    /*
+     * A login set up by both pam_setcred and pam_open_session, with its
+     * credentials refreshed and then torn down by both pam_setcred and
+     * pam_close_session, counts as one login and one close.
+     */
+    argv[0] = program;
+    pamh = module_start(user, "krb5cc_test");
+    is_int(PAM_SUCCESS, pam_sm_setcred(pamh, PAM_ESTABLISH_CRED, 3, argv),
+           "establish credentials");
+    is_int(PAM_SUCCESS, pam_sm_open_session(pamh, 0, 3, argv),
+           "...and open session");
+    is_int(PAM_SUCCESS, pam_sm_setcred(pamh, PAM_REFRESH_CRED, 3, argv),
+           "...and refresh credentials");
+    is_int(PAM_SUCCESS, pam_sm_setcred(pamh, PAM_DELETE_CRED, 3, argv),
+           "...and delete credentials");
+    pam_sm_close_session(pamh, 0, 3, argv);
+    pam_end(pamh, 0);
+    read_stats(state, &stats);
+    is_int(5, stats.counter[PAMAFS_STAT_LOGINS], "...and one more login");
+    is_int(2, stats.counter[PAMAFS_STAT_CLOSES], "...and one more close");
+
+    /* Clean up. */
+    unlink("aklog-args");
+    module_state_remove(state);
+    free(command);
+    test_file_path_free(tool);
+    free(minimum);
+    free(option);
+    free(state);
+    free(program);
+    test_tmpdir_free(tmpdir);
+    test_file_path_free(aklog);
+    return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * Test saving tokens for reuse by later sessions.
+ *
+ * Uses the fakekafs layer, which can hand out and accept a single fake token,
+ * to check that the tokens obtained for one session are put directly into the
+ * PAG of the next session for the same user and ticket cache without running
+ * aklog, and that closing the session forgets them.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <pwd.h>
+#include <time.h>
+
+#include <tests/fakepam/pam.h>
+#include <tests/module/util.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+/* Provided by the fakekafs layer. */
+extern int fakekafs_pag;
+extern bool fakekafs_token;
+extern time_t fakekafs_token_expires;
+extern int fakekafs_settok;
+
+
+/*
+ * Open a session with a new PAM handle for the given user, using the given
+ * ticket cache, and return the handle.
+ */
+static pam_handle_t *
+open_session(struct passwd *user, const char *cache, const char **argv)
+{
+    pam_handle_t *pamh;
+    int status;
+
+    pamh = module_start(user, cache);
+    unlink("aklog-args");
+    status = pam_sm_open_session(pamh, 0, 3, argv);
+    is_int(PAM_SUCCESS, status, "open session");
+    return pamh;
+}
+
+
+int
+main(void)
+{
+    struct passwd *user;
+    pam_handle_t *pamh;
+    int status;
+    char *aklog, *tmpdir, *program, *state, *cache, *other, *expire;
+    const char *argv[] = { NULL, NULL, "token_cache", NULL };
+
+#ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+#endif
+    plan(20);
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        bail("cannot find username of current user");
+    pam_set_pwd(user);
+
+    /* Set up the module arguments. */
+    aklog = test_file_path("data/fake-aklog");
+    tmpdir = test_tmpdir();
+    basprintf(&program, "program=%s", aklog);
+    basprintf(&state, "state_dir=%s/state", tmpdir);
+    argv[0] = program;
+    argv[1] = state;
+    cache = module_cache("krb5cc_test", time(NULL) + 3600);
+    other = module_cache("krb5cc_other", time(NULL) + 3600);
+    expire = module_cache("krb5cc_expire", time(NULL) + 3600);
+
+    /*
+     * The first session runs aklog and saves the resulting token.  The fake
+     * aklog can't change our token state, so pretend it already did.
+     */
+    fakekafs_token = true;
+    pamh = open_session(user, cache, argv);
+    ok(access("aklog-args", F_OK) == 0, "...and aklog was run");
+    pam_end(pamh, 0);
+
+    /* The second session reuses the token without running aklog. */
+    fakekafs_token = false;
+    pamh = open_session(user, cache, argv);
+    ok(access("aklog-args", F_OK) < 0, "...and aklog was not run");
+    ok(fakekafs_token, "...and the token was restored");
+    is_int(1, fakekafs_settok, "...with one VIOCSETTOK call");
+    is_int(2, fakekafs_pag, "...in a new PAG");
+
+    /* Closing the session removes the token and forgets the saved copy. */
+    status = pam_sm_close_session(pamh, 0, 3, argv);
+    is_int(PAM_SUCCESS, status, "close session");
+    ok(!fakekafs_token, "...and the token was removed");
+    pam_end(pamh, 0);
+    pamh = open_session(user, cache, argv);
+    ok(access("aklog-args", F_OK) == 0, "...and aklog was run again");
+    is_int(1, fakekafs_settok, "...without restoring a token");
+    pam_end(pamh, 0);
+
+    /* A different ticket cache doesn't get the saved token. */
+    fakekafs_token = true;
+    pamh = open_session(user, cache, argv);
+    pam_end(pamh, 0);
+    fakekafs_token = false;
+    pamh = open_session(user, other, argv);
+    ok(access("aklog-args", F_OK) == 0, "other cache runs aklog");
+    is_int(1, fakekafs_settok, "...without restoring a token");
+    pam_end(pamh, 0);
+
+    /* Tokens that are about to expire aren't reused. */
+    fakekafs_token = true;
+    fakekafs_token_expires = time(NULL) + 60;
+    pamh = open_session(user, expire, argv);
+    pam_end(pamh, 0);
+    fakekafs_token = false;
+    fakekafs_token_expires = 0;
+    pamh = open_session(user, expire, argv);
+    ok(access("aklog-args", F_OK) == 0, "expiring token is not reused");
+    is_int(1, fakekafs_settok, "...and was not restored");
+    pam_end(pamh, 0);
+
+    /* Clean up. */
+    unlink("aklog-args");
+    module_cache_free(cache);
+    module_cache_free(other);
+    module_cache_free(expire);
+    free(program);
+    free(state);
+    basprintf(&state, "%s/state", tmpdir);
+    module_state_remove(state);
+    free(state);
+    test_tmpdir_free(tmpdir);
+    test_file_path_free(aklog);
+    return 0;
+}
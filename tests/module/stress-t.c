@@ -0,0 +1,269 @@
+/*
+ * Stress test of the module called from many threads at once.
+ *
+ * Runs many PAM sessions through open_session, setcred, and close_session on
+ * parallel threads, each with its own fake PAM handle, and checks that every
+ * call succeeded, that the fake cache manager and the shared statistics and
+ * trace saw exactly the calls expected, and that the application's SIGCHLD
+ * handler survived.  This is done both with thread_safe and without it.
+ * The throughput for each number of threads is reported as a diagnostic to
+ * show how the module scales.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <stats.h>
+#include <tests/fakepam/pam.h>
+#include <tests/module/fakekafs.h>
+#include <tests/module/util.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+#include <trace.h>
+
+/* Sessions run by each thread. */
+#define SESSIONS 20
+
+/* The most threads run at once. */
+#define THREADS_MAX 16
+
+/* What each thread is given and what it reports. */
+struct worker {
+    pthread_t thread;
+    const char **argv;          /* Module arguments, NULL-terminated. */
+    int argc;                   /* Number of module arguments. */
+    unsigned long failures;     /* Calls that didn't return PAM_SUCCESS. */
+};
+
+/* The user the sessions are for. */
+static struct passwd *user;
+
+
+/*
+ * Signal handler for SIGCHLD.  It does nothing, since the module may or may
+ * not override it while children are running; the test is only that it's
+ * still in place afterwards.
+ */
+static void
+child_handler(int sig UNUSED)
+{
+}
+
+
+/*
+ * Return the current time on the monotonic clock in seconds.
+ */
+static double
+now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        sysbail("cannot read clock");
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * The body of each thread.  Runs SESSIONS sessions, each with a new PAM
+ * handle, counting the calls that fail.
+ */
+static void *
+worker_run(void *data)
+{
+    struct worker *worker = data;
+    pam_handle_t *pamh;
+    int i;
+
+    for (i = 0; i < SESSIONS; i++) {
+        pamh = module_start(user, "krb5cc_test");
+        if (pam_sm_open_session(pamh, 0, worker->argc, worker->argv)
+            != PAM_SUCCESS)
+            worker->failures++;
+        if (pam_sm_setcred(pamh, PAM_REINITIALIZE_CRED, worker->argc,
+                           worker->argv)
+            != PAM_SUCCESS)
+            worker->failures++;
+        if (pam_sm_close_session(pamh, 0, worker->argc, worker->argv)
+            != PAM_SUCCESS)
+            worker->failures++;
+        pam_end(pamh, 0);
+    }
+    return NULL;
+}
+
+
+/*
+ * Read the statistics from the given state directory.  Returns false if they
+ * can't be read.
+ */
+static bool
+read_stats(const char *state, struct pamafs_stats *stats)
+{
+    char *path;
+    ssize_t length;
+    int fd;
+
+    basprintf(&path, "%s/%s", state, PAMAFS_STATS_FILE);
+    fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0)
+        return false;
+    length = read(fd, stats, sizeof(*stats));
+    close(fd);
+    return (length == (ssize_t) sizeof(*stats));
+}
+
+
+/*
+ * Return the number of records in the trace in the given state directory.
+ */
+static unsigned long
+trace_records(const char *state)
+{
+    struct stat st;
+    char *path;
+    int status;
+
+    basprintf(&path, "%s/%s", state, PAMAFS_TRACE_FILE);
+    status = stat(path, &st);
+    free(path);
+    if (status < 0)
+        return 0;
+    return (unsigned long) st.st_size / sizeof(struct pamafs_trace);
+}
+
+
+/*
+ * Run SESSIONS sessions on each of the given number of threads, with the
+ * given program option and with thread_safe if safe is true, and check the
+ * results.  Runs five tests.
+ */
+static void
+run_threads(const char *program, const char *tmpdir, int threads, bool safe)
+{
+    struct worker workers[THREADS_MAX];
+    struct pamafs_stats stats;
+    struct sigaction sa;
+    char *state, *option;
+    const char *argv[] = { NULL, NULL, "stats", "trace_calls", NULL, NULL };
+    const char *mode = safe ? "thread_safe" : "default";
+    unsigned long expected, failures;
+    double start, elapsed;
+    int i, status;
+
+    /* Each run gets its own state directory. */
+    basprintf(&state, "%s/state-stress-%s-%d", tmpdir, mode, threads);
+    basprintf(&option, "state_dir=%s", state);
+    module_state_remove(state);
+    argv[0] = program;
+    argv[1] = option;
+    if (safe)
+        argv[4] = "thread_safe";
+    fakekafs_configure(NULL);
+
+    /* Run the threads. */
+    start = now();
+    for (i = 0; i < threads; i++) {
+        workers[i].argv = argv;
+        workers[i].argc = safe ? 5 : 4;
+        workers[i].failures = 0;
+        status = pthread_create(&workers[i].thread, NULL, worker_run,
+                                &workers[i]);
+        if (status != 0)
+            bail("cannot create thread: %s", strerror(status));
+    }
+    failures = 0;
+    for (i = 0; i < threads; i++) {
+        status = pthread_join(workers[i].thread, NULL);
+        if (status != 0)
+            bail("cannot join thread: %s", strerror(status));
+        failures += workers[i].failures;
+    }
+    elapsed = now() - start;
+    expected = (unsigned long) threads * SESSIONS;
+    diag("%s, %d threads: %lu sessions in %.3fs, %.1f sessions/s", mode,
+         threads, expected, elapsed,
+         (elapsed > 0) ? (double) expected / elapsed : 0.0);
+
+    /* Check the results. */
+    is_int(0, (long) failures, "%s, %d threads: all calls succeeded", mode,
+           threads);
+    ok(fakekafs_calls("setpag") == expected
+           && fakekafs_calls("unlog") == expected,
+       "...with a PAG and unlog for each session");
+    if (!read_stats(state, &stats))
+        memset(&stats, 0, sizeof(stats));
+    ok(stats.aklog_count == 2 * expected
+           && stats.counter[PAMAFS_STAT_CLOSES] == expected,
+       "...and every aklog and close counted");
+    is_int((long) (3 * expected), (long) trace_records(state),
+           "...and every call traced");
+    if (sigaction(SIGCHLD, NULL, &sa) < 0)
+        sysbail("cannot get SIGCHLD handler");
+    ok(sa.sa_handler == child_handler, "...and SIGCHLD handler intact");
+
+    /* Clean up. */
+    module_state_remove(state);
+    free(option);
+    free(state);
+}
+
+
+int
+main(void)
+{
+    struct sigaction sa;
+    char *aklog, *program, *tmpdir;
+    const int counts[] = { 1, 4, THREADS_MAX };
+    size_t i;
+
+#ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+#endif
+    plan(5 * 2 * 3);
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        bail("cannot find username of current user");
+    pam_set_pwd(user);
+
+    /* Install a SIGCHLD handler that the module must not lose. */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = child_handler;
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGCHLD, &sa, NULL) < 0)
+        sysbail("cannot set SIGCHLD handler");
+
+    /* Run the sessions with each number of threads and in each mode. */
+    aklog = test_file_path("data/fake-aklog");
+    if (aklog == NULL)
+        bail("cannot find fake-aklog");
+    basprintf(&program, "program=%s", aklog);
+    tmpdir = test_tmpdir();
+    for (i = 0; i < ARRAY_SIZE(counts); i++) {
+        run_threads(program, tmpdir, counts[i], false);
+        run_threads(program, tmpdir, counts[i], true);
+    }
+
+    /* Clean up. */
+    unlink("aklog-args");
+    free(program);
+    test_tmpdir_free(tmpdir);
+    test_file_path_free(aklog);
+    return 0;
+}
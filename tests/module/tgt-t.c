@@ -0,0 +1,108 @@
+/*
+ * Test checking the ticket cache before obtaining tokens.
+ *
+ * Builds ticket caches holding a fake TGT with various lifetimes, which is
+ * enough for the check since it never talks to a KDC, and checks that aklog
+ * is only run when check_tgt finds a TGT with enough lifetime left.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <pwd.h>
+#include <time.h>
+
+#include <tests/fakepam/pam.h>
+#include <tests/module/util.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Open and close a session using the given ticket cache and report whether
+ * aklog was run.
+ */
+#ifdef HAVE_KRB5
+static bool
+run_session(struct passwd *user, const char *cache, const char **argv)
+{
+    pam_handle_t *pamh;
+    bool ran;
+
+    pamh = module_start(user, cache);
+    unlink("aklog-args");
+    is_int(PAM_SUCCESS, pam_sm_open_session(pamh, 0, 3, argv),
+           "open session with %s", cache);
+    ran = (access("aklog-args", F_OK) == 0);
+    pam_sm_close_session(pamh, 0, 3, argv);
+    pam_end(pamh, 0);
+    unlink("aklog-args");
+    return ran;
+}
+#endif /* HAVE_KRB5 */
+
+
+int
+main(void)
+{
+#ifndef HAVE_KRB5
+    skip_all("not built with Kerberos support");
+#else
+    struct passwd *user;
+    char *aklog, *tmpdir, *program, *path, *cache;
+    const char *argv[] = { NULL, "check_tgt", "minimum_lifetime=600", NULL };
+
+# ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+# endif
+    plan(8);
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        bail("cannot find username of current user");
+    pam_set_pwd(user);
+
+    /* Set up the module arguments. */
+    aklog = test_file_path("data/fake-aklog");
+    if (aklog == NULL)
+        bail("cannot find fake-aklog");
+    basprintf(&program, "program=%s", aklog);
+    argv[0] = program;
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/krb5cc_test", tmpdir);
+
+    /* A TGT with plenty of time left. */
+    cache = module_cache(path, time(NULL) + 3600);
+    ok(run_session(user, cache, argv), "...and aklog was run");
+    module_cache_free(cache);
+
+    /* A TGT that expires within minimum_lifetime. */
+    cache = module_cache(path, time(NULL) + 300);
+    ok(!run_session(user, cache, argv), "...and aklog was not run");
+    module_cache_free(cache);
+
+    /* An expired TGT. */
+    cache = module_cache(path, time(NULL) - 60);
+    ok(!run_session(user, cache, argv), "...and aklog was not run");
+    module_cache_free(cache);
+
+    /* A ticket cache that doesn't exist. */
+    basprintf(&cache, "FILE:%s", path);
+    ok(!run_session(user, cache, argv), "...and aklog was not run");
+    free(cache);
+
+    /* Clean up. */
+    free(path);
+    free(program);
+    test_tmpdir_free(tmpdir);
+    test_file_path_free(aklog);
+    return 0;
+#endif /* HAVE_KRB5 */
+}
@@ -0,0 +1,112 @@
+/*
+ * Test the deadline on obtaining tokens.
+ *
+ * Uses a fake aklog that sleeps for a configurable length of time and checks
+ * that a session with token_timeout set gives up on it and continues without
+ * tokens once the deadline passes, even if aklog closes its output first, but
+ * still gets tokens from an aklog that finishes in time.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <pwd.h>
+#include <time.h>
+
+#include <tests/fakepam/pam.h>
+#include <tests/module/util.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Open a session with aklog sleeping for the given number of seconds, after
+ * closing its output if closing is true.  Returns the PAM handle after
+ * checking that the session opened successfully and that it took less than
+ * the given number of seconds.
+ */
+static pam_handle_t *
+open_session(struct passwd *user, const char **argv, const char *sleep,
+             bool closing, time_t limit)
+{
+    pam_handle_t *pamh;
+    char *env;
+    time_t start;
+    int status;
+
+    pamh = module_start(user, "krb5cc_test");
+    basprintf(&env, "AKLOG_SLEEP=%s", sleep);
+    if (pam_putenv(pamh, env) != PAM_SUCCESS)
+        sysbail("cannot set PAM environment variable");
+    free(env);
+    if (closing && pam_putenv(pamh, "AKLOG_CLOSE=1") != PAM_SUCCESS)
+        sysbail("cannot set PAM environment variable");
+    unlink("aklog-runs");
+    start = time(NULL);
+    status = pam_sm_open_session(pamh, 0, 2, argv);
+    is_int(PAM_SUCCESS, status, "open session with %ss aklog", sleep);
+    ok(time(NULL) - start < limit, "...in less than %lds", (long) limit);
+    ok(access("aklog-runs", F_OK) == 0, "...and aklog was run");
+    return pamh;
+}
+
+
+int
+main(void)
+{
+    struct passwd *user;
+    pam_handle_t *pamh;
+    const void *data;
+    char *aklog, *program;
+    const char *argv[] = { NULL, "token_timeout=1", NULL };
+
+#ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+#endif
+    plan(12);
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        bail("cannot find username of current user");
+    pam_set_pwd(user);
+
+    /* Set up the module arguments. */
+    aklog = test_file_path("data/fake-aklog-slow");
+    basprintf(&program, "program=%s", aklog);
+    argv[0] = program;
+
+    /* A fast aklog finishes and the session is marked as having tokens. */
+    pamh = open_session(user, argv, "0", false, 5);
+    data = NULL;
+    pam_get_data(pamh, "pam_afs_session", &data);
+    ok(data != NULL, "...and tokens were obtained");
+    pam_end(pamh, 0);
+
+    /* A slow aklog is killed once the deadline passes. */
+    pamh = open_session(user, argv, "10", false, 5);
+    data = NULL;
+    pam_get_data(pamh, "pam_afs_session", &data);
+    ok(data == NULL, "...and the session has no tokens");
+    pam_end(pamh, 0);
+
+    /* So is one that closes its output and then hangs. */
+    pamh = open_session(user, argv, "10", true, 5);
+    data = NULL;
+    pam_get_data(pamh, "pam_afs_session", &data);
+    ok(data == NULL, "...and the session has no tokens");
+    pam_end(pamh, 0);
+
+    /* Clean up. */
+    unlink("aklog-runs");
+    rmdir("aklog-running");
+    free(program);
+    test_file_path_free(aklog);
+    return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * Test logging the time spent in each phase of a PAM call.
+ *
+ * Checks that the breakdown is logged at the debug level with debug set and
+ * at the notice level without it only when a call takes longer than
+ * slow_threshold.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <pwd.h>
+#include <syslog.h>
+
+#include <tests/fakepam/pam.h>
+#include <tests/module/util.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Search messages for one at the given priority containing both of the
+ * given strings, and free the messages.  Returns true if one was found.
+ */
+static bool
+find_message(struct output *output, int priority, const char *first,
+             const char *second)
+{
+    const char *line;
+    size_t i;
+    bool found = false;
+
+    if (output == NULL)
+        return false;
+    for (i = 0; i < output->count; i++) {
+        line = output->lines[i].line;
+        if (output->lines[i].priority != priority)
+            continue;
+        if (strstr(line, first) != NULL && strstr(line, second) != NULL)
+            found = true;
+    }
+    pam_output_free(output);
+    return found;
+}
+
+
+/*
+ * Open and close a session with the given arguments.  Returns the messages
+ * logged while closing it if closing is true and while opening it otherwise.
+ */
+static struct output *
+run_session(struct passwd *user, int argc, const char **argv, bool closing)
+{
+    pam_handle_t *pamh;
+    struct output *opened, *closed;
+
+    pamh = module_start(user, "krb5cc_test");
+    pam_output_free(pam_output());
+    is_int(PAM_SUCCESS, pam_sm_open_session(pamh, 0, argc, argv),
+           "open session");
+    opened = pam_output();
+    pam_sm_close_session(pamh, 0, argc, argv);
+    closed = pam_output();
+    pam_end(pamh, 0);
+    if (closing) {
+        pam_output_free(opened);
+        return closed;
+    } else {
+        pam_output_free(closed);
+        return opened;
+    }
+}
+
+
+int
+main(void)
+{
+    struct passwd *user;
+    struct output *output;
+    char *aklog, *program;
+    const char *argv[] = { NULL, NULL, NULL };
+
+#ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+#endif
+    plan(8);
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        bail("cannot find username of current user");
+    pam_set_pwd(user);
+    aklog = test_file_path("data/fake-aklog");
+    if (aklog == NULL)
+        bail("cannot find fake-aklog");
+    basprintf(&program, "program=%s", aklog);
+
+    /* With debug, every call logs its timing. */
+    argv[0] = program;
+    argv[1] = "debug";
+    output = run_session(user, 2, argv, true);
+    ok(find_message(output, LOG_DEBUG, "pam_sm_close_session: timing:",
+                    " tokens_ms="), "...and close logs timing");
+    output = run_session(user, 2, argv, false);
+    ok(find_message(output, LOG_DEBUG, "pam_sm_open_session: timing:",
+                    " aklog_ms="), "...and open logs timing");
+
+    /* Without debug, only slow calls are logged. */
+    argv[0] = "program=/bin/sleep,0.2";
+    argv[1] = "slow_threshold=50";
+    output = run_session(user, 2, argv, false);
+    ok(find_message(output, LOG_NOTICE, "pam_sm_open_session: slow call:",
+                    " aklog_ms="), "...and a slow call is logged");
+    argv[1] = "slow_threshold=60000";
+    output = run_session(user, 2, argv, false);
+    ok(!find_message(output, LOG_NOTICE, "pam_sm_open_session", "total_ms="),
+       "...and a fast call is not");
+
+    /* Clean up. */
+    unlink("aklog-args");
+    free(program);
+    test_file_path_free(aklog);
+    return 0;
+}
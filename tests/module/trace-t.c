@@ -0,0 +1,206 @@
+/*
+ * Test the call trace kept with the trace_calls option.
+ *
+ * Makes several PAM calls with tracing enabled, checks the records written
+ * to the trace, and then prints and replays the trace with the replay
+ * driver.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <fcntl.h>
+#include <pwd.h>
+
+#include <tests/fakepam/pam.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+#include <trace.h>
+
+/* The number of calls made. */
+#define CALLS 6
+
+
+/*
+ * Run a command and return its output in newly allocated memory, setting
+ * lines to the number of lines of output.
+ */
+static char *
+run_command(const char *command, size_t *lines)
+{
+    char buffer[BUFSIZ * 4];
+    char *p;
+    size_t length;
+    FILE *output;
+
+    output = popen(command, "r");
+    if (output == NULL)
+        sysbail("cannot run %s", command);
+    length = fread(buffer, 1, sizeof(buffer) - 1, output);
+    buffer[length] = '\0';
+    if (pclose(output) != 0)
+        diag("%s failed", command);
+    *lines = 0;
+    for (p = buffer; *p != '\0'; p++)
+        if (*p == '\n')
+            (*lines)++;
+    return bstrdup(buffer);
+}
+
+
+/*
+ * Open and close a session for the given user and service with the given
+ * arguments, first authenticating and establishing credentials if full is
+ * set.
+ */
+static void
+run_session(struct passwd *user, const char *service, bool full, int argc,
+            const char **argv)
+{
+    pam_handle_t *pamh;
+    struct pam_conv conv = { NULL, NULL };
+
+    if (pam_start(service, user->pw_name, &conv, &pamh) != PAM_SUCCESS)
+        sysbail("cannot create PAM handle");
+    if (pam_putenv(pamh, "KRB5CCNAME=krb5cc_test") != PAM_SUCCESS)
+        sysbail("cannot set PAM environment variable");
+    if (full) {
+        pam_sm_authenticate(pamh, 0, argc, argv);
+        pam_sm_setcred(pamh, PAM_ESTABLISH_CRED, argc, argv);
+    }
+    pam_sm_open_session(pamh, 0, argc, argv);
+    pam_sm_close_session(pamh, 0, argc, argv);
+    pam_end(pamh, 0);
+}
+
+
+int
+main(void)
+{
+    struct passwd *user;
+    struct pamafs_trace records[CALLS + 1];
+    enum pamafs_trace_class class;
+    char *aklog, *tmpdir, *program, *state, *option, *path, *replay;
+    char *command, *output, *expected;
+    size_t lines;
+    ssize_t length;
+    int fd, i;
+    const char *argv[] = { NULL, NULL, "trace_calls", NULL };
+    const enum pamafs_event_call calls[CALLS] = {
+        PAMAFS_CALL_AUTHENTICATE, PAMAFS_CALL_SETCRED,
+        PAMAFS_CALL_OPEN_SESSION, PAMAFS_CALL_CLOSE_SESSION,
+        PAMAFS_CALL_OPEN_SESSION, PAMAFS_CALL_CLOSE_SESSION
+    };
+
+#ifdef NO_PAG_SUPPORT
+    skip_all("no PAG support");
+#endif
+    plan(13);
+
+    /* Determine the user so that setuid will work. */
+    user = getpwuid(getuid());
+    if (user == NULL)
+        bail("cannot find username of current user");
+    pam_set_pwd(user);
+    if (user->pw_uid == 0)
+        class = PAMAFS_CLASS_ROOT;
+    else if (user->pw_uid < PAMAFS_TRACE_SYSTEM_UID)
+        class = PAMAFS_CLASS_SYSTEM;
+    else
+        class = PAMAFS_CLASS_USER;
+
+    /* Set up the module arguments and paths. */
+    aklog = test_file_path("data/fake-aklog");
+    if (aklog == NULL)
+        bail("cannot find fake-aklog");
+    replay = test_file_path("module/replay");
+    if (replay == NULL)
+        bail("cannot find replay");
+    basprintf(&program, "program=%s", aklog);
+    tmpdir = test_tmpdir();
+    basprintf(&state, "%s/state-trace", tmpdir);
+    basprintf(&option, "state_dir=%s", state);
+    basprintf(&path, "%s/%s", state, PAMAFS_TRACE_FILE);
+    unlink(path);
+    rmdir(state);
+    argv[0] = program;
+    argv[1] = option;
+
+    /* Nothing is traced without trace_calls. */
+    run_session(user, "login", false, 2, argv);
+    ok(access(path, F_OK) < 0, "no trace without trace_calls");
+
+    /* A full login and a separate session. */
+    run_session(user, "login", true, 3, argv);
+    run_session(user, "cron", false, 3, argv);
+
+    /* Check the trace. */
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        sysbail("cannot open %s", path);
+    length = read(fd, records, sizeof(records));
+    close(fd);
+    is_int(CALLS * sizeof(struct pamafs_trace), length, "six calls traced");
+    for (i = 0; i < CALLS; i++) {
+        if (records[i].version != PAMAFS_TRACE_VERSION
+            || records[i].call != calls[i]
+            || records[i].pid != (uint32_t) getpid()
+            || records[i].user_class != class
+            || (i > 0 && records[i].time < records[i - 1].time))
+            break;
+    }
+    is_int(CALLS, i, "...with the right calls, process, class, and times");
+    is_int(PAM_ESTABLISH_CRED, records[1].flags, "...and setcred flags");
+    is_string("login", records[0].service, "...and the first service");
+    is_string("cron", records[5].service, "...and the last service");
+
+    /* Print the trace. */
+    basprintf(&command, "%s -p %s", replay, path);
+    output = run_command(command, &lines);
+    free(command);
+    is_int(CALLS, lines, "replay -p prints six calls");
+    basprintf(&expected, " setcred service=login user=%s flags=0x%x\n",
+              class == PAMAFS_CLASS_ROOT     ? "root"
+              : class == PAMAFS_CLASS_SYSTEM ? "system" : "user",
+              PAM_ESTABLISH_CRED);
+    ok(strstr(output, expected) != NULL, "...including setcred");
+    free(expected);
+    ok(strstr(output, " close_session service=cron ") != NULL,
+       "...and the last close");
+    free(output);
+
+    /* Replay it as quickly as possible. */
+    basprintf(&command, "%s -s 0 -a %s %s", replay, aklog, path);
+    output = run_command(command, &lines);
+    free(command);
+    ok(strstr(output, "\"replayed\": 6,") != NULL, "replay makes six calls");
+    ok(strstr(output, "\"call\": \"authenticate\", \"count\": 1,"
+                      " \"failures\": 0,") != NULL,
+       "...including one authenticate");
+    ok(strstr(output, "\"call\": \"open_session\", \"count\": 2,"
+                      " \"failures\": 0,") != NULL,
+       "...and two successful open_sessions");
+    ok(strstr(output, "\"call\": \"close_session\", \"count\": 2,"
+                      " \"failures\": 0,") != NULL,
+       "...and two successful close_sessions");
+    free(output);
+
+    /* Clean up. */
+    unlink("aklog-args");
+    unlink(path);
+    rmdir(state);
+    free(path);
+    free(option);
+    free(state);
+    free(program);
+    test_tmpdir_free(tmpdir);
+    test_file_path_free(replay);
+    test_file_path_free(aklog);
+    return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Utility functions for the module tests.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#ifdef HAVE_KRB5
+# include <portable/krb5.h>
+#endif
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <pwd.h>
+#include <time.h>
+
+#include <tests/fakepam/pam.h>
+#include <tests/module/util.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Create a new fake PAM handle for the given user, setting KRB5CCNAME if a
+ * ticket cache was given.
+ */
+pam_handle_t *
+module_start(const struct passwd *user, const char *cache)
+{
+    pam_handle_t *pamh;
+    struct pam_conv conv = { NULL, NULL };
+    char *env;
+
+    if (pam_start("test", user->pw_name, &conv, &pamh) != PAM_SUCCESS)
+        sysbail("cannot create PAM handle");
+    if (cache != NULL) {
+        basprintf(&env, "KRB5CCNAME=%s", cache);
+        if (pam_putenv(pamh, env) != PAM_SUCCESS)
+            sysbail("cannot set PAM environment variable");
+        free(env);
+    }
+    return pamh;
+}
+
+
+/*
+ * Create a ticket cache at path holding a TGT for test@EXAMPLE.COM that
+ * expires at the given time.  Without Kerberos, just return a copy of path.
+ */
+#ifdef HAVE_KRB5
+char *
+module_cache(const char *path, time_t endtime)
+{
+    krb5_context ctx;
+    krb5_ccache cache;
+    krb5_creds creds;
+    char *name;
+
+    basprintf(&name, "FILE:%s", path);
+    if (krb5_init_context(&ctx) != 0)
+        bail("cannot create Kerberos context");
+    memset(&creds, 0, sizeof(creds));
+    if (krb5_parse_name(ctx, "test@EXAMPLE.COM", &creds.client) != 0)
+        bail("cannot parse client principal");
+    if (krb5_parse_name(ctx, "krbtgt/EXAMPLE.COM@EXAMPLE.COM",
+                        &creds.server) != 0)
+        bail("cannot parse server principal");
+    creds.times.authtime = time(NULL);
+    creds.times.endtime = endtime;
+    if (krb5_cc_resolve(ctx, name, &cache) != 0)
+        bail("cannot resolve %s", name);
+    if (krb5_cc_initialize(ctx, cache, creds.client) != 0)
+        bail("cannot initialize %s", name);
+    if (krb5_cc_store_cred(ctx, cache, &creds) != 0)
+        bail("cannot store credentials in %s", name);
+    krb5_cc_close(ctx, cache);
+    krb5_free_cred_contents(ctx, &creds);
+    krb5_free_context(ctx);
+    return name;
+}
+#else /* !HAVE_KRB5 */
+char *
+module_cache(const char *path, time_t endtime UNUSED)
+{
+    return bstrdup(path);
+}
+#endif /* !HAVE_KRB5 */
+
+
+/*
+ * Remove a ticket cache created by module_cache.  Without Kerberos, no file
+ * was created, so there's nothing to remove.
+ */
+void
+module_cache_free(char *cache)
+{
+    if (cache == NULL)
+        return;
+#ifdef HAVE_KRB5
+    if (strncmp(cache, "FILE:", strlen("FILE:")) == 0)
+        unlink(cache + strlen("FILE:"));
+#endif
+    free(cache);
+}
+
+
+/*
+ * Remove the state directory and all files in it.
+ */
+void
+module_state_remove(const char *path)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char *file;
+
+    dir = opendir(path);
+    if (dir == NULL)
+        return;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        basprintf(&file, "%s/%s", path, entry->d_name);
+        unlink(file);
+        free(file);
+    }
+    closedir(dir);
+    rmdir(path);
+}
@@ -0,0 +1,54 @@
+/*
+ * Utility functions for the module tests.
+ *
+ * Setup and cleanup shared by the tests that run the module against the
+ * fakekafs layer: creating PAM handles, creating ticket caches that work
+ * whether or not the module was built with Kerberos, and removing the state
+ * directory the module leaves behind.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef TESTS_MODULE_UTIL_H
+#define TESTS_MODULE_UTIL_H 1
+
+#include <config.h>
+#include <portable/macros.h>
+#include <portable/pam.h>
+
+#include <pwd.h>
+#include <time.h>
+
+BEGIN_DECLS
+
+/*
+ * Create a new fake PAM handle for the test service and the given user, with
+ * KRB5CCNAME set in the PAM environment to the given ticket cache if it's not
+ * NULL.  Calls bail on any failure.
+ */
+pam_handle_t *module_start(const struct passwd *, const char *cache);
+
+/*
+ * Create a ticket cache at the given path and return the name to use for
+ * KRB5CCNAME, which should be freed with module_cache_free.  If built with
+ * Kerberos, this is a file cache holding a TGT for test@EXAMPLE.COM that
+ * expires at the given time, so that code tied to the TGT sees a real one;
+ * otherwise, the module never opens the cache and the path is returned as
+ * is.
+ */
+char *module_cache(const char *path, time_t endtime)
+    __attribute__((__nonnull__, __malloc__));
+
+/* Remove a ticket cache created by module_cache and free its name. */
+void module_cache_free(char *);
+
+/* Remove a state directory and all the files the module put in it. */
+void module_state_remove(const char *path)
+    __attribute__((__nonnull__));
+
+END_DECLS
+
+#endif /* !TESTS_MODULE_UTIL_H */
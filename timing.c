@@ -0,0 +1,138 @@
+/*
+ * Timing of the phases of each PAM call.
+ *
+ * Each PAM entry point records how long it spent in pamafs_init, k_hasafs,
+ * k_setpag, and the token functions, and how much of the last went to
+ * running aklog or krb5_afslog, using the monotonic clock.  At the end of the
+ * call, the breakdown is logged as a single line of key=value pairs at the
+ * debug level if debug is set, or at the notice level if the call took
+ * longer than slow_threshold milliseconds, so that slow logins can be
+ * diagnosed without logging every call.
+ *
+ * The timing for the current call is found through the pam_config struct so
+ * that it doesn't have to be passed down to the token functions.  It's NULL
+ * when not called from a PAM entry point, in which case nothing is
+ * recorded.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <time.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+
+/* The names of the phases, in the order of enum pamafs_phase. */
+static const char *const phase_names[PAMAFS_PHASE_MAX] = {
+    "init", "hasafs", "setpag", "tokens", "aklog"
+};
+
+
+/*
+ * Return the current time on the monotonic clock in nanoseconds, or 0 if the
+ * clock can't be read.
+ */
+uint64_t
+pamafs_time_now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        return 0;
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+
+/*
+ * Start timing a PAM call.  Called before pamafs_init so that its time can be
+ * included.
+ */
+void
+pamafs_timing_start(struct pamafs_timing *timing)
+{
+    memset(timing, 0, sizeof(*timing));
+    timing->uid = (uid_t) -1;
+    timing->aklog_status = PAMAFS_EVENTS_NO_AKLOG;
+    timing->start = pamafs_time_now();
+}
+
+
+/*
+ * Attach the timing for a PAM call to its arguments after pamafs_init
+ * returns, recording the time spent in it.
+ */
+void
+pamafs_timing_init(struct pam_args *args, struct pamafs_timing *timing)
+{
+    args->config->timing = timing;
+    pamafs_timing_add(args, PAMAFS_PHASE_INIT, timing->start);
+}
+
+
+/*
+ * Add the time since start to a phase of the current call, if it's being
+ * timed.
+ */
+void
+pamafs_timing_add(struct pam_args *args, enum pamafs_phase phase,
+                  uint64_t start)
+{
+    struct pamafs_timing *timing = args->config->timing;
+    uint64_t now;
+
+    if (timing == NULL || start == 0)
+        return;
+    now = pamafs_time_now();
+    if (now > start)
+        timing->phase[phase] += now - start;
+}
+
+
+/*
+ * Log the time spent in each phase of the current call, given the name of
+ * the PAM function, if debug is set or the call took longer than
+ * slow_threshold.  Phases that weren't reached are left out.
+ */
+void
+pamafs_timing_report(struct pam_args *args, const char *func)
+{
+    struct pamafs_timing *timing;
+    char buffer[256];
+    size_t offset;
+    uint64_t total, now;
+    long threshold;
+    bool slow;
+    int i;
+
+    if (args == NULL || args->config == NULL)
+        return;
+    timing = args->config->timing;
+    if (timing == NULL || timing->start == 0)
+        return;
+    now = pamafs_time_now();
+    total = (now > timing->start) ? now - timing->start : 0;
+    threshold = args->config->slow_threshold;
+    slow = (threshold > 0 && total >= (uint64_t) threshold * 1000000ULL);
+    if (!slow && !args->debug)
+        return;
+    snprintf(buffer, sizeof(buffer), "total_ms=%.3f",
+             (double) total / 1000000.0);
+    for (i = 0; i < PAMAFS_PHASE_MAX; i++) {
+        if (timing->phase[i] == 0)
+            continue;
+        offset = strlen(buffer);
+        snprintf(buffer + offset, sizeof(buffer) - offset, " %s_ms=%.3f",
+                 phase_names[i], (double) timing->phase[i] / 1000000.0);
+    }
+    if (slow)
+        putil_notice(args, "%s: slow call: %s", func, buffer);
+    else
+        putil_debug(args, "%s: timing: %s", func, buffer);
+}
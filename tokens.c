@@ -15,7 +15,7 @@
 
 #include <config.h>
 #include <portable/kafs.h>
-#ifdef HAVE_KERBEROS
+#ifdef HAVE_KRB5
 # include <portable/krb5.h>
 #endif
 #include <portable/pam.h>
@@ -30,6 +30,7 @@
 #include <pam-util/args.h>
 #include <pam-util/logging.h>
 #include <pam-util/vector.h>
+#include <probes.h>
 
 /*
  * HP-UX doesn't have a separate environment maintained in the PAM
@@ -43,6 +44,18 @@
 # define pam_getenv(p, e)       getenv(e)
 #endif
 
+/*
+ * Exit statuses of the OpenAFS aklog meaning that it couldn't get information
+ * about the cell from its servers or couldn't give the tokens to the cache
+ * manager, as opposed to problems with the user's credentials.
+ */
+#define AKLOG_EXIT_AFS   3
+#define AKLOG_EXIT_TOKEN 5
+
+/* Exit statuses of the child that calls krb5_afslog on failure. */
+#define AFSLOG_EXIT_USER 1
+#define AFSLOG_EXIT_CELL 2
+
 
 /*
  * Free the results of pam_getenvlist, but only if we have pam_getenvlist.
@@ -57,6 +70,34 @@ pamafs_free_envlist(char **env)
         free(env[i]);
     free(env);
 }
+
+
+/*
+ * Make a copy of the process environment that can be freed with
+ * pamafs_free_envlist.  Used in place of the PAM environment when there is
+ * no PAM handle, which is the case when called through the interface in
+ * api.c.  Returns NULL on failure.
+ */
+static char **
+pamafs_copy_environ(void)
+{
+    char **env;
+    size_t i, count;
+
+    for (count = 0; environ[count] != NULL; count++)
+        ;
+    env = calloc(count + 1, sizeof(char *));
+    if (env == NULL)
+        return NULL;
+    for (i = 0; i < count; i++) {
+        env[i] = strdup(environ[i]);
+        if (env[i] == NULL) {
+            pamafs_free_envlist(env);
+            return NULL;
+        }
+    }
+    return env;
+}
 #endif
 
 
@@ -66,7 +107,7 @@ pamafs_free_envlist(char **env)
  * have a low-numbered UID and we were configured to ignore such users.
  * Returns true if we should ignore them, false otherwise.
  */
-static bool
+bool
 pamafs_should_ignore(struct pam_args *args, const struct passwd *pwd)
 {
     long minimum_uid = args->config->minimum_uid;
@@ -100,15 +141,23 @@ pamafs_build_env(struct pam_args *args)
     const char *cache;
     size_t i;
 
-    env = pam_getenvlist(args->pamh);
+#ifdef HAVE_PAM_GETENVLIST
+    if (args->pamh == NULL)
+        env = pamafs_copy_environ();
+    else
+#endif
+        env = pam_getenvlist(args->pamh);
     if (env == NULL)
         return NULL;
 
     /*
      * Check whether KRB5CCNAME is set in the PAM environment.  If it isn't,
      * but it is set in the regular environment, we're going to have to add it
-     * into the environment passed to aklog.
+     * into the environment passed to aklog.  Without a PAM handle, the
+     * regular environment is what we started from.
      */
+    if (args->pamh == NULL)
+        return env;
     cache = pam_getenv(args->pamh, "KRB5CCNAME");
     if (cache == NULL)
         cache = getenv("KRB5CCNAME");
@@ -130,24 +179,273 @@ pamafs_build_env(struct pam_args *args)
     return env;
 }
 
+/*
+ * The variables passed to aklog when aklog_minimal_env is set, in addition to
+ * any listed in aklog_env.
+ */
+static const char * const pamafs_minimal_env[] = {
+    "KRB5CCNAME", "KRB5_CONFIG", "PATH", "TZ", NULL
+};
+
+
+/*
+ * Look up a variable for the minimal environment, preferring the PAM
+ * environment and falling back on the regular environment the way that
+ * pamafs_build_env does for KRB5CCNAME.
+ */
+static const char *
+pamafs_env_value(struct pam_args *args, const char *name)
+{
+    const char *value = NULL;
+
+    if (args->pamh != NULL)
+        value = pam_getenv(args->pamh, name);
+    if (value == NULL)
+        value = getenv(name);
+    return value;
+}
+
+
+/*
+ * Call func for each variable that belongs in the minimal environment and is
+ * set, skipping any extras that duplicate the standard list.
+ */
+static void
+pamafs_env_walk(struct pam_args *args,
+                void (*func)(const char *, const char *, void *), void *data)
+{
+    const struct vector *extra = args->config->aklog_env;
+    const char *value;
+    size_t i, j;
+    bool listed;
+
+    for (i = 0; pamafs_minimal_env[i] != NULL; i++) {
+        value = pamafs_env_value(args, pamafs_minimal_env[i]);
+        if (value != NULL)
+            func(pamafs_minimal_env[i], value, data);
+    }
+    if (extra == NULL)
+        return;
+    for (i = 0; i < extra->count; i++) {
+        listed = false;
+        for (j = 0; pamafs_minimal_env[j] != NULL; j++)
+            if (strcmp(extra->strings[i], pamafs_minimal_env[j]) == 0)
+                listed = true;
+        value = pamafs_env_value(args, extra->strings[i]);
+        if (!listed && value != NULL)
+            func(extra->strings[i], value, data);
+    }
+}
+
+
+/* State for building the minimal environment with pamafs_env_walk. */
+struct env_build {
+    size_t count;               /* Number of variables. */
+    size_t size;                /* Bytes needed for the strings. */
+    char **env;                 /* Environment being filled in, or NULL. */
+    char *next;                 /* Where to put the next string. */
+};
+
+
+/*
+ * pamafs_env_walk callback that sizes the environment on the first pass and
+ * fills it in on the second.
+ */
+static void
+pamafs_env_add(const char *name, const char *value, void *data)
+{
+    struct env_build *build = data;
+    size_t length;
+
+    length = strlen(name) + 1 + strlen(value) + 1;
+    if (build->env == NULL) {
+        build->count++;
+        build->size += length;
+        return;
+    }
+    build->env[build->count++] = build->next;
+    snprintf(build->next, length, "%s=%s", name, value);
+    build->next += length;
+}
+
+
+/*
+ * Build the environment for aklog when aklog_minimal_env is set, containing
+ * only the standard variables and those listed in aklog_env.  Rather than
+ * copying each string separately, the array and all of the strings are put
+ * in a single allocation, so the result is freed with free.  Returns NULL on
+ * failure.
+ */
+static char **
+pamafs_build_minimal_env(struct pam_args *args)
+{
+    struct env_build build = { 0, 0, NULL, NULL };
+    size_t offset;
+
+    pamafs_env_walk(args, pamafs_env_add, &build);
+    offset = (build.count + 1) * sizeof(char *);
+    build.env = malloc(offset + build.size);
+    if (build.env == NULL)
+        return NULL;
+    build.next = (char *) build.env + offset;
+    build.count = 0;
+    pamafs_env_walk(args, pamafs_env_add, &build);
+    build.env[build.count] = NULL;
+    return build.env;
+}
+
+
+/*
+ * Free an environment returned by pamafs_build_env or
+ * pamafs_build_minimal_env.
+ */
+static void
+pamafs_free_env(struct pam_args *args, char **env)
+{
+    if (args->config->aklog_minimal_env)
+        free(env);
+    else
+        pamafs_free_envlist(env);
+}
+
+
+/*
+ * Return the Kerberos realm configured for a cell in cell_realms, or NULL if
+ * there isn't one and the realm should be found the usual way.  Entries with
+ * an empty realm are skipped, as warned when the options were parsed.
+ */
+static const char *
+pamafs_cell_realm(struct pam_args *args, const char *cell)
+{
+    struct vector *realms = args->config->cell_realms;
+    size_t i, length;
+
+    if (realms == NULL || cell == NULL)
+        return NULL;
+    length = strlen(cell);
+    for (i = 0; i < realms->count; i++)
+        if (strncmp(realms->strings[i], cell, length) == 0
+            && realms->strings[i][length] == '='
+            && realms->strings[i][length + 1] != '\0')
+            return realms->strings[i] + length + 1;
+    return NULL;
+}
+
+
+/*
+ * Add the arguments telling aklog to obtain tokens for a cell, including its
+ * realm if one is configured, to argv.  Returns false on allocation failure.
+ */
+static bool
+pamafs_aklog_cell(struct pam_args *args, struct vector *argv,
+                  const char *cell)
+{
+    const char *realm;
+
+    if (!vector_add(argv, "-c") || !vector_add(argv, cell))
+        return false;
+    realm = pamafs_cell_realm(args, cell);
+    if (realm == NULL) {
+        putil_debug(args, "passing -c %s to aklog", cell);
+        return true;
+    }
+    if (!vector_add(argv, "-k") || !vector_add(argv, realm))
+        return false;
+    putil_debug(args, "passing -c %s -k %s to aklog", cell, realm);
+    return true;
+}
+
+
+/*
+ * Log how aklog went: its exit status, how long it took, the CPU time and
+ * memory it used, and each line of its output.  If failed is set, log at the
+ * error level, and otherwise at the debug level.  code is the exit status,
+ * or PAMAFS_EVENTS_NO_STATUS if it was killed after the timeout.
+ */
+static void
+pamafs_aklog_report(struct pam_args *args, int code, bool failed,
+                    uint64_t start, struct pamafs_child_output *output)
+{
+    void (*report)(struct pam_args *, const char *, ...)
+        __attribute__((__format__(printf, 2, 3)));
+    const struct rusage *usage = &output->usage;
+    char result[64];
+    char *line, *end;
+
+    if (!failed && !args->debug)
+        return;
+    report = failed ? putil_err : putil_debug;
+    if (code == PAMAFS_EVENTS_NO_STATUS)
+        strlcpy(result, "did not finish", sizeof(result));
+    else if (failed)
+        snprintf(result, sizeof(result), "returned %d", code);
+    else
+        snprintf(result, sizeof(result), "exited with status %d", code);
+    report(args, "aklog program %s %s after %.3fs (user %.3fs, system %.3fs,"
+           " max RSS %ldKB)", args->config->program->strings[0], result,
+           (pamafs_time_now() - start) / 1e9,
+           usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6,
+           usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6,
+           (long) usage->ru_maxrss);
+
+    /* Log the output a line at a time, skipping blank lines. */
+    for (line = output->buffer; *line != '\0'; line = end) {
+        end = line + strcspn(line, "\n");
+        if (*end != '\0')
+            *end++ = '\0';
+        if (*line != '\0')
+            report(args, "aklog: %s", line);
+    }
+    if (output->truncated)
+        report(args, "aklog: (further output discarded)");
+}
+
+
+/*
+ * Return whether an aklog failure, given the code set by pamafs_run_aklog,
+ * points to a problem with the cell or the local cache manager that would
+ * affect every user: a timeout, death by a signal, or an AFS or token error.
+ * Other failures, such as a missing or expired ticket, are specific to the
+ * user and don't count toward the circuit breaker.
+ */
+static bool
+aklog_cell_failure(int code)
+{
+    if (code == PAMAFS_EVENTS_NO_STATUS || code > 128)
+        return true;
+    return (code == AKLOG_EXIT_AFS || code == AKLOG_EXIT_TOKEN);
+}
+
+
 /*
  * Call aklog with the appropriate environment.  Takes the PAM handle (so that
- * we can get the environment), the arguments, and a struct passwd entry for
- * the user we're authenticating as.  Returns either PAM_SUCCESS or
+ * we can get the environment), the arguments, a struct passwd entry for the
+ * user we're authenticating as, and the cell to obtain tokens for.  If cell
+ * is NULL, obtain tokens for all the cells in afs_cells (or aklog's default).
+ * The aklog_homedir arguments are only added if homedir is true, so that
+ * they can be passed on only one of several runs.  Sets code to the exit
+ * status of aklog, or 128 plus the signal that killed it, for the event log.
+ * The output of aklog is collected and logged along with its exit status and
+ * resource usage by pamafs_aklog_report.  Returns either PAM_SUCCESS or
  * PAM_CRED_ERR.
  */
 static int
-pamafs_run_aklog(struct pam_args *args, struct passwd *pwd)
+pamafs_run_aklog(struct pam_args *args, struct passwd *pwd, const char *cell,
+                 bool homedir, int *code)
 {
     int res, status;
     size_t i;
     char **env = NULL;
+    char *home_cell = NULL;
     struct vector *argv = NULL;
-    struct sigaction sa, oldsa;
+    struct pamafs_child_output *output = NULL;
     bool restore_handler = false;
+    uint64_t start;
     pid_t child;
+    int fds[2] = { -1, -1 };
 
     /* Sanity check that we have some program to run. */
+    *code = PAMAFS_EVENTS_NO_AKLOG;
     if (args->config->program == NULL) {
         putil_err(args, "no token program set in PAM arguments");
         return PAM_CRED_ERR;
@@ -157,110 +455,181 @@ pamafs_run_aklog(struct pam_args *args, struct passwd *pwd)
     argv = vector_copy(args->config->program);
     if (argv == NULL)
         goto memfail;
-    if (args->config->aklog_homedir) {
-        if (!vector_add(argv, "-p") || !vector_add(argv, pwd->pw_dir))
-            goto memfail;
-        putil_debug(args, "passing -p %s to aklog", pwd->pw_dir);
+    if (homedir && args->config->aklog_homedir) {
+        if (args->config->aklog_homedir_cell)
+            home_cell = pamafs_homedir_cell(args, pwd->pw_dir);
+        if (home_cell != NULL) {
+            if (!pamafs_aklog_cell(args, argv, home_cell))
+                goto memfail;
+        } else {
+            if (!vector_add(argv, "-p") || !vector_add(argv, pwd->pw_dir))
+                goto memfail;
+            putil_debug(args, "passing -p %s to aklog", pwd->pw_dir);
+        }
     }
-    if (args->config->afs_cells != NULL)
+    if (cell != NULL) {
+        if (!pamafs_aklog_cell(args, argv, cell))
+            goto memfail;
+    } else if (args->config->afs_cells != NULL)
         for (i = 0; i < args->config->afs_cells->count; i++) {
-            if (!vector_add(argv, "-c"))
-                goto memfail;
-            if (!vector_add(argv, args->config->afs_cells->strings[i]))
+            cell = args->config->afs_cells->strings[i];
+            if (!pamafs_aklog_cell(args, argv, cell))
                 goto memfail;
-            putil_debug(args, "passing -c %s to aklog",
-                        args->config->afs_cells->strings[i]);
         }
+    free(home_cell);
+    home_cell = NULL;
+    output = malloc(sizeof(struct pamafs_child_output));
+    if (output == NULL)
+        goto memfail;
 
-    /*
-     * The application that calls us may have set a SIGCHLD handler, but we
-     * need to ensure that's not called for aklog, so we temporarily override
-     * it.  This is a bit of a disaster if the application has other children
-     * that it wants to handle while we run aklog; there seems to be no good
-     * solution here.
-     */
-    memset(&sa, 0, sizeof(sa));
-    memset(&oldsa, 0, sizeof(oldsa));
-    sa.sa_handler = SIG_DFL;
-    if (sigaction(SIGCHLD, &sa, &oldsa) < 0)
-        putil_err(args, "cannot set SIGCHLD handler, continuing anyway");
-    else
-        restore_handler = true;
+    /* Make room for the terminating NULL so the child needn't allocate. */
+    if (!vector_resize(argv, argv->count + 1))
+        goto memfail;
+    restore_handler = pamafs_child_sigchld(args);
 
     /*
-     * Run the program.  Be sure to use _exit instead of exit in the
+     * Run the program with its output going to the pipe, or to /dev/null if
+     * we couldn't create one.  Be sure to use _exit instead of exit in the
      * subprocess so that we won't run exit handlers or double-flush stdio
-     * buffers in the child process.
+     * buffers in the child process, and only make async-signal-safe calls
+     * before the exec, since the application may have other threads.
      */
-    env = pamafs_build_env(args);
+    if (args->config->aklog_minimal_env)
+        env = pamafs_build_minimal_env(args);
+    else
+        env = pamafs_build_env(args);
     putil_debug(args, "running %s as UID %lu",
                 args->config->program->strings[0],
                 (unsigned long) pwd->pw_uid);
+    pamafs_child_pipe(args, fds);
+    start = pamafs_time_now();
     child = fork();
     if (child < 0) {
         putil_crit(args, "cannot fork: %s", strerror(errno));
         goto fail;
     } else if (child == 0) {
-        if (setuid(pwd->pw_uid) < 0) {
-            putil_crit(args, "cannot setuid to UID %lu: %s",
-                       (unsigned long) pwd->pw_uid, strerror(errno));
-            _exit(1);
-        }
+        PAMAFS_PROBE1(aklog_exec, args->config->program->strings[0]);
+        if (fds[0] >= 0)
+            close(fds[0]);
+        if (fds[1] >= 0 && fds[1] <= 2)
+            fds[1] = fcntl(fds[1], F_DUPFD, 3);
         close(0);
         close(1);
         close(2);
         open("/dev/null", O_RDONLY);
-        open("/dev/null", O_WRONLY);
-        open("/dev/null", O_WRONLY);
+        if (fds[1] >= 0) {
+            dup2(fds[1], 1);
+            dup2(fds[1], 2);
+            close(fds[1]);
+        } else {
+            open("/dev/null", O_WRONLY);
+            open("/dev/null", O_WRONLY);
+        }
+        if (setuid(pwd->pw_uid) < 0)
+            pamafs_child_fail("cannot setuid", errno);
         vector_exec_env(args->config->program->strings[0], argv,
                         (const char * const *) env);
-        putil_err(args, "cannot exec %s: %s",
-                  args->config->program->strings[0], strerror(errno));
-        _exit(1);
+        pamafs_child_fail("cannot exec", errno);
     }
+    PAMAFS_PROBE1(aklog_fork, child);
     vector_free(argv);
     argv = NULL;
-    pamafs_free_envlist(env);
-    if (waitpid(child, &res, 0) && WIFEXITED(res) && WEXITSTATUS(res) == 0)
+    pamafs_free_env(args, env);
+    if (fds[1] >= 0)
+        close(fds[1]);
+    PAMAFS_PROBE1(aklog_wait_entry, child);
+    if (!pamafs_child_wait(args, child, fds[0], args->config->token_timeout,
+                           args->config->program->strings[0], &res, output)) {
+        *code = PAMAFS_EVENTS_NO_STATUS;
+        status = PAM_CRED_ERR;
+    } else if (WIFEXITED(res) && WEXITSTATUS(res) == 0) {
+        *code = 0;
         status = PAM_SUCCESS;
-    else {
-        putil_err(args, "aklog program %s returned %d",
-                  args->config->program->strings[0], WEXITSTATUS(res));
+    } else {
+        *code = WIFSIGNALED(res) ? 128 + WTERMSIG(res) : WEXITSTATUS(res);
         status = PAM_CRED_ERR;
     }
+    PAMAFS_PROBE2(aklog_wait_return, child, *code);
+    pamafs_aklog_report(args, *code, status != PAM_SUCCESS, start, output);
+    free(output);
     if (restore_handler)
-        if (sigaction(SIGCHLD, &oldsa, NULL) < 0)
-            putil_err(args, "cannot restore SIGCHLD handler");
+        pamafs_child_sigchld_restore(args);
     return status;
 
 memfail:
     putil_crit(args, "cannot allocate memory: %s", strerror(errno));
 fail:
+    free(home_cell);
+    free(output);
     if (argv != NULL)
         vector_free(argv);
     if (env != NULL)
-        pamafs_free_envlist(env);
+        pamafs_free_env(args, env);
+    if (fds[0] >= 0)
+        close(fds[0]);
+    if (fds[1] >= 0)
+        close(fds[1]);
     if (restore_handler)
-        if (sigaction(SIGCHLD, &oldsa, NULL) < 0)
-            putil_err(args, "cannot restore SIGCHLD handler");
+        pamafs_child_sigchld_restore(args);
     return PAM_CRED_ERR;
 }
 
 
+/*
+ * Return whether a krb5_afslog failure points to a problem with the cell or
+ * the local cache manager rather than with the user's credentials.  The kafs
+ * layer reports cache manager errors as errno values, far below the range of
+ * the Kerberos error tables, and an unreachable KDC affects every user of
+ * the realm.
+ */
+#ifdef HAVE_KRB5_AFSLOG
+static bool
+afslog_cell_failure(krb5_error_code ret)
+{
+    return (ret == KRB5_KDC_UNREACH || (ret > 0 && ret < 256));
+}
+#endif
+
+
+/*
+ * Obtain tokens for a single cell, or the default cell if cell is NULL, with
+ * krb5_afslog_uid, using the realm configured in cell_realms if any.  Returns
+ * the Kerberos error code.
+ */
+#ifdef HAVE_KRB5_AFSLOG
+static krb5_error_code
+afslog_cell(struct pam_args *args, krb5_ccache cache, const char *cell,
+            uid_t uid)
+{
+    krb5_error_code ret;
+
+    PAMAFS_PROBE1(afslog_cell_entry, cell);
+    ret = krb5_afslog_uid(args->ctx, cache, cell,
+                          pamafs_cell_realm(args, cell), uid);
+    PAMAFS_PROBE2(afslog_cell_return, cell, ret);
+    return ret;
+}
+#endif
+
+
 /*
  * Call the appropriate krb5_afslog function to get tokens directly without
- * running an external aklog binary.  Returns either PAM_SUCCESS or
- * PAM_CRED_ERR.
+ * running an external aklog binary.  If cell is not NULL, obtain tokens only
+ * for that cell.  Sets cell_failure to whether any failure was a problem
+ * with a cell or the cache manager (see afslog_cell_failure).  Returns
+ * either PAM_SUCCESS or PAM_CRED_ERR.
  */
 #ifdef HAVE_KRB5_AFSLOG
 static int
 pamafs_afslog(struct pam_args *args, const char *cachename,
-              struct passwd *pwd)
+              struct passwd *pwd, const char *cell, bool *cell_failure)
 {
     krb5_error_code ret;
     krb5_ccache cache;
+    char *home_cell = NULL;
     size_t i;
 
+    *cell_failure = false;
     if (cachename == NULL) {
         putil_debug(args, "skipping tokens, no Kerberos ticket cache");
         return PAM_SUCCESS;
@@ -270,35 +639,58 @@ pamafs_afslog(struct pam_args *args, const char *cachename,
         putil_err_krb5(args, ret, "cannot open Kerberos ticket cache");
         return PAM_CRED_ERR;
     }
-    if (args->config->aklog_homedir) {
-        putil_debug(args, "obtaining tokens for UID %lu and directory %s",
-                    (unsigned long) pwd->pw_uid, pwd->pw_dir);
-        ret = krb5_afslog_uid_home(args->ctx, cache, NULL, NULL, pwd->pw_uid,
-                                   pwd->pw_dir);
+    if (cell != NULL) {
+        putil_debug(args, "obtaining tokens for UID %lu in cell %s",
+                    (unsigned long) pwd->pw_uid, cell);
+        ret = afslog_cell(args, cache, cell, pwd->pw_uid);
         if (ret != 0)
-            putil_err_krb5(args, ret, "cannot obtain tokens for path %s",
-                           pwd->pw_dir);
+            putil_err_krb5(args, ret, "cannot obtain tokens for cell %s",
+                           cell);
+        *cell_failure = afslog_cell_failure(ret);
+    } else if (args->config->aklog_homedir) {
+        if (args->config->aklog_homedir_cell)
+            home_cell = pamafs_homedir_cell(args, pwd->pw_dir);
+        if (home_cell != NULL) {
+            putil_debug(args, "obtaining tokens for UID %lu in cell %s",
+                        (unsigned long) pwd->pw_uid, home_cell);
+            ret = afslog_cell(args, cache, home_cell, pwd->pw_uid);
+            if (ret != 0)
+                putil_err_krb5(args, ret, "cannot obtain tokens for cell %s",
+                               home_cell);
+            *cell_failure = afslog_cell_failure(ret);
+            free(home_cell);
+        } else {
+            putil_debug(args, "obtaining tokens for UID %lu and directory %s",
+                        (unsigned long) pwd->pw_uid, pwd->pw_dir);
+            ret = krb5_afslog_uid_home(args->ctx, cache, NULL, NULL,
+                                       pwd->pw_uid, pwd->pw_dir);
+            if (ret != 0)
+                putil_err_krb5(args, ret, "cannot obtain tokens for path %s",
+                               pwd->pw_dir);
+            *cell_failure = afslog_cell_failure(ret);
+        }
     } else if (args->config->afs_cells == NULL) {
         putil_debug(args, "obtaining tokens for UID %lu",
                     (unsigned long) pwd->pw_uid);
-        ret = krb5_afslog_uid(args->ctx, cache, NULL, NULL, pwd->pw_uid);
+        ret = afslog_cell(args, cache, NULL, pwd->pw_uid);
         if (ret != 0)
             putil_err_krb5(args, ret, "cannot obtain tokens");
+        *cell_failure = afslog_cell_failure(ret);
     } else {
         for (i = 0; i < args->config->afs_cells->count; i++) {
             int status;
 
+            cell = args->config->afs_cells->strings[i];
             putil_debug(args, "obtaining tokens for UID %lu in cell %s",
-                        (unsigned long) pwd->pw_uid,
-                        args->config->afs_cells->strings[i]);
-            status = krb5_afslog_uid(args->ctx, cache,
-                                     args->config->afs_cells->strings[i],
-                                     NULL, pwd->pw_uid);
+                        (unsigned long) pwd->pw_uid, cell);
+            status = afslog_cell(args, cache, cell, pwd->pw_uid);
             if (status != 0) {
                 putil_err_krb5(args, ret, "cannot obtain tokens for cell %s",
-                               args->config->afs_cells->strings[i]);
+                               cell);
                 if (ret == 0)
                     ret = status;
+                if (afslog_cell_failure(status))
+                    *cell_failure = true;
             }
         }
     }
@@ -311,11 +703,302 @@ pamafs_afslog(struct pam_args *args, const char *cachename,
 #endif
 
 
+/*
+ * Call pamafs_afslog in a helper child process so that it can be abandoned if
+ * it takes longer than token_timeout seconds.  The child is in the same PAG,
+ * so the tokens it obtains are visible to us.  Unlike a thread, the child can
+ * be killed safely on timeout without leaving any Kerberos or AFS library
+ * state in an unknown condition.  The child reports through its exit status
+ * whether a failure was a problem with a cell, and a timeout or signal is
+ * always treated as one.  Sets cell_failure accordingly and returns either
+ * PAM_SUCCESS or PAM_CRED_ERR.
+ */
+#ifdef HAVE_KRB5_AFSLOG
+static int
+pamafs_afslog_child(struct pam_args *args, const char *cachename,
+                    struct passwd *pwd, const char *cell, bool *cell_failure)
+{
+    bool restore_handler;
+    int fds[2] = { -1, -1 };
+    int res, status;
+    pid_t child;
+
+    *cell_failure = false;
+
+    /* See pamafs_child_sigchld for why we override SIGCHLD. */
+    restore_handler = pamafs_child_sigchld(args);
+
+    /* Do the work in the child and report the result as the exit status. */
+    pamafs_child_pipe(args, fds);
+    child = fork();
+    if (child < 0) {
+        putil_crit(args, "cannot fork: %s", strerror(errno));
+        if (fds[0] >= 0)
+            close(fds[0]);
+        if (fds[1] >= 0)
+            close(fds[1]);
+        status = PAM_CRED_ERR;
+        goto done;
+    } else if (child == 0) {
+        if (fds[0] >= 0)
+            close(fds[0]);
+        status = pamafs_afslog(args, cachename, pwd, cell, cell_failure);
+        if (status == PAM_SUCCESS)
+            _exit(0);
+        _exit(*cell_failure ? AFSLOG_EXIT_CELL : AFSLOG_EXIT_USER);
+    }
+    if (fds[1] >= 0)
+        close(fds[1]);
+    if (!pamafs_child_wait(args, child, fds[0], args->config->token_timeout,
+                           "krb5_afslog", &res, NULL)) {
+        *cell_failure = true;
+        status = PAM_CRED_ERR;
+    } else if (WIFEXITED(res) && WEXITSTATUS(res) == 0)
+        status = PAM_SUCCESS;
+    else {
+        *cell_failure = (WIFSIGNALED(res)
+                         || WEXITSTATUS(res) == AFSLOG_EXIT_CELL);
+        status = PAM_CRED_ERR;
+    }
+
+done:
+    if (restore_handler)
+        pamafs_child_sigchld_restore(args);
+    return status;
+}
+#endif
+
+
+/*
+ * Obtain tokens for the given cell, or for all configured cells if cell is
+ * NULL, using krb5_afslog if we have it and no program was specifically set
+ * and otherwise by running aklog.  homedir says whether to pass aklog the
+ * aklog_homedir arguments; see pamafs_run_aklog.  The Kerberos libraries
+ * can't be used in a child forked from a threaded application, so with
+ * thread_safe, krb5_afslog is always called directly and token_timeout
+ * doesn't apply.
+ * Sets cell_failure to whether a failure points to a problem with the cell
+ * or the cache manager rather than the user's credentials, for the circuit
+ * breaker.  Returns either PAM_SUCCESS or PAM_CRED_ERR.
+ */
+static int
+pamafs_obtain(struct pam_args *args, const char *cache, struct passwd *pwd,
+              const char *cell, bool homedir, bool *cell_failure)
+{
+    uint64_t start;
+    unsigned int cells = 1;
+    int status, code;
+
+    if (cell == NULL)
+        cells = (args->config->afs_cells == NULL)
+            ? 0 : (unsigned int) args->config->afs_cells->count;
+    start = pamafs_time_now();
+#ifdef HAVE_KRB5_AFSLOG
+    if (args->config->program == NULL) {
+        if (args->config->token_timeout > 0 && !args->config->thread_safe)
+            status = pamafs_afslog_child(args, cache, pwd, cell,
+                                         cell_failure);
+        else
+            status = pamafs_afslog(args, cache, pwd, cell, cell_failure);
+        pamafs_timing_add(args, PAMAFS_PHASE_AKLOG, start);
+        pamafs_stats_aklog(args, start);
+        pamafs_events_aklog(args, cells, (status == PAM_SUCCESS) ? 0 : 1);
+        return status;
+    }
+#else
+    (void) cache;
+#endif
+    status = pamafs_run_aklog(args, pwd, cell, homedir, &code);
+    *cell_failure = (status != PAM_SUCCESS && aklog_cell_failure(code));
+    pamafs_timing_add(args, PAMAFS_PHASE_AKLOG, start);
+    pamafs_stats_aklog(args, start);
+    pamafs_events_aklog(args, cells, code);
+    return status;
+}
+
+
+/*
+ * Obtain tokens, honoring the circuit breaker for failing cells if the
+ * cell_breaker option is set.  In that case, and if afs_cells is set, tokens
+ * are obtained separately for each cell so that failures can be attributed
+ * to the right cell.  Only failures that point to a problem with the cell or
+ * the cache manager are recorded, so that a few users with bad credentials
+ * can't cause a cell to be skipped for everyone.  The aklog_homedir
+ * arguments are passed only to the first aklog run, since otherwise the home
+ * cell would be looked up and obtained again for every cell.  Returns
+ * PAM_SUCCESS if tokens were obtained for every cell and PAM_CRED_ERR
+ * otherwise.
+ */
+static int
+pamafs_obtain_cells(struct pam_args *args, const char *cache,
+                    struct passwd *pwd)
+{
+    struct vector *cells = args->config->afs_cells;
+    const char *cell;
+    size_t i;
+    int status;
+    int result = PAM_SUCCESS;
+    bool cell_failure;
+    bool homedir = true;
+
+    if (args->config->cell_breaker <= 0)
+        return pamafs_obtain(args, cache, pwd, NULL, true, &cell_failure);
+    if (cells == NULL || cells->count == 0) {
+        if (!pamafs_breaker_allow(args, ""))
+            return PAM_CRED_ERR;
+        status = pamafs_obtain(args, cache, pwd, NULL, true, &cell_failure);
+        if (status == PAM_SUCCESS || cell_failure)
+            pamafs_breaker_record(args, "", status == PAM_SUCCESS);
+        return status;
+    }
+    for (i = 0; i < cells->count; i++) {
+        cell = cells->strings[i];
+        if (!pamafs_breaker_allow(args, cell)) {
+            result = PAM_CRED_ERR;
+            continue;
+        }
+        status = pamafs_obtain(args, cache, pwd, cell, homedir,
+                               &cell_failure);
+        homedir = false;
+        if (status == PAM_SUCCESS || cell_failure)
+            pamafs_breaker_record(args, cell, status == PAM_SUCCESS);
+        if (status != PAM_SUCCESS)
+            result = status;
+    }
+    return result;
+}
+
+
+/*
+ * Find the ticket-granting ticket for the default principal of a ticket
+ * cache.  Returns its authentication and expiration times and, if principal
+ * is not NULL, the client principal as a newly allocated string.  Returns 0
+ * on success, KRB5_CC_NOTFOUND if the cache holds no TGT, or another Kerberos
+ * error code on failure.  Errors are not reported; that's left to the caller.
+ */
+#ifdef HAVE_KRB5
+krb5_error_code
+pamafs_cache_tgt(struct pam_args *args, const char *cachename,
+                 char **principal, time_t *authtime, time_t *endtime)
+{
+    krb5_error_code ret;
+    krb5_ccache cache;
+    krb5_principal client = NULL;
+    krb5_cc_cursor cursor;
+    krb5_creds creds;
+    char *name = NULL;
+    char *server, *realm;
+    size_t length;
+    bool found = false;
+
+    ret = krb5_cc_resolve(args->ctx, cachename, &cache);
+    if (ret != 0)
+        return ret;
+    ret = krb5_cc_get_principal(args->ctx, cache, &client);
+    if (ret != 0)
+        goto done;
+    ret = krb5_unparse_name(args->ctx, client, &name);
+    if (ret != 0)
+        goto done;
+    realm = strrchr(name, '@');
+    if (realm == NULL) {
+        ret = KRB5_CC_NOTFOUND;
+        goto done;
+    }
+    realm++;
+    length = strlen(realm);
+
+    /*
+     * Walk the cache looking for krbtgt/REALM@REALM.  Comparing unparsed
+     * names avoids the differences between the MIT and Heimdal APIs for
+     * getting at the realm of a principal.
+     */
+    ret = krb5_cc_start_seq_get(args->ctx, cache, &cursor);
+    if (ret != 0)
+        goto done;
+    while (!found) {
+        ret = krb5_cc_next_cred(args->ctx, cache, &cursor, &creds);
+        if (ret != 0)
+            break;
+        if (krb5_unparse_name(args->ctx, creds.server, &server) == 0) {
+            if (strncmp(server, "krbtgt/", 7) == 0
+                && strncmp(server + 7, realm, length) == 0
+                && server[7 + length] == '@'
+                && strcmp(server + 7 + length + 1, realm) == 0) {
+                *authtime = creds.times.authtime;
+                *endtime = creds.times.endtime;
+                found = true;
+            }
+            free(server);
+        }
+        krb5_free_cred_contents(args->ctx, &creds);
+    }
+    krb5_cc_end_seq_get(args->ctx, cache, &cursor);
+    ret = found ? 0 : KRB5_CC_NOTFOUND;
+    if (found && principal != NULL) {
+        *principal = strdup(name);
+        if (*principal == NULL)
+            ret = ENOMEM;
+    }
+
+done:
+    free(name);
+    if (client != NULL)
+        krb5_free_principal(args->ctx, client);
+    krb5_cc_close(args->ctx, cache);
+    return ret;
+}
+#endif /* HAVE_KRB5 */
+
+
+/*
+ * If the check_tgt option is set, check that the ticket cache holds a TGT
+ * with more than minimum_lifetime seconds left before running aklog, since
+ * otherwise aklog can't succeed and running it only costs a process and a
+ * round trip to the KDC.  Returns true if obtaining tokens is worth trying.
+ * Without Kerberos support, there's no way to check, so always return true.
+ */
+#ifdef HAVE_KRB5
+static bool
+pamafs_tgt_usable(struct pam_args *args, const char *cache)
+{
+    krb5_error_code ret;
+    char *principal;
+    time_t authtime, endtime, left;
+
+    if (!args->config->check_tgt || cache == NULL || args->ctx == NULL)
+        return true;
+    ret = pamafs_cache_tgt(args, cache, &principal, &authtime, &endtime);
+    if (ret != 0) {
+        putil_debug_krb5(args, ret, "cannot find TGT in %s", cache);
+        putil_notice(args, "skipping tokens, no TGT in %s", cache);
+        return false;
+    }
+    left = endtime - time(NULL);
+    putil_debug(args, "TGT for %s in %s expires in %lds", principal, cache,
+                (long) left);
+    free(principal);
+    if (left <= args->config->minimum_lifetime) {
+        putil_notice(args, "skipping tokens, TGT in %s expires in %lds",
+                     cache, (long) left);
+        return false;
+    }
+    return true;
+}
+#else /* !HAVE_KRB5 */
+static bool
+pamafs_tgt_usable(struct pam_args *args UNUSED, const char *cache UNUSED)
+{
+    return true;
+}
+#endif /* !HAVE_KRB5 */
+
+
 /*
  * If the kdestroy option is set and we were built with Kerberos support,
  * destroy the ticket cache after we successfully got tokens.
  */
-#ifdef HAVE_KERBEROS
+#ifdef HAVE_KRB5
 static void
 maybe_destroy_cache(struct pam_args *args, const char *cache)
 {
@@ -334,13 +1017,139 @@ maybe_destroy_cache(struct pam_args *args, const char *cache)
     if (ret != 0)
         putil_err_krb5(args, ret, "cannot destroy Kerberos ticket cache");
 }
-#else /* !HAVE_KERBEROS */
+#else /* !HAVE_KRB5 */
 static void
 maybe_destroy_cache(struct pam_args *args UNUSED, const char *cache UNUSED)
 {
     return;
 }
-#endif /* !HAVE_KERBEROS */
+#endif /* !HAVE_KRB5 */
+
+
+/*
+ * Check whether we should obtain tokens for the given user and ticket cache,
+ * applying ignore_root, minimum_uid, afs_homedir_only, and (if built with
+ * Kerberos support) the checks on the TGT.  Returns PAM_SUCCESS if we should
+ * and PAM_IGNORE if we should skip obtaining tokens.
+ */
+int
+pamafs_token_check(struct pam_args *args, const struct passwd *pwd,
+                   const char *cache)
+{
+    if (pamafs_should_ignore(args, pwd)) {
+        pamafs_stats_count(args, PAMAFS_STAT_SKIP_IGNORED);
+        return PAM_IGNORE;
+    }
+    if (args->config->afs_homedir_only
+        && !pamafs_homedir_in_afs(args, pwd->pw_dir)) {
+        putil_debug(args, "skipping tokens, home directory %s not in AFS",
+                    pwd->pw_dir);
+        pamafs_stats_count(args, PAMAFS_STAT_SKIP_HOMEDIR);
+        return PAM_IGNORE;
+    }
+    if (!pamafs_tgt_usable(args, cache)) {
+        pamafs_stats_count(args, PAMAFS_STAT_SKIP_NO_TGT);
+        return PAM_IGNORE;
+    }
+    return PAM_SUCCESS;
+}
+
+
+/*
+ * Find the Kerberos ticket cache and look up the user, and check whether we
+ * should obtain tokens for them.  Returns PAM_SUCCESS and sets pwd and cache
+ * if we should, PAM_IGNORE if we should skip obtaining tokens, and
+ * PAM_USER_UNKNOWN if the user couldn't be determined.
+ *
+ * If authenticate is true, we're called from pam_sm_authenticate, and look
+ * at PAM_KRB5CCNAME first.  pam_krb5 sets that to the ticket cache it just
+ * created and only sets KRB5CCNAME later, in pam_sm_setcred.
+ */
+static int
+pamafs_token_user(struct pam_args *args, struct passwd **pwd,
+                  const char **cache, bool authenticate)
+{
+    int status;
+    PAM_CONST char *user;
+
+    /* Don't try to get a token unless we have a K5 ticket cache. */
+    *cache = NULL;
+    if (authenticate)
+        *cache = pam_getenv(args->pamh, "PAM_KRB5CCNAME");
+    if (*cache == NULL)
+        *cache = pam_getenv(args->pamh, "KRB5CCNAME");
+    if (*cache == NULL)
+        *cache = getenv("KRB5CCNAME");
+    if (*cache == NULL && !args->config->always_aklog) {
+        putil_debug(args, "skipping tokens, no Kerberos ticket cache");
+        pamafs_stats_count(args, PAMAFS_STAT_SKIP_NO_CACHE);
+        return PAM_IGNORE;
+    }
+
+    /* Get the user, look them up, and see if we should skip this user. */
+    status = pam_get_user(args->pamh, &user, NULL);
+    if (status != PAM_SUCCESS || user == NULL) {
+        putil_err_pam(args, status, "no user set");
+        return PAM_USER_UNKNOWN;
+    }
+    *pwd = pam_modutil_getpwnam(args->pamh, user);
+    if (*pwd == NULL) {
+        putil_err(args, "cannot find UID for %s: %s", user, strerror(errno));
+        return PAM_USER_UNKNOWN;
+    }
+    pamafs_events_user(args, (*pwd)->pw_uid);
+    return pamafs_token_check(args, *pwd, *cache);
+}
+
+
+/*
+ * Obtain tokens for the given user and ticket cache in the current PAG,
+ * reusing saved tokens or waiting for another session to obtain them if so
+ * configured, and destroy the ticket cache afterwards if kdestroy is set.
+ * This is the part of pamafs_token_get that's done in the background if
+ * async_tokens is set.  Returns PAM_SUCCESS if tokens were obtained and an
+ * error code for pam_setcred otherwise.
+ */
+int
+pamafs_token_acquire(struct pam_args *args, struct passwd *pwd,
+                     const char *cache, bool reinitialize)
+{
+    int status;
+    int lock = -1;
+    int slot;
+
+    if (!reinitialize && args->config->prefetch_tokens
+        && pamafs_prefetch_wait(args, pwd, cache)) {
+        pamafs_stats_count(args, PAMAFS_STAT_TOKENS_CACHED);
+        status = PAM_SUCCESS;
+    } else if (!reinitialize && args->config->token_cache
+               && pamafs_store_restore(args, pwd, cache, NULL)) {
+        pamafs_stats_count(args, PAMAFS_STAT_TOKENS_CACHED);
+        status = PAM_SUCCESS;
+    } else if (!reinitialize && args->config->coalesce_tokens
+               && !args->config->kdestroy
+               && pamafs_coalesce_wait(args, pwd, cache, &lock)) {
+        pamafs_stats_count(args, PAMAFS_STAT_TOKENS_SHARED);
+        status = PAM_SUCCESS;
+    } else if (!pamafs_slot_acquire(args, &slot)) {
+        pamafs_stats_count(args, PAMAFS_STAT_TOKENS_NO_SLOT);
+        status = PAM_CRED_UNAVAIL;
+    } else {
+        status = pamafs_obtain_cells(args, cache, pwd);
+        pamafs_slot_release(args, slot);
+        if (status == PAM_SUCCESS)
+            pamafs_stats_count(args, PAMAFS_STAT_TOKENS_AKLOG);
+        else
+            pamafs_stats_count(args, PAMAFS_STAT_TOKENS_FAILED);
+        if (status == PAM_SUCCESS && args->config->token_cache
+            && !args->config->kdestroy)
+            pamafs_store_save(args, pwd, cache, NULL);
+    }
+    pamafs_coalesce_end(args, lock);
+    if (status == PAM_SUCCESS)
+        maybe_destroy_cache(args, cache);
+    return status;
+}
 
 
 /*
@@ -366,36 +1175,21 @@ int
 pamafs_token_get(struct pam_args *args, bool reinitialize)
 {
     int status;
-    PAM_CONST char *user;
     const char *cache;
     struct passwd *pwd;
 
-    /* Don't try to get a token unless we have a K5 ticket cache. */
-    cache = pam_getenv(args->pamh, "KRB5CCNAME");
-    if (cache == NULL)
-        cache = getenv("KRB5CCNAME");
-    if (cache == NULL && !args->config->always_aklog) {
-        putil_debug(args, "skipping tokens, no Kerberos ticket cache");
+    PAMAFS_PROBE1(token_get_entry, reinitialize);
+    status = pamafs_token_user(args, &pwd, &cache, false);
+    if (status == PAM_IGNORE) {
+        PAMAFS_PROBE1(token_get_return, PAM_SUCCESS);
         return PAM_SUCCESS;
+    } else if (status != PAM_SUCCESS) {
+        PAMAFS_PROBE1(token_get_return, status);
+        return status;
     }
 
-    /* Get the user, look them up, and see if we should skip this user. */
-    status = pam_get_user(args->pamh, &user, NULL);
-    if (status != PAM_SUCCESS || user == NULL) {
-        putil_err_pam(args, status, "no user set");
-        return PAM_USER_UNKNOWN;
-    }
-    pwd = pam_modutil_getpwnam(args->pamh, user);
-    if (pwd == NULL) {
-        putil_err(args, "cannot find UID for %s: %s", user, strerror(errno));
-        return PAM_USER_UNKNOWN;
-    }
-    if (pamafs_should_ignore(args, pwd))
-        return PAM_SUCCESS;
-
     /*
-     * If we have krb5_afslog and no program was specifically set, call it.
-     * Otherwise, run aklog.
+     * Obtain tokens, either now or in the background.
      *
      * Always return success even if obtaining tokens failed.  An argument
      * could be made for failing if getting tokens fails, but that may cause
@@ -408,15 +1202,15 @@ pamafs_token_get(struct pam_args *args, bool reinitialize)
      * This could be made an option later if necessary, but I'd rather avoid
      * too many options.
      */
-#ifdef HAVE_KRB5_AFSLOG
-    if (args->config->program == NULL)
-        status = pamafs_afslog(args, cache, pwd);
-    else
-        status = pamafs_run_aklog(args, pwd);
-#else
-    status = pamafs_run_aklog(args, pwd);
-#endif
+    if (!reinitialize && args->config->async_tokens) {
+        pamafs_stats_count(args, PAMAFS_STAT_TOKENS_ASYNC);
+        status = pamafs_async_start(args, pwd, cache);
+    } else
+        status = pamafs_token_acquire(args, pwd, cache, reinitialize);
     if (status == PAM_SUCCESS && !reinitialize) {
+        if (args->config->renew_tokens)
+            pamafs_renew_start(args, pwd, cache);
+        pamafs_refcount_open(args, pwd);
         status = pam_set_data(args->pamh, "pam_afs_session", (char *) "yes",
                               NULL);
         if (status != PAM_SUCCESS) {
@@ -424,12 +1218,54 @@ pamafs_token_get(struct pam_args *args, bool reinitialize)
             status = PAM_CRED_ERR;
         }
     }
-    if (status == PAM_SUCCESS)
-        maybe_destroy_cache(args, cache);
+    PAMAFS_PROBE1(token_get_return, PAM_SUCCESS);
     return PAM_SUCCESS;
 }
 
 
+/*
+ * Start obtaining tokens in the background from pam_sm_authenticate, if the
+ * prefetch_tokens option is set, so that they're ready by the time the
+ * session is opened.  See async.c for the details.
+ */
+void
+pamafs_token_prefetch(struct pam_args *args)
+{
+    const char *cache;
+    struct passwd *pwd;
+
+    if (!args->config->prefetch_tokens || args->config->notokens)
+        return;
+    if (pamafs_token_user(args, &pwd, &cache, true) != PAM_SUCCESS)
+        return;
+    pamafs_prefetch_start(args, pwd, cache);
+}
+
+
+/*
+ * Remove any saved copy of the tokens for the current user and ticket cache.
+ * Used when deleting tokens; failures are ignored, since the only
+ * consequence is that a later session may reuse tokens that are still valid.
+ */
+static void
+forget_saved_tokens(struct pam_args *args)
+{
+    PAM_CONST char *user;
+    const char *cache;
+    struct passwd *pwd;
+
+    if (pam_get_user(args->pamh, &user, NULL) != PAM_SUCCESS || user == NULL)
+        return;
+    pwd = pam_modutil_getpwnam(args->pamh, user);
+    if (pwd == NULL)
+        return;
+    cache = pam_getenv(args->pamh, "KRB5CCNAME");
+    if (cache == NULL)
+        cache = getenv("KRB5CCNAME");
+    pamafs_store_remove(args, pwd, cache, NULL);
+}
+
+
 /*
  * Delete AFS tokens by running k_unlog, but only if our flag data item was
  * set indicating that we'd previously gotten AFS tokens.  Returns either
@@ -450,11 +1286,28 @@ pamafs_token_delete(struct pam_args *args)
         return PAM_SUCCESS;
     }
 
-    /* Okay, go ahead and delete the tokens. */
-    putil_debug(args, "destroying tokens");
-    if (k_unlog() != 0) {
-        putil_err(args, "unable to delete credentials: %s", strerror(errno));
-        return PAM_SESSION_ERR;
+    /*
+     * If tokens are still being obtained or renewed in the background, stop
+     * that first so that they don't show up after we've deleted them.
+     */
+    pamafs_async_stop(args);
+    pamafs_renew_stop(args);
+
+    /*
+     * Okay, go ahead and delete the tokens, unless unlog_refcount is set and
+     * other sessions are still using them or they'll be deleted later.
+     */
+    if (pamafs_refcount_close(args)) {
+        putil_debug(args, "destroying tokens");
+        if (pamafs_unlog() != 0) {
+            putil_err(args, "unable to delete credentials: %s",
+                      strerror(errno));
+            return PAM_SESSION_ERR;
+        }
+
+        /* Saved copies of the tokens go away along with the tokens. */
+        if (args->config->token_cache)
+            forget_saved_tokens(args);
     }
 
     /*
@@ -0,0 +1,268 @@
+/*
+ * Decode the event log kept by pam-afs-session.
+ *
+ * Reads the ring buffer of records that the module writes to its state
+ * directory when the event_log option is set and prints the complete records
+ * in the order they were written, one per line, optionally filtered by entry
+ * point, user, or result.  Each line gives the local time the call returned,
+ * the process ID, the entry point, the user and UID, the PAM flags, the PAM
+ * status returned, whether a PAG was created, the number of cells tokens
+ * were requested for, the exit status of aklog (if it was run), and the time
+ * spent in the call and in each of its phases.
+ *
+ * The log can be read while the module is writing to it.  Records that are
+ * being written at the same time are skipped.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <events.h>
+
+#ifndef PATH_STATE_DIR
+# define PATH_STATE_DIR "/run/pam-afs-session"
+#endif
+
+/* Without the atomic builtins, fall back on ordinary loads. */
+#ifdef HAVE_ATOMIC_BUILTINS
+# define EVENTS_LOAD(p)  __atomic_load_n((p), __ATOMIC_ACQUIRE)
+# define EVENTS_FENCE()  __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#else
+# define EVENTS_LOAD(p)  (*(volatile uint64_t *) (p))
+# define EVENTS_FENCE()  /* empty */
+#endif
+
+/* The names of the entry points, in the order of enum pamafs_event_call. */
+static const char *const call_names[PAMAFS_CALL_MAX] = {
+    "authenticate", "setcred", "open_session", "close_session"
+};
+
+/* The names of the phases, in the order of enum pamafs_phase. */
+static const char *const phase_names[] = {
+    "init", "hasafs", "setpag", "tokens", "aklog"
+};
+
+/* Usage message. */
+static const char usage_message[] = "\
+Usage: pam-afs-session-events [-eh] [-c <call>] [-n <count>] [-u <user>]\n\
+                              [<file>]\n\
+\n\
+Print the event log kept by pam_afs_session when event_log is set.\n\
+\n\
+    -c <call>   Only show calls to this entry point (authenticate, setcred,\n\
+                open_session, or close_session)\n\
+    -e          Only show calls that failed or where aklog failed\n\
+    -h          Show this usage message\n\
+    -n <count>  Only show the last <count> matching calls\n\
+    -u <user>   Only show calls for this user\n\
+\n\
+<file> defaults to " PATH_STATE_DIR "/" PAMAFS_EVENTS_FILE ".\n";
+
+
+/*
+ * Report a fatal error and exit with status 1.
+ */
+static void __attribute__((__noreturn__, __format__(printf, 1, 2)))
+die(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+
+/*
+ * Compare two records by sequence number, for qsort.
+ */
+static int
+compare_seq(const void *a, const void *b)
+{
+    const struct pamafs_event *first = a;
+    const struct pamafs_event *second = b;
+
+    if (first->seq < second->seq)
+        return -1;
+    return (first->seq > second->seq) ? 1 : 0;
+}
+
+
+/*
+ * Copy all complete records out of the mapped event log into a newly
+ * allocated array, sorted by sequence number.  Returns the array and sets
+ * count to the number of records in it.
+ */
+static struct pamafs_event *
+copy_events(const struct pamafs_events *events, size_t slots, size_t *count)
+{
+    struct pamafs_event *copy;
+    const struct pamafs_event *record;
+    uint64_t seq;
+    size_t i, n = 0;
+
+    copy = calloc(slots, sizeof(struct pamafs_event));
+    if (copy == NULL)
+        die("cannot allocate memory: %s", strerror(errno));
+    for (i = 0; i < slots; i++) {
+        record = &events->record[i];
+        seq = EVENTS_LOAD(&record->seq);
+        if (seq == 0)
+            continue;
+        memcpy(&copy[n], record, sizeof(struct pamafs_event));
+        EVENTS_FENCE();
+        if (EVENTS_LOAD(&record->seq) != seq)
+            continue;
+        copy[n].seq = seq;
+        n++;
+    }
+    qsort(copy, n, sizeof(struct pamafs_event), compare_seq);
+    *count = n;
+    return copy;
+}
+
+
+/*
+ * Print one record.
+ */
+static void
+print_event(const struct pamafs_event *event)
+{
+    time_t seconds;
+    struct tm *tm;
+    char date[64];
+    size_t i;
+
+    seconds = (time_t) (event->time / 1000000000ULL);
+    tm = localtime(&seconds);
+    if (tm == NULL || strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", tm)
+                          == 0)
+        strlcpy(date, "unknown", sizeof(date));
+    printf("%s.%06lu pid=%lu %s user=%s", date,
+           (unsigned long) (event->time % 1000000000ULL) / 1000,
+           (unsigned long) event->pid,
+           event->call < PAMAFS_CALL_MAX ? call_names[event->call] : "unknown",
+           event->user[0] == '\0' ? "-" : event->user);
+    if (event->uid == UINT32_MAX)
+        printf(" uid=-");
+    else
+        printf(" uid=%lu", (unsigned long) event->uid);
+    printf(" flags=0x%x status=%ld pag=%d cells=%d",
+           (unsigned int) event->flags, (long) event->status,
+           event->pag_created, event->cells);
+    if (event->aklog_status == PAMAFS_EVENTS_NO_AKLOG)
+        printf(" aklog=-");
+    else if (event->aklog_status == PAMAFS_EVENTS_NO_STATUS)
+        printf(" aklog=timeout");
+    else
+        printf(" aklog=%ld", (long) event->aklog_status);
+    printf(" total_ms=%.3f", event->total_us / 1000.0);
+    for (i = 0; i < sizeof(phase_names) / sizeof(phase_names[0]); i++)
+        if (event->phase_us[i] != 0)
+            printf(" %s_ms=%.3f", phase_names[i], event->phase_us[i] / 1000.0);
+    printf("\n");
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    const char *path = PATH_STATE_DIR "/" PAMAFS_EVENTS_FILE;
+    const char *call = NULL;
+    const char *user = NULL;
+    bool errors = false;
+    unsigned long last = 0;
+    const struct pamafs_events *events;
+    struct pamafs_event *copy, *event;
+    struct stat st;
+    size_t slots, count, i, start;
+    int option, fd;
+    char *end;
+
+    while ((option = getopt(argc, argv, "c:ehn:u:")) != EOF) {
+        switch (option) {
+        case 'c':
+            call = optarg;
+            break;
+        case 'e':
+            errors = true;
+            break;
+        case 'h':
+            fputs(usage_message, stdout);
+            return 0;
+        case 'n':
+            last = strtoul(optarg, &end, 10);
+            if (*end != '\0' || last == 0)
+                die("invalid count %s", optarg);
+            break;
+        case 'u':
+            user = optarg;
+            break;
+        default:
+            fputs(usage_message, stderr);
+            return 1;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc > 1) {
+        fputs(usage_message, stderr);
+        return 1;
+    }
+    if (argc == 1)
+        path = argv[0];
+
+    /* Map the event log and check that it's one of ours. */
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        die("cannot open %s: %s", path, strerror(errno));
+    if (fstat(fd, &st) < 0)
+        die("cannot stat %s: %s", path, strerror(errno));
+    if ((size_t) st.st_size < sizeof(struct pamafs_events))
+        die("%s is not a pam_afs_session event log", path);
+    events = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (events == MAP_FAILED)
+        die("cannot map %s: %s", path, strerror(errno));
+    close(fd);
+    slots = ((size_t) st.st_size - sizeof(struct pamafs_events))
+        / sizeof(struct pamafs_event);
+    if (events->magic != PAMAFS_EVENTS_MAGIC || events->count > slots)
+        die("%s is not a pam_afs_session event log", path);
+    copy = copy_events(events, (size_t) events->count, &count);
+
+    /* Filter the records in place and print the ones we want. */
+    for (i = 0, start = 0; i < count; i++) {
+        event = &copy[i];
+        if (call != NULL
+            && (event->call >= PAMAFS_CALL_MAX
+                || strcmp(call, call_names[event->call]) != 0))
+            continue;
+        if (user != NULL && strncmp(user, event->user, sizeof(event->user))
+                                != 0)
+            continue;
+        if (errors && event->status == PAM_SUCCESS
+            && (event->aklog_status == 0
+                || event->aklog_status == PAMAFS_EVENTS_NO_AKLOG))
+            continue;
+        copy[start++] = *event;
+    }
+    i = (last > 0 && last < start) ? start - last : 0;
+    for (; i < start; i++)
+        print_event(&copy[i]);
+    free(copy);
+    return 0;
+}
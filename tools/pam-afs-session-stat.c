@@ -0,0 +1,150 @@
+/*
+ * Report the statistics kept by pam-afs-session.
+ *
+ * Reads the statistics file that the module keeps in its state directory
+ * when the stats option is set and prints each counter as a name and value
+ * separated by a space, one per line, followed by the aklog latency
+ * histogram.  Histogram buckets are printed as aklog_latency_us_lt_<n>,
+ * giving the number of aklog runs that took less than n microseconds (and at
+ * least half that), and only buckets with a count are printed.  The output
+ * is meant to be easy to feed into monitoring systems, which can compute
+ * rates from successive runs since the counters only ever increase.
+ *
+ * Takes the path to the statistics file as an optional argument, defaulting
+ * to the file in the default state directory.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+
+#include <stats.h>
+
+#ifndef PATH_STATE_DIR
+# define PATH_STATE_DIR "/run/pam-afs-session"
+#endif
+
+/*
+ * The names of the counters, in the order of enum pamafs_stat.  Counters
+ * without a name here, added by a newer module, are printed by number.
+ */
+static const char *const stat_names[PAMAFS_STAT_MAX] = {
+    "logins",
+    "closes",
+    "tokens_aklog",
+    "tokens_cached",
+    "tokens_shared",
+    "tokens_async",
+    "tokens_failed",
+    "tokens_no_slot",
+    "skip_no_afs",
+    "skip_no_cache",
+    "skip_ignored_user",
+    "skip_homedir",
+    "skip_no_tgt",
+    "pag_lost",
+    "pag_failed",
+};
+
+/* Usage message. */
+static const char usage_message[] = "\
+Usage: pam-afs-session-stat [-h] [<file>]\n\
+\n\
+Print the statistics kept by pam_afs_session when the stats option is set.\n\
+<file> defaults to " PATH_STATE_DIR "/" PAMAFS_STATS_FILE ".\n";
+
+
+/*
+ * Read the statistics file into the provided struct.  Exits with status 1 on
+ * any error.
+ */
+static void
+read_stats(const char *path, struct pamafs_stats *stats)
+{
+    int fd;
+    ssize_t status;
+    size_t total = 0;
+    char *p = (char *) stats;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    while (total < sizeof(*stats)) {
+        status = read(fd, p + total, sizeof(*stats) - total);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status < 0) {
+            fprintf(stderr, "cannot read %s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+        if (status == 0)
+            break;
+        total += (size_t) status;
+    }
+    close(fd);
+    if (total < sizeof(*stats) || stats->magic != PAMAFS_STATS_MAGIC) {
+        fprintf(stderr, "%s is not a pam_afs_session statistics file\n",
+                path);
+        exit(1);
+    }
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct pamafs_stats stats;
+    const char *path = PATH_STATE_DIR "/" PAMAFS_STATS_FILE;
+    unsigned long long limit;
+    size_t i, last;
+
+    if (argc > 1 && strcmp(argv[1], "-h") == 0) {
+        fputs(usage_message, stdout);
+        return 0;
+    }
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+        fputs(usage_message, stderr);
+        return 1;
+    }
+    if (argc == 2)
+        path = argv[1];
+    read_stats(path, &stats);
+
+    /* Print the counters, skipping unused space at the end. */
+    for (last = PAMAFS_STATS_COUNTERS; last > PAMAFS_STAT_MAX; last--)
+        if (stats.counter[last - 1] != 0)
+            break;
+    for (i = 0; i < last; i++) {
+        if (i < PAMAFS_STAT_MAX)
+            printf("%s", stat_names[i]);
+        else
+            printf("counter_%lu", (unsigned long) i);
+        printf(" %llu\n", (unsigned long long) stats.counter[i]);
+    }
+
+    /* Print the histogram. */
+    printf("aklog_latency_count %llu\n",
+           (unsigned long long) stats.aklog_count);
+    printf("aklog_latency_total_us %llu\n",
+           (unsigned long long) stats.aklog_total_us);
+    for (i = 0; i < PAMAFS_STATS_BUCKETS; i++) {
+        if (stats.aklog_bucket[i] == 0)
+            continue;
+        limit = 1ULL << i;
+        if (i == PAMAFS_STATS_BUCKETS - 1)
+            printf("aklog_latency_us_lt_inf");
+        else
+            printf("aklog_latency_us_lt_%llu", limit);
+        printf(" %llu\n", (unsigned long long) stats.aklog_bucket[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * Trace of PAM calls for replay.
+ *
+ * If the trace_calls option is set, each PAM call appends one record
+ * describing how it was called (the time, process ID, entry point, flags,
+ * PAM service, and class of user) to a file in the state directory.  The
+ * replay driver in the test suite reads this trace and reproduces the same
+ * traffic against the fake PAM and kafs libraries for benchmarking.
+ *
+ * The file is opened the first time it's needed and stays open for the life
+ * of the process.  Each record is written with a single write to a file
+ * opened for appending, so concurrent processes don't need to lock.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/pam.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <time.h>
+
+#include <internal.h>
+#include <pam-util/args.h>
+#include <pam-util/logging.h>
+#include <trace.h>
+
+/*
+ * The open trace and the state directory it was found in.  If the file
+ * couldn't be opened, trace_fd is -1 but trace_dir is still set so that we
+ * don't try again for the same directory.  Both are protected by trace_lock,
+ * which is also held while the descriptor is used so that another thread
+ * can't close it.
+ */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd = -1;
+static char *trace_dir = NULL;
+
+
+/*
+ * Return the descriptor of the trace to write to, opening the file if this
+ * is the first time we've needed it for this state directory, or -1 if
+ * tracing isn't enabled or the trace can't be written.  If the return value
+ * isn't -1, trace_lock is held and must be released by the caller.
+ */
+static int
+trace_get(struct pam_args *args)
+{
+    const char *dir = args->config->state_dir;
+    int fd;
+
+    if (!args->config->trace_calls || dir == NULL)
+        return -1;
+    pthread_mutex_lock(&trace_lock);
+    if (trace_dir == NULL || strcmp(trace_dir, dir) != 0) {
+        if (trace_fd >= 0) {
+            close(trace_fd);
+            trace_fd = -1;
+        }
+        free(trace_dir);
+        trace_dir = strdup(dir);
+        if (trace_dir == NULL)
+            putil_crit(args, "cannot allocate memory: %s", strerror(errno));
+        else
+            trace_fd = pamafs_state_open(args, PAMAFS_TRACE_FILE,
+                                         O_WRONLY | O_CREAT | O_APPEND);
+    }
+    fd = trace_fd;
+    if (fd < 0)
+        pthread_mutex_unlock(&trace_lock);
+    return fd;
+}
+
+
+/*
+ * Return the class of the user the call is for.
+ */
+static enum pamafs_trace_class
+trace_class(struct pam_args *args)
+{
+    PAM_CONST void *user = NULL;
+    struct passwd *pwd;
+
+    if (pam_get_item(args->pamh, PAM_USER, &user) != PAM_SUCCESS
+        || user == NULL)
+        return PAMAFS_CLASS_UNKNOWN;
+    pwd = pam_modutil_getpwnam(args->pamh, user);
+    if (pwd == NULL)
+        return PAMAFS_CLASS_UNKNOWN;
+    if (pwd->pw_uid == 0)
+        return PAMAFS_CLASS_ROOT;
+    if (pwd->pw_uid < PAMAFS_TRACE_SYSTEM_UID)
+        return PAMAFS_CLASS_SYSTEM;
+    return PAMAFS_CLASS_USER;
+}
+
+
+/*
+ * Append a record of the current call to the trace, given the entry point
+ * and the PAM flags it was called with.
+ */
+void
+pamafs_trace_record(struct pam_args *args, enum pamafs_event_call call,
+                    int flags)
+{
+    struct pamafs_trace record;
+    struct timespec now;
+    PAM_CONST void *service = NULL;
+    enum pamafs_trace_class class;
+    ssize_t status;
+    int fd, error;
+
+    if (args == NULL || args->config == NULL || !args->config->trace_calls)
+        return;
+    memset(&record, 0, sizeof(record));
+    if (clock_gettime(CLOCK_REALTIME, &now) == 0)
+        record.time = (uint64_t) now.tv_sec * 1000000ULL
+            + (uint64_t) now.tv_nsec / 1000;
+    record.pid = (uint32_t) getpid();
+    record.flags = flags;
+    record.version = PAMAFS_TRACE_VERSION;
+    record.call = (uint8_t) call;
+    class = trace_class(args);
+    record.user_class = (uint8_t) class;
+    if (pam_get_item(args->pamh, PAM_SERVICE, &service) == PAM_SUCCESS
+        && service != NULL)
+        strlcpy(record.service, service, sizeof(record.service));
+    fd = trace_get(args);
+    if (fd < 0)
+        return;
+    status = write(fd, &record, sizeof(record));
+    error = errno;
+    pthread_mutex_unlock(&trace_lock);
+    if (status < 0)
+        putil_err(args, "cannot write to %s: %s", PAMAFS_TRACE_FILE,
+                  strerror(error));
+    else if ((size_t) status != sizeof(record))
+        putil_err(args, "short write to %s", PAMAFS_TRACE_FILE);
+}
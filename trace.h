@@ -0,0 +1,63 @@
+/*
+ * Layout of the call trace.
+ *
+ * If the trace_calls option is set, the module appends a fixed-size record
+ * for each PAM call to a file in the state directory as the call starts,
+ * giving the entry point, flags, PAM service, and class of user, so that
+ * the shape of production traffic can be replayed against the test suite's
+ * fake PAM and kafs libraries.  This header describes the layout of that
+ * file and is shared between the module and the replay driver.
+ *
+ * Records are written with a single append each, so records from different
+ * processes are never interleaved, but they may be slightly out of time
+ * order.  The inter-arrival time of two calls is the difference of their
+ * times.  Usernames are deliberately not recorded.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H 1
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <events.h>
+
+/* Name of the trace in the state directory. */
+#define PAMAFS_TRACE_FILE "trace"
+
+/* Version of the record layout, stored in each record. */
+#define PAMAFS_TRACE_VERSION 1
+
+/* Space for the PAM service, which is truncated if longer. */
+#define PAMAFS_TRACE_SERVICE 20
+
+/* UIDs other than root below this are counted as system accounts. */
+#define PAMAFS_TRACE_SYSTEM_UID 1000
+
+/* The classes of user. */
+enum pamafs_trace_class {
+    PAMAFS_CLASS_UNKNOWN,       /* No user or the user couldn't be found. */
+    PAMAFS_CLASS_ROOT,          /* UID 0. */
+    PAMAFS_CLASS_SYSTEM,        /* Below PAMAFS_TRACE_SYSTEM_UID. */
+    PAMAFS_CLASS_USER,          /* Everyone else. */
+    PAMAFS_CLASS_MAX
+};
+
+/* One record in the trace, describing the start of one PAM call. */
+struct pamafs_trace {
+    uint64_t time;              /* Microseconds since the epoch. */
+    uint32_t pid;               /* Process ID of the caller. */
+    int32_t flags;              /* PAM flags passed to the call. */
+    uint8_t version;            /* PAMAFS_TRACE_VERSION. */
+    uint8_t call;               /* enum pamafs_event_call. */
+    uint8_t user_class;         /* enum pamafs_trace_class. */
+    uint8_t reserved;           /* Unused, for alignment. */
+    char service[PAMAFS_TRACE_SERVICE]; /* PAM service, nul-terminated. */
+};
+
+#endif /* !TRACE_H */